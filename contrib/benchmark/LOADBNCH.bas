@@ -0,0 +1,15 @@
+   10 REM Time repeated LOADs from a fileserver
+   20 INPUT "Fileserver station",S%
+   30 INPUT "User",U$
+   40 INPUT "File",F$
+   50 INPUT "Times",N%
+   60 OSCLI "FS "+STR$(S%)
+   70 OSCLI "I AM "+U$
+   80 OSCLI "LOAD "+F$+" 3000"
+   90 T%=TIME
+  100 FOR I%=1 TO N%
+  110   OSCLI "LOAD "+F$+" 3000"
+  120 NEXT
+  130 T%=TIME-T%
+  140 PRINT "Total ";T%/100;" s"
+  150 PRINT "Per LOAD ";T%*10/N%;" ms"
@@ -11,16 +11,72 @@
  */
 
 #include <stdint.h>
-#include "lwip/sockets.h"
-#include "lwip/netdb.h"
+#include <stdlib.h>
+#include "lwip/udp.h"
+#include "lwip/tcpip.h"
+#include "lwip/dns.h"
+#include "freertos/timers.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "config.h"
 #include "econet.h"
 #include "aun_bridge.h"
+#include "fs_cache.h"
+#include "fileserver.h"
+#include "print_spool.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+#define AUN_STANDARD_PORT 32768
+#define AUN_MAX_ENDPOINTS 4
+#define AUN_PROBE_INTERVAL_MS 1000
+#define AUN_PROBE_MISSES 3
+#define AUN_MAX_TRUNK_STATIONS 32
+#define AUN_TRUNK_MTU 1400
+#define AUN_RX_QUEUE_DEPTH 16
+#define AUN_MAX_IOV 8
+#define AUN_DNS_REFRESH_MS 10000
+#define AUN_DYNAMIC_IDLE_MS (10 * 60 * 1000)
+#define AUN_DYNAMIC_EVICT_IDLE_MS (30 * 1000)
+#define AUN_DYNAMIC_SCAN_MS 5000
+#define AUN_TX_QUEUE_DEPTH 16
+#define AUN_MAX_TX_CONTEXTS 16
+#define AUN_TX_BACKLOG 4
+#define AUN_TX_ATTEMPTS 4
+#define AUN_SCHED_POOL_SIZE 32
+#define AUN_SCHED_STATION_DEPTH 8
+#define AUN_SCHED_QUANTUM 1024
+#define AUN_SCHED_DEFAULT_CLASS 1
+#define AUN_MAX_RX_CONTEXTS 16
+#define AUN_RX_WINDOW 16
+#define AUN_RX_REORDER_SLOTS 4
+#define AUN_RX_REORDER_HOLD_MS 20
+#define AUN_RTO_INITIAL_MS 200
+#define AUN_RTO_MIN_MS 10
+#define AUN_RTO_MAX_MS 1000
+#define AUN_IMM_REPLY_MAX 1024
+#define AUN_BROADCAST_QUEUE_DEPTH 4
+#define AUN_BROADCAST_BURST 8
+#define AUN_BROADCAST_REFILL_MS 100
+#define AUN_BROADCAST_RECENT 8
+#define AUN_BROADCAST_DEDUPE_MS 1000
+#define AUN_PLAYBACK_ATTEMPTS 10
+#define AUN_LOCAL_QUEUE_DEPTH 8
+#define AUN_READAHEAD_MIN_BYTES 256 // Frames this size or more can start a run
+#define AUN_READAHEAD_RUN 2         // In-order frames on one port before acking early
+#define AUN_READAHEAD_WINDOW 4      // Frames acked early but not yet on the Econet
+#define AUN_READAHEAD_ATTEMPTS AUN_TX_ATTEMPTS // Econet tries for a frame acked early, spaced like AUN retries
+#define AUN_READAHEAD_BACKOFF_MS 10000
+#define AUN_LOCAL_QUEUE_WAIT_MS 1000
+#define AUN_LOCAL_DONE_WAIT_MS 30000 // Longer than the scheduler takes to give up on a full queue
+#define AUN_PRINT_WAIT_MS 10000 // Longer than the TX task takes to give up on a frame
+#define AUN_WAITER_ACKED 1
+#define AUN_WAITER_FAILED 2
+#define AUN_BRIDGE_PORT 0x9C     // Bridge protocol queries, broadcast by Beebs
+#define AUN_BRIDGE_WHAT_NET 0x82 // Which network is this?
+#define AUN_BRIDGE_IS_NET 0x83   // Can network N be reached?
+
 aunbridge_stats_t aunbridge_stats;
 
 static const char *TAG = "AUN";
@@ -28,35 +84,472 @@ static const char *ECONETTAG = "ECONET";
 
 static bool is_running;
 static volatile TaskHandle_t shutdown_notify_handle;
-static QueueHandle_t ack_queue;
-static int rx_udp_ctl_pipe[2];
+static QueueHandle_t aun_tx_queue;
+static QueueHandle_t aun_rx_queue;
+static TimerHandle_t dns_refresh_timer;
+static TimerHandle_t probe_timer;
+
+typedef struct aun_sched_item aun_sched_item_t;
 
 typedef struct
 {
     uint8_t station_id;
     uint8_t network_id;
     uint16_t local_udp_port;
-    int socket;
-    bool is_open;
+    struct udp_pcb *pcb;
+
+    // Endpoints made on demand for unconfigured Beebs are closed again when
+    // idle. A closed slot can't be reused until the RX and TX tasks have
+    // both dropped their state for it.
+    bool is_dynamic;
+    volatile bool is_rx_releasing;
+    volatile bool is_tx_releasing;
+    uint32_t last_out_ms; // Last delivery to the Beeb, by the scheduler
+
+    // The Beeb's answer to MACHINETYPE, kept so AUN hosts can be answered
+    // without going near the bus. Scheduler task only.
+    uint8_t machine_type[4];
+    bool has_machine_type;
+
+    // A cached LOAD being fed to the Beeb by the scheduler. Set by the
+    // Econet RX task when idle, under aun_sched_lock.
+    fs_cache_playback_t playback;
+    uint8_t playback_server_stn;
+    uint8_t playback_server_net;
+    uint8_t playback_attempts;
+
+    // Frames from AUN waiting for the Econet, one queue per priority class.
+    // Guarded by aun_sched_lock.
+    aun_sched_item_t *queue_head[AUN_SCHED_CLASSES];
+    aun_sched_item_t *queue_tail[AUN_SCHED_CLASSES];
+    uint32_t deficit[AUN_SCHED_CLASSES];
+    bool has_quantum[AUN_SCHED_CLASSES];
+    uint8_t queue_depth;
+    uint8_t queue_depth_max;
+    uint32_t wait_count;
+    uint32_t wait_total_ms;
+    uint32_t wait_max_ms;
+
+    // A frame acked early that the Beeb refused, with everything queued
+    // behind it in its class. Held back until the head's retry is due, so
+    // nothing overtakes it and other stations aren't held up. Counted in
+    // queue_depth but not the class depth. Guarded by aun_sched_lock.
+    aun_sched_item_t *retry_head;
+    aun_sched_item_t *retry_tail;
+
+    // "in" is traffic from the Beeb, "out" is traffic to it. Latency is the
+    // Econet handshake time.
+    aunbridge_station_counters_t counters;
 } econet_station_t;
-static econet_station_t econet_stations[5];
+static econet_station_t econet_stations[AUN_MAX_ECONET_STATIONS];
+
+// One of the servers that can stand in for an AUN station. Reachability
+// and RTT come from MACHINETYPE probes. Guarded by the lwIP core lock.
+typedef struct
+{
+    char host[64];
+    ip4_addr_t addr; // Resolved address. Zero until known.
+    bool is_hostname;
+    uint16_t udp_port;
+    bool is_up;
+    uint8_t missed;        // Probes unanswered in a row
+    uint32_t probe_seq;
+    int64_t probe_sent_us; // Zero when no probe is outstanding
+    int32_t srtt_us;
+    int32_t rttvar_us;
+} aun_endpoint_t;
 
 typedef struct
 {
     char remote_address[64];
+    ip4_addr_t addr; // Resolved address. Zero until known.
     uint8_t station_id;
     uint8_t network_id;
     uint16_t udp_port;
-    uint32_t last_acked_seq;
-    econet_acktype_t last_tx_result;
+    bool is_derived;        // Made from the sender's address in single port mode
+    bool is_trunk;          // Beyond the trunk, known by network and station number
+    uint8_t last_econet_id; // Beeb that last sent here. Single port replies go back to it.
+
+    // Configured stations list one or more servers. remote_address, addr
+    // and udp_port above are a copy of the active one. Derived stations
+    // have none.
+    aun_endpoint_t *endpoints;
+    uint8_t endpoint_count;
+    uint8_t endpoint_active;
+
+    int32_t srtt_us;   // Smoothed RTT. Zero until the first sample.
+    int32_t rttvar_us; // RTT variation
+    uint32_t rto_ms;   // Current retransmission timeout
+
+    // Last sequence number sent here from the shared socket, where every
+    // Beeb looks the same to the host. AUN TX task only.
+    uint32_t shared_seq;
+
+    // "in" is traffic from the AUN host, "out" is traffic to it. Latency is
+    // the AUN round trip time.
+    aunbridge_station_counters_t counters;
 } aun_station_t;
-static aun_station_t aun_stations[20];
+static aun_station_t aun_stations[AUN_MAX_AUN_STATIONS];
+static aun_endpoint_t aun_endpoints[AUN_MAX_AUN_STATIONS][AUN_MAX_ENDPOINTS];
+
+// Station number to AUN station, configured or derived. Entries are fully
+// set up before they're published here and are only removed with the
+// bridge stopped, so readers don't need a lock.
+static aun_station_t *aun_station_map[AUN_MAX_MAPPED_STATIONS];
+
+// Single port mode. Every Econet station shares aun_shared_pcb and AUN
+// stations are made on demand from aun_derived[] the first time they're
+// used. Derived entries are never freed, only reset by a reconfigure.
+static struct udp_pcb *aun_shared_pcb;
+static ip4_addr_t aun_subnet;
+static aun_station_t *aun_derived[256];
+
+// Trunk to a PiEconetBridge. Each datagram carries one or more records,
+// a little-endian length then the frame with its Econet addresses in front
+// of the AUN header. Frames that are ready together go out together.
+// Stations beyond the trunk are made on demand. Guarded by the lwIP core
+// lock.
+static struct udp_pcb *aun_trunk_pcb;
+static ip4_addr_t aun_trunk_addr;
+static aun_station_t aun_trunk_stations[AUN_MAX_TRUNK_STATIONS];
+static uint8_t aun_trunk_batch[AUN_TRUNK_MTU];
+static uint16_t aun_trunk_batch_len;
+static uint8_t aun_trunk_batch_frames;
+
+// Routing table, indexed by network number. Every network other than our
+// own that the bridge reaches has an entry: beyond the trunk, or AUN hosts
+// listed with that network number or numbered by their address in the
+// route's subnet. Entries are only changed with the bridge stopped; the
+// stations in them are made on demand under the lwIP core lock.
+typedef struct
+{
+    bool is_trunk;
+    uint8_t network_id;
+    ip4_addr_t subnet; // Any if hosts aren't numbered by address
+    aun_station_t *stations[256];
+} aun_route_t;
+static aun_route_t *aun_route_map[256];
+
+// Broadcasts. Ones from AUN wait in a short queue of their own and the
+// scheduler puts them on the Econet ahead of unicast frames, so a token
+// bucket limits how many get that far. Anything seen in the last second,
+// in either direction, is dropped as a repeat; that includes our own
+// coming back. Guarded by the lwIP core lock.
+static QueueHandle_t aun_broadcast_queue;
+static uint8_t aun_broadcast_tokens;
+static uint32_t aun_broadcast_refill_ms;
+static struct
+{
+    uint32_t hash;
+    uint32_t seen_ms;
+} aun_broadcast_recent[AUN_BROADCAST_RECENT];
+static uint8_t aun_broadcast_recent_next;
+static aun_station_t aun_trunk_broadcast = {
+    .station_id = ECONET_BROADCAST,
+    .network_id = ECONET_BROADCAST,
+    .is_trunk = true,
+};
+
+// Frames from the built-in fileserver and print spooler, waiting for the
+// scheduler. Only the one at the front is tried, so they reach each Beeb in
+// order. The queue filling up holds the sender back.
+typedef struct
+{
+    struct pbuf *p;
+    uint8_t src_stn;
+    uint8_t dst_stn;
+    uint8_t port;
+    uint8_t control;
+    TaskHandle_t waiter; // Told whether the Beeb took it, if not NULL
+} aun_local_frame_t;
+static QueueHandle_t aun_local_queue;
+static aun_local_frame_t aun_local_pending; // p is NULL when there's none
+static uint8_t aun_local_attempts;
+
+// Work for the AUN RX task: 'D' datagram from the lwIP receive callback,
+// 'C' Econet delivery completed by the scheduler, 'R' a frame acked early
+// refused and being retried, 'X' Econet station closed, 'S' shutdown. Datagram
+// pbufs are passed by reference so the payload is never copied.
+typedef struct
+{
+    char type;
+    struct pbuf *p;
+    econet_station_t *econet_station;
+    ip_addr_t addr;
+    uint16_t port;
+    aun_station_t *aun_station; // 'C' and 'R' only
+    uint32_t seq;
+    econet_acktype_t result;
+    bool is_early_ack; // 'D' only. Already acknowledged to the sender.
+} aun_rx_item_t;
+
+// A data frame waiting in an Econet station's transmit queue
+struct aun_sched_item
+{
+    aun_sched_item_t *next;
+    aun_rx_item_t item;
+    aun_station_t *aun_station;
+    uint8_t class_id;
+    TickType_t queued_at;
+    uint8_t attempts;    // Econet tries so far, for a frame acked early
+    TickType_t retry_at; // ... and when to try again
+};
+static aun_sched_item_t aun_sched_pool[AUN_SCHED_POOL_SIZE];
+static aun_sched_item_t *aun_sched_free;
+static portMUX_TYPE aun_sched_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Per-class scheduler state. Station cursors are for the DRR within each
+// class; credit and class_cursor drive weighted mode.
+static config_priority_t aun_priority;
+static uint8_t aun_sched_class_depth[AUN_SCHED_CLASSES];
+static uint8_t aun_sched_class_credit[AUN_SCHED_CLASSES];
+static int aun_sched_class_cursor;
+static int aun_sched_cursor[AUN_SCHED_CLASSES];
+static aunbridge_class_stats_t aun_sched_class_stats[AUN_SCHED_CLASSES];
+
+#define AUN_SCHED_NOTIFY_WORK (1UL << 0)
+#define AUN_SCHED_NOTIFY_SHUTDOWN (1UL << 1)
+static TaskHandle_t aun_sched_task_handle;
+
+// Inbound state for one (Econet station, AUN station) pair: the outcome of
+// recently delivered sequence numbers and frames held waiting for a gap.
+typedef struct
+{
+    uint32_t seq;
+    econet_acktype_t result;
+    bool is_valid;
+    bool is_pending; // Queued for the Econet, no result yet
+    bool is_early_ack;
+} aun_rx_seen_t;
+
+typedef struct
+{
+    econet_station_t *econet_station; // NULL when the context is free
+    aun_station_t *aun_station;
+    bool is_synced;
+    uint32_t next_seq;
+    aun_rx_seen_t seen[AUN_RX_WINDOW];
+    uint8_t seen_next;
+    struct
+    {
+        aun_rx_item_t item; // item.p is NULL when the slot is free
+        uint32_t seq;
+    } held[AUN_RX_REORDER_SLOTS];
+    uint8_t held_count;
+    TickType_t hold_deadline;
+    TickType_t last_used;
+
+    // Read-ahead. A run of in-order frames to one port looks like a file
+    // transfer, so frames are acknowledged as soon as they're queued and
+    // the server sends the next without waiting for the Econet. Everything
+    // for the pair goes in the run's class while any are queued, so nothing
+    // overtakes them.
+    uint8_t run_port;
+    uint8_t run_length;
+    uint8_t readahead_pending;
+    uint8_t readahead_class;
+    bool is_readahead_held;         // One was refused. Nothing more until they've gone.
+    TickType_t readahead_off_until; // Backoff after the Beeb wouldn't take one at all
+} aun_rx_ctx_t;
+static aun_rx_ctx_t aun_rx_ctxs[AUN_MAX_RX_CONTEXTS];
+
+// Outbound transfer state for one (Econet source station, AUN station) pair.
+// Each context has its own sequence space, retry budget and timer so a dead
+// server only holds up the frames addressed to it. Behind the shared socket
+// the sequence space belongs to the AUN station instead.
+typedef struct
+{
+    econet_station_t *econet_station; // NULL when the context is free
+    aun_station_t *aun_station;
+    uint32_t seq;
+    struct pbuf *backlog[AUN_TX_BACKLOG]; // backlog[backlog_head] is in flight when is_busy
+    TaskHandle_t waiters[AUN_TX_BACKLOG]; // Told how each frame went, if not NULL
+    uint8_t backlog_head;
+    uint8_t backlog_count;
+    bool is_busy;
+    uint8_t attempts_left;
+    uint8_t nack_count;
+    bool is_retransmit;  // Karn: no RTT sample once a frame has been resent
+    bool is_nack_retry;  // Deadline is a NACK holdoff rather than a timeout
+    int64_t sent_at_us;
+    TickType_t deadline;
+    TickType_t last_used;
+} aun_tx_ctx_t;
+static aun_tx_ctx_t aun_tx_ctxs[AUN_MAX_TX_CONTEXTS];
+
+// Outstanding transaction for each TX context, indexed the same way. The
+// lwIP thread matches incoming (N)ACKs against this by peer and sequence
+// and wakes the TX task with the context's notification bit.
+typedef struct
+{
+    econet_station_t *econet_station;
+    aun_station_t *aun_station;
+    uint32_t seq;
+    bool is_armed;
+    uint8_t result; // AUN_TYPE_ACK or AUN_TYPE_NACK once answered
+} aun_tx_pending_t;
+static aun_tx_pending_t aun_tx_pending[AUN_MAX_TX_CONTEXTS];
+static portMUX_TYPE aun_tx_pending_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Notification bits for the AUN TX task. Bits below AUN_MAX_TX_CONTEXTS
+// flag an answered transaction in that context.
+#define AUN_TX_NOTIFY_QUEUE (1UL << 31)
+static TaskHandle_t aun_tx_task_handle;
+
+// Work for the AUN TX task: 'F' outbound frame, 'P' block of a print job
+// for the print server, 'X' Econet station closed, 'S' shutdown.
+typedef struct
+{
+    char type;
+    econet_station_t *econet_station;
+    aun_station_t *aun_station;
+    struct pbuf *p;
+    TaskHandle_t waiter; // 'P' only
+} aun_tx_event_t;
+
+static config_bridge_t bridge_cfg;
+
+static bool _aun_trunk_covers(uint8_t network_id)
+{
+    aun_route_t *route = aun_route_map[network_id];
+    return route != NULL && route->is_trunk && aun_trunk_pcb != NULL;
+}
+
+static bool _aun_route_reaches(uint8_t network_id)
+{
+    aun_route_t *route = aun_route_map[network_id];
+    return route != NULL && (!route->is_trunk || aun_trunk_pcb != NULL);
+}
+
+static aun_route_t *_aun_route_add(uint8_t network_id)
+{
+    aun_route_t *route = aun_route_map[network_id];
+    if (route == NULL)
+    {
+        route = calloc(1, sizeof(*route));
+        if (route == NULL)
+        {
+            ESP_LOGE(TAG, "Out of memory for route to network %d", network_id);
+            return NULL;
+        }
+        route->network_id = network_id;
+        aun_route_map[network_id] = route;
+    }
+    return route;
+}
+
+static void _aun_route_clear(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(aun_route_map); i++)
+    {
+        aun_route_t *route = aun_route_map[i];
+        if (route == NULL)
+        {
+            continue;
+        }
+        for (int j = 0; j < ARRAY_SIZE(route->stations); j++)
+        {
+            if (route->stations[j] != NULL && route->stations[j]->is_derived)
+            {
+                free(route->stations[j]);
+            }
+        }
+        free(route);
+        aun_route_map[i] = NULL;
+    }
+}
+
+// Must hold the lwIP core lock
+static aun_station_t *_aun_trunk_station(uint8_t network_id, uint8_t station_id)
+{
+    aun_station_t *station = NULL;
+    for (int i = 0; i < ARRAY_SIZE(aun_trunk_stations); i++)
+    {
+        aun_station_t *s = &aun_trunk_stations[i];
+        if (s->station_id == station_id && s->network_id == network_id)
+        {
+            return s;
+        }
+        if (s->station_id == 0 && station == NULL)
+        {
+            station = s;
+        }
+    }
+    if (station == NULL)
+    {
+        ESP_LOGW(TAG, "No free slot for trunk station %d.%d", network_id, station_id);
+        return NULL;
+    }
+
+    memset(station, 0, sizeof(*station));
+    snprintf(station->remote_address, sizeof(station->remote_address), "%s", bridge_cfg.trunk_host);
+    station->addr = aun_trunk_addr;
+    station->udp_port = bridge_cfg.trunk_port;
+    station->is_trunk = true;
+    station->network_id = network_id;
+    station->rto_ms = AUN_RTO_INITIAL_MS;
+    station->station_id = station_id;
+    return station;
+}
+
+// AUN station for network.station, made from the route's subnet if it
+// isn't listed. Must hold the lwIP core lock.
+static aun_station_t *_aun_route_station(uint8_t network_id, uint8_t station_id)
+{
+    aun_route_t *route = aun_route_map[network_id];
+    if (route == NULL)
+    {
+        return NULL;
+    }
+    if (route->is_trunk)
+    {
+        return aun_trunk_pcb != NULL ? _aun_trunk_station(network_id, station_id) : NULL;
+    }
+    aun_station_t *station = route->stations[station_id];
+    if (station != NULL || ip4_addr_isany_val(route->subnet))
+    {
+        return station;
+    }
+
+    station = calloc(1, sizeof(*station));
+    if (station == NULL)
+    {
+        ESP_LOGE(TAG, "Out of memory for AUN station %d.%d", network_id, station_id);
+        return NULL;
+    }
+    ip4_addr_set_u32(&station->addr, ip4_addr_get_u32(&route->subnet) | PP_HTONL(station_id));
+    ip4addr_ntoa_r(&station->addr, station->remote_address, sizeof(station->remote_address));
+    station->is_derived = true;
+    station->network_id = network_id;
+    station->station_id = station_id;
+    station->udp_port = AUN_STANDARD_PORT;
+    station->rto_ms = AUN_RTO_INITIAL_MS;
+    route->stations[station_id] = station;
+
+    ESP_LOGI(TAG, "AUN station %d.%d is %s", network_id, station_id, station->remote_address);
+    return station;
+}
+
+// AUN host in one of the routes' subnets. Must hold the lwIP core lock.
+static aun_station_t *_aun_route_from_addr(const ip4_addr_t *ip)
+{
+    for (int i = 0; i < bridge_cfg.route_count; i++)
+    {
+        aun_route_t *route = aun_route_map[bridge_cfg.routes[i].network_id];
+        if (route != NULL && !route->is_trunk && !ip4_addr_isany_val(route->subnet) &&
+            (ip4_addr_get_u32(ip) & PP_HTONL(0xFFFFFF00UL)) == ip4_addr_get_u32(&route->subnet))
+        {
+            return _aun_route_station(route->network_id, ip4_addr4(ip));
+        }
+    }
+    return NULL;
+}
 
 static econet_station_t *_get_econet_station_by_id(uint8_t station_id)
 {
     for (int i = 0; i < ARRAY_SIZE(econet_stations); i++)
     {
-        if (econet_stations[i].station_id == station_id)
+        if (econet_stations[i].station_id == station_id && econet_stations[i].pcb != NULL)
         {
             return &econet_stations[i];
         }
@@ -66,80 +559,3256 @@ static econet_station_t *_get_econet_station_by_id(uint8_t station_id)
 
 static aun_station_t *_get_aun_station_by_id(uint8_t station_id)
 {
-    for (int i = 0; i < ARRAY_SIZE(aun_stations); i++)
+    return aun_station_map[station_id];
+}
+
+static aun_endpoint_t *_aun_endpoint_find(aun_station_t *station, const ip4_addr_t *ip, uint16_t port)
+{
+    for (int i = 0; i < station->endpoint_count; i++)
     {
-        if (aun_stations[i].station_id == station_id)
+        aun_endpoint_t *endpoint = &station->endpoints[i];
+        if (endpoint->udp_port == port && ip4_addr_cmp(&endpoint->addr, ip))
         {
-            return &aun_stations[i];
+            return endpoint;
         }
     }
     return NULL;
 }
 
-static aun_station_t *_get_aun_station_by_port(uint16_t udp_port)
+// Find the configured AUN station one of whose servers is ip:port. Unless
+// is_exact is set a port match alone will do, for hosts that answer from
+// an address other than the one we sent to.
+static aun_station_t *_aun_station_by_endpoint(const ip4_addr_t *ip, uint16_t port, bool is_exact)
+{
+    aun_station_t *port_match = NULL;
+    for (int i = 0; i < ARRAY_SIZE(aun_stations); i++)
+    {
+        aun_station_t *station = &aun_stations[i];
+        if (station->station_id == 0)
+        {
+            continue;
+        }
+        if (_aun_endpoint_find(station, ip, port) != NULL)
+        {
+            return station;
+        }
+        for (int j = 0; j < station->endpoint_count && port_match == NULL && !is_exact; j++)
+        {
+            if (station->endpoints[j].udp_port == port)
+            {
+                port_match = station;
+            }
+        }
+    }
+    return port_match;
+}
+
+static bool _aun_single_port_covers(uint8_t station_id)
+{
+    return aun_shared_pcb != NULL && bridge_cfg.aun_first_station != 0 &&
+           station_id >= bridge_cfg.aun_first_station && station_id <= bridge_cfg.aun_last_station;
+}
+
+// Make an AUN station for subnet.station_id. Must hold the lwIP core lock
+// so the lwIP thread and the Econet RX task can't both make the same one.
+static aun_station_t *_aun_station_derive(uint8_t station_id)
+{
+    if (aun_station_map[station_id] != NULL)
+    {
+        return aun_station_map[station_id];
+    }
+    if (!_aun_single_port_covers(station_id))
+    {
+        return NULL;
+    }
+
+    aun_station_t *station = aun_derived[station_id];
+    if (station == NULL)
+    {
+        station = calloc(1, sizeof(*station));
+        if (station == NULL)
+        {
+            ESP_LOGE(TAG, "Out of memory for AUN station %d", station_id);
+            return NULL;
+        }
+        aun_derived[station_id] = station;
+    }
+
+    memset(station, 0, sizeof(*station));
+    ip4_addr_set_u32(&station->addr, ip4_addr_get_u32(&aun_subnet) | PP_HTONL(station_id));
+    ip4addr_ntoa_r(&station->addr, station->remote_address, sizeof(station->remote_address));
+    station->is_derived = true;
+    station->station_id = station_id;
+    station->udp_port = AUN_STANDARD_PORT;
+    station->rto_ms = AUN_RTO_INITIAL_MS;
+    aun_station_map[station_id] = station;
+
+    ESP_LOGI(TAG, "AUN station %d is %s", station_id, station->remote_address);
+    return station;
+}
+
+// Identify the AUN station a datagram came from. Runs in the lwIP thread.
+// With a socket per Econet station the configured servers say who it is;
+// in single port mode the last octet of a subnet address is the station
+// number unless a configured server has that address.
+static aun_station_t *_aun_station_from_addr(const ip_addr_t *addr, uint16_t port)
+{
+    if (!IP_IS_V4(addr))
+    {
+        return NULL;
+    }
+
+    const ip4_addr_t *ip = ip_2_ip4(addr);
+    if (aun_shared_pcb == NULL)
+    {
+        aun_station_t *station = _aun_station_by_endpoint(ip, port, false);
+        return station != NULL ? station : _aun_route_from_addr(ip);
+    }
+
+    aun_station_t *station = aun_station_map[ip4_addr4(ip)];
+    if (station != NULL && ip4_addr_cmp(&station->addr, ip))
+    {
+        return station;
+    }
+    aun_station_t *configured = _aun_station_by_endpoint(ip, port, true);
+    if (configured != NULL)
+    {
+        return configured;
+    }
+    if (station == NULL && (ip4_addr_get_u32(ip) & PP_HTONL(0xFFFFFF00UL)) == ip4_addr_get_u32(&aun_subnet))
+    {
+        return _aun_station_derive(ip4_addr4(ip));
+    }
+    return _aun_route_from_addr(ip);
+}
+
+static uint32_t _aun_get_seq(const aun_hdr_t *hdr)
+{
+    return hdr->sequence[0] |
+           (hdr->sequence[1] << 8) |
+           (hdr->sequence[2] << 16) |
+           (hdr->sequence[3] << 24);
+}
+
+static bool _aun_remote_addr(const aun_station_t *aun_station, ip_addr_t *addr)
+{
+    uint32_t ip = ip4_addr_get_u32(&aun_station->addr);
+    if (ip == IPADDR_ANY)
+    {
+        return false;
+    }
+    ip_addr_set_ip4_u32(addr, ip);
+    return true;
+}
+
+// DNS results arrive in the lwIP thread. A station slot may have been
+// reconfigured since the query was made so check it's still ours.
+static void _aun_dns_found(const char *name, const ip_addr_t *ipaddr, void *arg)
+{
+    aun_station_t *aun_station = arg;
+    if (aun_station->station_id == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < aun_station->endpoint_count; i++)
+    {
+        aun_endpoint_t *endpoint = &aun_station->endpoints[i];
+        if (!endpoint->is_hostname || strcmp(name, endpoint->host) != 0)
+        {
+            continue;
+        }
+
+        if (ipaddr == NULL || !IP_IS_V4(ipaddr))
+        {
+            ESP_LOGW(TAG, "Unable to resolve '%s' for AUN station %d", name, aun_station->station_id);
+            continue;
+        }
+
+        if (ip4_addr_get_u32(ip_2_ip4(ipaddr)) != ip4_addr_get_u32(&endpoint->addr))
+        {
+            ESP_LOGI(TAG, "AUN station %d: '%s' is %s", aun_station->station_id, name, ipaddr_ntoa(ipaddr));
+            ip4_addr_set_u32(&endpoint->addr, ip4_addr_get_u32(ip_2_ip4(ipaddr)));
+            if (i == aun_station->endpoint_active)
+            {
+                aun_station->addr = endpoint->addr;
+            }
+        }
+    }
+}
+
+// Must hold the lwIP core lock. lwIP answers from its cache until the
+// record's TTL runs out so calling this regularly costs nothing until the
+// name actually needs re-querying.
+static void _aun_resolve(aun_station_t *aun_station, const char *host)
+{
+    ip_addr_t result;
+    err_t err = dns_gethostbyname_addrtype(host, &result, _aun_dns_found, aun_station, LWIP_DNS_ADDRTYPE_IPV4);
+    if (err == ERR_OK)
+    {
+        _aun_dns_found(host, &result, aun_station);
+    }
+    else if (err != ERR_INPROGRESS)
+    {
+        ESP_LOGW(TAG, "DNS lookup of '%s' failed: err %d", host, err);
+    }
+}
+
+static void _aun_dns_refresh(TimerHandle_t t)
 {
+    LOCK_TCPIP_CORE();
     for (int i = 0; i < ARRAY_SIZE(aun_stations); i++)
     {
-        if (aun_stations[i].udp_port == udp_port)
+        aun_station_t *station = &aun_stations[i];
+        for (int j = 0; station->station_id != 0 && j < station->endpoint_count; j++)
+        {
+            if (station->endpoints[j].is_hostname)
+            {
+                _aun_resolve(station, station->endpoints[j].host);
+            }
+        }
+    }
+    UNLOCK_TCPIP_CORE();
+}
+
+// Send from task context. The raw API isn't thread safe so we borrow the
+// lwIP core lock for the duration of the call. A dynamic endpoint can be
+// closed under the scheduler part way through a handshake.
+static err_t _aun_sendto(econet_station_t *econet_station, struct pbuf *p, const ip_addr_t *addr, uint16_t port)
+{
+    LOCK_TCPIP_CORE();
+    err_t err = econet_station->pcb != NULL ? udp_sendto(econet_station->pcb, p, addr, port) : ERR_CONN;
+    UNLOCK_TCPIP_CORE();
+    return err;
+}
+
+static err_t _aun_send_buffer(econet_station_t *econet_station, const void *data, uint16_t length,
+                              const ip_addr_t *addr, uint16_t port)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, length, PBUF_RAM);
+    if (p == NULL)
+    {
+        return ERR_MEM;
+    }
+    pbuf_take(p, data, length);
+    err_t err = _aun_sendto(econet_station, p, addr, port);
+    pbuf_free(p);
+    return err;
+}
+
+// Must hold the lwIP core lock
+static void _aun_trunk_flush_locked(void)
+{
+    if (aun_trunk_batch_len == 0)
+    {
+        return;
+    }
+
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, aun_trunk_batch_len, PBUF_RAM);
+    if (p != NULL)
+    {
+        pbuf_take(p, aun_trunk_batch, aun_trunk_batch_len);
+        ip_addr_t dest;
+        ip_addr_set_ip4_u32(&dest, ip4_addr_get_u32(&aun_trunk_addr));
+        if (udp_sendto(aun_trunk_pcb, p, &dest, bridge_cfg.trunk_port) == ERR_OK)
+        {
+            aunbridge_stats.trunk_tx_datagram_count++;
+            aunbridge_stats.trunk_tx_frame_count += aun_trunk_batch_frames;
+        }
+        else
+        {
+            aunbridge_stats.tx_error_count++;
+        }
+        pbuf_free(p);
+    }
+    else
+    {
+        aunbridge_stats.tx_error_count++;
+    }
+    aun_trunk_batch_len = 0;
+    aun_trunk_batch_frames = 0;
+}
+
+static void _aun_trunk_flush(void)
+{
+    LOCK_TCPIP_CORE();
+    _aun_trunk_flush_locked();
+    UNLOCK_TCPIP_CORE();
+}
+
+// Add an AUN frame from a Beeb to the trunk batch. Nothing is sent until
+// the batch fills or _aun_trunk_flush() is called. A frame too big to
+// share a datagram goes on its own.
+static void _aun_trunk_append(econet_station_t *econet_station, aun_station_t *aun_station, struct pbuf *p)
+{
+    econet_hdr_t hdr = {
+        .dst_stn = aun_station->station_id,
+        .dst_net = aun_station->network_id,
+        .src_stn = econet_station->station_id,
+        .src_net = bridge_cfg.trunk_local_net,
+    };
+    uint16_t length = sizeof(hdr) + p->tot_len;
+
+    LOCK_TCPIP_CORE();
+    if (aun_trunk_pcb == NULL)
+    {
+        UNLOCK_TCPIP_CORE();
+        return;
+    }
+    if (aun_trunk_batch_len + 2 + length > sizeof(aun_trunk_batch))
+    {
+        _aun_trunk_flush_locked();
+    }
+
+    if (2 + length > sizeof(aun_trunk_batch))
+    {
+        struct pbuf *q = pbuf_alloc(PBUF_TRANSPORT, 2 + sizeof(hdr), PBUF_RAM);
+        if (q != NULL)
         {
-            return &aun_stations[i];
+            uint8_t prefix[2 + sizeof(hdr)] = {length & 0xFF, length >> 8};
+            memcpy(&prefix[2], &hdr, sizeof(hdr));
+            pbuf_take(q, prefix, sizeof(prefix));
+            pbuf_chain(q, p);
+            ip_addr_t dest;
+            ip_addr_set_ip4_u32(&dest, ip4_addr_get_u32(&aun_trunk_addr));
+            if (udp_sendto(aun_trunk_pcb, q, &dest, bridge_cfg.trunk_port) == ERR_OK)
+            {
+                aunbridge_stats.trunk_tx_datagram_count++;
+                aunbridge_stats.trunk_tx_frame_count++;
+            }
+            else
+            {
+                aunbridge_stats.tx_error_count++;
+            }
+            pbuf_free(q);
         }
+        else
+        {
+            aunbridge_stats.tx_error_count++;
+        }
+    }
+    else
+    {
+        uint8_t *record = &aun_trunk_batch[aun_trunk_batch_len];
+        record[0] = length & 0xFF;
+        record[1] = length >> 8;
+        memcpy(&record[2], &hdr, sizeof(hdr));
+        pbuf_copy_partial(p, &record[2 + sizeof(hdr)], p->tot_len, 0);
+        aun_trunk_batch_len += 2 + length;
+        aun_trunk_batch_frames++;
+    }
+    UNLOCK_TCPIP_CORE();
+}
+
+static bool _econet_rx(econet_rx_packet_t *pkt, uint32_t timeout)
+{
+    if (xQueueReceive(econet_rx_packet_queue, pkt, timeout) == pdFALSE)
+    {
+        return false;
+    }
+
+    if (pkt->type == 'S')
+    {
+        econet_rx_clear_bitmaps();
+        ESP_LOGI(TAG, "Econet RX shutdown");
+        xTaskNotifyGive(shutdown_notify_handle);
+        vTaskDelete(NULL);
+    }
+
+    return true;
+}
+
+// Counters are bumped without locks. Each field has a single writer task
+// and readers only need a roughly consistent snapshot.
+static void _aun_count_latency(aunbridge_station_counters_t *counters, uint32_t sample_us)
+{
+    if (counters->latency_avg_us == 0)
+    {
+        counters->latency_avg_us = sample_us;
+    }
+    else
+    {
+        counters->latency_avg_us += ((int32_t)sample_us - (int32_t)counters->latency_avg_us) / 8;
+    }
+    if (sample_us > counters->latency_max_us)
+    {
+        counters->latency_max_us = sample_us;
+    }
+}
+
+static uint32_t _aun_now_ms(void)
+{
+    return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+// FNV-1a over the port, control byte and payload of an AUN broadcast. The
+// sequence number is left out so the same broadcast arriving by two
+// routes looks the same.
+static uint32_t _aun_broadcast_hash(struct pbuf *p)
+{
+    aun_hdr_t hdr;
+    pbuf_copy_partial(p, &hdr, sizeof(hdr), 0);
+
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ hdr.econet_port) * 16777619u;
+    hash = (hash ^ (hdr.econet_control & 0x7F)) * 16777619u;
+    uint16_t offset = sizeof(hdr);
+    for (struct pbuf *q = p; q != NULL; q = q->next)
+    {
+        if (offset >= q->len)
+        {
+            offset -= q->len;
+            continue;
+        }
+        const uint8_t *data = q->payload;
+        for (uint16_t i = offset; i < q->len; i++)
+        {
+            hash = (hash ^ data[i]) * 16777619u;
+        }
+        offset = 0;
+    }
+    return hash;
+}
+
+// Must hold the lwIP core lock. True if the broadcast was seen recently,
+// otherwise it's remembered.
+static bool _aun_broadcast_seen(uint32_t hash)
+{
+    uint32_t now = _aun_now_ms();
+    for (int i = 0; i < ARRAY_SIZE(aun_broadcast_recent); i++)
+    {
+        if (aun_broadcast_recent[i].seen_ms != 0 && aun_broadcast_recent[i].hash == hash &&
+            now - aun_broadcast_recent[i].seen_ms < AUN_BROADCAST_DEDUPE_MS)
+        {
+            return true;
+        }
+    }
+    aun_broadcast_recent[aun_broadcast_recent_next].hash = hash;
+    aun_broadcast_recent[aun_broadcast_recent_next].seen_ms = now | 1;
+    aun_broadcast_recent_next = (aun_broadcast_recent_next + 1) % ARRAY_SIZE(aun_broadcast_recent);
+    return false;
+}
+
+static aun_tx_ctx_t *_aun_tx_ctx_find(econet_station_t *econet_station, aun_station_t *aun_station)
+{
+    for (int i = 0; i < ARRAY_SIZE(aun_tx_ctxs); i++)
+    {
+        if (aun_tx_ctxs[i].econet_station == econet_station && aun_tx_ctxs[i].aun_station == aun_station)
+        {
+            return &aun_tx_ctxs[i];
+        }
+    }
+    return NULL;
+}
+
+static aun_tx_ctx_t *_aun_tx_ctx_get(econet_station_t *econet_station, aun_station_t *aun_station)
+{
+    aun_tx_ctx_t *ctx = _aun_tx_ctx_find(econet_station, aun_station);
+    if (ctx != NULL)
+    {
+        return ctx;
+    }
+
+    // Take a free context, or else recycle the longest idle one
+    for (int i = 0; i < ARRAY_SIZE(aun_tx_ctxs); i++)
+    {
+        aun_tx_ctx_t *c = &aun_tx_ctxs[i];
+        if (c->econet_station == NULL)
+        {
+            ctx = c;
+            break;
+        }
+        if (!c->is_busy && c->backlog_count == 0 &&
+            (ctx == NULL || (int32_t)(c->last_used - ctx->last_used) < 0))
+        {
+            ctx = c;
+        }
+    }
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->econet_station = econet_station;
+    ctx->aun_station = aun_station;
+
+    // A recycled pair must not restart a sequence the server has already
+    // seen or it would be taken as a duplicate. Stop-and-wait can't use
+    // four sequence numbers per millisecond so seeding from the tick count
+    // keeps us ahead of anything sent previously.
+    ctx->seq = (uint32_t)xTaskGetTickCount() << 2;
+    return ctx;
+}
+
+// RFC 6298 estimator. The clock granularity term is one RTOS tick.
+static void _aun_rtt_sample(aun_station_t *station, int32_t rtt_us)
+{
+    if (rtt_us <= 0)
+    {
+        rtt_us = 1;
+    }
+
+    if (station->srtt_us == 0)
+    {
+        station->srtt_us = rtt_us;
+        station->rttvar_us = rtt_us / 2;
+    }
+    else
+    {
+        int32_t err = station->srtt_us - rtt_us;
+        if (err < 0)
+        {
+            err = -err;
+        }
+        station->rttvar_us += (err - station->rttvar_us) / 4;
+        station->srtt_us += (rtt_us - station->srtt_us) / 8;
+    }
+
+    int32_t var_us = 4 * station->rttvar_us;
+    if (var_us < portTICK_PERIOD_MS * 1000)
+    {
+        var_us = portTICK_PERIOD_MS * 1000;
+    }
+    uint32_t rto_ms = (station->srtt_us + var_us + 999) / 1000;
+    if (rto_ms < AUN_RTO_MIN_MS)
+    {
+        rto_ms = AUN_RTO_MIN_MS;
+    }
+    else if (rto_ms > AUN_RTO_MAX_MS)
+    {
+        rto_ms = AUN_RTO_MAX_MS;
+    }
+    station->rto_ms = rto_ms;
+}
+
+// Make an endpoint the one traffic goes to. The station's RTT estimate
+// starts again from what the probes have seen of the new server. Must hold
+// the lwIP core lock.
+static void _aun_endpoint_use(aun_station_t *station, int index)
+{
+    aun_endpoint_t *endpoint = &station->endpoints[index];
+    station->endpoint_active = index;
+    snprintf(station->remote_address, sizeof(station->remote_address), "%s", endpoint->host);
+    station->addr = endpoint->addr;
+    station->udp_port = endpoint->udp_port;
+
+    station->srtt_us = 0;
+    station->rttvar_us = 0;
+    station->rto_ms = AUN_RTO_INITIAL_MS;
+    if (endpoint->srtt_us != 0)
+    {
+        _aun_rtt_sample(station, endpoint->srtt_us);
+    }
+}
+
+// Healthiest server other than skip: up, resolved and quickest to answer
+static int _aun_endpoint_best(aun_station_t *station, int skip)
+{
+    int best = -1;
+    for (int i = 0; i < station->endpoint_count; i++)
+    {
+        aun_endpoint_t *endpoint = &station->endpoints[i];
+        if (i == skip || !endpoint->is_up || ip4_addr_get_u32(&endpoint->addr) == IPADDR_ANY)
+        {
+            continue;
+        }
+        if (best < 0 || endpoint->srtt_us < station->endpoints[best].srtt_us)
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Called when a transmission times out. Rather than spend the remaining
+// attempts on a server that has stopped answering, move to the best of the
+// others. Returns true if the station changed server.
+static bool _aun_failover(aun_station_t *station)
+{
+    bool is_moved = false;
+    LOCK_TCPIP_CORE();
+    if (station->endpoint_count > 1)
+    {
+        int active = station->endpoint_active;
+        station->endpoints[active].is_up = false;
+        int best = _aun_endpoint_best(station, active);
+        if (best >= 0)
+        {
+            ESP_LOGW(TAG, "AUN station %d: %s:%d not answering, moving to %s:%d", station->station_id,
+                     station->endpoints[active].host, station->endpoints[active].udp_port,
+                     station->endpoints[best].host, station->endpoints[best].udp_port);
+            _aun_endpoint_use(station, best);
+            is_moved = true;
+        }
+    }
+    UNLOCK_TCPIP_CORE();
+    return is_moved;
+}
+
+// Runs in the lwIP thread when a MACHINETYPE reply arrives
+static void _aun_probe_reply(aun_station_t *station, const ip_addr_t *addr, uint16_t port, const aun_hdr_t *hdr)
+{
+    if (station == NULL || station->endpoint_count < 2 || !IP_IS_V4(addr))
+    {
+        return;
+    }
+    aun_endpoint_t *endpoint = _aun_endpoint_find(station, ip_2_ip4(addr), port);
+    if (endpoint == NULL || endpoint->probe_sent_us == 0 || _aun_get_seq(hdr) != endpoint->probe_seq)
+    {
+        return;
+    }
+
+    int32_t rtt_us = esp_timer_get_time() - endpoint->probe_sent_us;
+    if (endpoint->srtt_us == 0)
+    {
+        endpoint->srtt_us = rtt_us;
+        endpoint->rttvar_us = rtt_us / 2;
+    }
+    else
+    {
+        int32_t err = endpoint->srtt_us - rtt_us;
+        endpoint->rttvar_us += ((err < 0 ? -err : err) - endpoint->rttvar_us) / 4;
+        endpoint->srtt_us += (rtt_us - endpoint->srtt_us) / 8;
+    }
+    endpoint->probe_sent_us = 0;
+    endpoint->missed = 0;
+    if (!endpoint->is_up)
+    {
+        ESP_LOGI(TAG, "AUN station %d: %s:%d is answering again", station->station_id, endpoint->host, endpoint->udp_port);
+        endpoint->is_up = true;
+    }
+}
+
+// Probe every server of stations that have more than one, and move
+// traffic if the active one is down or another is answering in under half
+// the time.
+static void _aun_probe(TimerHandle_t t)
+{
+    LOCK_TCPIP_CORE();
+    struct udp_pcb *pcb = aun_shared_pcb;
+    for (int i = 0; i < ARRAY_SIZE(econet_stations) && pcb == NULL; i++)
+    {
+        pcb = econet_stations[i].pcb;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(aun_stations) && pcb != NULL; i++)
+    {
+        aun_station_t *station = &aun_stations[i];
+        if (station->station_id == 0 || station->endpoint_count < 2)
+        {
+            continue;
+        }
+
+        for (int j = 0; j < station->endpoint_count; j++)
+        {
+            aun_endpoint_t *endpoint = &station->endpoints[j];
+            if (endpoint->probe_sent_us != 0 && ++endpoint->missed >= AUN_PROBE_MISSES && endpoint->is_up)
+            {
+                ESP_LOGW(TAG, "AUN station %d: %s:%d stopped answering", station->station_id, endpoint->host, endpoint->udp_port);
+                endpoint->is_up = false;
+            }
+            if (ip4_addr_get_u32(&endpoint->addr) == IPADDR_ANY)
+            {
+                continue;
+            }
+
+            endpoint->probe_seq++;
+            aun_hdr_t hdr = {
+                .transaction_type = AUN_TYPE_IMM,
+                .econet_port = 0,
+                .econet_control = 0x08, // MACHINETYPE
+                .sequence = {endpoint->probe_seq, endpoint->probe_seq >> 8, endpoint->probe_seq >> 16, endpoint->probe_seq >> 24},
+            };
+            struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, sizeof(hdr), PBUF_RAM);
+            if (p == NULL)
+            {
+                continue;
+            }
+            pbuf_take(p, &hdr, sizeof(hdr));
+            ip_addr_t dest;
+            ip_addr_set_ip4_u32(&dest, ip4_addr_get_u32(&endpoint->addr));
+            endpoint->probe_sent_us = esp_timer_get_time();
+            udp_sendto(pcb, p, &dest, endpoint->udp_port);
+            pbuf_free(p);
+        }
+
+        aun_endpoint_t *active = &station->endpoints[station->endpoint_active];
+        int best = _aun_endpoint_best(station, station->endpoint_active);
+        if (best >= 0 && (!active->is_up || station->endpoints[best].srtt_us < active->srtt_us / 2))
+        {
+            ESP_LOGI(TAG, "AUN station %d: moving to %s:%d", station->station_id,
+                     station->endpoints[best].host, station->endpoints[best].udp_port);
+            _aun_endpoint_use(station, best);
+        }
+    }
+    UNLOCK_TCPIP_CORE();
+}
+
+static void _aun_tx_transmit(aun_tx_ctx_t *ctx)
+{
+    struct pbuf *p = ctx->backlog[ctx->backlog_head];
+
+    ip_addr_t dest_addr;
+    if (ctx->aun_station->is_trunk)
+    {
+        _aun_trunk_append(ctx->econet_station, ctx->aun_station, p);
+    }
+    else if (!_aun_remote_addr(ctx->aun_station, &dest_addr))
+    {
+        ESP_LOGW(TAG, "AUN station %d address '%s' not resolved yet", ctx->aun_station->station_id, ctx->aun_station->remote_address);
+        aunbridge_stats.tx_error_count++;
+    }
+    else
+    {
+        err_t err = _aun_sendto(ctx->econet_station, p, &dest_addr, ctx->aun_station->udp_port);
+        if (err != ERR_OK)
+        {
+            ESP_LOGE(TAG, "Error occurred during sending: err %d", err);
+            aunbridge_stats.tx_error_count++;
+        }
+    }
+
+    ctx->sent_at_us = esp_timer_get_time();
+    ctx->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(ctx->aun_station->rto_ms);
+}
+
+// Put the next backlogged frame on the wire if the context is idle
+static void _aun_tx_start(aun_tx_ctx_t *ctx)
+{
+    if (ctx->is_busy || ctx->backlog_count == 0)
+    {
+        return;
+    }
+
+    if (ctx->econet_station->pcb != NULL && ctx->econet_station->pcb == aun_shared_pcb)
+    {
+        // The host can't tell the Beebs behind the shared socket apart, so
+        // they take their sequence numbers from one space per host
+        aun_station_t *aun_station = ctx->aun_station;
+        if (aun_station->shared_seq == 0)
+        {
+            aun_station->shared_seq = (uint32_t)xTaskGetTickCount() << 2;
+        }
+        aun_station->shared_seq += 4;
+        ctx->seq = aun_station->shared_seq;
+    }
+    else
+    {
+        ctx->seq += 4;
+    }
+    uint8_t seq[4] = {
+        (ctx->seq >> 0) & 0xFF,
+        (ctx->seq >> 8) & 0xFF,
+        (ctx->seq >> 16) & 0xFF,
+        (ctx->seq >> 24) & 0xFF,
+    };
+    pbuf_take_at(ctx->backlog[ctx->backlog_head], seq, sizeof(seq), offsetof(aun_hdr_t, sequence));
+
+    aun_tx_pending_t *pending = &aun_tx_pending[ctx - aun_tx_ctxs];
+    taskENTER_CRITICAL(&aun_tx_pending_lock);
+    pending->econet_station = ctx->econet_station;
+    pending->aun_station = ctx->aun_station;
+    pending->seq = ctx->seq;
+    pending->result = 0;
+    pending->is_armed = true;
+    taskEXIT_CRITICAL(&aun_tx_pending_lock);
+
+    aunbridge_stats.tx_count++;
+    ctx->aun_station->counters.frames_out++;
+    ctx->aun_station->counters.bytes_out += ctx->backlog[ctx->backlog_head]->tot_len - sizeof(aun_hdr_t);
+    ctx->is_busy = true;
+    ctx->attempts_left = AUN_TX_ATTEMPTS;
+    ctx->nack_count = 0;
+    ctx->is_retransmit = false;
+    ctx->is_nack_retry = false;
+    _aun_tx_transmit(ctx);
+}
+
+static void _aun_tx_notify(TaskHandle_t waiter, bool is_acked)
+{
+    if (waiter != NULL)
+    {
+        xTaskNotify(waiter, is_acked ? AUN_WAITER_ACKED : AUN_WAITER_FAILED, eSetValueWithOverwrite);
+    }
+}
+
+static void _aun_tx_complete(aun_tx_ctx_t *ctx, bool is_acked)
+{
+    taskENTER_CRITICAL(&aun_tx_pending_lock);
+    aun_tx_pending[ctx - aun_tx_ctxs].is_armed = false;
+    taskEXIT_CRITICAL(&aun_tx_pending_lock);
+
+    _aun_tx_notify(ctx->waiters[ctx->backlog_head], is_acked);
+    pbuf_free(ctx->backlog[ctx->backlog_head]);
+    ctx->backlog[ctx->backlog_head] = NULL;
+    ctx->waiters[ctx->backlog_head] = NULL;
+    ctx->backlog_head = (ctx->backlog_head + 1) % AUN_TX_BACKLOG;
+    ctx->backlog_count--;
+    ctx->is_busy = false;
+    ctx->last_used = xTaskGetTickCount();
+    _aun_tx_start(ctx);
+}
+
+static void _aun_tx_enqueue(aun_tx_event_t *evt)
+{
+    aun_tx_ctx_t *ctx = _aun_tx_ctx_get(evt->econet_station, evt->aun_station);
+    if (ctx == NULL || ctx->backlog_count == AUN_TX_BACKLOG)
+    {
+        ESP_LOGW(TAG, "No room to queue frame from %d to AUN station %d. Packet dropped.",
+                 evt->econet_station->station_id, evt->aun_station->station_id);
+        aunbridge_stats.tx_error_count++;
+        _aun_tx_notify(evt->waiter, false);
+        pbuf_free(evt->p);
+        return;
+    }
+
+    ctx->backlog[(ctx->backlog_head + ctx->backlog_count) % AUN_TX_BACKLOG] = evt->p;
+    ctx->waiters[(ctx->backlog_head + ctx->backlog_count) % AUN_TX_BACKLOG] = evt->waiter;
+    ctx->backlog_count++;
+    ctx->last_used = xTaskGetTickCount();
+    _aun_tx_start(ctx);
+}
+
+static void _aun_tx_ack(aun_tx_ctx_t *ctx)
+{
+    aun_tx_pending_t *pending = &aun_tx_pending[ctx - aun_tx_ctxs];
+    taskENTER_CRITICAL(&aun_tx_pending_lock);
+    uint8_t result = pending->is_armed ? pending->result : 0;
+    pending->result = 0;
+    taskEXIT_CRITICAL(&aun_tx_pending_lock);
+
+    if (result == 0 || !ctx->is_busy)
+    {
+        return;
+    }
+
+    if (result == AUN_TYPE_NACK)
+    {
+        // The server is alive but couldn't take the frame. Resend straight
+        // away the first time, then back off so a busy server isn't hammered.
+        // This is not a loss so the peer's RTO is left alone.
+        TickType_t holdoff = 0;
+        if (ctx->nack_count > 0)
+        {
+            uint32_t holdoff_ms = AUN_RTO_MIN_MS << (ctx->nack_count - 1);
+            if (holdoff_ms > ctx->aun_station->rto_ms)
+            {
+                holdoff_ms = ctx->aun_station->rto_ms;
+            }
+            holdoff = pdMS_TO_TICKS(holdoff_ms);
+        }
+        if (ctx->nack_count < 8)
+        {
+            ctx->nack_count++;
+        }
+        ctx->is_nack_retry = true;
+        ctx->deadline = xTaskGetTickCount() + holdoff;
+        return;
+    }
+
+    if (!ctx->is_retransmit)
+    {
+        int32_t rtt_us = esp_timer_get_time() - ctx->sent_at_us;
+        _aun_rtt_sample(ctx->aun_station, rtt_us);
+        _aun_count_latency(&ctx->aun_station->counters, rtt_us);
+    }
+    _aun_tx_complete(ctx, true);
+}
+
+// Retransmit or give up on any context whose timer has run out and return
+// how long until the next one is due.
+static TickType_t _aun_tx_service_timers(void)
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t wait = portMAX_DELAY;
+
+    for (int i = 0; i < ARRAY_SIZE(aun_tx_ctxs); i++)
+    {
+        aun_tx_ctx_t *ctx = &aun_tx_ctxs[i];
+        if (!ctx->is_busy)
+        {
+            continue;
+        }
+
+        if ((int32_t)(ctx->deadline - now) <= 0)
+        {
+            if (!ctx->is_nack_retry && !_aun_failover(ctx->aun_station))
+            {
+                // Timed out. Back off until a fresh sample says otherwise.
+                // Moving to another server brings its own RTO instead.
+                uint32_t rto_ms = ctx->aun_station->rto_ms * 2;
+                ctx->aun_station->rto_ms = rto_ms > AUN_RTO_MAX_MS ? AUN_RTO_MAX_MS : rto_ms;
+            }
+            ctx->is_nack_retry = false;
+
+            if (--ctx->attempts_left > 0)
+            {
+                aunbridge_stats.tx_retry_count++;
+                ctx->aun_station->counters.retries++;
+                ctx->econet_station->counters.retries++;
+                ESP_LOGI(TAG, "Retry! %d remain", ctx->attempts_left);
+                ctx->is_retransmit = true;
+                _aun_tx_transmit(ctx);
+            }
+            else
+            {
+                ESP_LOGW(TAG, "Retries exhausted, no response from server %s:%d",
+                         ctx->aun_station->remote_address, ctx->aun_station->udp_port);
+                aunbridge_stats.tx_abort_count++;
+                ctx->aun_station->counters.aborts++;
+                ctx->econet_station->counters.aborts++;
+                _aun_tx_complete(ctx, false);
+                if (!ctx->is_busy)
+                {
+                    continue;
+                }
+            }
+        }
+
+        TickType_t remaining = ctx->deadline - now;
+        if (remaining < wait)
+        {
+            wait = remaining;
+        }
+    }
+
+    return wait;
+}
+
+static void _aun_tx_release(econet_station_t *econet_station)
+{
+    for (int i = 0; i < ARRAY_SIZE(aun_tx_ctxs); i++)
+    {
+        aun_tx_ctx_t *ctx = &aun_tx_ctxs[i];
+        if (ctx->econet_station != econet_station)
+        {
+            continue;
+        }
+
+        taskENTER_CRITICAL(&aun_tx_pending_lock);
+        aun_tx_pending[i].is_armed = false;
+        taskEXIT_CRITICAL(&aun_tx_pending_lock);
+
+        for (int j = 0; j < ctx->backlog_count; j++)
+        {
+            _aun_tx_notify(ctx->waiters[(ctx->backlog_head + j) % AUN_TX_BACKLOG], false);
+            pbuf_free(ctx->backlog[(ctx->backlog_head + j) % AUN_TX_BACKLOG]);
+        }
+        memset(ctx, 0, sizeof(*ctx));
+    }
+    econet_station->is_tx_releasing = false;
+}
+
+static void _aun_tx_reset(void)
+{
+    taskENTER_CRITICAL(&aun_tx_pending_lock);
+    memset(aun_tx_pending, 0, sizeof(aun_tx_pending));
+    taskEXIT_CRITICAL(&aun_tx_pending_lock);
+
+    for (int i = 0; i < ARRAY_SIZE(aun_tx_ctxs); i++)
+    {
+        aun_tx_ctx_t *ctx = &aun_tx_ctxs[i];
+        for (int j = 0; j < ctx->backlog_count; j++)
+        {
+            _aun_tx_notify(ctx->waiters[(ctx->backlog_head + j) % AUN_TX_BACKLOG], false);
+            pbuf_free(ctx->backlog[(ctx->backlog_head + j) % AUN_TX_BACKLOG]);
+        }
+    }
+    memset(aun_tx_ctxs, 0, sizeof(aun_tx_ctxs));
+}
+
+// A block of a spooled print job goes from the print station to the print
+// server, looked up here so it always matches the running configuration
+static void _aun_tx_print(aun_tx_event_t *evt)
+{
+    evt->econet_station = bridge_cfg.print_station_id != 0 ? _get_econet_station_by_id(bridge_cfg.print_station_id) : NULL;
+    evt->aun_station = _get_aun_station_by_id(bridge_cfg.print_server_id);
+    if (evt->econet_station == NULL || evt->aun_station == NULL)
+    {
+        _aun_tx_notify(evt->waiter, false);
+        pbuf_free(evt->p);
+        return;
+    }
+    _aun_tx_enqueue(evt);
+}
+
+static void _aun_tx_task(void *params)
+{
+    TickType_t wait = portMAX_DELAY;
+
+    for (;;)
+    {
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, wait);
+
+        for (int i = 0; i < ARRAY_SIZE(aun_tx_ctxs); i++)
+        {
+            if (bits & (1UL << i))
+            {
+                _aun_tx_ack(&aun_tx_ctxs[i]);
+            }
+        }
+
+        aun_tx_event_t evt;
+        while (xQueueReceive(aun_tx_queue, &evt, 0) == pdTRUE)
+        {
+            switch (evt.type)
+            {
+            case 'F':
+                _aun_tx_enqueue(&evt);
+                break;
+            case 'P':
+                _aun_tx_print(&evt);
+                break;
+            case 'X':
+                _aun_tx_release(evt.econet_station);
+                break;
+            case 'S':
+                ESP_LOGI(TAG, "AUN: TX shutdown");
+                _aun_tx_reset();
+                vTaskSuspendAll();
+                aun_tx_task_handle = NULL;
+                xTaskResumeAll();
+                xTaskNotifyGive(shutdown_notify_handle);
+                vTaskDelete(NULL);
+                break;
+            }
+        }
+
+        wait = _aun_tx_service_timers();
+
+        // Everything that became ready this time round shares datagrams
+        _aun_trunk_flush();
+    }
+}
+
+static aun_rx_ctx_t *_aun_rx_ctx_find(econet_station_t *econet_station, aun_station_t *aun_station)
+{
+    for (int i = 0; i < ARRAY_SIZE(aun_rx_ctxs); i++)
+    {
+        aun_rx_ctx_t *c = &aun_rx_ctxs[i];
+        if (c->econet_station == econet_station && c->aun_station == aun_station)
+        {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static aun_rx_ctx_t *_aun_rx_ctx_get(econet_station_t *econet_station, aun_station_t *aun_station)
+{
+    aun_rx_ctx_t *ctx = _aun_rx_ctx_find(econet_station, aun_station);
+    if (ctx != NULL)
+    {
+        return ctx;
+    }
+
+    // Take a free context, or else recycle the longest idle one that has
+    // nothing held
+    for (int i = 0; i < ARRAY_SIZE(aun_rx_ctxs); i++)
+    {
+        aun_rx_ctx_t *c = &aun_rx_ctxs[i];
+        if (c->econet_station == NULL)
+        {
+            ctx = c;
+            break;
+        }
+        if (c->held_count == 0 && (ctx == NULL || (int32_t)(c->last_used - ctx->last_used) < 0))
+        {
+            ctx = c;
+        }
+    }
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->econet_station = econet_station;
+    ctx->aun_station = aun_station;
+    return ctx;
+}
+
+static aun_rx_seen_t *_aun_rx_seen_find(aun_rx_ctx_t *ctx, uint32_t seq)
+{
+    for (int i = 0; i < ARRAY_SIZE(ctx->seen); i++)
+    {
+        if (ctx->seen[i].is_valid && ctx->seen[i].seq == seq)
+        {
+            return &ctx->seen[i];
+        }
+    }
+    return NULL;
+}
+
+static void _aun_send_ack(econet_station_t *econet_station, aun_station_t *aun_station,
+                          aun_hdr_t *hdr, econet_acktype_t result)
+{
+    ip_addr_t dest_addr;
+    if (!_aun_remote_addr(aun_station, &dest_addr))
+    {
+        return;
+    }
+
+    if (result == ECONET_ACK)
+    {
+        hdr->transaction_type = AUN_TYPE_ACK;
+        aunbridge_stats.tx_ack_count++;
+    }
+    else
+    {
+        hdr->transaction_type = AUN_TYPE_NACK;
+        aunbridge_stats.tx_nack_count++;
+    }
+
+    // Send (N)ACK to calling station at port we have on file
+    if (aun_station->is_trunk)
+    {
+        struct pbuf *p = pbuf_alloc(PBUF_RAW, sizeof(*hdr), PBUF_RAM);
+        if (p != NULL)
+        {
+            pbuf_take(p, hdr, sizeof(*hdr));
+            _aun_trunk_append(econet_station, aun_station, p);
+            _aun_trunk_flush();
+            pbuf_free(p);
+        }
+        return;
+    }
+    _aun_send_buffer(econet_station, hdr, sizeof(*hdr), &dest_addr, aun_station->udp_port);
+}
+
+// Answer an immediate operation the way it came, over the trunk or direct
+static void _aun_send_imm_reply(econet_station_t *econet_station, aun_station_t *aun_station,
+                                const uint8_t *reply, uint16_t length)
+{
+    if (aun_station->is_trunk)
+    {
+        struct pbuf *p = pbuf_alloc(PBUF_RAW, length, PBUF_RAM);
+        if (p != NULL)
+        {
+            pbuf_take(p, reply, length);
+            _aun_trunk_append(econet_station, aun_station, p);
+            _aun_trunk_flush();
+            pbuf_free(p);
+        }
+        return;
+    }
+
+    ip_addr_t dest_addr;
+    if (_aun_remote_addr(aun_station, &dest_addr))
+    {
+        _aun_send_buffer(econet_station, reply, length, &dest_addr, aun_station->udp_port);
+    }
+}
+
+static uint8_t _aun_sched_classify(uint8_t port, uint8_t control)
+{
+    for (int i = 0; i < aun_priority.rule_count; i++)
+    {
+        config_priority_rule_t *rule = &aun_priority.rules[i];
+        if (rule->port == port && (rule->control == 0 || (rule->control | 0x80) == control))
+        {
+            return rule->class_id;
+        }
+    }
+    return AUN_SCHED_DEFAULT_CLASS;
+}
+
+// Queue a data frame for its Econet station. Takes ownership of item->p
+// on success.
+static bool _aun_sched_enqueue_class(aun_rx_item_t *item, aun_station_t *aun_station, uint8_t class_id)
+{
+    econet_station_t *econet_station = item->econet_station;
+
+    taskENTER_CRITICAL(&aun_sched_lock);
+    aun_sched_item_t *entry = NULL;
+    if (econet_station->queue_depth < AUN_SCHED_STATION_DEPTH)
+    {
+        entry = aun_sched_free;
+    }
+    if (entry != NULL)
+    {
+        aun_sched_free = entry->next;
+        entry->next = NULL;
+        entry->item = *item;
+        entry->aun_station = aun_station;
+        entry->class_id = class_id;
+        entry->queued_at = xTaskGetTickCount();
+        entry->attempts = 0;
+        if (econet_station->retry_head != NULL && econet_station->retry_head->class_id == class_id)
+        {
+            // Waits behind the frame being retried
+            econet_station->retry_tail->next = entry;
+            econet_station->retry_tail = entry;
+        }
+        else
+        {
+            if (econet_station->queue_tail[class_id] != NULL)
+            {
+                econet_station->queue_tail[class_id]->next = entry;
+            }
+            else
+            {
+                econet_station->queue_head[class_id] = entry;
+            }
+            econet_station->queue_tail[class_id] = entry;
+            aun_sched_class_depth[class_id]++;
+        }
+        econet_station->queue_depth++;
+        if (econet_station->queue_depth > econet_station->queue_depth_max)
+        {
+            econet_station->queue_depth_max = econet_station->queue_depth;
+        }
+    }
+    taskEXIT_CRITICAL(&aun_sched_lock);
+
+    if (entry == NULL)
+    {
+        ESP_LOGW(TAG, "Econet TX queue for station %d full. Packet dropped.", econet_station->station_id);
+        return false;
+    }
+
+    item->p = NULL;
+    xTaskNotify(aun_sched_task_handle, AUN_SCHED_NOTIFY_WORK, eSetBits);
+    return true;
+}
+
+static bool _aun_sched_enqueue(aun_rx_item_t *item, aun_station_t *aun_station)
+{
+    aun_hdr_t hdr;
+    pbuf_copy_partial(item->p, &hdr, sizeof(hdr), 0);
+    return _aun_sched_enqueue_class(item, aun_station, _aun_sched_classify(hdr.econet_port, hdr.econet_control | 0x80));
+}
+
+// Choose which priority class to serve next. Strict mode always takes the
+// highest non-empty class; weighted mode gives each class its weight in
+// frames per round. Call with aun_sched_lock held.
+static int _aun_sched_pick_class(void)
+{
+    if (!aun_priority.is_weighted)
+    {
+        for (int c = 0; c < AUN_SCHED_CLASSES; c++)
+        {
+            if (aun_sched_class_depth[c] > 0)
+            {
+                return c;
+            }
+        }
+        return -1;
+    }
+
+    for (int round = 0; round < 2; round++)
+    {
+        for (int k = 0; k < AUN_SCHED_CLASSES; k++)
+        {
+            int c = (aun_sched_class_cursor + k) % AUN_SCHED_CLASSES;
+            if (aun_sched_class_depth[c] > 0 && aun_sched_class_credit[c] > 0)
+            {
+                aun_sched_class_credit[c]--;
+                aun_sched_class_cursor = c;
+                return c;
+            }
+        }
+
+        // Everyone with work has used their share. Start a new round.
+        for (int c = 0; c < AUN_SCHED_CLASSES; c++)
+        {
+            aun_sched_class_credit[c] = aun_priority.weights[c];
+        }
+    }
+    return -1;
+}
+
+// Deficit round robin across the Econet stations' queues within the chosen
+// class so one busy station can't monopolise the bus. Returns NULL when
+// everything is empty.
+static aun_sched_item_t *_aun_sched_next(void)
+{
+    aun_sched_item_t *entry = NULL;
+
+    taskENTER_CRITICAL(&aun_sched_lock);
+    int c = _aun_sched_pick_class();
+
+    while (c >= 0)
+    {
+        econet_station_t *station = &econet_stations[aun_sched_cursor[c]];
+        if (station->queue_head[c] == NULL)
+        {
+            station->deficit[c] = 0;
+            station->has_quantum[c] = false;
+            aun_sched_cursor[c] = (aun_sched_cursor[c] + 1) % ARRAY_SIZE(econet_stations);
+            continue;
+        }
+
+        if (!station->has_quantum[c])
+        {
+            station->deficit[c] += AUN_SCHED_QUANTUM;
+            station->has_quantum[c] = true;
+        }
+
+        uint16_t size = station->queue_head[c]->item.p->tot_len;
+        if (size <= station->deficit[c])
+        {
+            station->deficit[c] -= size;
+            entry = station->queue_head[c];
+            station->queue_head[c] = entry->next;
+            if (station->queue_head[c] == NULL)
+            {
+                station->queue_tail[c] = NULL;
+            }
+            station->queue_depth--;
+            aun_sched_class_depth[c]--;
+            break;
+        }
+
+        // Out of credit for this round
+        station->has_quantum[c] = false;
+        aun_sched_cursor[c] = (aun_sched_cursor[c] + 1) % ARRAY_SIZE(econet_stations);
+    }
+    taskEXIT_CRITICAL(&aun_sched_lock);
+
+    return entry;
+}
+
+static void _aun_sched_release(aun_sched_item_t *entry)
+{
+    taskENTER_CRITICAL(&aun_sched_lock);
+    entry->next = aun_sched_free;
+    aun_sched_free = entry;
+    taskEXIT_CRITICAL(&aun_sched_lock);
+}
+
+// Hold back a refused frame taken from its queue, along with everything
+// behind it in the class, until its retry is due
+static void _aun_sched_defer(aun_sched_item_t *entry)
+{
+    econet_station_t *station = entry->item.econet_station;
+    int c = entry->class_id;
+
+    taskENTER_CRITICAL(&aun_sched_lock);
+    entry->next = station->queue_head[c];
+    station->retry_head = entry;
+    station->retry_tail = station->queue_tail[c] != NULL ? station->queue_tail[c] : entry;
+    for (aun_sched_item_t *e = station->queue_head[c]; e != NULL; e = e->next)
+    {
+        aun_sched_class_depth[c]--;
+    }
+    station->queue_head[c] = NULL;
+    station->queue_tail[c] = NULL;
+    station->queue_depth++;
+    taskEXIT_CRITICAL(&aun_sched_lock);
+}
+
+// A retried frame has gone, one way or the other. What waited behind it
+// goes back to the front of its queue.
+static void _aun_sched_retry_done(econet_station_t *station)
+{
+    taskENTER_CRITICAL(&aun_sched_lock);
+    aun_sched_item_t *entry = station->retry_head;
+    int c = entry->class_id;
+    station->queue_depth--;
+    if (entry->next != NULL)
+    {
+        for (aun_sched_item_t *e = entry->next; e != NULL; e = e->next)
+        {
+            aun_sched_class_depth[c]++;
+        }
+        station->retry_tail->next = station->queue_head[c];
+        if (station->queue_tail[c] == NULL)
+        {
+            station->queue_tail[c] = station->retry_tail;
+        }
+        station->queue_head[c] = entry->next;
+    }
+    station->retry_head = NULL;
+    station->retry_tail = NULL;
+    taskEXIT_CRITICAL(&aun_sched_lock);
+}
+
+// A held frame whose retry is due, or NULL. wait is set to the ticks until
+// the next one is.
+static aun_sched_item_t *_aun_sched_retry_next(TickType_t *wait)
+{
+    aun_sched_item_t *entry = NULL;
+    TickType_t now = xTaskGetTickCount();
+    *wait = portMAX_DELAY;
+
+    taskENTER_CRITICAL(&aun_sched_lock);
+    for (int i = 0; i < ARRAY_SIZE(econet_stations) && entry == NULL; i++)
+    {
+        aun_sched_item_t *head = econet_stations[i].retry_head;
+        if (head == NULL)
+        {
+            continue;
+        }
+        int32_t remaining = (int32_t)(head->retry_at - now);
+        if (remaining <= 0)
+        {
+            entry = head;
+            *wait = 0;
+        }
+        else if ((TickType_t)remaining < *wait)
+        {
+            *wait = remaining;
+        }
+    }
+    taskEXIT_CRITICAL(&aun_sched_lock);
+    return entry;
+}
+
+// Point iovecs at the pbuf chain from offset onwards so the Econet encoder
+// can read the payload in place. Returns the count or -1 if there are too
+// many pieces.
+static int _aun_pbuf_iov(struct pbuf *p, uint16_t offset, econet_iovec_t *iov, int max_iov)
+{
+    int iov_count = 0;
+    for (struct pbuf *q = p; q != NULL; q = q->next)
+    {
+        if (offset >= q->len)
+        {
+            offset -= q->len;
+            continue;
+        }
+        if (iov_count == max_iov)
+        {
+            return -1;
+        }
+        iov[iov_count].data = (const uint8_t *)q->payload + offset;
+        iov[iov_count].length = q->len - offset;
+        iov_count++;
+        offset = 0;
+    }
+    return iov_count;
+}
+
+// Put an immediate operation from an AUN host on the Econet. The AUN
+// payload is the scout's arguments followed by any data. There's no
+// (N)ACK for these on AUN; a successful operation is answered with
+// IMM_REPLY carrying whatever the Beeb sent back and a failed one isn't
+// answered at all.
+static void _aun_sched_send_imm(aun_sched_item_t *entry, const aun_hdr_t *hdr)
+{
+    static uint8_t reply[sizeof(aun_hdr_t) + AUN_IMM_REPLY_MAX];
+
+    aun_rx_item_t *item = &entry->item;
+    econet_station_t *econet_station = item->econet_station;
+    aun_station_t *aun_station = entry->aun_station;
+    struct pbuf *p = item->p;
+
+    econet_scout_t scout = {
+        .hdr = {
+            .dst_stn = econet_station->station_id,
+            .dst_net = 0x00,
+            .src_stn = aun_station->station_id,
+            .src_net = aun_station->network_id,
+        },
+        .control = hdr->econet_control | 0x80,
+        .port = 0,
+    };
+
+    uint8_t extra[8];
+    size_t extra_len = econet_imm_scout_extra(scout.control);
+    if (p->tot_len < sizeof(*hdr) + extra_len)
+    {
+        ESP_LOGW(TAG, "Short immediate operation 0x%02x from AUN station %d. Ignored.", scout.control, aun_station->station_id);
+        return;
+    }
+    pbuf_copy_partial(p, extra, extra_len, sizeof(*hdr));
+
+    econet_iovec_t iov[AUN_MAX_IOV];
+    int iov_count = _aun_pbuf_iov(p, sizeof(*hdr) + extra_len, iov, ARRAY_SIZE(iov));
+    if (iov_count < 0)
+    {
+        ESP_LOGE(TAG, "AUN packet too fragmented (%d bytes). Ignored.", p->tot_len);
+        return;
+    }
+
+    size_t reply_len = 0;
+    int64_t start_us = esp_timer_get_time();
+    econet_acktype_t result = econet_sendv_imm(&scout, extra, extra_len, iov, iov_count,
+                                               reply + sizeof(*hdr), AUN_IMM_REPLY_MAX, &reply_len);
+    econet_station->last_out_ms = _aun_now_ms();
+    ESP_LOGI(TAG, "Immediate operation 0x%02x from %d.%d to Econet %d.%d: %d",
+             scout.control, aun_station->network_id, aun_station->station_id,
+             econet_station->network_id, econet_station->station_id, result);
+    if (result != ECONET_ACK)
+    {
+        econet_station->counters.nacks++;
+        return;
+    }
+    econet_station->counters.frames_out++;
+    _aun_count_latency(&econet_station->counters, esp_timer_get_time() - start_us);
+
+    if (scout.control == ECONET_IMM_MACHINETYPE && reply_len >= sizeof(econet_station->machine_type))
+    {
+        memcpy(econet_station->machine_type, reply + sizeof(*hdr), sizeof(econet_station->machine_type));
+        econet_station->has_machine_type = true;
+    }
+
+    memcpy(reply, hdr, sizeof(*hdr));
+    reply[0] = AUN_TYPE_IMM_REPLY;
+    _aun_send_imm_reply(econet_station, aun_station, reply, sizeof(*hdr) + reply_len);
+}
+
+// Put a queued frame on the Econet, answer the sender and let the RX task
+// record the outcome for duplicate suppression. False if it was acked
+// early, refused and should be tried again at entry->retry_at.
+static bool _aun_sched_send(aun_sched_item_t *entry)
+{
+    aun_rx_item_t *item = &entry->item;
+    econet_station_t *econet_station = item->econet_station;
+    aun_station_t *aun_station = entry->aun_station;
+    struct pbuf *p = item->p;
+
+    uint32_t wait_ms = (xTaskGetTickCount() - entry->queued_at) * portTICK_PERIOD_MS;
+    if (entry->attempts == 0)
+    {
+        econet_station->wait_count++;
+        econet_station->wait_total_ms += wait_ms;
+        if (wait_ms > econet_station->wait_max_ms)
+        {
+            econet_station->wait_max_ms = wait_ms;
+        }
+        aunbridge_class_stats_t *class_stats = &aun_sched_class_stats[entry->class_id];
+        class_stats->tx_count++;
+        class_stats->wait_total_ms += wait_ms;
+        if (wait_ms > class_stats->wait_max_ms)
+        {
+            class_stats->wait_max_ms = wait_ms;
+        }
+    }
+
+    aun_hdr_t hdr;
+    pbuf_copy_partial(p, &hdr, sizeof(hdr), 0);
+    uint32_t seq = _aun_get_seq(&hdr);
+
+    if (hdr.transaction_type == AUN_TYPE_IMM)
+    {
+        _aun_sched_send_imm(entry, &hdr);
+        return true;
+    }
+
+    // Econet header comes from the station tables; the payload is gathered
+    // straight out of the pbuf chain by the Econet encoder.
+    econet_scout_t scout = {
+        .hdr = {
+            .dst_stn = econet_station->station_id,
+            .dst_net = 0x00,
+            .src_stn = aun_station->station_id,
+            .src_net = aun_station->network_id,
+        },
+        .control = hdr.econet_control | 0x80,
+        .port = hdr.econet_port,
+    };
+
+    econet_iovec_t iov[AUN_MAX_IOV];
+    int iov_count = _aun_pbuf_iov(p, sizeof(hdr), iov, ARRAY_SIZE(iov));
+    if (iov_count < 0)
+    {
+        ESP_LOGE(TAG, "AUN packet too fragmented (%d bytes). Ignored.", p->tot_len);
+    }
+
+    econet_acktype_t result = ECONET_SEND_ERROR;
+    if (iov_count >= 0)
+    {
+        ESP_LOGI(TAG, "[%05d] Sending %d byte frame from %d.%d (%s) to Econet %d.%d after %lu ms",
+                 seq, p->tot_len,
+                 aun_station->network_id, aun_station->station_id,
+                 ipaddr_ntoa(&item->addr),
+                 econet_station->network_id, econet_station->station_id,
+                 wait_ms);
+
+        int64_t start_us = esp_timer_get_time();
+        result = econet_sendv(&scout, iov, iov_count);
+        if (!item->is_early_ack)
+        {
+            _aun_send_ack(econet_station, aun_station, &hdr, result);
+        }
+        econet_station->last_out_ms = _aun_now_ms();
+
+        if (result == ECONET_ACK)
+        {
+            econet_station->counters.frames_out++;
+            econet_station->counters.bytes_out += p->tot_len - sizeof(hdr);
+            _aun_count_latency(&econet_station->counters, esp_timer_get_time() - start_us);
+            if (bridge_cfg.is_fs_cache && !aun_station->is_trunk)
+            {
+                fs_cache_observe(aun_station->station_id, econet_station->station_id,
+                                 scout.port, scout.control, iov, iov_count);
+            }
+        }
+        else
+        {
+            econet_station->counters.nacks++;
+        }
+    }
+
+    // A frame acked early can't be NACKed now. Give the Beeb the time the
+    // server would have taken to retransmit, while the scheduler gets on
+    // with other stations.
+    if (item->is_early_ack && result != ECONET_ACK && iov_count >= 0 &&
+        ++entry->attempts < AUN_READAHEAD_ATTEMPTS)
+    {
+        uint32_t retry_ms = AUN_RTO_INITIAL_MS << (entry->attempts - 1);
+        entry->retry_at = xTaskGetTickCount() + pdMS_TO_TICKS(retry_ms < AUN_RTO_MAX_MS ? retry_ms : AUN_RTO_MAX_MS);
+        if (entry->attempts == 1)
+        {
+            aun_rx_item_t refused = {
+                .type = 'R',
+                .econet_station = econet_station,
+                .aun_station = aun_station,
+                .seq = seq,
+            };
+            xQueueSend(aun_rx_queue, &refused, 0);
+        }
+        return false;
+    }
+
+    aun_rx_item_t done = {
+        .type = 'C',
+        .econet_station = econet_station,
+        .aun_station = aun_station,
+        .seq = seq,
+        .result = result,
+    };
+    if (xQueueSend(aun_rx_queue, &done, pdMS_TO_TICKS(100)) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "AUN RX queue full. Lost Econet result for [%05d]", seq);
+    }
+    return true;
+}
+
+// Put a broadcast from AUN on the Econet as coming from its AUN station
+static void _aun_sched_broadcast(aun_rx_item_t *item)
+{
+    aun_station_t *aun_station = item->aun_station;
+    struct pbuf *p = item->p;
+
+    aun_hdr_t hdr;
+    pbuf_copy_partial(p, &hdr, sizeof(hdr), 0);
+
+    econet_scout_t scout = {
+        .hdr = {
+            .dst_stn = ECONET_BROADCAST,
+            .dst_net = ECONET_BROADCAST,
+            .src_stn = aun_station->station_id,
+            .src_net = aun_station->network_id,
+        },
+        .control = hdr.econet_control | 0x80,
+        .port = hdr.econet_port,
+    };
+
+    econet_iovec_t iov[AUN_MAX_IOV];
+    int iov_count = _aun_pbuf_iov(p, sizeof(hdr), iov, ARRAY_SIZE(iov));
+    if (iov_count < 0)
+    {
+        ESP_LOGE(TAG, "AUN broadcast too fragmented (%d bytes). Ignored.", p->tot_len);
+        return;
+    }
+
+    ESP_LOGI(TAG, "Broadcast %d bytes from %d.%d (%s) to Econet (ctrl=0x%x, port=0x%x)",
+             p->tot_len - sizeof(hdr), aun_station->network_id, aun_station->station_id,
+             ipaddr_ntoa(&item->addr), scout.control, scout.port);
+    if (econet_broadcast(&scout, iov, iov_count) == ECONET_ACK)
+    {
+        aunbridge_stats.rx_broadcast_count++;
+    }
+}
+
+// Next Econet station with a cached file to feed it, round robin
+static econet_station_t *_aun_sched_playback_next(void)
+{
+    static int cursor;
+    econet_station_t *station = NULL;
+    taskENTER_CRITICAL(&aun_sched_lock);
+    for (int n = 0; n < ARRAY_SIZE(econet_stations) && station == NULL; n++)
+    {
+        cursor = (cursor + 1) % ARRAY_SIZE(econet_stations);
+        if (econet_stations[cursor].playback.entry != NULL)
+        {
+            station = &econet_stations[cursor];
+        }
+    }
+    taskEXIT_CRITICAL(&aun_sched_lock);
+    return station;
+}
+
+// Send the next frame of a cached LOAD, as if from the server. A Beeb
+// that stops taking them is left to time out the LOAD itself.
+static void _aun_sched_playback(econet_station_t *econet_station)
+{
+    fs_cache_playback_t *playback = &econet_station->playback;
+    fs_cache_frame_t frame;
+    if (econet_station->pcb == NULL || !fs_cache_next(playback, &frame))
+    {
+        fs_cache_finish(playback);
+        return;
+    }
+
+    econet_scout_t scout = {
+        .hdr = {
+            .dst_stn = econet_station->station_id,
+            .dst_net = 0x00,
+            .src_stn = econet_station->playback_server_stn,
+            .src_net = econet_station->playback_server_net,
+        },
+        .control = frame.control | 0x80,
+        .port = frame.port,
+    };
+    econet_iovec_t iov = {.data = frame.data, .length = frame.length};
+
+    int64_t start_us = esp_timer_get_time();
+    econet_acktype_t result = econet_sendv(&scout, &iov, 1);
+    econet_station->last_out_ms = _aun_now_ms();
+    if (result == ECONET_ACK)
+    {
+        econet_station->counters.frames_out++;
+        econet_station->counters.bytes_out += frame.length;
+        _aun_count_latency(&econet_station->counters, esp_timer_get_time() - start_us);
+        econet_station->playback_attempts = 0;
+        fs_cache_advance(playback);
+    }
+    else if (++econet_station->playback_attempts >= AUN_PLAYBACK_ATTEMPTS)
+    {
+        ESP_LOGW(TAG, "Econet station %d stopped taking cached file. Abandoned.", econet_station->station_id);
+        econet_station->counters.nacks++;
+        fs_cache_finish(playback);
+    }
+}
+
+// Send the local frame at the front of the queue. A Beeb that won't take it
+// is given up on after a few goes, as with cached LOADs.
+static void _aun_sched_local(void)
+{
+    aun_local_frame_t *frame = &aun_local_pending;
+    econet_scout_t scout = {
+        .hdr = {
+            .dst_stn = frame->dst_stn,
+            .dst_net = 0x00,
+            .src_stn = frame->src_stn,
+            .src_net = 0x00,
+        },
+        .control = frame->control | 0x80,
+        .port = frame->port,
+    };
+    econet_iovec_t iov = {.data = frame->p->payload, .length = frame->p->len};
+
+    econet_acktype_t result = econet_sendv(&scout, &iov, 1);
+    if (result != ECONET_ACK && ++aun_local_attempts < AUN_PLAYBACK_ATTEMPTS)
+    {
+        return;
+    }
+    if (result != ECONET_ACK)
+    {
+        ESP_LOGW(TAG, "Econet station %d not taking frames from %d. Dropped one.", frame->dst_stn, frame->src_stn);
+    }
+    _aun_tx_notify(frame->waiter, result == ECONET_ACK);
+    pbuf_free(frame->p);
+    frame->p = NULL;
+    aun_local_attempts = 0;
+}
+
+static void _aun_sched_reset(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(econet_stations); i++)
+    {
+        econet_station_t *station = &econet_stations[i];
+        for (int c = 0; c < AUN_SCHED_CLASSES; c++)
+        {
+            for (aun_sched_item_t *entry = station->queue_head[c]; entry != NULL; entry = entry->next)
+            {
+                pbuf_free(entry->item.p);
+            }
+            station->queue_head[c] = NULL;
+            station->queue_tail[c] = NULL;
+            station->deficit[c] = 0;
+            station->has_quantum[c] = false;
+        }
+        for (aun_sched_item_t *entry = station->retry_head; entry != NULL; entry = entry->next)
+        {
+            pbuf_free(entry->item.p);
+        }
+        station->retry_head = NULL;
+        station->retry_tail = NULL;
+        station->queue_depth = 0;
+        fs_cache_finish(&station->playback);
+        station->playback_attempts = 0;
+    }
+    memset(aun_sched_class_depth, 0, sizeof(aun_sched_class_depth));
+    memset(aun_sched_class_credit, 0, sizeof(aun_sched_class_credit));
+    memset(aun_sched_cursor, 0, sizeof(aun_sched_cursor));
+    aun_sched_class_cursor = 0;
+
+    aun_rx_item_t bcast;
+    while (xQueueReceive(aun_broadcast_queue, &bcast, 0) == pdTRUE)
+    {
+        pbuf_free(bcast.p);
+    }
+    if (aun_local_pending.p != NULL)
+    {
+        _aun_tx_notify(aun_local_pending.waiter, false);
+        pbuf_free(aun_local_pending.p);
+        aun_local_pending.p = NULL;
+    }
+    while (xQueueReceive(aun_local_queue, &aun_local_pending, 0) == pdTRUE)
+    {
+        _aun_tx_notify(aun_local_pending.waiter, false);
+        pbuf_free(aun_local_pending.p);
+        aun_local_pending.p = NULL;
+    }
+    aun_local_attempts = 0;
+
+    aun_sched_free = NULL;
+    for (int i = 0; i < ARRAY_SIZE(aun_sched_pool); i++)
+    {
+        aun_sched_pool[i].next = aun_sched_free;
+        aun_sched_free = &aun_sched_pool[i];
+    }
+}
+
+static void _aun_sched_task(void *params)
+{
+    for (;;)
+    {
+        // Only block when there's nothing to send. A waiting broadcast goes
+        // out first.
+        aun_rx_item_t bcast;
+        bool has_broadcast = xQueueReceive(aun_broadcast_queue, &bcast, 0) == pdTRUE;
+        if (aun_local_pending.p == NULL)
+        {
+            xQueueReceive(aun_local_queue, &aun_local_pending, 0);
+        }
+        bool has_local = aun_local_pending.p != NULL;
+        aun_sched_item_t *entry = _aun_sched_next();
+        econet_station_t *playback = _aun_sched_playback_next();
+        TickType_t retry_wait;
+        aun_sched_item_t *retry = _aun_sched_retry_next(&retry_wait);
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits,
+                        (entry != NULL || has_broadcast || has_local || playback != NULL) ? 0 : retry_wait);
+
+        if (bits & AUN_SCHED_NOTIFY_SHUTDOWN)
+        {
+            ESP_LOGI(TAG, "AUN: Econet TX shutdown");
+            if (has_broadcast)
+            {
+                pbuf_free(bcast.p);
+            }
+            if (entry != NULL)
+            {
+                pbuf_free(entry->item.p);
+                _aun_sched_release(entry);
+            }
+            // Cleared before the reset so that nothing queued from the
+            // lwIP thread is left behind for the next scheduler
+            vTaskSuspendAll();
+            aun_sched_task_handle = NULL;
+            xTaskResumeAll();
+            _aun_sched_reset();
+            xTaskNotifyGive(shutdown_notify_handle);
+            vTaskDelete(NULL);
+        }
+
+        if (has_broadcast)
+        {
+            _aun_sched_broadcast(&bcast);
+            pbuf_free(bcast.p);
+        }
+        if (has_local)
+        {
+            _aun_sched_local();
+        }
+        if (playback != NULL)
+        {
+            _aun_sched_playback(playback);
+        }
+        if (retry != NULL && _aun_sched_send(retry))
+        {
+            _aun_sched_retry_done(retry->item.econet_station);
+            pbuf_free(retry->item.p);
+            _aun_sched_release(retry);
+        }
+        if (entry != NULL)
+        {
+            if (_aun_sched_send(entry))
+            {
+                pbuf_free(entry->item.p);
+                _aun_sched_release(entry);
+            }
+            else
+            {
+                _aun_sched_defer(entry);
+            }
+        }
+    }
+}
+
+// Hand a data frame to the Econet TX scheduler and note it in the window
+static void _aun_rx_deliver(aun_rx_ctx_t *ctx, aun_rx_item_t *item)
+{
+    aun_hdr_t hdr;
+    pbuf_copy_partial(item->p, &hdr, sizeof(hdr), 0);
+    uint32_t seq = _aun_get_seq(&hdr);
+    uint16_t length = item->p->tot_len - sizeof(hdr);
+
+    // Track runs of in-order frames to one port. A short frame can end a
+    // run but not start one.
+    bool is_in_run = ctx->is_synced && seq == ctx->next_seq && hdr.econet_port == ctx->run_port;
+    if (is_in_run)
+    {
+        if (ctx->run_length < UINT8_MAX)
+        {
+            ctx->run_length++;
+        }
+    }
+    else
+    {
+        ctx->run_port = hdr.econet_port;
+        ctx->run_length = length >= AUN_READAHEAD_MIN_BYTES ? 1 : 0;
+    }
+
+    uint8_t class_id = _aun_sched_classify(hdr.econet_port, hdr.econet_control | 0x80);
+    item->is_early_ack = bridge_cfg.is_readahead &&
+                         !ctx->is_readahead_held &&
+                         ctx->run_length >= AUN_READAHEAD_RUN &&
+                         ctx->readahead_pending < AUN_READAHEAD_WINDOW &&
+                         (int32_t)(xTaskGetTickCount() - ctx->readahead_off_until) >= 0;
+    if (ctx->readahead_pending > 0)
+    {
+        class_id = ctx->readahead_class;
+    }
+
+    if (!_aun_sched_enqueue_class(item, ctx->aun_station, class_id))
+    {
+        return; // Not acknowledged, so the sender will try again
+    }
+    if (item->is_early_ack)
+    {
+        _aun_send_ack(item->econet_station, ctx->aun_station, &hdr, ECONET_ACK);
+        ctx->readahead_pending++;
+        ctx->readahead_class = class_id;
+        aunbridge_stats.rx_readahead_count++;
+    }
+
+    aun_rx_seen_t *seen = _aun_rx_seen_find(ctx, seq);
+    if (seen == NULL)
+    {
+        seen = &ctx->seen[ctx->seen_next];
+        ctx->seen_next = (ctx->seen_next + 1) % AUN_RX_WINDOW;
+    }
+    if (seen->is_valid && seen->is_pending && seen->is_early_ack)
+    {
+        ctx->readahead_pending--; // Its result was lost
+        if (ctx->readahead_pending == 0)
+        {
+            ctx->is_readahead_held = false;
+        }
+    }
+    seen->seq = seq;
+    seen->is_valid = true;
+    seen->is_pending = true;
+    seen->is_early_ack = item->is_early_ack;
+
+    if (!ctx->is_synced || (int32_t)(seq - ctx->next_seq) >= 0)
+    {
+        ctx->next_seq = seq + 4;
+        ctx->is_synced = true;
+    }
+}
+
+// Record how the Econet took a frame so retransmissions of it can be
+// answered from the window
+static void _aun_rx_complete(aun_rx_item_t *item)
+{
+    aun_rx_ctx_t *ctx = _aun_rx_ctx_find(item->econet_station, item->aun_station);
+    if (ctx == NULL)
+    {
+        return;
+    }
+    aun_rx_seen_t *seen = _aun_rx_seen_find(ctx, item->seq);
+    if (seen != NULL && seen->is_pending)
+    {
+        seen->result = item->result;
+        seen->is_pending = false;
+        if (seen->is_early_ack && --ctx->readahead_pending == 0)
+        {
+            ctx->is_readahead_held = false;
+        }
+
+        // The server was told it arrived and the retries ran out, so the
+        // Beeb will have to time out and ask again. Its retry goes through
+        // without read-ahead.
+        if (seen->is_early_ack && item->result != ECONET_ACK)
+        {
+            ESP_LOGW(TAG, "[%05d] Econet station %d wouldn't take a frame acked early. Read-ahead off for a while.",
+                     item->seq, item->econet_station->station_id);
+            aunbridge_stats.rx_readahead_fail_count++;
+            ctx->readahead_off_until = xTaskGetTickCount() + pdMS_TO_TICKS(AUN_READAHEAD_BACKOFF_MS);
+            ctx->run_length = 0;
+        }
+    }
+}
+
+// A frame acked early was refused and the scheduler is retrying it. Stop
+// acking early until the ones already acked have gone.
+static void _aun_rx_refused(aun_rx_item_t *item)
+{
+    aun_rx_ctx_t *ctx = _aun_rx_ctx_find(item->econet_station, item->aun_station);
+    if (ctx == NULL)
+    {
+        return;
+    }
+    ESP_LOGI(TAG, "[%05d] Econet station %d refused a frame acked early. Retrying.",
+             item->seq, item->econet_station->station_id);
+    ctx->is_readahead_held = true;
+    ctx->run_length = 0;
+}
+
+// Deliver anything held that is now next in sequence. With is_forced set
+// the gap is given up on and everything held goes out in sequence order.
+static void _aun_rx_flush(aun_rx_ctx_t *ctx, bool is_forced)
+{
+    while (ctx->held_count > 0)
+    {
+        int best = -1;
+        int32_t best_delta = INT32_MAX;
+        for (int i = 0; i < ARRAY_SIZE(ctx->held); i++)
+        {
+            if (ctx->held[i].item.p == NULL)
+            {
+                continue;
+            }
+            int32_t delta = ctx->held[i].seq - ctx->next_seq;
+            if (delta < best_delta)
+            {
+                best = i;
+                best_delta = delta;
+            }
+        }
+
+        if (best_delta > 0 && !is_forced)
+        {
+            return;
+        }
+
+        aun_rx_item_t item = ctx->held[best].item;
+        ctx->held[best].item.p = NULL;
+        ctx->held_count--;
+        if (best_delta > 0)
+        {
+            aunbridge_stats.rx_reorder_timeout_count++;
+        }
+        _aun_rx_deliver(ctx, &item);
+        if (item.p != NULL)
+        {
+            pbuf_free(item.p);
+        }
+    }
+}
+
+// Takes ownership of item->p by clearing it if the frame is held back
+static void _aun_udp_rx_process(aun_rx_item_t *item)
+{
+    econet_station_t *econet_station = item->econet_station;
+    struct pbuf *p = item->p;
+
+    // Sending AUN station, identified by the receive callback
+    aun_station_t *aun_station = item->aun_station;
+    if (aun_station == NULL)
+    {
+        ESP_LOGW(TAG, "Received AUN packet but can't identify station ID. Ignored.");
+        return;
+    }
+
+    aun_hdr_t hdr;
+    pbuf_copy_partial(p, &hdr, sizeof(hdr), 0);
+    uint32_t seq = _aun_get_seq(&hdr);
+
+    ip_addr_t dest_addr;
+    if (!_aun_remote_addr(aun_station, &dest_addr))
+    {
+        ESP_LOGW(TAG, "AUN station %d address '%s' not resolved yet", aun_station->station_id, aun_station->remote_address);
+        return;
+    }
+
+    if (hdr.transaction_type == AUN_TYPE_IMM)
+    {
+        // MACHINETYPE is how AUN hosts check a station is there, so once
+        // the Beeb has answered it we answer for it. Everything else goes
+        // on the Econet queue. There's no sequence window for these; an
+        // AUN host that gets no reply simply asks again.
+        if ((hdr.econet_control | 0x80) == ECONET_IMM_MACHINETYPE && econet_station->has_machine_type)
+        {
+            uint8_t reply[sizeof(hdr) + sizeof(econet_station->machine_type)];
+            memcpy(reply, &hdr, sizeof(hdr));
+            reply[0] = AUN_TYPE_IMM_REPLY;
+            memcpy(&reply[sizeof(hdr)], econet_station->machine_type, sizeof(econet_station->machine_type));
+            _aun_send_imm_reply(econet_station, aun_station, reply, sizeof(reply));
+            return;
+        }
+        _aun_sched_enqueue(item, aun_station);
+        return;
+    }
+
+    aun_rx_ctx_t *ctx = _aun_rx_ctx_get(econet_station, aun_station);
+    if (ctx == NULL)
+    {
+        ESP_LOGW(TAG, "No free AUN receive context. Packet dropped.");
+        return;
+    }
+    ctx->last_used = xTaskGetTickCount();
+
+    // Anything the Beeb has already taken is re-acknowledged from the
+    // window without going near the bus. A NACK'd frame is tried again.
+    aun_rx_seen_t *seen = _aun_rx_seen_find(ctx, seq);
+    if (seen != NULL && seen->is_pending)
+    {
+        aunbridge_stats.rx_duplicate_count++;
+        if (seen->is_early_ack)
+        {
+            _aun_send_ack(econet_station, aun_station, &hdr, ECONET_ACK);
+        }
+        return; // Still queued; it'll be answered when it goes out
+    }
+    if (seen != NULL && seen->result != ECONET_NACK && seen->result != ECONET_NACK_CORRUPT)
+    {
+        ESP_LOGI(TAG, "[%05d] Re-acknowledging duplicate (Econet ack was %d)", seq, seen->result);
+        aunbridge_stats.rx_duplicate_count++;
+        _aun_send_ack(econet_station, aun_station, &hdr, seen->result);
+        return;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(ctx->held); i++)
+    {
+        if (ctx->held[i].item.p != NULL && ctx->held[i].seq == seq)
+        {
+            aunbridge_stats.rx_duplicate_count++;
+            return; // Already waiting; it'll be answered when it goes out
+        }
+    }
+
+    // A frame a little ahead of the one we expect is held briefly in case
+    // the missing one was overtaken on the air. Anything else, including a
+    // large jump from a restarted sender, goes straight out.
+    int32_t delta = seq - ctx->next_seq;
+    if (ctx->is_synced && delta > 0 && delta <= AUN_RX_REORDER_SLOTS * 4 && ctx->held_count < AUN_RX_REORDER_SLOTS)
+    {
+        for (int i = 0; i < ARRAY_SIZE(ctx->held); i++)
+        {
+            if (ctx->held[i].item.p == NULL)
+            {
+                ctx->held[i].item = *item;
+                ctx->held[i].seq = seq;
+                if (ctx->held_count++ == 0)
+                {
+                    ctx->hold_deadline = xTaskGetTickCount() + pdMS_TO_TICKS(AUN_RX_REORDER_HOLD_MS);
+                }
+                aunbridge_stats.rx_reorder_count++;
+                item->p = NULL;
+                return;
+            }
+        }
+    }
+
+    _aun_rx_deliver(ctx, item);
+    _aun_rx_flush(ctx, false);
+}
+
+// Release held frames whose gap hasn't filled in time. Returns how long
+// until the next hold expires.
+static TickType_t _aun_rx_service_timers(void)
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t wait = portMAX_DELAY;
+
+    for (int i = 0; i < ARRAY_SIZE(aun_rx_ctxs); i++)
+    {
+        aun_rx_ctx_t *ctx = &aun_rx_ctxs[i];
+        if (ctx->held_count == 0)
+        {
+            continue;
+        }
+        if ((int32_t)(ctx->hold_deadline - now) <= 0)
+        {
+            _aun_rx_flush(ctx, true);
+            continue;
+        }
+        TickType_t remaining = ctx->hold_deadline - now;
+        if (remaining < wait)
+        {
+            wait = remaining;
+        }
+    }
+
+    return wait;
+}
+
+static void _aun_rx_release(econet_station_t *econet_station)
+{
+    for (int i = 0; i < ARRAY_SIZE(aun_rx_ctxs); i++)
+    {
+        aun_rx_ctx_t *ctx = &aun_rx_ctxs[i];
+        if (ctx->econet_station != econet_station)
+        {
+            continue;
+        }
+        for (int j = 0; j < ARRAY_SIZE(ctx->held); j++)
+        {
+            if (ctx->held[j].item.p != NULL)
+            {
+                pbuf_free(ctx->held[j].item.p);
+            }
+        }
+        memset(ctx, 0, sizeof(*ctx));
+    }
+    econet_station->is_rx_releasing = false;
+}
+
+static void _aun_rx_reset(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(aun_rx_ctxs); i++)
+    {
+        aun_rx_ctx_t *ctx = &aun_rx_ctxs[i];
+        for (int j = 0; j < ARRAY_SIZE(ctx->held); j++)
+        {
+            if (ctx->held[j].item.p != NULL)
+            {
+                pbuf_free(ctx->held[j].item.p);
+            }
+        }
+    }
+    memset(aun_rx_ctxs, 0, sizeof(aun_rx_ctxs));
+}
+
+// Runs in the lwIP thread. Finds the transaction a (N)ACK answers and
+// wakes the TX task for that context only. On the shared socket the Beeb
+// isn't known so the sequence number alone picks it out.
+static void _aun_match_ack(econet_station_t *econet_station, aun_station_t *aun_station, const aun_hdr_t *hdr)
+{
+    uint32_t seq = _aun_get_seq(hdr);
+
+    int match = -1;
+    taskENTER_CRITICAL(&aun_tx_pending_lock);
+    for (int i = 0; i < ARRAY_SIZE(aun_tx_pending); i++)
+    {
+        aun_tx_pending_t *pending = &aun_tx_pending[i];
+        if (pending->is_armed && pending->seq == seq && pending->aun_station == aun_station &&
+            (econet_station == NULL || pending->econet_station == econet_station))
+        {
+            pending->result = hdr->transaction_type;
+            match = i;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&aun_tx_pending_lock);
+
+    if (match < 0)
+    {
+        ESP_LOGD(TAG, "Ignoring stale ACK (seq=%lu, station=%d)", seq, aun_station ? aun_station->station_id : 0);
+        aunbridge_stats.rx_stale_ack_count++;
+        return;
+    }
+    xTaskNotify(aun_tx_task_handle, 1UL << match, eSetBits);
+}
+
+// Traffic on the shared socket goes to whichever Beeb last sent to that
+// AUN station, or to the first Econet station when none has yet.
+static econet_station_t *_aun_single_port_target(aun_station_t *aun_station)
+{
+    econet_station_t *econet_station = NULL;
+    if (aun_station != NULL && aun_station->last_econet_id != 0)
+    {
+        econet_station = _get_econet_station_by_id(aun_station->last_econet_id);
+    }
+    for (int i = 0; i < ARRAY_SIZE(econet_stations) && econet_station == NULL; i++)
+    {
+        if (econet_stations[i].pcb != NULL)
+        {
+            econet_station = &econet_stations[i];
+        }
+    }
+    return econet_station;
+}
+
+// Runs in the lwIP thread. Queue a broadcast from AUN for the Econet
+// unless it's a repeat or over the rate limit. Takes ownership of p.
+static void _aun_broadcast_in(aun_station_t *aun_station, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    uint32_t now = _aun_now_ms();
+    uint32_t refill = (now - aun_broadcast_refill_ms) / AUN_BROADCAST_REFILL_MS;
+    if (refill > 0)
+    {
+        aun_broadcast_tokens = refill >= AUN_BROADCAST_BURST ? AUN_BROADCAST_BURST : aun_broadcast_tokens + refill;
+        if (aun_broadcast_tokens > AUN_BROADCAST_BURST)
+        {
+            aun_broadcast_tokens = AUN_BROADCAST_BURST;
+        }
+        aun_broadcast_refill_ms = now;
+    }
+
+    if (aun_station == NULL || _aun_broadcast_seen(_aun_broadcast_hash(p)) || aun_broadcast_tokens == 0)
+    {
+        aunbridge_stats.rx_broadcast_drop_count++;
+        pbuf_free(p);
+        return;
+    }
+    aun_broadcast_tokens--;
+
+    aun_rx_item_t item = {
+        .type = 'B',
+        .p = p,
+        .aun_station = aun_station,
+        .addr = *addr,
+        .port = port,
+    };
+
+    // The PCBs outlive the scheduler during a reconfigure. A broadcast that
+    // arrives then is dropped, as the station it names may not survive.
+    vTaskSuspendAll();
+    bool is_queued = aun_sched_task_handle != NULL && xQueueSend(aun_broadcast_queue, &item, 0) == pdTRUE;
+    if (is_queued)
+    {
+        xTaskNotify(aun_sched_task_handle, AUN_SCHED_NOTIFY_WORK, eSetBits);
+    }
+    xTaskResumeAll();
+
+    if (!is_queued)
+    {
+        aunbridge_stats.rx_broadcast_drop_count++;
+        pbuf_free(p);
+    }
+}
+
+// Runs in the lwIP thread and takes ownership of p, an AUN frame. ACKs are
+// consumed here; anything that has to go onto the Econet is handed over to
+// the AUN RX task by reference. With no Econet station the frame came in on
+// the shared socket in single port mode.
+static void _aun_rx_dispatch(econet_station_t *econet_station, aun_station_t *aun_station,
+                             struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    aun_hdr_t hdr_buf;
+    const aun_hdr_t *hdr = pbuf_get_contiguous(p, &hdr_buf, sizeof(hdr_buf), sizeof(hdr_buf), 0);
+
+    if (aun_station != NULL)
+    {
+        aun_station->counters.last_seen_ms = _aun_now_ms();
+    }
+
+    switch (hdr->transaction_type)
+    {
+    case AUN_TYPE_IMM:
+        aunbridge_stats.rx_imm_count++;
+        break;
+    case AUN_TYPE_DATA:
+        aunbridge_stats.rx_data_count++;
+        if (aun_station != NULL)
+        {
+            aun_station->counters.frames_in++;
+            aun_station->counters.bytes_in += p->tot_len - sizeof(aun_hdr_t);
+        }
+        break;
+    case AUN_TYPE_ACK:
+        aunbridge_stats.rx_ack_count++;
+        _aun_match_ack(econet_station, aun_station, hdr);
+        pbuf_free(p);
+        return;
+    case AUN_TYPE_BROADCAST:
+        _aun_broadcast_in(aun_station, p, addr, port);
+        return;
+    case AUN_TYPE_IMM_REPLY:
+        // MACHINETYPE answers, probes included, fill the cache the Econet
+        // receiver uses to answer for AUN stations itself
+        if (aun_station != NULL && !aun_station->is_trunk &&
+            (hdr->econet_control | 0x80) == ECONET_IMM_MACHINETYPE && p->tot_len >= sizeof(*hdr) + 4)
+        {
+            uint8_t machine_type[4];
+            pbuf_copy_partial(p, machine_type, sizeof(machine_type), sizeof(*hdr));
+            econet_rx_set_machine_type(aun_station->station_id, machine_type);
+        }
+        _aun_probe_reply(aun_station, addr, port, hdr);
+        pbuf_free(p);
+        return;
+    case AUN_TYPE_NACK:
+        aunbridge_stats.rx_nack_count++;
+        if (aun_station != NULL)
+        {
+            aun_station->counters.nacks++;
+        }
+        _aun_match_ack(econet_station, aun_station, hdr);
+        pbuf_free(p);
+        return;
+    default:
+        ESP_LOGW(TAG, "Received AUN packet of unknown type 0x%02x. Ignored.", hdr->transaction_type);
+        aunbridge_stats.rx_unknown_count++;
+        pbuf_free(p);
+        return;
+    }
+
+    if (econet_station == NULL)
+    {
+        econet_station = _aun_single_port_target(aun_station);
+        if (econet_station == NULL)
+        {
+            ESP_LOGW(TAG, "No Econet station to deliver AUN packet to. Ignored.");
+            pbuf_free(p);
+            return;
+        }
+    }
+
+    aun_rx_item_t item = {
+        .type = 'D',
+        .p = p,
+        .econet_station = econet_station,
+        .aun_station = aun_station,
+        .addr = *addr,
+        .port = port,
+    };
+    if (xQueueSend(aun_rx_queue, &item, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "AUN RX queue full. Packet dropped.");
+        pbuf_free(p);
+    }
+}
+
+static void _aun_udp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    if (p->tot_len < sizeof(aun_hdr_t))
+    {
+        aunbridge_stats.rx_unknown_count++;
+        pbuf_free(p);
+        return;
+    }
+
+    _aun_rx_dispatch(arg, _aun_station_from_addr(addr, port), p, addr, port);
+}
+
+// Runs in the lwIP thread. Each record on the trunk is split out into an
+// AUN frame of its own and treated as if it had arrived from the station
+// it names. Broadcasts have no station of ours to go to, as on the UDP
+// path.
+static void _aun_trunk_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    if (!IP_IS_V4(addr) || !ip4_addr_cmp(ip_2_ip4(addr), &aun_trunk_addr))
+    {
+        aunbridge_stats.rx_unknown_count++;
+        pbuf_free(p);
+        return;
+    }
+
+    uint16_t offset = 0;
+    while (offset + 2 <= p->tot_len)
+    {
+        uint8_t prefix[2];
+        pbuf_copy_partial(p, prefix, sizeof(prefix), offset);
+        uint16_t length = prefix[0] | (prefix[1] << 8);
+        if (length < sizeof(econet_hdr_t) + sizeof(aun_hdr_t) || offset + 2 + length > p->tot_len)
+        {
+            ESP_LOGW(TAG, "Malformed trunk record (len=%d). Rest of datagram ignored.", length);
+            aunbridge_stats.rx_unknown_count++;
+            break;
+        }
+        offset += 2;
+
+        econet_hdr_t hdr;
+        pbuf_copy_partial(p, &hdr, sizeof(hdr), offset);
+        econet_station_t *econet_station = NULL;
+        if (hdr.dst_net == 0 || hdr.dst_net == bridge_cfg.trunk_local_net)
+        {
+            econet_station = _get_econet_station_by_id(hdr.dst_stn);
+        }
+        aun_station_t *aun_station = _aun_trunk_station(hdr.src_net, hdr.src_stn);
+        bool is_broadcast = hdr.dst_stn == ECONET_BROADCAST;
+
+        struct pbuf *q = NULL;
+        if ((econet_station != NULL || is_broadcast) && aun_station != NULL)
+        {
+            q = pbuf_alloc(PBUF_RAW, length - sizeof(hdr), PBUF_RAM);
+        }
+        if (q != NULL)
+        {
+            pbuf_copy_partial(p, q->payload, q->len, offset + sizeof(hdr));
+            _aun_rx_dispatch(econet_station, aun_station, q, addr, port);
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Trunk frame from %d.%d to %d.%d dropped",
+                     hdr.src_net, hdr.src_stn, hdr.dst_net, hdr.dst_stn);
+        }
+        offset += length;
+    }
+    pbuf_free(p);
+}
+
+static void _aun_udp_rx_task(void *params)
+{
+
+    ESP_LOGI(TAG, "Waiting for AUN packets...");
+
+    TickType_t wait = portMAX_DELAY;
+
+    for (;;)
+    {
+        aun_rx_item_t item;
+        if (xQueueReceive(aun_rx_queue, &item, wait) == pdTRUE)
+        {
+            switch (item.type)
+            {
+            case 'D':
+                _aun_udp_rx_process(&item);
+                if (item.p != NULL)
+                {
+                    pbuf_free(item.p);
+                }
+                break;
+            case 'C':
+                _aun_rx_complete(&item);
+                break;
+            case 'R':
+                _aun_rx_refused(&item);
+                break;
+            case 'X':
+                _aun_rx_release(item.econet_station);
+                break;
+            case 'S':
+                ESP_LOGI(TAG, "AUN: RX shutdown");
+                _aun_rx_reset();
+                xTaskNotifyGive(shutdown_notify_handle);
+                vTaskDelete(NULL);
+                break;
+            }
+        }
+
+        wait = _aun_rx_service_timers();
+    }
+}
+
+// The remote address is a list of servers, separated by commas or spaces,
+// each optionally with its own ":port". Traffic goes to the first until
+// the probes find a better one.
+static esp_err_t _alloc_aun_station(config_aun_station_t *cfg)
+{
+    int slot = -1;
+    for (int i = 0; i < ARRAY_SIZE(aun_stations); i++)
+    {
+        if (aun_stations[i].station_id == 0)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0)
+    {
+        ESP_LOGE(TAG, "No free AUN station slots.");
+        return ESP_FAIL;
+    }
+    aun_station_t *station = &aun_stations[slot];
+
+    LOCK_TCPIP_CORE();
+    station->network_id = cfg->network_id;
+    station->is_derived = false;
+    station->last_econet_id = 0;
+    memset(&station->counters, 0, sizeof(station->counters));
+
+    // Parse numeric addresses once here. Anything else is a hostname which
+    // resolves in the background and is refreshed by dns_refresh_timer.
+    station->endpoints = aun_endpoints[slot];
+    station->endpoint_count = 0;
+    char *save;
+    for (char *host = strtok_r(cfg->remote_address, ", ", &save);
+         host != NULL && station->endpoint_count < AUN_MAX_ENDPOINTS;
+         host = strtok_r(NULL, ", ", &save))
+    {
+        aun_endpoint_t *endpoint = &station->endpoints[station->endpoint_count++];
+        memset(endpoint, 0, sizeof(*endpoint));
+        endpoint->udp_port = cfg->udp_port;
+        char *colon = strchr(host, ':');
+        if (colon != NULL)
+        {
+            *colon = '\0';
+            int port = atoi(colon + 1);
+            if (port > 0 && port <= 65535)
+            {
+                endpoint->udp_port = port;
+            }
+        }
+        snprintf(endpoint->host, sizeof(endpoint->host), "%s", host);
+        endpoint->is_hostname = !ip4addr_aton(endpoint->host, &endpoint->addr);
+        if (endpoint->is_hostname)
+        {
+            ip4_addr_set_u32(&endpoint->addr, IPADDR_ANY);
+        }
+        endpoint->is_up = true;
+    }
+    if (station->endpoint_count == 0)
+    {
+        UNLOCK_TCPIP_CORE();
+        ESP_LOGE(TAG, "AUN station %d has no address", cfg->station_id);
+        return ESP_FAIL;
+    }
+
+    _aun_endpoint_use(station, 0);
+    station->station_id = cfg->station_id;
+    for (int i = 0; i < station->endpoint_count; i++)
+    {
+        if (station->endpoints[i].is_hostname)
+        {
+            _aun_resolve(station, station->endpoints[i].host);
+        }
+    }
+    if (station->network_id == 0)
+    {
+        aun_station_map[station->station_id] = station;
+    }
+    else
+    {
+        aun_route_t *route = _aun_route_add(station->network_id);
+        if (route != NULL)
+        {
+            route->stations[station->station_id] = station;
+        }
+    }
+    UNLOCK_TCPIP_CORE();
+    return ESP_OK;
+}
+
+int aunbridge_get_peer_stats(aunbridge_peer_stats_t *peers, int max_peers)
+{
+    int count = 0;
+    for (int i = 0; i < ARRAY_SIZE(aun_station_map) && count < max_peers; i++)
+    {
+        aun_station_t *station = aun_station_map[i];
+        if (station == NULL)
+        {
+            continue;
+        }
+        peers[count].station_id = station->station_id;
+        peers[count].srtt_us = station->srtt_us;
+        peers[count].rttvar_us = station->rttvar_us;
+        peers[count].rto_ms = station->rto_ms;
+        count++;
+    }
+    return count;
+}
+
+int aunbridge_get_econet_station_stats(aunbridge_station_stats_t *stations, int max_stations)
+{
+    int count = 0;
+    for (int i = 0; i < ARRAY_SIZE(econet_stations) && count < max_stations; i++)
+    {
+        if (econet_stations[i].station_id == 0)
+        {
+            continue;
+        }
+        stations[count].station_id = econet_stations[i].station_id;
+        stations[count].counters = econet_stations[i].counters;
+        count++;
+    }
+    return count;
+}
+
+int aunbridge_get_aun_station_stats(aunbridge_station_stats_t *stations, int max_stations)
+{
+    int count = 0;
+    for (int i = 0; i < ARRAY_SIZE(aun_station_map) && count < max_stations; i++)
+    {
+        aun_station_t *station = aun_station_map[i];
+        if (station == NULL)
+        {
+            continue;
+        }
+        stations[count].station_id = station->station_id;
+        stations[count].counters = station->counters;
+        count++;
+    }
+    return count;
+}
+
+int aunbridge_get_class_stats(aunbridge_class_stats_t *classes, int max_classes)
+{
+    int count = max_classes < AUN_SCHED_CLASSES ? max_classes : AUN_SCHED_CLASSES;
+    memcpy(classes, aun_sched_class_stats, count * sizeof(*classes));
+    return count;
+}
+
+int aunbridge_get_queue_stats(aunbridge_queue_stats_t *queues, int max_queues)
+{
+    int count = 0;
+    for (int i = 0; i < ARRAY_SIZE(econet_stations) && count < max_queues; i++)
+    {
+        econet_station_t *station = &econet_stations[i];
+        if (station->station_id == 0)
+        {
+            continue;
+        }
+        queues[count].station_id = station->station_id;
+        queues[count].depth = station->queue_depth;
+        queues[count].depth_max = station->queue_depth_max;
+        queues[count].wait_avg_ms = station->wait_count ? station->wait_total_ms / station->wait_count : 0;
+        queues[count].wait_max_ms = station->wait_max_ms;
+        count++;
+    }
+    return count;
+}
+
+// Interactive fileserver traffic goes ahead of everything else and bulk
+// printer data goes last unless the config says otherwise
+static void _default_priority_classes(void)
+{
+    static const config_priority_t defaults = {
+        .is_weighted = false,
+        .weights = {8, 4, 2, 1},
+        .rule_count = 3,
+        .rules = {
+            {.port = 0x99, .control = 0, .class_id = 0}, // FS command
+            {.port = 0x90, .control = 0, .class_id = 0}, // FS reply
+            {.port = 0xD1, .control = 0, .class_id = 3}, // Printer data
+        },
+    };
+    aun_priority = defaults;
+}
+
+// Must hold the lwIP core lock
+static struct udp_pcb *_aun_pcb_open(uint16_t local_udp_port, udp_recv_fn recv, void *arg)
+{
+    struct udp_pcb *pcb = udp_new();
+    if (pcb == NULL)
+    {
+        ESP_LOGE(TAG, "Unable to create PCB for port %d", local_udp_port);
+        return NULL;
+    }
+
+    err_t err = udp_bind(pcb, IP_ADDR_ANY, local_udp_port);
+    if (err != ERR_OK)
+    {
+        udp_remove(pcb);
+        ESP_LOGE(TAG, "Unable to bind port %d: err %d", local_udp_port, err);
+        return NULL;
+    }
+    ip_set_option(pcb, SOF_BROADCAST);
+    udp_recv(pcb, recv, arg);
+    return pcb;
+}
+
+// In single port mode the station shares aun_shared_pcb rather than
+// getting a socket of its own
+static esp_err_t _econet_station_open(econet_station_t *station, uint8_t station_id, uint16_t local_udp_port)
+{
+    LOCK_TCPIP_CORE();
+    struct udp_pcb *pcb = aun_shared_pcb;
+    if (pcb != NULL)
+    {
+        local_udp_port = AUN_STANDARD_PORT;
+    }
+    else if ((pcb = _aun_pcb_open(local_udp_port, _aun_udp_recv, station)) == NULL)
+    {
+        UNLOCK_TCPIP_CORE();
+        ESP_LOGE(TAG, "Failed to add station %d", station_id);
+        return ESP_FAIL;
+    }
+
+    station->station_id = station_id;
+    station->network_id = 0;
+    station->local_udp_port = local_udp_port;
+    station->is_dynamic = false;
+    station->is_rx_releasing = false;
+    station->is_tx_releasing = false;
+    station->last_out_ms = 0;
+    station->has_machine_type = false;
+    station->queue_depth_max = 0;
+    station->wait_count = 0;
+    station->wait_total_ms = 0;
+    station->wait_max_ms = 0;
+    memset(&station->counters, 0, sizeof(station->counters));
+    station->pcb = pcb;
+    UNLOCK_TCPIP_CORE();
+
+    ESP_LOGI(TAG, "Added Econet station %d on port %d", station_id, local_udp_port);
+    return ESP_OK;
+}
+
+static econet_station_t *_econet_station_free_slot(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(econet_stations); i++)
+    {
+        econet_station_t *station = &econet_stations[i];
+        if (station->pcb == NULL && !station->is_rx_releasing && !station->is_tx_releasing &&
+            station->queue_depth == 0)
+        {
+            return station;
+        }
+    }
+    return NULL;
+}
+
+static esp_err_t _open_econet_station(config_econet_station_t *cfg)
+{
+    econet_station_t *station = _econet_station_free_slot();
+    if (station == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to add station %d. No free slots.", cfg->station_id);
+        return ESP_FAIL;
+    }
+
+    return _econet_station_open(station, cfg->station_id, cfg->local_udp_port);
+}
+
+static uint32_t _econet_station_idle_ms(econet_station_t *station, uint32_t now)
+{
+    uint32_t last = station->counters.last_seen_ms;
+    if ((int32_t)(station->last_out_ms - last) > 0)
+    {
+        last = station->last_out_ms;
+    }
+    return now - last;
+}
+
+// Close a dynamic endpoint. The RX and TX tasks are told to drop their
+// state for it and the slot becomes free once they have.
+static void _econet_station_close(econet_station_t *station)
+{
+    ESP_LOGI(TAG, "Closing idle dynamic endpoint for Econet station %d on port %d",
+             station->station_id, station->local_udp_port);
+
+    station->is_rx_releasing = true;
+    station->is_tx_releasing = true;
+    LOCK_TCPIP_CORE();
+    if (station->pcb != aun_shared_pcb)
+    {
+        udp_remove(station->pcb);
+    }
+    station->pcb = NULL;
+    UNLOCK_TCPIP_CORE();
+
+    aun_rx_item_t rx_cmd = {.type = 'X', .econet_station = station};
+    xQueueSend(aun_rx_queue, &rx_cmd, portMAX_DELAY);
+
+    aun_tx_event_t tx_cmd = {.type = 'X', .econet_station = station};
+    xQueueSend(aun_tx_queue, &tx_cmd, portMAX_DELAY);
+    xTaskNotify(aun_tx_task_handle, AUN_TX_NOTIFY_QUEUE, eSetBits);
+}
+
+// The least recently used dynamic endpoint that has been quiet long enough
+// to give up its slot to another Beeb
+static econet_station_t *_aun_dynamic_victim(void)
+{
+    uint32_t now = _aun_now_ms();
+    econet_station_t *lru = NULL;
+    for (int i = 0; i < ARRAY_SIZE(econet_stations); i++)
+    {
+        econet_station_t *s = &econet_stations[i];
+        if (s->is_dynamic && s->pcb != NULL && s->queue_depth == 0 &&
+            _econet_station_idle_ms(s, now) >= AUN_DYNAMIC_EVICT_IDLE_MS &&
+            (lru == NULL || _econet_station_idle_ms(s, now) > _econet_station_idle_ms(lru, now)))
+        {
+            lru = s;
+        }
+    }
+    return lru;
+}
+
+// Give an unconfigured Beeb an AUN endpoint at dynamic_port_base plus its
+// station number. When the table is full the least recently used dynamic
+// endpoint that has been quiet for a while is closed, and the slot is taken
+// by the first Beeb to need one after the RX and TX tasks have let go of
+// it. This frame is dropped meanwhile, as waiting here would let the
+// Econet RX queue fill with frames that have already been ACKed.
+// Runs in the Econet RX task only.
+static econet_station_t *_aun_dynamic_open(uint8_t station_id)
+{
+    if (bridge_cfg.dynamic_port_base == 0 && aun_shared_pcb == NULL)
+    {
+        return NULL;
+    }
+
+    econet_station_t *station = _econet_station_free_slot();
+    if (station == NULL)
+    {
+        econet_station_t *victim = _aun_dynamic_victim();
+        if (victim != NULL)
+        {
+            _econet_station_close(victim);
+        }
+        ESP_LOGW(TAG, "No free endpoint for Econet station %d", station_id);
+        return NULL;
+    }
+
+    if (_econet_station_open(station, station_id, bridge_cfg.dynamic_port_base + station_id) != ESP_OK)
+    {
+        return NULL;
+    }
+    station->is_dynamic = true;
+    return station;
+}
+
+// Close dynamic endpoints that have been idle for a long time. With the
+// table full, one that has been quiet for a while is closed too, so that a
+// slot is ready for the next unconfigured Beeb before it sends anything.
+static void _aun_dynamic_expire(void)
+{
+    if (bridge_cfg.dynamic_port_base == 0 && aun_shared_pcb == NULL)
+    {
+        return;
+    }
+
+    uint32_t now = _aun_now_ms();
+    bool is_full = true;
+    for (int i = 0; i < ARRAY_SIZE(econet_stations); i++)
+    {
+        econet_station_t *station = &econet_stations[i];
+        if (station->is_dynamic && station->pcb != NULL && station->queue_depth == 0 &&
+            _econet_station_idle_ms(station, now) >= AUN_DYNAMIC_IDLE_MS)
+        {
+            _econet_station_close(station);
+        }
+        if (station->pcb == NULL)
+        {
+            is_full = false;
+        }
+    }
+
+    econet_station_t *victim = is_full ? _aun_dynamic_victim() : NULL;
+    if (victim != NULL)
+    {
+        _econet_station_close(victim);
+    }
+}
+
+// Get the data frame that follows a scout
+static bool _econet_rx_data(const econet_scout_t *scout, econet_rx_packet_t *pkt)
+{
+    if (!_econet_rx(pkt, 10000))
+    {
+        ESP_LOGW(ECONETTAG, "Timeout waiting for data packet from %d.%d to %d.%d (ctrl=0x%x, port=0x%x). No clock?",
+                 scout->hdr.src_net, scout->hdr.src_stn, scout->hdr.dst_net, scout->hdr.dst_stn, scout->control, scout->port);
+        return false;
+    }
+    else if (pkt->type == 'I')
+    {
+        ESP_LOGW(ECONETTAG, "Idle whilst getting data packet from %d.%d to %d.%d (ctrl=0x%x, port=0x%x)",
+                 scout->hdr.src_net, scout->hdr.src_stn, scout->hdr.dst_net, scout->hdr.dst_stn, scout->control, scout->port);
+        return false;
+    }
+    else if (pkt->length < 6)
+    {
+        ESP_LOGW(ECONETTAG, "Unexpected short frame discarded");
+        return false;
+    }
+    return true;
+}
+
+// Pass an immediate operation from a Beeb to its AUN host. These go once,
+// straight from here; the Beeb has had its ACK already and AUN doesn't
+// acknowledge them. Operations that want a frame back can't be answered
+// inside the Econet's reply time, apart from MACHINETYPE whose answer is
+// remembered for next time.
+static void _aun_forward_imm(econet_station_t *econet_station, aun_station_t *aun_station,
+                             const econet_scout_t *scout, const uint8_t *extra, size_t extra_len,
+                             const uint8_t *data, size_t data_len)
+{
+    static uint32_t imm_seq;
+
+    if (aun_station->is_trunk)
+    {
+        ESP_LOGW(TAG, "Immediate operations can't cross the trunk. Dropped 0x%02x for %d.%d.",
+                 scout->control, aun_station->network_id, aun_station->station_id);
+        return;
+    }
+    if (econet_imm_handshake(scout->control) == ECONET_HANDSHAKE_REPLY && scout->control != ECONET_IMM_MACHINETYPE)
+    {
+        ESP_LOGW(TAG, "Immediate operation 0x%02x to AUN station %d can't be answered in time. Dropped.",
+                 scout->control, aun_station->station_id);
+        return;
+    }
+    ip_addr_t dest_addr;
+    if (!_aun_remote_addr(aun_station, &dest_addr))
+    {
+        return;
+    }
+
+    imm_seq += 4;
+    aun_hdr_t hdr = {
+        .transaction_type = AUN_TYPE_IMM,
+        .econet_port = 0,
+        .econet_control = scout->control & 0x7F,
+        .sequence = {imm_seq, imm_seq >> 8, imm_seq >> 16, imm_seq >> 24},
+    };
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, sizeof(hdr) + extra_len + data_len, PBUF_RAM);
+    if (p == NULL)
+    {
+        aunbridge_stats.tx_error_count++;
+        return;
+    }
+    pbuf_take(p, &hdr, sizeof(hdr));
+    if (extra_len > 0)
+    {
+        pbuf_take_at(p, extra, extra_len, sizeof(hdr));
+    }
+    if (data_len > 0)
+    {
+        pbuf_take_at(p, data, data_len, sizeof(hdr) + extra_len);
+    }
+    _aun_sendto(econet_station, p, &dest_addr, aun_station->udp_port);
+    pbuf_free(p);
+}
+
+// Send a broadcast heard on the Econet to every AUN host we know of: each
+// configured station, the whole subnet in single port mode and the trunk.
+// The frame is encoded once; it has no room for headers in front so lwIP
+// puts them in a pbuf of their own for each send and leaves it untouched.
+static void _aun_econet_broadcast(const econet_rx_packet_t *pkt)
+{
+    static uint32_t broadcast_seq;
+
+    econet_scout_t scout;
+    memcpy(&scout, pkt->data + 4, sizeof(scout));
+
+    econet_station_t *econet_station = _get_econet_station_by_id(scout.hdr.src_stn);
+    if (econet_station == NULL)
+    {
+        econet_station = _aun_dynamic_open(scout.hdr.src_stn);
+    }
+    if (econet_station == NULL)
+    {
+        ESP_LOGW(TAG, "Econet station %d is not configured. Not forwarding broadcast", scout.hdr.src_stn);
+        return;
+    }
+
+    uint16_t data_len = pkt->length - sizeof(scout);
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, sizeof(aun_hdr_t) + data_len, PBUF_RAM);
+    if (p == NULL)
+    {
+        aunbridge_stats.tx_error_count++;
+        return;
+    }
+    broadcast_seq += 4;
+    aun_hdr_t hdr = {
+        .transaction_type = AUN_TYPE_BROADCAST,
+        .econet_port = scout.port,
+        .econet_control = scout.control & 0x7F,
+        .sequence = {broadcast_seq, broadcast_seq >> 8, broadcast_seq >> 16, broadcast_seq >> 24},
+    };
+    pbuf_take(p, &hdr, sizeof(hdr));
+    if (data_len > 0)
+    {
+        pbuf_take_at(p, pkt->data + 4 + sizeof(scout), data_len, sizeof(hdr));
+    }
+    ESP_LOGI(ECONETTAG, "Broadcast %d bytes from %d.%d (ctrl=0x%x, port=0x%x)",
+             data_len, scout.hdr.src_net, scout.hdr.src_stn, scout.control, scout.port);
+
+    LOCK_TCPIP_CORE();
+    _aun_broadcast_seen(_aun_broadcast_hash(p));
+    for (int i = 0; i < ARRAY_SIZE(aun_stations); i++)
+    {
+        aun_station_t *aun_station = &aun_stations[i];
+        ip_addr_t dest_addr;
+        if (aun_station->station_id != 0 && _aun_remote_addr(aun_station, &dest_addr))
+        {
+            udp_sendto(econet_station->pcb, p, &dest_addr, aun_station->udp_port);
+        }
+    }
+    if (aun_shared_pcb != NULL)
+    {
+        ip_addr_t dest_addr;
+        ip_addr_set_ip4_u32(&dest_addr, ip4_addr_get_u32(&aun_subnet) | PP_HTONL(0xFF));
+        udp_sendto(aun_shared_pcb, p, &dest_addr, AUN_STANDARD_PORT);
+    }
+    bool has_trunk = aun_trunk_pcb != NULL;
+    UNLOCK_TCPIP_CORE();
+
+    if (has_trunk)
+    {
+        _aun_trunk_append(econet_station, &aun_trunk_broadcast, p);
+        _aun_trunk_flush();
+    }
+    aunbridge_stats.tx_broadcast_count++;
+    pbuf_free(p);
+}
+
+// Queue a frame from one of our own stations, waiting up to queue_wait_ms
+// for room. With is_wait, returns once the Beeb has taken it or it has been
+// given up on.
+static bool _aun_local_tx(uint8_t src_stn, uint8_t client_id, uint8_t port, uint8_t control,
+                          const uint8_t *data, size_t length, bool is_wait, uint32_t queue_wait_ms)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, length, PBUF_RAM);
+    if (p == NULL)
+    {
+        return false;
+    }
+    pbuf_take(p, data, length);
+
+    if (is_wait)
+    {
+        // Anything left over from a wait that timed out would be taken for
+        // this frame's answer
+        xTaskNotifyStateClear(NULL);
+        ulTaskNotifyValueClear(NULL, UINT32_MAX);
+    }
+
+    aun_local_frame_t frame = {
+        .p = p,
+        .src_stn = src_stn,
+        .dst_stn = client_id,
+        .port = port,
+        .control = control,
+        .waiter = is_wait ? xTaskGetCurrentTaskHandle() : NULL,
+    };
+    if (xQueueSend(aun_local_queue, &frame, pdMS_TO_TICKS(queue_wait_ms)) != pdTRUE)
+    {
+        pbuf_free(p);
+        return false;
+    }
+
+    // The scheduler comes and goes with reconfiguration. One that starts
+    // later finds the frame anyway.
+    vTaskSuspendAll();
+    if (aun_sched_task_handle != NULL)
+    {
+        xTaskNotify(aun_sched_task_handle, AUN_SCHED_NOTIFY_WORK, eSetBits);
+    }
+    xTaskResumeAll();
+
+    if (!is_wait)
+    {
+        return true;
+    }
+    uint32_t result = 0;
+    xTaskNotifyWait(0, UINT32_MAX, &result, pdMS_TO_TICKS(AUN_LOCAL_DONE_WAIT_MS));
+    return result == AUN_WAITER_ACKED;
+}
+
+static bool _aun_fileserver_tx(uint8_t client_id, uint8_t port, uint8_t control,
+                               const uint8_t *data, size_t length, bool is_wait)
+{
+    return _aun_local_tx(bridge_cfg.fs_station_id, client_id, port, control, data, length, is_wait,
+                         AUN_LOCAL_QUEUE_WAIT_MS);
+}
+
+static bool _aun_print_reply(uint8_t client_id, uint8_t port, uint8_t control, const uint8_t *data, size_t length)
+{
+    return _aun_local_tx(bridge_cfg.print_station_id, client_id, port, control, data, length, false,
+                         AUN_LOCAL_QUEUE_WAIT_MS);
+}
+
+// Hand a block of a print job to the TX task and wait to hear whether the
+// print server took it. Called from the spooler's own task.
+static bool _aun_print_forward(uint8_t control, const uint8_t *data, size_t length)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, sizeof(aun_hdr_t) + length, PBUF_RAM);
+    if (p == NULL)
+    {
+        return false;
+    }
+    aun_hdr_t hdr = {
+        .transaction_type = AUN_TYPE_DATA,
+        .econet_port = PRINT_PORT_DATA,
+        .econet_control = control & 0x7F,
+    };
+    pbuf_take(p, &hdr, sizeof(hdr));
+    pbuf_take_at(p, data, length, sizeof(hdr));
+
+    // Anything left over from a wait that timed out would be taken for
+    // this block's answer
+    xTaskNotifyStateClear(NULL);
+    ulTaskNotifyValueClear(NULL, UINT32_MAX);
+
+    aun_tx_event_t evt = {
+        .type = 'P',
+        .p = p,
+        .waiter = xTaskGetCurrentTaskHandle(),
+    };
+    if (xQueueSend(aun_tx_queue, &evt, pdMS_TO_TICKS(AUN_LOCAL_QUEUE_WAIT_MS)) != pdTRUE)
+    {
+        pbuf_free(p);
+        return false;
+    }
+    vTaskSuspendAll();
+    if (aun_tx_task_handle != NULL)
+    {
+        xTaskNotify(aun_tx_task_handle, AUN_TX_NOTIFY_QUEUE, eSetBits);
     }
-    return NULL;
+    xTaskResumeAll();
+
+    uint32_t result = 0;
+    xTaskNotifyWait(0, UINT32_MAX, &result, pdMS_TO_TICKS(AUN_PRINT_WAIT_MS));
+    return result == AUN_WAITER_ACKED;
 }
 
-static bool _econet_rx(econet_rx_packet_t *pkt, uint32_t timeout)
+// Offer a fileserver request to the LOAD cache. True if the cache is
+// answering it and it mustn't be forwarded.
+static bool _aun_fs_cache_request(econet_station_t *econet_station, aun_station_t *aun_station,
+                                  const uint8_t *data, size_t length)
 {
-    if (xQueueReceive(econet_rx_packet_queue, pkt, timeout) == pdFALSE)
+    taskENTER_CRITICAL(&aun_sched_lock);
+    bool is_idle = econet_station->playback.entry == NULL;
+    taskEXIT_CRITICAL(&aun_sched_lock);
+
+    fs_cache_playback_t playback;
+    fs_cache_result_t result = fs_cache_request(aun_station->station_id, econet_station->station_id,
+                                                data, length, is_idle ? &playback : NULL);
+    if (result == FS_CACHE_MISS)
     {
-        return false;
+        aunbridge_stats.fs_cache_miss_count++;
     }
-
-    if (pkt->type == 'S')
+    if (result != FS_CACHE_HIT)
     {
-        econet_rx_clear_bitmaps();
-        ESP_LOGI(TAG, "Econet RX shutdown");
-        xTaskNotifyGive(shutdown_notify_handle);
-        vTaskDelete(NULL);
+        return false;
     }
 
+    aunbridge_stats.fs_cache_hit_count++;
+    taskENTER_CRITICAL(&aun_sched_lock);
+    econet_station->playback = playback;
+    econet_station->playback_server_stn = aun_station->station_id;
+    econet_station->playback_server_net = aun_station->network_id;
+    econet_station->playback_attempts = 0;
+    taskEXIT_CRITICAL(&aun_sched_lock);
+    xTaskNotify(aun_sched_task_handle, AUN_SCHED_NOTIFY_WORK, eSetBits);
     return true;
 }
 
-static bool _aun_wait_ack(uint32_t seq)
+// Answer the bridge protocol queries Beebs broadcast to learn their own
+// network number and whether another network can be reached. A query is
+// "BRIDGE", the port to reply to and, for IS_NET, the network asked about.
+// The reply is our network number and the one asked about. Networks we
+// can't reach aren't answered. True if the broadcast was a query.
+static bool _aun_bridge_query(const econet_rx_packet_t *pkt)
 {
-    aun_hdr_t ack;
-    for (int i = 0; i < 5; i++)
+    econet_scout_t scout;
+    memcpy(&scout, pkt->data + 4, sizeof(scout));
+    if (scout.port != AUN_BRIDGE_PORT || bridge_cfg.bridge_station_id == 0)
     {
-        if (xQueueReceive(ack_queue, &ack, 200) == pdPASS)
-        {
-            uint32_t ack_seq =
-                ack.sequence[0] |
-                (ack.sequence[1] << 8) |
-                (ack.sequence[2] << 16) |
-                (ack.sequence[3] << 24);
+        return false;
+    }
 
-            if (ack_seq == seq)
-            {
-                return true;
-            }
-            else
-            {
-                ESP_LOGW(TAG, "Ignoring out-of-sequence ACK");
-            }
-        }
-        else
-        {
-            return false;
-        }
+    const uint8_t *data = pkt->data + 4 + sizeof(scout);
+    size_t length = pkt->length - sizeof(scout);
+    if (length < 7 || memcmp(data, "BRIDGE", 6) != 0)
+    {
+        return true;
     }
-    ESP_LOGW(TAG, "Too many out-of-sequence ACK!");
-    return false;
+
+    uint8_t control = scout.control | 0x80;
+    uint8_t reply[2] = {bridge_cfg.trunk_local_net, bridge_cfg.trunk_local_net};
+    if (control == AUN_BRIDGE_IS_NET && length >= 8 && _aun_route_reaches(data[7]))
+    {
+        reply[1] = data[7];
+    }
+    else if (control != AUN_BRIDGE_WHAT_NET || bridge_cfg.trunk_local_net == 0)
+    {
+        return true;
+    }
+
+    // Runs in Econet RX, which mustn't wait. The Beeb asks again if the
+    // answer is lost to a full queue.
+    ESP_LOGI(TAG, "Answering bridge query 0x%02x from station %d", control, scout.hdr.src_stn);
+    aunbridge_stats.bridge_query_count++;
+    _aun_local_tx(bridge_cfg.bridge_station_id, scout.hdr.src_stn, data[6], 0x80, reply, sizeof(reply), false, 0);
+    return true;
 }
 
 static void _aun_econet_rx_task(void *params)
 {
-    static uint32_t rx_seq;
     econet_rx_packet_t econet_pkt;
 
     econet_scout_t scout;
@@ -147,8 +3816,12 @@ static void _aun_econet_rx_task(void *params)
 
     for (;;)
     {
-        // Get scout
-        _econet_rx(&econet_pkt, portMAX_DELAY);
+        // Get scout. Wake now and then to close idle dynamic endpoints.
+        _aun_dynamic_expire();
+        if (!_econet_rx(&econet_pkt, pdMS_TO_TICKS(AUN_DYNAMIC_SCAN_MS)))
+        {
+            continue;
+        }
         if (econet_pkt.type == 'I')
         {
             continue; // Idle notification
@@ -158,415 +3831,415 @@ static void _aun_econet_rx_task(void *params)
             ESP_LOGW(ECONETTAG, "Unexpected short scout frame (len=%d) discarded", econet_pkt.length);
             continue;
         }
+        if (econet_pkt.type == 'B')
+        {
+            if (!_aun_bridge_query(&econet_pkt))
+            {
+                _aun_econet_broadcast(&econet_pkt);
+            }
+            continue;
+        }
         memcpy(&scout, econet_pkt.data + 4, sizeof(scout));
-        if (econet_pkt.length != 6)
+
+        // Immediate operations carry their arguments in the scout
+        uint8_t imm_extra[8];
+        size_t imm_extra_len = scout.port == 0 ? econet_imm_scout_extra(scout.control) : 0;
+        if (econet_pkt.length != 6 + imm_extra_len)
         {
             ESP_LOGW(ECONETTAG, "Expected scout but got a %d byte frame from %d.%d to %d.%d. Discarding",
                      econet_pkt.length, scout.hdr.src_net, scout.hdr.src_stn, scout.hdr.dst_net, scout.hdr.dst_stn);
             continue;
         }
+        memcpy(imm_extra, econet_pkt.data + 4 + 6, imm_extra_len);
 
-        // Get data packet
-        if (!_econet_rx(&econet_pkt, 10000))
+        // Get data packet, unless this is an immediate operation that ends
+        // with the scout
+        const uint8_t *imm_data = NULL;
+        size_t imm_data_len = 0;
+        if (scout.port == 0 && econet_imm_handshake(scout.control) != ECONET_HANDSHAKE_4WAY)
         {
-            ESP_LOGW(ECONETTAG, "Timeout waiting for data packet from %d.%d to %d.%d (ctrl=0x%x, port=0x%x). No clock?",
-                     scout.hdr.src_net, scout.hdr.src_stn, scout.hdr.dst_net, scout.hdr.dst_stn, scout.control, scout.port);
-            continue;
+            memcpy(&econet_hdr, &scout.hdr, sizeof(econet_hdr));
+        }
+        else
+        {
+            if (!_econet_rx_data(&scout, &econet_pkt))
+            {
+                continue;
+            }
+            memcpy(&econet_hdr, econet_pkt.data + 4, sizeof(econet_hdr));
+            ESP_LOGI(ECONETTAG, "Data packet %d bytes from %d.%d to %d.%d (ctrl=0x%x, port=0x%x)",
+                     econet_pkt.length - 4,
+                     econet_hdr.src_net, econet_hdr.src_stn,
+                     econet_hdr.dst_net, econet_hdr.dst_stn,
+                     scout.control, scout.port);
+
+            if (memcmp(&econet_hdr, &scout, sizeof(econet_hdr)) != 0)
+            {
+                ESP_LOGW(ECONETTAG, "Address mismatch on scout/data packet");
+            }
+            imm_data = econet_pkt.data + 4 + sizeof(econet_hdr);
+            imm_data_len = econet_pkt.length - sizeof(econet_hdr);
         }
-        else if (econet_pkt.type == 'I')
+
+        // The built-in fileserver is answered without going near AUN
+        if (bridge_cfg.fs_station_id != 0 && econet_hdr.dst_stn == bridge_cfg.fs_station_id &&
+            econet_hdr.dst_net == 0)
         {
-            ESP_LOGW(ECONETTAG, "Idle whilst getting data packet from %d.%d to %d.%d (ctrl=0x%x, port=0x%x)",
-                     scout.hdr.src_net, scout.hdr.src_stn, scout.hdr.dst_net, scout.hdr.dst_stn, scout.control, scout.port);
+            if (scout.port != 0)
+            {
+                fileserver_rx(econet_hdr.src_stn, scout.port, scout.control, imm_data, imm_data_len);
+            }
             continue;
         }
-        else if (econet_pkt.length < 6)
+
+        // So is the print spooler
+        if (bridge_cfg.print_station_id != 0 && econet_hdr.dst_stn == bridge_cfg.print_station_id &&
+            econet_hdr.dst_net == 0)
         {
-            ESP_LOGW(ECONETTAG, "Unexpected short frame discarded");
+            print_spool_rx(econet_hdr.src_stn, scout.port, scout.control, imm_data, imm_data_len);
             continue;
         }
-        memcpy(&econet_hdr, econet_pkt.data + 4, sizeof(econet_hdr));
-        ESP_LOGI(ECONETTAG, "Data packet %d bytes from %d.%d to %d.%d (ctrl=0x%x, port=0x%x)",
-                 econet_pkt.length - 4,
-                 econet_hdr.src_net, econet_hdr.src_stn,
-                 econet_hdr.dst_net, econet_hdr.dst_stn,
-                 scout.control, scout.port);
 
-        if (memcmp(&econet_hdr, &scout, sizeof(econet_hdr)) != 0)
+        // A Beeb inside the single port range can't be an AUN host as well
+        if (_aun_single_port_covers(econet_hdr.src_stn) && _get_aun_station_by_id(econet_hdr.src_stn) == NULL)
         {
-            ESP_LOGW(ECONETTAG, "Address mismatch on scout/data packet");
+            exonet_rx_disable_station(econet_hdr.src_stn);
         }
 
         econet_station_t *econet_station = _get_econet_station_by_id(econet_hdr.src_stn);
         if (econet_station == NULL)
         {
-            // FUTURE: Dynamically make a socket for it...
+            econet_station = _aun_dynamic_open(econet_hdr.src_stn);
+        }
+        if (econet_station == NULL)
+        {
             ESP_LOGW(TAG, "Econet station %d is not configured. Not forwarding packet", econet_hdr.src_stn);
             continue;
         }
 
-        aun_station_t *aun_station = _get_aun_station_by_id(econet_hdr.dst_stn);
+        aun_station_t *aun_station = NULL;
+        if (econet_hdr.dst_net != 0)
+        {
+            LOCK_TCPIP_CORE();
+            aun_station = _aun_route_station(econet_hdr.dst_net, econet_hdr.dst_stn);
+            UNLOCK_TCPIP_CORE();
+        }
+        else
+        {
+            aun_station = _get_aun_station_by_id(econet_hdr.dst_stn);
+        }
+        if (aun_station == NULL && econet_hdr.dst_net == 0 && _aun_single_port_covers(econet_hdr.dst_stn))
+        {
+            LOCK_TCPIP_CORE();
+            aun_station = _aun_station_derive(econet_hdr.dst_stn);
+            UNLOCK_TCPIP_CORE();
+        }
         if (aun_station == NULL)
         {
-            ESP_LOGE(TAG, "AUN station %d is not configured but we accepted a packet for it!", econet_hdr.dst_stn);
+            ESP_LOGE(TAG, "AUN station %d.%d is not configured but we accepted a packet for it!",
+                     econet_hdr.dst_net, econet_hdr.dst_stn);
             continue;
         }
 
-        struct sockaddr_in dest_addr;
-        dest_addr.sin_addr.s_addr = inet_addr(aun_station->remote_address);
-        dest_addr.sin_family = AF_INET;
-        dest_addr.sin_port = htons(aun_station->udp_port);
+        econet_station->counters.frames_in++;
+        econet_station->counters.bytes_in += econet_pkt.length - sizeof(econet_hdr);
+        econet_station->counters.last_seen_ms = _aun_now_ms();
+        aun_station->last_econet_id = econet_station->station_id;
 
-        aunbridge_stats.tx_count++;
+        if (scout.port == 0)
+        {
+            _aun_forward_imm(econet_station, aun_station, &scout, imm_extra, imm_extra_len, imm_data, imm_data_len);
+            continue;
+        }
 
-        rx_seq += 4;
+        if (scout.port == NETFS_PORT && bridge_cfg.is_fs_cache && !aun_station->is_trunk &&
+            _aun_fs_cache_request(econet_station, aun_station, econet_pkt.data + 4 + sizeof(econet_hdr),
+                                  econet_pkt.length - sizeof(econet_hdr)))
+        {
+            continue;
+        }
 
+        // The AUN header overwrites the workspace and Econet address bytes in
+        // front of the payload. The sequence number is filled in when the
+        // frame reaches the front of its context's backlog. The frame has to
+        // be copied out here because the Econet RX buffers are recycled.
         uint8_t *aun_packet = econet_pkt.data;
-        int retries = 5;
-        while (--retries > 0)
-        {
-            aun_packet[0] = AUN_TYPE_DATA;
-            aun_packet[1] = scout.port;
-            aun_packet[2] = scout.control & 0x7F;
-            aun_packet[3] = 0x00;
-            aun_packet[4] = (rx_seq >> 0) & 0xFF;
-            aun_packet[5] = (rx_seq >> 8) & 0xFF;
-            aun_packet[6] = (rx_seq >> 16) & 0xFF;
-            aun_packet[7] = (rx_seq >> 24) & 0xFF;
-
-            int err = sendto(econet_station->socket, aun_packet, econet_pkt.length - sizeof(econet_hdr) + 8, 0,
-                             (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-            if (err < 0)
-            {
-                ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-                aunbridge_stats.tx_error_count++;
-            }
-
-            if (_aun_wait_ack(rx_seq))
-            {
-                break;
-            }
+        aun_packet[0] = AUN_TYPE_DATA;
+        aun_packet[1] = scout.port;
+        aun_packet[2] = scout.control & 0x7F;
+        aun_packet[3] = 0x00;
 
-            aunbridge_stats.tx_retry_count++;
-            ESP_LOGI(TAG, "Retry! %d remain", retries - 1);
+        uint16_t aun_len = econet_pkt.length - sizeof(econet_hdr) + sizeof(aun_hdr_t);
+        struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, aun_len, PBUF_RAM);
+        if (p == NULL)
+        {
+            ESP_LOGE(TAG, "Out of memory. Packet dropped.");
+            aunbridge_stats.tx_error_count++;
+            continue;
         }
+        pbuf_take(p, aun_packet, aun_len);
 
-        if (retries == 0)
+        aun_tx_event_t evt = {
+            .type = 'F',
+            .econet_station = econet_station,
+            .aun_station = aun_station,
+            .p = p,
+        };
+        if (xQueueSend(aun_tx_queue, &evt, 0) != pdTRUE)
         {
-            ESP_LOGW(TAG, "Retries exhausted, no response from server %s:%d", inet_ntoa(dest_addr.sin_addr), ntohs(dest_addr.sin_port));
-            aunbridge_stats.tx_abort_count++;
+            ESP_LOGW(TAG, "AUN TX queue full. Packet dropped.");
+            aunbridge_stats.tx_error_count++;
+            pbuf_free(p);
+            continue;
         }
+        xTaskNotify(aun_tx_task_handle, AUN_TX_NOTIFY_QUEUE, eSetBits);
     }
 }
 
-static void _aun_udp_rx_process(econet_station_t *econet_station)
+void aunbridge_shutdown(void)
 {
-    static uint8_t aun_rx_buffer[ECONET_MTU];
-    struct sockaddr_in source_addr;
-    socklen_t socklen = sizeof(source_addr);
-    int len = recvfrom(econet_station->socket, aun_rx_buffer, sizeof(aun_rx_buffer), 0,
-                       (struct sockaddr *)&source_addr, &socklen);
-    if (len < 0)
+    if (is_running)
     {
-        ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
-        return;
-    }
+        shutdown_notify_handle = xTaskGetCurrentTaskHandle();
 
-    switch (aun_rx_buffer[0])
-    {
-    case AUN_TYPE_IMM:
-        aunbridge_stats.rx_imm_count++;
-        break;
-    case AUN_TYPE_DATA:
-        aunbridge_stats.rx_data_count++;
-        break;
-    case AUN_TYPE_ACK:
-        aunbridge_stats.rx_ack_count++;
-        xQueueSend(ack_queue, aun_rx_buffer, 0);
-        return;
-    case AUN_TYPE_NACK:
-        aunbridge_stats.rx_nack_count++;
-        xQueueSend(ack_queue, aun_rx_buffer, 0);
-        return;
-    default:
-        ESP_LOGW(TAG, "Received AUN packet of unknown type 0x%02x. Ignored.", aun_rx_buffer[0]);
-        aunbridge_stats.rx_unknown_count++;
-        return;
-    }
+        // Shutdown Econet RX
+        econet_rx_shutdown();
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-    // Look up sending AUN station
-    aun_station_t *aun_station = _get_aun_station_by_port(ntohs(source_addr.sin_port));
-    if (aun_station == NULL)
-    {
-        ESP_LOGW(TAG, "Received AUN packet but can't identify station ID. Ignored.");
-        return;
-    }
+        // Shut down AUN RX
+        aun_rx_item_t shutdown_cmd = {.type = 'S'};
+        xQueueSend(aun_rx_queue, &shutdown_cmd, portMAX_DELAY);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-    aun_hdr_t hdr;
-    memcpy(&hdr, aun_rx_buffer, sizeof(hdr));
-    uint32_t ack_seq =
-        hdr.sequence[0] |
-        (hdr.sequence[1] << 8) |
-        (hdr.sequence[2] << 16) |
-        (hdr.sequence[3] << 24);
-
-    if (aun_rx_buffer[0] == AUN_TYPE_IMM)
-    {
-        // MACHINETYPE - TODO: We should forward this but need some other
-        //  stuff first because IMM is handled differently. This is to
-        //  satify AUN stations that use this as a reachability test
-        if (hdr.econet_port == 0 && hdr.econet_control == 0x8)
-        {
-            struct sockaddr_in dest_addr;
-            dest_addr.sin_addr.s_addr = inet_addr(aun_station->remote_address);
-            dest_addr.sin_family = AF_INET;
-            dest_addr.sin_port = htons(aun_station->udp_port);
-            memcpy(aun_rx_buffer, &hdr, sizeof(hdr));
-            aun_rx_buffer[0] = AUN_TYPE_IMM_REPLY;
-            sendto(econet_station->socket, aun_rx_buffer, 12, 0,
-                   (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-            ESP_LOGI(TAG, "Responded to MACHINETYPE request without forwarding.");
-        }
-        else
-        {
-            ESP_LOGW(TAG, "Ignored IMM packet with ");
-        }
+        // Shut down Econet TX scheduler. This waits for any handshake that
+        // is in progress.
+        xTaskNotify(aun_sched_task_handle, AUN_SCHED_NOTIFY_SHUTDOWN, eSetBits);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
-        return;
+        // Shut down AUN TX
+        aun_tx_event_t tx_shutdown_cmd = {.type = 'S'};
+        xQueueSend(aun_tx_queue, &tx_shutdown_cmd, portMAX_DELAY);
+        xTaskNotify(aun_tx_task_handle, AUN_TX_NOTIFY_QUEUE, eSetBits);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        is_running = false;
     }
+}
 
-    // Change AUN header to Econet style
-    aun_rx_buffer[2] = econet_station->station_id;
-    aun_rx_buffer[3] = 0x00;
-    aun_rx_buffer[4] = aun_station->station_id;
-    aun_rx_buffer[5] = 0x00;
-    aun_rx_buffer[6] = hdr.econet_control | 0x80;
-    aun_rx_buffer[7] = hdr.econet_port;
+void aunbridge_reconfigure(void)
+{
+    // Shut down receivers so we can safely modify state
+    aunbridge_shutdown();
 
-    // Send to Beeb (but only if we didn't get acknowledgement before for this packet.)
-    // NOTE: We're not encountering out of order but if we do then we'll need a different strategy to reorder them.
-    if (ack_seq != aun_station->last_acked_seq || aun_station->last_tx_result == ECONET_NACK || aun_station->last_tx_result == ECONET_NACK_CORRUPT)
+    // Clear down stations
+    LOCK_TCPIP_CORE();
+    for (int i = 0; i < ARRAY_SIZE(econet_stations); i++)
     {
-        ESP_LOGI(TAG, "[%05d] Sending %d byte frame from %d.%d (%s) to Econet %d.%d",
-                 ack_seq, len,
-                 aun_station->network_id, aun_station->station_id,
-                 inet_ntoa(source_addr.sin_addr),
-                 econet_station->network_id, econet_station->station_id);
-
-        aun_station->last_tx_result = econet_send(&aun_rx_buffer[2], len - 2);
-        aun_station->last_acked_seq = ack_seq;
+        if (econet_stations[i].pcb != NULL && econet_stations[i].pcb != aun_shared_pcb)
+        {
+            udp_remove(econet_stations[i].pcb);
+        }
+        econet_stations[i].pcb = NULL;
+        econet_stations[i].station_id = 0;
+        econet_stations[i].is_dynamic = false;
+        econet_stations[i].is_rx_releasing = false;
+        econet_stations[i].is_tx_releasing = false;
     }
-    else
+    for (int i = 0; i < ARRAY_SIZE(aun_stations); i++)
     {
-        ESP_LOGI(TAG, "[%05d] Re-acknowledging duplicate (Econet ack was %d)", ack_seq, aun_station->last_tx_result);
+        aun_stations[i].station_id = 0;
     }
-
-    // Send AUN ack/nack
-    if (aun_station->last_tx_result==ECONET_ACK)
+    memset(aun_station_map, 0, sizeof(aun_station_map));
+    _aun_route_clear();
+    if (aun_shared_pcb != NULL)
     {
-        hdr.transaction_type = AUN_TYPE_ACK;
-        aunbridge_stats.tx_ack_count++;
+        udp_remove(aun_shared_pcb);
+        aun_shared_pcb = NULL;
     }
-    else
+    if (aun_trunk_pcb != NULL)
     {
-        hdr.transaction_type = AUN_TYPE_NACK;
-        aunbridge_stats.tx_nack_count++;
+        udp_remove(aun_trunk_pcb);
+        aun_trunk_pcb = NULL;
     }
+    memset(aun_trunk_stations, 0, sizeof(aun_trunk_stations));
+    aun_trunk_batch_len = 0;
+    aun_trunk_batch_frames = 0;
+    UNLOCK_TCPIP_CORE();
 
-    // Send (N)ACK to calling station at port we have on file
-    struct sockaddr_in dest_addr;
-    dest_addr.sin_addr.s_addr = inet_addr(aun_station->remote_address);
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(aun_station->udp_port);
-    memcpy(aun_rx_buffer, &hdr, sizeof(hdr));
-    sendto(econet_station->socket, aun_rx_buffer, 8, 0,
-           (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-}
-
-static void _aun_udp_rx_task(void *params)
-{
-
-    ESP_LOGI(TAG, "Waiting for AUN packets...");
-
-    for (;;)
+    // Release anything that arrived after the tasks stopped
+    aun_rx_item_t item;
+    while (xQueueReceive(aun_rx_queue, &item, 0) == pdTRUE)
     {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(rx_udp_ctl_pipe[0], &rfds);
-        int max_fd = rx_udp_ctl_pipe[0];
-        for (int i = 0; i < ARRAY_SIZE(econet_stations); i++)
+        if (item.p != NULL)
         {
-            if (econet_stations[i].is_open)
-            {
-                FD_SET(econet_stations[i].socket, &rfds);
-                if (econet_stations[i].socket > max_fd)
-                {
-                    max_fd = econet_stations[i].socket;
-                }
-            }
+            pbuf_free(item.p);
         }
-
-        int err = select(max_fd + 1, &rfds, NULL, NULL, NULL);
-        if (err < 0)
+    }
+    aun_tx_event_t evt;
+    while (xQueueReceive(aun_tx_queue, &evt, 0) == pdTRUE)
+    {
+        if (evt.p != NULL)
         {
-            ESP_LOGE(TAG, "select error: errno %d", errno);
-            continue;
+            pbuf_free(evt.p);
         }
+    }
 
-        if (FD_ISSET(rx_udp_ctl_pipe[0], &rfds))
+    // Load configuration from config file. Anything cached may be stale
+    // against a different set of servers.
+    config_load_bridge(&bridge_cfg);
+    fs_cache_clear();
+    if (bridge_cfg.is_single_port)
+    {
+        if (!ip4addr_aton(bridge_cfg.aun_subnet, &aun_subnet))
         {
-            ESP_LOGI(TAG, "AUN: RX shutdown");
-            char tmp[1];
-            read(rx_udp_ctl_pipe[0], &tmp, sizeof(tmp));
-            xTaskNotifyGive(shutdown_notify_handle);
-            vTaskDelete(NULL);
-            continue;
+            ESP_LOGE(TAG, "Invalid AUN subnet '%s'", bridge_cfg.aun_subnet);
+            ip4_addr_set_u32(&aun_subnet, IPADDR_ANY);
         }
+        ip4_addr_set_u32(&aun_subnet, ip4_addr_get_u32(&aun_subnet) & PP_HTONL(0xFFFFFF00UL));
 
-        for (int i = 0; i < ARRAY_SIZE(econet_stations); i++)
+        LOCK_TCPIP_CORE();
+        aun_shared_pcb = _aun_pcb_open(AUN_STANDARD_PORT, _aun_udp_recv, NULL);
+        UNLOCK_TCPIP_CORE();
+        if (aun_shared_pcb == NULL)
         {
-            if (FD_ISSET(econet_stations[i].socket, &rfds))
-            {
-                _aun_udp_rx_process(&econet_stations[i]);
-            }
+            ESP_LOGE(TAG, "Unable to open AUN port. Using a port per station.");
         }
     }
-}
-
-static esp_err_t _alloc_aun_station(config_aun_station_t *cfg)
-{
-    aun_station_t *station = NULL;
-    for (int i = 0; i < ARRAY_SIZE(aun_stations); i++)
+    if (bridge_cfg.trunk_host[0] != '\0')
     {
-        if (aun_stations[i].station_id == 0)
+        if (!ip4addr_aton(bridge_cfg.trunk_host, &aun_trunk_addr))
         {
-            station = &aun_stations[i];
-            break;
+            ESP_LOGE(TAG, "Trunk host must be an IP address, not '%s'", bridge_cfg.trunk_host);
+        }
+        else
+        {
+            LOCK_TCPIP_CORE();
+            aun_trunk_pcb = _aun_pcb_open(bridge_cfg.trunk_local_port, _aun_trunk_recv, NULL);
+            UNLOCK_TCPIP_CORE();
         }
     }
-    if (station == NULL)
-    {
-        ESP_LOGE(TAG, "No free AUN station slots.");
-        return ESP_FAIL;
-    }
-
-    snprintf(station->remote_address, sizeof(station->remote_address), "%s", cfg->remote_address);
-    station->station_id = cfg->station_id;
-    station->network_id = cfg->network_id;
-    station->udp_port = cfg->udp_port;
-    station->last_acked_seq = UINT32_MAX;
-    station->last_tx_result = ECONET_NACK;
-    return ESP_OK;
-}
 
-static esp_err_t _open_econet_station(config_econet_station_t *cfg)
-{
-    econet_station_t *station = NULL;
-    for (int i = 0; i < ARRAY_SIZE(econet_stations); i++)
+    // Routing table. Trunk networks go in first so a subnet can't take
+    // one over; AUN stations listed with a network number are added as
+    // they're loaded.
+    LOCK_TCPIP_CORE();
+    for (int i = 0; i < bridge_cfg.trunk_net_count && aun_trunk_pcb != NULL; i++)
     {
-        if (!econet_stations[i].is_open)
+        aun_route_t *route = _aun_route_add(bridge_cfg.trunk_nets[i]);
+        if (route != NULL)
         {
-            station = &econet_stations[i];
-            break;
+            route->is_trunk = true;
         }
     }
-    if (station == NULL)
+    for (int i = 0; i < bridge_cfg.route_count; i++)
     {
-        ESP_LOGE(TAG, "Failed to add station %d. No free slots.", cfg->station_id);
-        return ESP_FAIL;
+        config_route_t *route_cfg = &bridge_cfg.routes[i];
+        aun_route_t *route = _aun_route_add(route_cfg->network_id);
+        if (route == NULL || route->is_trunk)
+        {
+            continue;
+        }
+        if (!ip4addr_aton(route_cfg->subnet, &route->subnet))
+        {
+            ESP_LOGE(TAG, "Invalid subnet '%s' for network %d", route_cfg->subnet, route_cfg->network_id);
+            ip4_addr_set_u32(&route->subnet, IPADDR_ANY);
+        }
+        ip4_addr_set_u32(&route->subnet, ip4_addr_get_u32(&route->subnet) & PP_HTONL(0xFFFFFF00UL));
     }
+    UNLOCK_TCPIP_CORE();
 
-    struct sockaddr_in listen_addr = {
-        .sin_addr.s_addr = htonl(INADDR_ANY),
-        .sin_family = AF_INET,
-        .sin_port = htons(cfg->local_udp_port),
-    };
-
-    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-    if (sock < 0)
-    {
-        ESP_LOGE(TAG, "Failed to add station %d. Unable to create socket: errno %d", cfg->station_id, errno);
-        return ESP_FAIL;
-    }
+    _default_priority_classes();
+    config_load_econet(_open_econet_station, _alloc_aun_station, &aun_priority);
 
-    int err = bind(sock, (struct sockaddr *)&listen_addr, sizeof(listen_addr));
-    if (err < 0)
+    // The print spooler talks to its server from its own endpoint, as if it
+    // were another Beeb
+    if (bridge_cfg.print_station_id != 0 && _get_econet_station_by_id(bridge_cfg.print_station_id) == NULL)
     {
-        ESP_LOGE(TAG, "Failed to add station %d. Socket unable to bind: errno %d", cfg->station_id, errno);
-        close(sock);
-        return ESP_FAIL;
+        config_econet_station_t print_cfg = {
+            .station_id = bridge_cfg.print_station_id,
+            .local_udp_port = bridge_cfg.print_local_port,
+        };
+        if (print_cfg.local_udp_port == 0 && bridge_cfg.dynamic_port_base != 0)
+        {
+            print_cfg.local_udp_port = bridge_cfg.dynamic_port_base + print_cfg.station_id;
+        }
+        if (print_cfg.local_udp_port == 0 && aun_shared_pcb == NULL)
+        {
+            ESP_LOGE(TAG, "Print station needs a local UDP port. Jobs will be kept until it has one.");
+        }
+        else
+        {
+            _open_econet_station(&print_cfg);
+        }
     }
 
-    ESP_LOGI(TAG, "Added Econet station %d on port %d", cfg->station_id, cfg->local_udp_port);
-
-    station->station_id = cfg->station_id;
-    station->network_id = 0;
-    station->local_udp_port = cfg->local_udp_port;
-    station->socket = sock;
-    station->is_open = true;
-    return ESP_OK;
-}
-
-void aunbridge_shutdown(void)
-{
-    if (is_running)
+    // Enable Econet RX for the AUN stations. In single port mode that's
+    // the whole range apart from the Beebs we know about.
+    econet_rx_clear_bitmaps();
+    for (int i = 0; i < ARRAY_SIZE(aun_station_map); i++)
     {
-        shutdown_notify_handle = xTaskGetCurrentTaskHandle();
-
-        // Shutdown Econet RX
-        econet_rx_shutdown();
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-
-        // Shut down AUN RX
-        char tmp = 0;
-        write(rx_udp_ctl_pipe[1], &tmp, sizeof(tmp));
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-        is_running = false;
+        if (aun_station_map[i] != NULL ||
+            (_aun_single_port_covers(i) && _get_econet_station_by_id(i) == NULL))
+        {
+            exonet_rx_enable_station(i);
+        }
+        if (_aun_route_reaches(i))
+        {
+            exonet_rx_enable_network(i);
+        }
     }
-}
-
-void aunbridge_reconfigure(void)
-{
-    // Shut down receivers so we can safely modify state
-    aunbridge_shutdown();
-
-    // Clear down stations
-    for (int i = 0; i < ARRAY_SIZE(econet_stations); i++)
+    fileserver_reset();
+    if (bridge_cfg.fs_station_id != 0)
     {
-        if (econet_stations[i].is_open)
+        if (aun_station_map[bridge_cfg.fs_station_id] != NULL)
         {
-            closesocket(econet_stations[i].socket);
-            econet_stations[i].is_open = false;
+            ESP_LOGW(TAG, "Built-in fileserver hides AUN station %d", bridge_cfg.fs_station_id);
         }
-        econet_stations[i].station_id = 0;
+        exonet_rx_enable_station(bridge_cfg.fs_station_id);
     }
-    for (int i = 0; i < ARRAY_SIZE(aun_stations); i++)
+    print_spool_reset();
+    if (bridge_cfg.print_station_id != 0)
     {
-        aun_stations[i].station_id = 0;
+        if (aun_station_map[bridge_cfg.print_station_id] != NULL)
+        {
+            ESP_LOGW(TAG, "Print spooler hides AUN station %d", bridge_cfg.print_station_id);
+        }
+        exonet_rx_enable_station(bridge_cfg.print_station_id);
     }
 
-    // Load configuration from config file
-    config_load_econet(_open_econet_station, _alloc_aun_station);
-
-    // Enable Econet RX for the AUN stations
-    econet_rx_clear_bitmaps();
-    for (int i = 0; i < ARRAY_SIZE(aun_stations); i++)
+    // Beebs send bridge queries as broadcasts, but the reply's scout is
+    // ACKed to the bridge station. The bitmaps were cleared above, so a
+    // station that is no longer configured stops answering.
+    if (bridge_cfg.bridge_station_id != 0)
     {
-        if (aun_stations[i].station_id != 0)
+        if (aun_station_map[bridge_cfg.bridge_station_id] != NULL)
         {
-            exonet_rx_enable_station(aun_stations[i].station_id);
+            ESP_LOGW(TAG, "Bridge station hides AUN station %d", bridge_cfg.bridge_station_id);
         }
+        exonet_rx_enable_station(bridge_cfg.bridge_station_id);
     }
 
     // Start receivers
+    xTaskCreate(_aun_sched_task, "aun_sched", 4096, NULL, 1, &aun_sched_task_handle);
     xTaskCreate(_aun_udp_rx_task, "aun_udp_rx", 4096, NULL, 1, NULL);
+    xTaskCreate(_aun_tx_task, "aun_tx", 4096, NULL, 1, &aun_tx_task_handle);
     xTaskCreate(_aun_econet_rx_task, "aun_econet_rx", 4096, NULL, 1, NULL);
     is_running = true;
 }
 
 void aunbrige_start(void)
 {
-    ack_queue = xQueueCreate(10, sizeof(aun_hdr_t));
-    pipe(rx_udp_ctl_pipe); // Ugh. I feel dirty using sockets on embedded!
+    aun_tx_queue = xQueueCreate(AUN_TX_QUEUE_DEPTH, sizeof(aun_tx_event_t));
+    aun_rx_queue = xQueueCreate(AUN_RX_QUEUE_DEPTH, sizeof(aun_rx_item_t));
+    aun_broadcast_queue = xQueueCreate(AUN_BROADCAST_QUEUE_DEPTH, sizeof(aun_rx_item_t));
+    aun_local_queue = xQueueCreate(AUN_LOCAL_QUEUE_DEPTH, sizeof(aun_local_frame_t));
+    fs_cache_init();
+    fileserver_init(_aun_fileserver_tx);
+    print_spool_init(_aun_print_reply, _aun_print_forward);
+    _aun_sched_reset();
+    dns_refresh_timer = xTimerCreate("aun_dns", pdMS_TO_TICKS(AUN_DNS_REFRESH_MS), pdTRUE, NULL, _aun_dns_refresh);
+    xTimerStart(dns_refresh_timer, 0);
+    probe_timer = xTimerCreate("aun_probe", pdMS_TO_TICKS(AUN_PROBE_INTERVAL_MS), pdTRUE, NULL, _aun_probe);
+    xTimerStart(probe_timer, 0);
     is_running = false;
     aunbridge_reconfigure();
 }
\ No newline at end of file
@@ -14,6 +14,14 @@
 
 #include <stdint.h>
 
+#include "config.h"
+
+// Table sizes, for sizing what is passed to the aunbridge_get_*() calls
+#define AUN_MAX_ECONET_STATIONS 32
+#define AUN_MAX_AUN_STATIONS 20     // Configured. Single port mode derives more.
+#define AUN_MAX_MAPPED_STATIONS 256 // AUN stations by number, configured or derived
+#define AUN_SCHED_CLASSES CONFIG_PRIORITY_CLASSES
+
 #define AUN_TYPE_BROADCAST 0x01
 #define AUN_TYPE_DATA 0x02
 #define AUN_TYPE_ACK 0x03
@@ -41,12 +49,75 @@ typedef struct
     uint32_t rx_imm_count;
     uint32_t rx_data_count;
     uint32_t rx_ack_count;
+    uint32_t rx_stale_ack_count;      // ACKs for nothing we're waiting on
     uint32_t rx_nack_count;
     uint32_t rx_unknown_count;
+    uint32_t rx_duplicate_count;
+    uint32_t rx_reorder_count;
+    uint32_t rx_reorder_timeout_count;
+    uint32_t trunk_tx_frame_count;
+    uint32_t trunk_tx_datagram_count;
+    uint32_t tx_broadcast_count;      // Econet broadcasts sent to AUN
+    uint32_t rx_broadcast_count;      // AUN broadcasts put on the Econet
+    uint32_t rx_broadcast_drop_count; // AUN broadcasts dropped as repeats or over the rate limit
+    uint32_t fs_cache_hit_count;      // Fileserver LOADs answered from the cache
+    uint32_t fs_cache_miss_count;
+    uint32_t rx_readahead_count;      // AUN frames acknowledged before reaching the Econet
+    uint32_t rx_readahead_fail_count; // ... that the Beeb then wouldn't take
+    uint32_t bridge_query_count;      // Bridge protocol queries answered
 } aunbridge_stats_t;
 
 extern aunbridge_stats_t aunbridge_stats;
 
+typedef struct
+{
+    uint32_t frames_in;
+    uint32_t bytes_in;
+    uint32_t frames_out;
+    uint32_t bytes_out;
+    uint32_t retries;
+    uint32_t aborts;
+    uint32_t nacks;
+    uint32_t last_seen_ms; // Uptime when last heard from. Zero if never.
+    uint32_t latency_avg_us;
+    uint32_t latency_max_us;
+} aunbridge_station_counters_t;
+
+typedef struct
+{
+    uint8_t station_id;
+    aunbridge_station_counters_t counters;
+} aunbridge_station_stats_t;
+
+typedef struct
+{
+    uint8_t station_id;
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    uint32_t rto_ms;
+} aunbridge_peer_stats_t;
+
+typedef struct
+{
+    uint8_t station_id;
+    uint8_t depth;
+    uint8_t depth_max;
+    uint32_t wait_avg_ms;
+    uint32_t wait_max_ms;
+} aunbridge_queue_stats_t;
+
+typedef struct
+{
+    uint32_t tx_count;
+    uint32_t wait_total_ms;
+    uint32_t wait_max_ms;
+} aunbridge_class_stats_t;
+
 void aunbrige_on_econet_frame_rx(uint8_t *data, uint16_t length, void *user_ctx);
 void aunbrige_start(void);
-void aunbridge_reconfigure(void);
\ No newline at end of file
+void aunbridge_reconfigure(void);
+int aunbridge_get_peer_stats(aunbridge_peer_stats_t *peers, int max_peers);
+int aunbridge_get_queue_stats(aunbridge_queue_stats_t *queues, int max_queues);
+int aunbridge_get_class_stats(aunbridge_class_stats_t *classes, int max_classes);
+int aunbridge_get_econet_station_stats(aunbridge_station_stats_t *stations, int max_stations);
+int aunbridge_get_aun_station_stats(aunbridge_station_stats_t *stations, int max_stations);
\ No newline at end of file
@@ -120,7 +120,7 @@ cJSON *config_load_econet_json(void)
     return root;
 }
 
-esp_err_t config_load_econet(config_cb_econet_station eco_cb, config_cb_aun_station aun_cb)
+esp_err_t config_load_econet(config_cb_econet_station eco_cb, config_cb_aun_station aun_cb, config_priority_t *priority)
 {
     FILE *fp = fopen(ECONET_CONFIG_FILE, "r");
     if (!fp)
@@ -180,6 +180,7 @@ esp_err_t config_load_econet(config_cb_econet_station eco_cb, config_cb_aun_stat
         {
 
             cJSON *station_id = cJSON_GetObjectItem(item, "station_id");
+            cJSON *network_id = cJSON_GetObjectItem(item, "network_id");
             cJSON *udp_port = cJSON_GetObjectItem(item, "udp_port");
             cJSON *remote_ip = cJSON_GetObjectItem(item, "remote_ip");
 
@@ -193,17 +194,185 @@ esp_err_t config_load_econet(config_cb_econet_station eco_cb, config_cb_aun_stat
                     .station_id = station_id->valueint,
                     .network_id = 0,
                     .udp_port = udp_port->valueint};
+                if (cJSON_IsNumber(network_id) && network_id->valueint >= 0 && network_id->valueint <= 254)
+                {
+                    cfg.network_id = network_id->valueint;
+                }
                 snprintf(cfg.remote_address, sizeof(cfg.remote_address), "%s", remote_ip->valuestring);
                 aun_cb(&cfg);
             }
         }
     }
 
+    // Econet transmit priority classes. priority holds the bridge's
+    // defaults; each setting present replaces its part. An empty rule table
+    // keeps the default rules.
+    cJSON *mode = cJSON_GetObjectItemCaseSensitive(root, "priorityMode");
+    if (cJSON_IsString(mode))
+    {
+        priority->is_weighted = !strcmp(mode->valuestring, "weighted");
+    }
+
+    cJSON *weights = cJSON_GetObjectItemCaseSensitive(root, "priorityWeights");
+    for (int i = 0; i < CONFIG_PRIORITY_CLASSES; i++)
+    {
+        cJSON *weight = cJSON_GetArrayItem(weights, i);
+        if (cJSON_IsNumber(weight) && weight->valueint >= 1 && weight->valueint <= 255)
+        {
+            priority->weights[i] = weight->valueint;
+        }
+    }
+
+    cfgs = cJSON_GetObjectItemCaseSensitive(root, "priorityRules");
+    if (cJSON_IsArray(cfgs) && cJSON_GetArraySize(cfgs) > 0)
+    {
+        priority->rule_count = 0;
+        for (cJSON *item = cfgs->child; item != NULL && priority->rule_count < CONFIG_PRIORITY_MAX_RULES; item = item->next)
+        {
+            cJSON *port = cJSON_GetObjectItem(item, "port");
+            cJSON *control = cJSON_GetObjectItem(item, "control");
+            cJSON *class_id = cJSON_GetObjectItem(item, "class");
+
+            // No control matches any. Rules that don't fit are skipped
+            // rather than truncated into some other port's rule.
+            bool is_ok = cJSON_IsNumber(port) &&
+                         port->valueint >= 1 && port->valueint <= 255 &&
+                         (control == NULL || (cJSON_IsNumber(control) &&
+                                              control->valueint >= 0 && control->valueint <= 255)) &&
+                         cJSON_IsNumber(class_id) &&
+                         class_id->valueint >= 0 && class_id->valueint < CONFIG_PRIORITY_CLASSES;
+
+            if (is_ok)
+            {
+                config_priority_rule_t *rule = &priority->rules[priority->rule_count++];
+                rule->port = port->valueint;
+                rule->control = control != NULL ? control->valueint : 0;
+                rule->class_id = class_id->valueint;
+            }
+        }
+    }
+
     cJSON_Delete(root);
 
     return ESP_OK;
 }
 
+esp_err_t config_load_bridge(config_bridge_t *cfg)
+{
+    config_bridge_t defaults = {
+        .dynamic_port_base = 10000,
+        .is_single_port = false,
+    };
+    *cfg = defaults;
+
+    cJSON *root = config_load_econet_json();
+    if (root == NULL)
+    {
+        return ESP_OK;
+    }
+
+    cJSON *port_base = cJSON_GetObjectItemCaseSensitive(root, "dynamicPortBase");
+    if (cJSON_IsNumber(port_base) && port_base->valueint >= 0 && port_base->valueint <= 65535 - 255)
+    {
+        cfg->dynamic_port_base = port_base->valueint;
+    }
+
+    cJSON *mode = cJSON_GetObjectItemCaseSensitive(root, "aunMode");
+    cfg->is_single_port = cJSON_IsString(mode) && !strcmp(mode->valuestring, "single");
+
+    cJSON *subnet = cJSON_GetObjectItemCaseSensitive(root, "aunSubnet");
+    if (cJSON_IsString(subnet))
+    {
+        snprintf(cfg->aun_subnet, sizeof(cfg->aun_subnet), "%s", subnet->valuestring);
+    }
+
+    cJSON *first = cJSON_GetObjectItemCaseSensitive(root, "aunFirstStation");
+    cJSON *last = cJSON_GetObjectItemCaseSensitive(root, "aunLastStation");
+    if (cJSON_IsNumber(first) && cJSON_IsNumber(last) &&
+        first->valueint >= 1 && last->valueint <= 254 && first->valueint <= last->valueint)
+    {
+        cfg->aun_first_station = first->valueint;
+        cfg->aun_last_station = last->valueint;
+    }
+
+    cJSON *trunk_host = cJSON_GetObjectItemCaseSensitive(root, "trunkHost");
+    cJSON *trunk_port = cJSON_GetObjectItemCaseSensitive(root, "trunkPort");
+    cJSON *trunk_local_port = cJSON_GetObjectItemCaseSensitive(root, "trunkLocalPort");
+    if (cJSON_IsString(trunk_host) && cJSON_IsNumber(trunk_port) && cJSON_IsNumber(trunk_local_port) &&
+        trunk_port->valueint > 0 && trunk_port->valueint <= 65535 &&
+        trunk_local_port->valueint > 0 && trunk_local_port->valueint <= 65535)
+    {
+        snprintf(cfg->trunk_host, sizeof(cfg->trunk_host), "%s", trunk_host->valuestring);
+        cfg->trunk_port = trunk_port->valueint;
+        cfg->trunk_local_port = trunk_local_port->valueint;
+    }
+
+    cJSON *local_net = cJSON_GetObjectItemCaseSensitive(root, "trunkLocalNet");
+    if (cJSON_IsNumber(local_net) && local_net->valueint >= 0 && local_net->valueint <= 254)
+    {
+        cfg->trunk_local_net = local_net->valueint;
+    }
+
+    cJSON *nets = cJSON_GetObjectItemCaseSensitive(root, "trunkNetworks");
+    for (cJSON *net = cJSON_IsArray(nets) ? nets->child : NULL;
+         net != NULL && cfg->trunk_net_count < CONFIG_TRUNK_MAX_NETS;
+         net = net->next)
+    {
+        if (cJSON_IsNumber(net) && net->valueint > 0 && net->valueint <= 254)
+        {
+            cfg->trunk_nets[cfg->trunk_net_count++] = net->valueint;
+        }
+    }
+
+    cfg->is_fs_cache = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(root, "fsCache"));
+    cfg->is_readahead = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(root, "readAhead"));
+
+    cJSON *fs_station = cJSON_GetObjectItemCaseSensitive(root, "fsStation");
+    if (cJSON_IsNumber(fs_station) && fs_station->valueint >= 0 && fs_station->valueint <= 254)
+    {
+        cfg->fs_station_id = fs_station->valueint;
+    }
+
+    cJSON *print_station = cJSON_GetObjectItemCaseSensitive(root, "printStation");
+    cJSON *print_server = cJSON_GetObjectItemCaseSensitive(root, "printServer");
+    if (cJSON_IsNumber(print_station) && cJSON_IsNumber(print_server) &&
+        print_station->valueint > 0 && print_station->valueint <= 254 &&
+        print_server->valueint > 0 && print_server->valueint <= 254)
+    {
+        cfg->print_station_id = print_station->valueint;
+        cfg->print_server_id = print_server->valueint;
+    }
+    cJSON *print_local_port = cJSON_GetObjectItemCaseSensitive(root, "printLocalPort");
+    if (cJSON_IsNumber(print_local_port) && print_local_port->valueint > 0 && print_local_port->valueint <= 65535)
+    {
+        cfg->print_local_port = print_local_port->valueint;
+    }
+
+    cJSON *routes = cJSON_GetObjectItemCaseSensitive(root, "routes");
+    for (cJSON *item = cJSON_IsArray(routes) ? routes->child : NULL;
+         item != NULL && cfg->route_count < CONFIG_MAX_ROUTES; item = item->next)
+    {
+        cJSON *network = cJSON_GetObjectItemCaseSensitive(item, "network");
+        cJSON *subnet = cJSON_GetObjectItemCaseSensitive(item, "subnet");
+        if (cJSON_IsNumber(network) && cJSON_IsString(subnet) &&
+            network->valueint > 0 && network->valueint <= 254)
+        {
+            config_route_t *route = &cfg->routes[cfg->route_count++];
+            route->network_id = network->valueint;
+            snprintf(route->subnet, sizeof(route->subnet), "%s", subnet->valuestring);
+        }
+    }
+
+    cJSON *bridge_station = cJSON_GetObjectItemCaseSensitive(root, "bridgeStation");
+    if (cJSON_IsNumber(bridge_station) && bridge_station->valueint >= 0 && bridge_station->valueint <= 254)
+    {
+        cfg->bridge_station_id = bridge_station->valueint;
+    }
+
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
 void config_init(void)
 {
     esp_err_t ret = nvs_flash_init();
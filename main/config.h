@@ -46,12 +46,71 @@ typedef struct
 
 typedef struct
 {
-    char remote_address[64];
+    char remote_address[160]; // One or more servers, comma separated, each optionally host:port
     uint8_t station_id;
     uint8_t network_id;
     uint16_t udp_port;
 } config_aun_station_t;
 
+#define CONFIG_PRIORITY_CLASSES 4
+#define CONFIG_PRIORITY_MAX_RULES 16
+#define CONFIG_TRUNK_MAX_NETS 8
+#define CONFIG_MAX_ROUTES 8
+
+typedef struct
+{
+    uint8_t port;
+    uint8_t control; // 0 matches any control byte
+    uint8_t class_id; // 0 is the highest priority
+} config_priority_rule_t;
+
+typedef struct
+{
+    bool is_weighted;                         // Weighted round robin rather than strict priority
+    uint8_t weights[CONFIG_PRIORITY_CLASSES]; // Frames per round for each class when weighted
+    uint8_t rule_count;
+    config_priority_rule_t rules[CONFIG_PRIORITY_MAX_RULES];
+} config_priority_t;
+
+// Econet network reached through AUN hosts numbered by their address, as
+// standard AUN does: station S is subnet.S
+typedef struct
+{
+    uint8_t network_id;
+    char subnet[16];
+} config_route_t;
+
+typedef struct
+{
+    uint16_t dynamic_port_base; // Unconfigured Beebs get this + station ID. 0 disables.
+    bool is_single_port;        // Standard AUN: one socket, AUN stations derived from their IP address
+    char aun_subnet[16];        // Network address of the AUN hosts (/24) in single port mode
+    uint8_t aun_first_station;  // Station numbers answered for on the Econet in single port mode.
+    uint8_t aun_last_station;   // ... 0 answers for none; there's no safe default.
+
+    // Trunk to a PiEconetBridge. An empty host disables it.
+    char trunk_host[64];        // Peer's IP address
+    uint16_t trunk_port;        // Peer's trunk port
+    uint16_t trunk_local_port;  // Our trunk port
+    uint8_t trunk_local_net;    // Network number the peer knows our Econet by. Also given in answers to bridge queries.
+    uint8_t trunk_net_count;
+    uint8_t trunk_nets[CONFIG_TRUNK_MAX_NETS]; // Networks reached through the trunk
+
+    bool is_fs_cache;           // Answer repeated fileserver LOADs from a local cache
+    uint8_t fs_station_id;      // Station number of the built-in fileserver. 0 disables.
+    bool is_readahead;          // Acknowledge block transfers from AUN ahead of the Econet
+
+    // Spooling print server. Jobs are taken from the Beebs as the print
+    // station and passed on to the AUN print server later.
+    uint8_t print_station_id;   // 0 disables
+    uint8_t print_server_id;    // AUN station the jobs go to
+    uint16_t print_local_port;  // Our UDP port for talking to it, unless in single port mode
+
+    uint8_t route_count;
+    config_route_t routes[CONFIG_MAX_ROUTES];
+    uint8_t bridge_station_id;  // Station bridge queries are answered from. 0 ignores them.
+} config_bridge_t;
+
 typedef esp_err_t (*config_cb_econet_station)(config_econet_station_t *cfg);
 typedef esp_err_t (*config_cb_aun_station)(config_aun_station_t *cfg);
 
@@ -61,7 +120,9 @@ esp_err_t config_load_wifi(void);
 
 cJSON *config_load_econet_json(void);
 esp_err_t config_save_econet(const cJSON *settings);
-esp_err_t config_load_econet(config_cb_econet_station eco_cb, config_cb_aun_station aun_cb);
+esp_err_t config_load_econet(config_cb_econet_station eco_cb, config_cb_aun_station aun_cb, config_priority_t *priority);
+
+esp_err_t config_load_bridge(config_bridge_t *cfg);
 
 esp_err_t config_save_econet_clock(const config_econet_clock_t* clk);
 esp_err_t config_load_econet_clock(config_econet_clock_t* clk);
\ No newline at end of file
@@ -19,6 +19,20 @@
 
 #define ECONET_MTU 8192
 
+// Station number that addresses every station
+#define ECONET_BROADCAST 0xFF
+
+// Immediate operations are sent to port 0 with one of these control bytes
+#define ECONET_IMM_PEEK 0x81
+#define ECONET_IMM_POKE 0x82
+#define ECONET_IMM_JSR 0x83
+#define ECONET_IMM_USERPROC 0x84
+#define ECONET_IMM_OSPROC 0x85
+#define ECONET_IMM_HALT 0x86
+#define ECONET_IMM_CONTINUE 0x87
+#define ECONET_IMM_MACHINETYPE 0x88
+#define ECONET_IMM_GETREGS 0x89
+
 typedef void (*econet_frame_callback)(uint8_t *data, uint16_t length, void *user_ctx);
 
 /*** Econet acknowledgement types.
@@ -55,6 +69,22 @@ typedef enum
     ECONET_SEND_ERROR,   ///< Send could not be started
 } econet_acktype_t;
 
+/*** Handshake shapes.
+ *
+ * Ordinary traffic and immediate operations that carry data to the remote
+ * station use the four-way handshake. HALT and CONTINUE are just a scout and
+ * its ACK. PEEK, MACHINETYPE and GETREGS are a scout answered directly by a
+ * frame carrying the result, which is not acknowledged. A broadcast is a
+ * single frame that nobody acknowledges.
+ */
+typedef enum
+{
+    ECONET_HANDSHAKE_4WAY,       ///< Scout, ACK, data, ACK
+    ECONET_HANDSHAKE_SCOUT_ONLY, ///< Scout, ACK
+    ECONET_HANDSHAKE_REPLY,      ///< Scout, reply frame
+    ECONET_HANDSHAKE_BROADCAST,  ///< One frame, no ACK
+} econet_handshake_t;
+
 typedef struct
 {
     gpio_num_t clk_pin;            /*!< ADLC clock input pin */
@@ -104,6 +134,12 @@ typedef struct
     char type;
 } econet_rx_packet_t;
 
+typedef struct
+{
+    const uint8_t *data;
+    size_t length;
+} econet_iovec_t;
+
 extern econet_stats_t econet_stats;
 extern QueueHandle_t econet_rx_packet_queue;
 
@@ -111,9 +147,18 @@ void econet_setup(const econet_config_t *config);
 void econet_clock_reconfigure(void);
 void econet_start(void);
 econet_acktype_t econet_send(uint8_t *data, uint16_t length);
+econet_acktype_t econet_sendv(const econet_scout_t *scout, const econet_iovec_t *iov, int iov_count);
+econet_acktype_t econet_sendv_imm(const econet_scout_t *scout, const uint8_t *extra, size_t extra_len,
+                                  const econet_iovec_t *iov, int iov_count,
+                                  uint8_t *reply, size_t reply_size, size_t *reply_len);
+econet_acktype_t econet_broadcast(const econet_scout_t *scout, const econet_iovec_t *iov, int iov_count);
+econet_handshake_t econet_imm_handshake(uint8_t control);
+size_t econet_imm_scout_extra(uint8_t control);
 void econet_rx_clear_bitmaps(void);
 void exonet_rx_enable_station(uint8_t station_id);
+void exonet_rx_disable_station(uint8_t station_id);
 void exonet_rx_enable_network(uint8_t network_id);
+void econet_rx_set_machine_type(uint8_t station_id, const uint8_t machine_type[4]);
 void econet_rx_shutdown(void);
 
 #ifdef ECONET_PRIVATE_API
@@ -122,6 +167,11 @@ extern econet_config_t econet_cfg;
 extern QueueHandle_t tx_command_queue;
 extern TaskHandle_t tx_task;
 extern volatile bool tx_is_in_progress;
+extern volatile bool tx_imm_reply_pending;
+extern volatile uint8_t tx_imm_reply_stn;
+extern volatile uint8_t tx_imm_reply_net;
+extern volatile uint8_t *tx_imm_reply_data;
+extern volatile uint16_t tx_imm_reply_len;
 extern uint32_t rx_ack_wait_time;
 
 void econet_rx_setup(void);
@@ -137,6 +187,7 @@ typedef struct
     uint8_t dst_net;
     uint8_t src_stn;
     uint8_t src_net;
+    uint8_t data[4]; // MACHINETYPE answer for 'M'
 } econet_tx_command_t;
 
 #endif
\ No newline at end of file
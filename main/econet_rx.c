@@ -52,6 +52,11 @@ typedef struct
 static DRAM_ATTR bitmap256_t rx_station_bitmap;
 static DRAM_ATTR bitmap256_t rx_network_bitmap;
 
+// Known machine types for stations we answer for, so MACHINETYPE queries can
+// be answered from the ISR without a round trip.
+static DRAM_ATTR bitmap256_t rx_machine_type_bitmap;
+static uint8_t DRAM_ATTR rx_machine_types[256][4];
+
 static inline bool bm256_test(const bitmap256_t *bm, uint8_t bit)
 {
     uint32_t word = bit >> 5;
@@ -66,6 +71,13 @@ static inline void bm256_set(bitmap256_t *bm, uint8_t bit)
     bm->w[word] |= (1u << offset);
 }
 
+static inline void bm256_clear(bitmap256_t *bm, uint8_t bit)
+{
+    uint32_t word = bit >> 5;
+    uint32_t offset = bit & 31;
+    bm->w[word] &= ~(1u << offset);
+}
+
 static inline void IRAM_ATTR _begin_frame(void)
 {
     _recv_data_bit = 0;
@@ -74,6 +86,21 @@ static inline void IRAM_ATTR _begin_frame(void)
     is_frame_active = 1;
 }
 
+// Skips the buffer holding an immediate reply until the TX task has copied
+// it out
+static inline void IRAM_ATTR _next_rx_buffer(void)
+{
+    do
+    {
+        rx_packet_buffer_index++;
+        if (rx_packet_buffer_index >= ECONET_PACKET_BUFFER_COUNT)
+        {
+            rx_packet_buffer_index = 0;
+        }
+    } while (&rx_packet_buffers[rx_packet_buffer_index][ECONET_BUFFER_WORKSPACE] == tx_imm_reply_data);
+    rx_buf = &rx_packet_buffers[rx_packet_buffer_index][ECONET_BUFFER_WORKSPACE];
+}
+
 static inline void IRAM_ATTR _complete_frame()
 {
     gpio_set_level(19, 1);
@@ -96,6 +123,24 @@ static inline void IRAM_ATTR _complete_frame()
 
     econet_stats.rx_frame_count++;
 
+    // Broadcasts are passed up whole and never acknowledged. Ones from a
+    // station we answer for are our own.
+    if (rx_buf[0] == ECONET_BROADCAST && !(bm256_test(&rx_station_bitmap, rx_buf[2]) && rx_buf[3] == 0x00))
+    {
+        econet_rx_packet_t rx_pkt = {
+            .type = 'B',
+            .data = &rx_packet_buffers[rx_packet_buffer_index][0],
+            .length = rx_frame_len - 2,
+        };
+        if (xQueueSendFromISR(econet_rx_packet_queue, &rx_pkt, NULL) == errQUEUE_FULL)
+        {
+            econet_stats.rx_error_count++;
+            return;
+        }
+        _next_rx_buffer();
+        return;
+    }
+
     // Is this for us?
     if ((bm256_test(&rx_station_bitmap, rx_buf[0]) && rx_buf[1] == 0x00) || bm256_test(&rx_network_bitmap, rx_buf[1]))
     {
@@ -104,7 +149,32 @@ static inline void IRAM_ATTR _complete_frame()
 
         // Send ACK immediately
         BaseType_t is_awoken = true;
-        if (data_len > 4)
+        if (data_len > 4 && tx_imm_reply_pending && rx_buf[2] == tx_imm_reply_stn && rx_buf[3] == tx_imm_reply_net)
+        {
+            // Answer to an immediate operation we sent. It takes the place
+            // of the scout ACK so isn't itself acknowledged.
+            tx_imm_reply_pending = false;
+            tx_imm_reply_data = rx_buf;
+            tx_imm_reply_len = data_len;
+            econet_tx_command_t reply_cmd = {.cmd = 'r'};
+            xQueueSendFromISR(tx_command_queue, &reply_cmd, &is_awoken);
+            _next_rx_buffer();
+        }
+        else if (data_len == 6 && rx_buf[4] == ECONET_IMM_MACHINETYPE && rx_buf[5] == 0 &&
+                 bm256_test(&rx_machine_type_bitmap, rx_buf[0]))
+        {
+            // MACHINETYPE query we know the answer to
+            econet_tx_command_t reply_cmd = {
+                .cmd = 'M',
+                .dst_stn = rx_buf[2],
+                .dst_net = rx_buf[3],
+                .src_stn = rx_buf[0],
+                .src_net = rx_buf[1]};
+            memcpy(reply_cmd.data, rx_machine_types[rx_buf[0]], 4);
+            xQueueSendFromISR(tx_command_queue, &reply_cmd, &is_awoken);
+            econet_tx_pre_go();
+        }
+        else if (data_len > 4)
         {
             econet_tx_command_t ack_cmd = {
                 .cmd = 'A',
@@ -123,12 +193,7 @@ static inline void IRAM_ATTR _complete_frame()
             if (xQueueSendFromISR(econet_rx_packet_queue, &rx_pkt, NULL) == errQUEUE_FULL)
               econet_stats.rx_error_count++;
 
-            rx_packet_buffer_index++;
-            if (rx_packet_buffer_index >= ECONET_PACKET_BUFFER_COUNT)
-            {
-                rx_packet_buffer_index = 0;
-            }
-            rx_buf = &rx_packet_buffers[rx_packet_buffer_index][ECONET_BUFFER_WORKSPACE];
+            _next_rx_buffer();
 
             rx_ack_wait_time = esp_cpu_get_cycle_count();
         }
@@ -351,6 +416,13 @@ void econet_rx_clear_bitmaps(void)
 {
     memset(&rx_station_bitmap, 0, sizeof(rx_station_bitmap));
     memset(&rx_network_bitmap, 0, sizeof(rx_network_bitmap));
+    memset(&rx_machine_type_bitmap, 0, sizeof(rx_machine_type_bitmap));
+}
+
+void econet_rx_set_machine_type(uint8_t station_id, const uint8_t machine_type[4])
+{
+    memcpy(rx_machine_types[station_id], machine_type, 4);
+    bm256_set(&rx_machine_type_bitmap, station_id);
 }
 
 void exonet_rx_enable_station(uint8_t station_id)
@@ -358,6 +430,11 @@ void exonet_rx_enable_station(uint8_t station_id)
     bm256_set(&rx_station_bitmap, station_id);
 }
 
+void exonet_rx_disable_station(uint8_t station_id)
+{
+    bm256_clear(&rx_station_bitmap, station_id);
+}
+
 void exonet_rx_enable_network(uint8_t network_id)
 {
     bm256_set(&rx_network_bitmap, network_id);
@@ -14,6 +14,7 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "freertos/message_buffer.h"
 #include "esp_log.h"
 
@@ -34,21 +35,38 @@ typedef struct
     uint32_t bit_pos;
     uint8_t one_count;
     uint8_t c;
+    uint16_t crc;
 } tx_bitstuff_ctx;
 
 TaskHandle_t DRAM_ATTR tx_task = NULL;
 QueueHandle_t DRAM_ATTR tx_command_queue;
 volatile bool DRAM_ATTR tx_is_in_progress;
 
+// Set while waiting for the frame that answers an immediate operation. The
+// RX ISR hands that frame over rather than acknowledging it, once it has
+// checked the frame comes from the station the operation went to. The RX
+// buffer it's in is left out of the ring until tx_imm_reply_data is cleared.
+volatile bool DRAM_ATTR tx_imm_reply_pending;
+volatile uint8_t DRAM_ATTR tx_imm_reply_stn;
+volatile uint8_t DRAM_ATTR tx_imm_reply_net;
+volatile uint8_t *DRAM_ATTR tx_imm_reply_data;
+volatile uint16_t DRAM_ATTR tx_imm_reply_len;
+
 static parlio_tx_unit_handle_t DRAM_ATTR tx_unit;
-static TaskHandle_t DRAM_ATTR tx_sender_task = NULL;
+// Given by the TX task when a send finishes. Kept apart from the sender's
+// task notification, which the bridge scheduler uses for its own events.
+static SemaphoreHandle_t DRAM_ATTR tx_done;
 static volatile econet_acktype_t DRAM_ATTR tx_sent_ack;
+static volatile econet_handshake_t DRAM_ATTR tx_handshake;
+static uint8_t *tx_reply;
+static size_t tx_reply_size;
+static size_t tx_reply_len;
 
 // Outgoing frame
 static uint8_t DRAM_ATTR tx_flag_stream[ECONET_FLAGSTREAM_PADDING * ECONET_PARLIO_WIDTH];
 static volatile uint32_t DRAM_ATTR tx_flag_stream_length;
 static volatile size_t DRAM_ATTR scout_bits_len;
-static uint8_t DRAM_ATTR scout_bits[32 * ECONET_PARLIO_WIDTH];
+static uint8_t DRAM_ATTR scout_bits[64 * ECONET_PARLIO_WIDTH]; // Room for immediate op arguments
 static uint8_t DRAM_ATTR tx_bits[ECONET_MTU * ECONET_PARLIO_WIDTH];
 static volatile size_t DRAM_ATTR tx_bits_len;
 
@@ -81,19 +99,15 @@ static esp_err_t _queue_flagstream()
     return ret;
 }
 
-static inline uint16_t IRAM_ATTR crc16_x25(const uint8_t *data, size_t len)
+static inline uint16_t IRAM_ATTR crc16_x25_update(uint16_t crc, uint8_t c)
 {
-    uint16_t crc = 0xFFFF;
-    for (size_t i = 0; i < len; i++)
+    crc ^= c;
+    for (int j = 0; j < 8; j++)
     {
-        crc ^= data[i];
-        for (int j = 0; j < 8; j++)
-        {
-            crc = (crc & 0x0001) ? (uint16_t)((crc >> 1) ^ 0x8408)
-                                 : (uint16_t)(crc >> 1);
-        }
+        crc = (crc & 0x0001) ? (uint16_t)((crc >> 1) ^ 0x8408)
+                             : (uint16_t)(crc >> 1);
     }
-    return (uint16_t)(crc ^ 0xFFFF);
+    return crc;
 }
 
 static inline void IRAM_ATTR _add_raw_bit(tx_bitstuff_ctx *ctx, uint8_t b)
@@ -152,52 +166,63 @@ static inline void IRAM_ATTR _add_byte_stuffed(tx_bitstuff_ctx *ctx, uint8_t c)
     }
 }
 
-size_t IRAM_ATTR _generate_frame_bits(uint8_t *bits, size_t bits_size, const uint8_t *payload, size_t payload_length)
+static void IRAM_ATTR _frame_begin(tx_bitstuff_ctx *ctx, uint8_t *bits, size_t bits_size)
 {
-
-    tx_bitstuff_ctx stuff_ctx = {
-        .bits = bits,
-        .bits_size = bits_size,
-    };
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->bits = bits;
+    ctx->bits_size = bits_size;
+    ctx->crc = 0xFFFF;
 
     // Double flag - this is because the handover from flagstream to
     // our stream is problematic. Future version we'll customise the
     // PARLIO driver fully to get rid of this nonsense
-    _add_byte_unstuffed(&stuff_ctx, 0x7e);
-    _add_byte_unstuffed(&stuff_ctx, 0x7e);
+    _add_byte_unstuffed(ctx, 0x7e);
+    _add_byte_unstuffed(ctx, 0x7e);
+}
 
-    for (int i = 0; i < payload_length; i++)
+// Add payload bytes to the frame. May be called repeatedly to gather a frame
+// from several buffers; the CRC is accumulated as we go.
+static void IRAM_ATTR _frame_add(tx_bitstuff_ctx *ctx, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
     {
-        _add_byte_stuffed(&stuff_ctx, payload[i]);
+        ctx->crc = crc16_x25_update(ctx->crc, data[i]);
+        _add_byte_stuffed(ctx, data[i]);
     }
+}
 
-    // Compute CRC over unstuffed payload bytes
-    uint16_t fcs = crc16_x25(payload, payload_length);
-
-    // Emit CRC (16 bits)
-    uint8_t fcs_bytes[2] = {(uint8_t)(fcs & 0xFF), (uint8_t)(fcs >> 8)};
-    for (int i = 0; i < 2; i++)
-    {
-        _add_byte_stuffed(&stuff_ctx, fcs_bytes[i]);
-    }
+static size_t IRAM_ATTR _frame_end(tx_bitstuff_ctx *ctx)
+{
+    // Emit CRC (16 bits) computed over unstuffed payload bytes
+    uint16_t fcs = ctx->crc ^ 0xFFFF;
+    _add_byte_stuffed(ctx, (uint8_t)(fcs & 0xFF));
+    _add_byte_stuffed(ctx, (uint8_t)(fcs >> 8));
 
     // Flag must be unstuffed (but still packed)
-    _add_byte_unstuffed(&stuff_ctx, 0x7e);
+    _add_byte_unstuffed(ctx, 0x7e);
 
     // Pad out block so it's on correct boundary
     // otherwise subequent transactions are screwed up
-    while (stuff_ctx.bit_pos || (stuff_ctx.byte_pos % 4) != 0)
+    while (ctx->bit_pos || (ctx->byte_pos % 4) != 0)
     {
-        _add_raw_bit(&stuff_ctx, 0);
+        _add_raw_bit(ctx, 0);
     }
 
     // Check for overflow
-    if (stuff_ctx.byte_pos > stuff_ctx.bits_size)
+    if (ctx->byte_pos > ctx->bits_size)
     {
         return 0;
     }
 
-    return stuff_ctx.byte_pos;
+    return ctx->byte_pos;
+}
+
+size_t IRAM_ATTR _generate_frame_bits(uint8_t *bits, size_t bits_size, const uint8_t *payload, size_t payload_length)
+{
+    tx_bitstuff_ctx stuff_ctx;
+    _frame_begin(&stuff_ctx, bits, bits_size);
+    _frame_add(&stuff_ctx, payload, payload_length);
+    return _frame_end(&stuff_ctx);
 }
 
 size_t IRAM_ATTR _generate_flag_stream(uint8_t *bits, size_t bits_size, int number_of_flags)
@@ -248,11 +273,11 @@ static void IRAM_ATTR _tx_task(void *params)
             return;
         }
 
-        // Generate ACK.
-        if (cmd.cmd == 'A')
+        // Generate ACK, or the answer to a MACHINETYPE query which is an
+        // ACK with the machine type on the end.
+        if (cmd.cmd == 'A' || cmd.cmd == 'M')
         {
-            // Generate and send ack
-            size_t tx_len = _generate_frame_bits(ack_bits, sizeof(ack_bits), &cmd.dst_stn, 4);
+            size_t tx_len = _generate_frame_bits(ack_bits, sizeof(ack_bits), &cmd.dst_stn, cmd.cmd == 'M' ? 8 : 4);
             _transmit_bits(ack_bits, tx_len);
             econet_stats.tx_ack_count++;
             continue;
@@ -270,7 +295,19 @@ static void IRAM_ATTR _tx_task(void *params)
 
         is_data_ready = false;
 
-        // Send scout
+        // A broadcast is a lone frame. Nothing answers it.
+        if (tx_handshake == ECONET_HANDSHAKE_BROADCAST)
+        {
+            _transmit_bits(tx_bits, tx_bits_len);
+            tx_sent_ack = ECONET_ACK;
+            xSemaphoreGive(tx_done);
+            econet_stats.tx_frame_count++;
+            continue;
+        }
+
+        // Send scout. A reply left over from one that timed out is let go.
+        tx_imm_reply_data = NULL;
+        tx_imm_reply_pending = (tx_handshake == ECONET_HANDSHAKE_REPLY);
         _transmit_bits(scout_bits, scout_bits_len);
         _queue_flagstream();
 
@@ -278,20 +315,51 @@ static void IRAM_ATTR _tx_task(void *params)
         if (xQueueReceive(tx_command_queue, &cmd, 200) == pdFALSE)
         {
             ESP_LOGW(TAG, "Timeout waiting for scout ack");
+            tx_imm_reply_pending = false;
             tx_sent_ack = ECONET_NACK;
-            xTaskNotifyGive(tx_sender_task);
+            xSemaphoreGive(tx_done);
             econet_stats.rx_nack_count++;
             continue;
         }
         if (cmd.cmd == 'I')
         {
             ESP_LOGI(TAG, "Bus became idle whilst waiting for scout ack (%d)", econet_rx_is_idle());
+            tx_imm_reply_pending = false;
             tx_sent_ack = ECONET_NACK;
-            xTaskNotifyGive(tx_sender_task);
+            xSemaphoreGive(tx_done);
             econet_stats.rx_nack_count++;
             continue;
         }
 
+        // Immediate operations that finish with the scout. A reply frame
+        // replaces the ACK; its addresses are dropped.
+        if (tx_handshake == ECONET_HANDSHAKE_REPLY)
+        {
+            tx_imm_reply_pending = false;
+            if (cmd.cmd != 'r')
+            {
+                ESP_LOGW(TAG, "Expected immediate reply but got '%c'", cmd.cmd);
+                tx_sent_ack = ECONET_NACK;
+                xSemaphoreGive(tx_done);
+                econet_stats.rx_nack_count++;
+                continue;
+            }
+            tx_reply_len = tx_imm_reply_len - 4;
+            if (tx_reply_len > tx_reply_size)
+            {
+                tx_reply_len = tx_reply_size;
+            }
+            memcpy(tx_reply, (const uint8_t *)tx_imm_reply_data + 4, tx_reply_len);
+            tx_imm_reply_data = NULL;
+        }
+        if (tx_handshake != ECONET_HANDSHAKE_4WAY)
+        {
+            tx_sent_ack = ECONET_ACK;
+            xSemaphoreGive(tx_done);
+            econet_stats.tx_frame_count++;
+            continue;
+        }
+
         // Send payload frame
         _transmit_bits(tx_bits, tx_bits_len);
         _queue_flagstream();
@@ -301,7 +369,7 @@ static void IRAM_ATTR _tx_task(void *params)
         {
             ESP_LOGW(TAG, "Timeout waiting for data ack");
             tx_sent_ack = ECONET_NACK_CORRUPT;
-            xTaskNotifyGive(tx_sender_task);
+            xSemaphoreGive(tx_done);
             econet_stats.rx_nack_count++;
             continue;
         }
@@ -309,40 +377,58 @@ static void IRAM_ATTR _tx_task(void *params)
         {
             ESP_LOGW(TAG, "Bus became idle whilst waiting for data ack");
             tx_sent_ack = ECONET_NACK_CORRUPT;
-            xTaskNotifyGive(tx_sender_task);
+            xSemaphoreGive(tx_done);
             econet_stats.rx_nack_count++;
             continue;
         }
 
         tx_sent_ack = ECONET_ACK;
-        xTaskNotifyGive(tx_sender_task);
+        xSemaphoreGive(tx_done);
         econet_stats.tx_frame_count++;
     }
 }
 
-econet_acktype_t econet_send(uint8_t *data, uint16_t length)
+econet_handshake_t econet_imm_handshake(uint8_t control)
 {
-    tx_sender_task = xTaskGetCurrentTaskHandle();
-
-    // Generate scout
-    econet_scout_t scout;
-    memcpy(&scout, data, sizeof(scout));
-    if (scout.port == 0)
+    switch (control | 0x80)
     {
-        ESP_LOGW(TAG, "Discarded immediate mode packet. (TX)");
-        return ECONET_SEND_ERROR;
+    case ECONET_IMM_PEEK:
+    case ECONET_IMM_MACHINETYPE:
+    case ECONET_IMM_GETREGS:
+        return ECONET_HANDSHAKE_REPLY;
+    case ECONET_IMM_HALT:
+    case ECONET_IMM_CONTINUE:
+        return ECONET_HANDSHAKE_SCOUT_ONLY;
+    default:
+        return ECONET_HANDSHAKE_4WAY;
     }
+}
 
-    scout_bits_len = _generate_frame_bits(scout_bits, sizeof(scout_bits), (uint8_t *)&scout, sizeof(scout));
+// Bytes of arguments carried in the scout after the port byte: start and
+// end addresses for PEEK and POKE, an address or procedure number for the
+// calls.
+size_t econet_imm_scout_extra(uint8_t control)
+{
+    switch (control | 0x80)
+    {
+    case ECONET_IMM_PEEK:
+    case ECONET_IMM_POKE:
+        return 8;
+    case ECONET_IMM_JSR:
+    case ECONET_IMM_USERPROC:
+    case ECONET_IMM_OSPROC:
+        return 4;
+    default:
+        return 0;
+    }
+}
 
-    // Generate payload frame
-    data[5] = data[3];
-    data[4] = data[2];
-    data[3] = data[1];
-    data[2] = data[0];
-    tx_bits_len = _generate_frame_bits(tx_bits, sizeof(tx_bits), &data[2], length - 2);
+// Hand the prepared frames to the TX task and wait for the outcome
+static econet_acktype_t _econet_post_and_wait(void)
+{
+    // Clear a completion left over from a send that timed out
+    xSemaphoreTake(tx_done, 0);
 
-    // Notify sender task
     econet_tx_command_t cmd = {.cmd = 'S'};
     if (xQueueSend(tx_command_queue, &cmd, 1000) != pdTRUE)
     {
@@ -351,7 +437,7 @@ econet_acktype_t econet_send(uint8_t *data, uint16_t length)
     }
 
     // Wait for send completion (Full 4-way ACK or NACK)
-    if (ulTaskNotifyTake(pdTRUE, 10000) != pdTRUE)
+    if (xSemaphoreTake(tx_done, 10000) != pdTRUE)
     {
         ESP_LOGE(TAG, "Timeout waiting for send. Missing clock or line jammed?");
         return ECONET_SEND_ERROR;
@@ -360,6 +446,106 @@ econet_acktype_t econet_send(uint8_t *data, uint16_t length)
     return tx_sent_ack;
 }
 
+static econet_acktype_t _econet_transmit(const econet_scout_t *scout, const uint8_t *extra, size_t extra_len,
+                                         const econet_iovec_t *iov, int iov_count, econet_handshake_t handshake)
+{
+    tx_handshake = handshake;
+    tx_imm_reply_stn = scout->hdr.dst_stn;
+    tx_imm_reply_net = scout->hdr.dst_net;
+
+    // Generate scout
+    tx_bitstuff_ctx stuff_ctx;
+    _frame_begin(&stuff_ctx, scout_bits, sizeof(scout_bits));
+    _frame_add(&stuff_ctx, (const uint8_t *)scout, sizeof(*scout));
+    _frame_add(&stuff_ctx, extra, extra_len);
+    scout_bits_len = _frame_end(&stuff_ctx);
+    if (scout_bits_len == 0)
+    {
+        ESP_LOGE(TAG, "Scout too large. Discarded.");
+        return ECONET_SEND_ERROR;
+    }
+
+    // Generate payload frame straight from the caller's buffers
+    _frame_begin(&stuff_ctx, tx_bits, sizeof(tx_bits));
+    _frame_add(&stuff_ctx, (const uint8_t *)&scout->hdr, sizeof(scout->hdr));
+    for (int i = 0; i < iov_count; i++)
+    {
+        _frame_add(&stuff_ctx, iov[i].data, iov[i].length);
+    }
+    tx_bits_len = _frame_end(&stuff_ctx);
+    if (tx_bits_len == 0)
+    {
+        ESP_LOGE(TAG, "Frame too large for TX buffer. Discarded.");
+        return ECONET_SEND_ERROR;
+    }
+
+    return _econet_post_and_wait();
+}
+
+econet_acktype_t econet_sendv(const econet_scout_t *scout, const econet_iovec_t *iov, int iov_count)
+{
+    if (scout->port == 0)
+    {
+        ESP_LOGW(TAG, "Discarded immediate mode packet. (TX)");
+        return ECONET_SEND_ERROR;
+    }
+    return _econet_transmit(scout, NULL, 0, iov, iov_count, ECONET_HANDSHAKE_4WAY);
+}
+
+// Immediate operation. extra is the scout's argument bytes and the iovecs
+// are the data phase, if the operation has one. When it answers with a
+// frame, the frame's payload is copied to reply.
+econet_acktype_t econet_sendv_imm(const econet_scout_t *scout, const uint8_t *extra, size_t extra_len,
+                                  const econet_iovec_t *iov, int iov_count,
+                                  uint8_t *reply, size_t reply_size, size_t *reply_len)
+{
+    tx_reply = reply;
+    tx_reply_size = reply != NULL ? reply_size : 0;
+    tx_reply_len = 0;
+    econet_acktype_t result = _econet_transmit(scout, extra, extra_len, iov, iov_count,
+                                               econet_imm_handshake(scout->control));
+    if (reply_len != NULL)
+    {
+        *reply_len = tx_reply_len;
+    }
+    return result;
+}
+
+// Broadcast a frame to every station. The iovecs follow the control and
+// port bytes.
+econet_acktype_t econet_broadcast(const econet_scout_t *scout, const econet_iovec_t *iov, int iov_count)
+{
+    tx_handshake = ECONET_HANDSHAKE_BROADCAST;
+
+    tx_bitstuff_ctx stuff_ctx;
+    _frame_begin(&stuff_ctx, tx_bits, sizeof(tx_bits));
+    _frame_add(&stuff_ctx, (const uint8_t *)scout, sizeof(*scout));
+    for (int i = 0; i < iov_count; i++)
+    {
+        _frame_add(&stuff_ctx, iov[i].data, iov[i].length);
+    }
+    tx_bits_len = _frame_end(&stuff_ctx);
+    if (tx_bits_len == 0)
+    {
+        ESP_LOGE(TAG, "Broadcast too large for TX buffer. Discarded.");
+        return ECONET_SEND_ERROR;
+    }
+
+    return _econet_post_and_wait();
+}
+
+econet_acktype_t econet_send(uint8_t *data, uint16_t length)
+{
+    econet_scout_t scout;
+    memcpy(&scout, data, sizeof(scout));
+
+    econet_iovec_t iov = {
+        .data = data + sizeof(scout),
+        .length = length - sizeof(scout),
+    };
+    return econet_sendv(&scout, &iov, 1);
+}
+
 void econet_tx_setup(void)
 {
     parlio_tx_unit_config_t tx_config = {
@@ -388,6 +574,7 @@ void econet_tx_setup(void)
     ESP_ERROR_CHECK(parlio_new_tx_unit(&tx_config, &tx_unit));
 
     tx_command_queue = xQueueCreate(8, sizeof(econet_tx_command_t));
+    tx_done = xSemaphoreCreateBinary();
 
     // Pre-calculate flag bitstream
     tx_flag_stream_length = _generate_flag_stream(tx_flag_stream, sizeof(tx_flag_stream), ECONET_FLAGSTREAM_PADDING);
@@ -0,0 +1,1725 @@
+/*
+ * EconetWiFi
+ * Copyright (c) 2025 Paul G. Banks <https://paulbanks.org/projects/econet>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the LICENSE file in the project root for full license information.
+ */
+
+// Built-in NetFS fileserver. Serves the files under FILESERVER_ROOT on the
+// user partition straight onto the Econet, so small setups don't need a
+// fileserver on the WiFi at all.
+//
+// Only a core set of operations is provided: logging on, LOAD, SAVE and
+// RUN, the catalogue and file info calls, *DIR and *LIB, and byte access
+// through OPEN, BGET and BPUT. There are no passwords or access control.
+// Load and execute addresses live in a NAME.inf file next to each file.
+// NetFS names can't contain a dot, so the Beebs never see these.
+//
+// Requests arrive from the bridge's Econet RX task and are handled in turn
+// on our own task, so a slow flash write never holds up the bus. Replies go
+// back through the bridge, which owns the transmitter.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_littlefs.h"
+
+#include "fileserver.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define FILESERVER_ROOT "/user/netfs"
+#define FILESERVER_PARTITION "user"
+#define FILESERVER_QUEUE_DEPTH 8
+#define FILESERVER_SESSIONS 8
+#define FILESERVER_FILES 4          // Open files per Beeb
+#define FILESERVER_PATH_MAX 96      // Relative to the root
+#define FILESERVER_NAME_MAX 10
+#define FILESERVER_DIR_MAX 128      // Entries sorted for a catalogue
+#define FILESERVER_BLOCK 1024       // Data block size for LOAD and SAVE
+#define FILESERVER_DATA_PORT 0x97   // SAVE data is sent to us here
+#define FILESERVER_DISC_NAME "NBREAK"
+#define FILESERVER_VERSION "N-Break FS 1.00"
+
+// Access byte: bit 0 public read, bit 1 public write, bit 2 owner read,
+// bit 3 owner write, bit 5 directory
+#define FILESERVER_ACCESS_FILE 0x0D
+#define FILESERVER_ACCESS_DIR 0x20
+
+// Directory handles given out at logon. Every Beeb gets the same three.
+#define FILESERVER_HANDLE_URD 1
+#define FILESERVER_HANDLE_CSD 2
+#define FILESERVER_HANDLE_LIB 3
+#define FILESERVER_HANDLE_FILE 0x10 // First file handle
+
+static const char *TAG = "FILESERVER";
+
+typedef struct
+{
+    FILE *fp; // NULL when the handle is free
+    bool is_read_only;
+    uint8_t last_seq; // Control bit 0 of the last BGET or BPUT, 0xFF before the first
+    uint8_t last_reply[4];
+    uint8_t last_reply_len;
+} fileserver_file_t;
+
+// Everything we know about one Beeb
+typedef struct
+{
+    uint8_t client_id; // 0 when the slot is free
+    uint32_t last_ms;
+    char user[FILESERVER_NAME_MAX + 1];
+    char dirs[3][FILESERVER_PATH_MAX]; // URD, CSD and LIB, relative to the root
+    fileserver_file_t files[FILESERVER_FILES];
+
+    // SAVE waiting for its data
+    FILE *save_fp;
+    char save_path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT)];
+    uint32_t save_load;
+    uint32_t save_exec;
+    uint32_t save_remaining;
+    uint8_t save_reply_port;
+    uint8_t save_ack_port;
+} fileserver_session_t;
+
+typedef struct
+{
+    bool is_dir;
+    uint32_t load;
+    uint32_t exec;
+    uint32_t size;
+    uint8_t access;
+    time_t mtime;
+} fileserver_object_t;
+
+// Work for the fileserver task: 'F' frame from a Beeb, 'R' reset
+typedef struct
+{
+    char type;
+    uint8_t client_id;
+    uint8_t port;
+    uint8_t control;
+    uint16_t length;
+    uint8_t *data;
+} fileserver_item_t;
+
+fileserver_stats_t fileserver_stats;
+
+static fileserver_tx_fn fileserver_tx;
+static QueueHandle_t fileserver_queue;
+static fileserver_session_t fileserver_sessions[FILESERVER_SESSIONS];
+static uint8_t fileserver_block[FILESERVER_BLOCK];
+static uint64_t fileserver_service_total_us;
+
+static uint32_t _fileserver_now_ms(void)
+{
+    return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+static uint32_t _fileserver_get24(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static uint32_t _fileserver_get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t *_fileserver_put24(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    return p + 3;
+}
+
+static uint8_t *_fileserver_put32(uint8_t *p, uint32_t value)
+{
+    _fileserver_put24(p, value);
+    p[3] = value >> 24;
+    return p + 4;
+}
+
+// Space padded, not terminated
+static uint8_t *_fileserver_put_padded(uint8_t *p, const char *text, size_t width)
+{
+    size_t length = MIN(strlen(text), width);
+    memcpy(p, text, length);
+    memset(p + length, ' ', width - length);
+    return p + width;
+}
+
+// Acorn fileserver date: day, month and years since 1981 in two bytes
+static uint8_t *_fileserver_put_date(uint8_t *p, time_t t)
+{
+    struct tm tm;
+    localtime_r(&t, &tm);
+    int year = MAX(tm.tm_year + 1900 - 1981, 0);
+    p[0] = tm.tm_mday | ((year & 0x70) << 1);
+    p[1] = (tm.tm_mon + 1) | ((year & 0x0F) << 4);
+    return p + 2;
+}
+
+// A CR terminated string from a request, without leading spaces
+static void _fileserver_text(const uint8_t *data, size_t length, char *text, size_t text_size)
+{
+    while (length > 0 && *data == ' ')
+    {
+        data++;
+        length--;
+    }
+    size_t n = 0;
+    while (n < length && n < text_size - 1 && data[n] != '\r' && data[n] != '\0')
+    {
+        text[n] = data[n];
+        n++;
+    }
+    text[n] = '\0';
+}
+
+static bool _fileserver_send(uint8_t client_id, uint8_t port, const uint8_t *data, size_t length)
+{
+    if (!fileserver_tx(client_id, port, 0x80, data, length, false))
+    {
+        ESP_LOGW(TAG, "Frame to station %d lost", client_id);
+        return false;
+    }
+    return true;
+}
+
+// For the frames of a transfer, where one going missing spoils the file.
+// Waits until the client has taken it.
+static bool _fileserver_send_block(uint8_t client_id, uint8_t port, const uint8_t *data, size_t length)
+{
+    if (!fileserver_tx(client_id, port, 0x80, data, length, true))
+    {
+        ESP_LOGW(TAG, "Block to station %d lost", client_id);
+        return false;
+    }
+    return true;
+}
+
+static void _fileserver_error(uint8_t client_id, uint8_t reply_port, uint8_t code)
+{
+    const char *message;
+    switch (code)
+    {
+    case NETFS_ERR_DIR_NOT_EMPTY:
+        message = "Dir. not empty";
+        break;
+    case NETFS_ERR_ACCESS:
+        message = "Insufficient access";
+        break;
+    case NETFS_ERR_WRONG_TYPE:
+        message = "Wrong type";
+        break;
+    case NETFS_ERR_TOO_MANY_OPEN:
+        message = "Too many open files";
+        break;
+    case NETFS_ERR_DISC_FULL:
+        message = "Disc full";
+        break;
+    case NETFS_ERR_DISC_FAULT:
+        message = "Disc fault";
+        break;
+    case NETFS_ERR_BAD_NAME:
+        message = "Bad name";
+        break;
+    case NETFS_ERR_NOT_FOUND:
+        message = "Not found";
+        break;
+    case NETFS_ERR_CHANNEL:
+        message = "Channel";
+        break;
+    case NETFS_ERR_NOT_LISTENING:
+        message = "Not listening";
+        break;
+    default:
+        message = "Bad command";
+        break;
+    }
+
+    uint8_t reply[32] = {0, code};
+    size_t length = 2 + snprintf((char *)reply + 2, sizeof(reply) - 3, "%s", message);
+    reply[length++] = '\r';
+    fileserver_stats.error_count++;
+    _fileserver_send(client_id, reply_port, reply, length);
+}
+
+static void _fileserver_ok(uint8_t client_id, uint8_t reply_port)
+{
+    uint8_t reply[2] = {0, 0};
+    _fileserver_send(client_id, reply_port, reply, sizeof(reply));
+}
+
+// Reply to a CLI command with a code telling the client what to do next
+static void _fileserver_cli_reply(uint8_t client_id, uint8_t reply_port, uint8_t code, const char *text)
+{
+    uint8_t reply[84] = {code, 0};
+    size_t length = 2 + snprintf((char *)reply + 2, sizeof(reply) - 3, "%s", text);
+    reply[length++] = '\r';
+    _fileserver_send(client_id, reply_port, reply, length);
+}
+
+static void _fileserver_path(const char *rel, char *path, size_t path_size)
+{
+    snprintf(path, path_size, "%s%s%s", FILESERVER_ROOT, rel[0] != '\0' ? "/" : "", rel);
+}
+
+// NAME.inf holds the load and execute addresses, as "NAME LOAD EXEC"
+static void _fileserver_read_addresses(const char *path, uint32_t *load, uint32_t *exec)
+{
+    *load = 0;
+    *exec = 0;
+
+    char inf[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT) + 4];
+    snprintf(inf, sizeof(inf), "%s.inf", path);
+    FILE *fp = fopen(inf, "r");
+    if (fp == NULL)
+    {
+        return;
+    }
+    unsigned long l, e;
+    if (fscanf(fp, "%*s %lx %lx", &l, &e) == 2)
+    {
+        *load = l;
+        *exec = e;
+    }
+    fclose(fp);
+}
+
+static void _fileserver_write_addresses(const char *path, uint32_t load, uint32_t exec)
+{
+    char inf[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT) + 4];
+    snprintf(inf, sizeof(inf), "%s.inf", path);
+    FILE *fp = fopen(inf, "w");
+    if (fp == NULL)
+    {
+        ESP_LOGW(TAG, "Unable to write %s", inf);
+        return;
+    }
+    fprintf(fp, "%s %08lX %08lX\n", strrchr(path, '/') + 1, (unsigned long)load, (unsigned long)exec);
+    fclose(fp);
+}
+
+static bool _fileserver_stat(const char *path, fileserver_object_t *obj)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        return false;
+    }
+    memset(obj, 0, sizeof(*obj));
+    obj->is_dir = S_ISDIR(st.st_mode);
+    obj->access = obj->is_dir ? FILESERVER_ACCESS_DIR : FILESERVER_ACCESS_FILE;
+    obj->mtime = st.st_mtime;
+    if (!obj->is_dir)
+    {
+        obj->size = st.st_size;
+        _fileserver_read_addresses(path, &obj->load, &obj->exec);
+    }
+    return true;
+}
+
+// Case insensitive, with the NetFS wildcards: # any character, * any run
+static bool _fileserver_match(const char *pattern, const char *name)
+{
+    for (; *pattern != '\0'; pattern++, name++)
+    {
+        if (*pattern == '*')
+        {
+            for (;; name++)
+            {
+                if (_fileserver_match(pattern + 1, name))
+                {
+                    return true;
+                }
+                if (*name == '\0')
+                {
+                    return false;
+                }
+            }
+        }
+        if (*name == '\0' ||
+            (*pattern != '#' && toupper((unsigned char)*pattern) != toupper((unsigned char)*name)))
+        {
+            return false;
+        }
+    }
+    return *name == '\0';
+}
+
+// Names the Beebs can see: no dots, and short enough
+static bool _fileserver_visible(const char *name)
+{
+    return name[0] != '\0' && strchr(name, '.') == NULL && strlen(name) <= FILESERVER_NAME_MAX;
+}
+
+static bool _fileserver_find(const char *rel, const char *pattern, char *found)
+{
+    char path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT)];
+    _fileserver_path(rel, path, sizeof(path));
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return false;
+    }
+    bool is_found = false;
+    struct dirent *de;
+    while (!is_found && (de = readdir(dir)) != NULL)
+    {
+        if (_fileserver_visible(de->d_name) && _fileserver_match(pattern, de->d_name))
+        {
+            strcpy(found, de->d_name);
+            is_found = true;
+        }
+    }
+    closedir(dir);
+    return is_found;
+}
+
+static const char *_fileserver_dir(fileserver_session_t *session, uint8_t handle)
+{
+    if (handle >= FILESERVER_HANDLE_URD && handle <= FILESERVER_HANDLE_LIB)
+    {
+        return session->dirs[handle - FILESERVER_HANDLE_URD];
+    }
+    return "";
+}
+
+// Turn a NetFS name, relative to a directory handle, into a path relative
+// to the root. Only the last part may be missing, and only when creating.
+static uint8_t _fileserver_resolve(fileserver_session_t *session, uint8_t dir_handle, const char *name,
+                                   bool must_exist, char *rel, size_t rel_size)
+{
+    char work[FILESERVER_PATH_MAX];
+    snprintf(work, sizeof(work), "%s", name);
+    work[strcspn(work, " ")] = '\0';
+    snprintf(rel, rel_size, "%s", _fileserver_dir(session, dir_handle));
+
+    // There's only the one disc
+    char *part = work;
+    if (*part == ':')
+    {
+        char *dot = strchr(part, '.');
+        part = dot != NULL ? dot + 1 : part + strlen(part);
+        rel[0] = '\0';
+    }
+
+    while (*part != '\0')
+    {
+        char *dot = strchr(part, '.');
+        if (dot != NULL)
+        {
+            *dot = '\0';
+        }
+        bool is_last = dot == NULL;
+
+        if (!strcmp(part, "$"))
+        {
+            rel[0] = '\0';
+        }
+        else if (!strcmp(part, "&"))
+        {
+            snprintf(rel, rel_size, "%s", session->dirs[0]);
+        }
+        else if (!strcmp(part, "^"))
+        {
+            char *slash = strrchr(rel, '/');
+            *(slash != NULL ? slash : rel) = '\0';
+        }
+        else if (strcmp(part, "@") != 0)
+        {
+            if (strlen(part) > FILESERVER_NAME_MAX || strpbrk(part, "/\\:\"") != NULL)
+            {
+                return NETFS_ERR_BAD_NAME;
+            }
+            char found[FILESERVER_NAME_MAX + 1];
+            if (!_fileserver_find(rel, part, found))
+            {
+                if (!is_last || must_exist || strpbrk(part, "#*") != NULL)
+                {
+                    return NETFS_ERR_NOT_FOUND;
+                }
+                strcpy(found, part);
+            }
+            size_t length = strlen(rel);
+            if (length + 1 + strlen(found) >= rel_size)
+            {
+                return NETFS_ERR_BAD_NAME;
+            }
+            snprintf(rel + length, rel_size - length, "%s%s", length > 0 ? "/" : "", found);
+        }
+        part = is_last ? part + strlen(part) : dot + 1;
+    }
+    return 0;
+}
+
+// Resolve a name that has to be an existing directory
+static uint8_t _fileserver_resolve_dir(fileserver_session_t *session, uint8_t dir_handle, const char *name,
+                                       char *rel, size_t rel_size)
+{
+    uint8_t rc = _fileserver_resolve(session, dir_handle, name, true, rel, rel_size);
+    if (rc != 0)
+    {
+        return rc;
+    }
+    char path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT)];
+    fileserver_object_t obj;
+    _fileserver_path(rel, path, sizeof(path));
+    if (!_fileserver_stat(path, &obj))
+    {
+        return NETFS_ERR_NOT_FOUND;
+    }
+    return obj.is_dir ? 0 : NETFS_ERR_WRONG_TYPE;
+}
+
+static const char *_fileserver_leaf(const char *rel)
+{
+    const char *slash = strrchr(rel, '/');
+    return slash != NULL ? slash + 1 : rel[0] != '\0' ? rel : "$";
+}
+
+static void _fileserver_close_files(fileserver_session_t *session)
+{
+    for (int i = 0; i < ARRAY_SIZE(session->files); i++)
+    {
+        if (session->files[i].fp != NULL)
+        {
+            fclose(session->files[i].fp);
+            session->files[i].fp = NULL;
+        }
+    }
+    if (session->save_fp != NULL)
+    {
+        fclose(session->save_fp);
+        session->save_fp = NULL;
+        unlink(session->save_path);
+    }
+}
+
+static void _fileserver_session_free(fileserver_session_t *session)
+{
+    _fileserver_close_files(session);
+    memset(session, 0, sizeof(*session));
+}
+
+static fileserver_session_t *_fileserver_session_find(uint8_t client_id)
+{
+    for (int i = 0; i < ARRAY_SIZE(fileserver_sessions); i++)
+    {
+        if (fileserver_sessions[i].client_id == client_id)
+        {
+            return &fileserver_sessions[i];
+        }
+    }
+    return NULL;
+}
+
+// The Beeb's session, made if need be. There's no password, so a Beeb that
+// never logged on is treated as if it had, with the root as its home.
+static fileserver_session_t *_fileserver_session(uint8_t client_id)
+{
+    fileserver_session_t *session = _fileserver_session_find(client_id);
+    if (session == NULL)
+    {
+        session = _fileserver_session_find(0);
+    }
+    if (session == NULL)
+    {
+        session = &fileserver_sessions[0];
+        for (int i = 1; i < ARRAY_SIZE(fileserver_sessions); i++)
+        {
+            if (fileserver_sessions[i].last_ms < session->last_ms)
+            {
+                session = &fileserver_sessions[i];
+            }
+        }
+        ESP_LOGW(TAG, "Out of sessions. Station %d logged off.", session->client_id);
+        _fileserver_session_free(session);
+    }
+    if (session->client_id == 0)
+    {
+        session->client_id = client_id;
+        for (int i = 0; i < ARRAY_SIZE(session->files); i++)
+        {
+            session->files[i].last_seq = 0xFF;
+        }
+    }
+    session->last_ms = _fileserver_now_ms();
+    return session;
+}
+
+static fileserver_file_t *_fileserver_file(fileserver_session_t *session, uint8_t handle)
+{
+    int index = handle - FILESERVER_HANDLE_FILE;
+    if (index < 0 || index >= ARRAY_SIZE(session->files) || session->files[index].fp == NULL)
+    {
+        return NULL;
+    }
+    return &session->files[index];
+}
+
+static uint32_t _fileserver_extent(FILE *fp)
+{
+    long pos = ftell(fp);
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, pos, SEEK_SET);
+    return size;
+}
+
+static uint8_t _fileserver_logon(fileserver_session_t *session, uint8_t reply_port, const char *user)
+{
+    _fileserver_close_files(session);
+    snprintf(session->user, sizeof(session->user), "%.*s", (int)strcspn(user, " "), user);
+
+    // Home is the directory named after the user, if there is one
+    char found[FILESERVER_NAME_MAX + 1];
+    if (session->user[0] != '\0' && _fileserver_find("", session->user, found))
+    {
+        snprintf(session->dirs[0], sizeof(session->dirs[0]), "%s", found);
+    }
+    else
+    {
+        session->dirs[0][0] = '\0';
+    }
+    strcpy(session->dirs[1], session->dirs[0]);
+    if (_fileserver_find("", "LIBRARY", found))
+    {
+        snprintf(session->dirs[2], sizeof(session->dirs[2]), "%s", found);
+    }
+    else
+    {
+        session->dirs[2][0] = '\0';
+    }
+
+    ESP_LOGI(TAG, "Station %d logged on as %s", session->client_id, session->user);
+    uint8_t reply[] = {NETFS_CLI_LOGON, 0,
+                       FILESERVER_HANDLE_URD, FILESERVER_HANDLE_CSD, FILESERVER_HANDLE_LIB, 0};
+    _fileserver_send(session->client_id, reply_port, reply, sizeof(reply));
+    return 0;
+}
+
+static uint8_t _fileserver_delete(fileserver_session_t *session, uint8_t reply_port, uint8_t dir_handle,
+                                  const char *name)
+{
+    char rel[FILESERVER_PATH_MAX];
+    uint8_t rc = _fileserver_resolve(session, dir_handle, name, true, rel, sizeof(rel));
+    if (rc != 0)
+    {
+        return rc;
+    }
+    if (rel[0] == '\0')
+    {
+        return NETFS_ERR_BAD_NAME;
+    }
+
+    char path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT)];
+    char inf[sizeof(path) + 4];
+    fileserver_object_t obj;
+    _fileserver_path(rel, path, sizeof(path));
+    if (!_fileserver_stat(path, &obj))
+    {
+        return NETFS_ERR_NOT_FOUND;
+    }
+    if (obj.is_dir)
+    {
+        if (rmdir(path) != 0)
+        {
+            return NETFS_ERR_DIR_NOT_EMPTY;
+        }
+    }
+    else
+    {
+        if (unlink(path) != 0)
+        {
+            return NETFS_ERR_DISC_FAULT;
+        }
+        snprintf(inf, sizeof(inf), "%s.inf", path);
+        unlink(inf);
+    }
+    _fileserver_ok(session->client_id, reply_port);
+    return 0;
+}
+
+static uint8_t _fileserver_cdir(fileserver_session_t *session, uint8_t reply_port, uint8_t dir_handle,
+                                const char *name)
+{
+    char rel[FILESERVER_PATH_MAX];
+    uint8_t rc = _fileserver_resolve(session, dir_handle, name, false, rel, sizeof(rel));
+    if (rc != 0)
+    {
+        return rc;
+    }
+    char path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT)];
+    _fileserver_path(rel, path, sizeof(path));
+    if (mkdir(path, 0775) != 0)
+    {
+        return NETFS_ERR_DISC_FAULT;
+    }
+    _fileserver_ok(session->client_id, reply_port);
+    return 0;
+}
+
+static uint8_t _fileserver_rename(fileserver_session_t *session, uint8_t reply_port, uint8_t dir_handle,
+                                  char *args)
+{
+    char *to = args + strcspn(args, " ");
+    if (*to == '\0')
+    {
+        return NETFS_ERR_BAD_NAME;
+    }
+    *to++ = '\0';
+    while (*to == ' ')
+    {
+        to++;
+    }
+
+    char from_rel[FILESERVER_PATH_MAX];
+    char to_rel[FILESERVER_PATH_MAX];
+    uint8_t rc = _fileserver_resolve(session, dir_handle, args, true, from_rel, sizeof(from_rel));
+    if (rc == 0)
+    {
+        rc = _fileserver_resolve(session, dir_handle, to, false, to_rel, sizeof(to_rel));
+    }
+    if (rc != 0)
+    {
+        return rc;
+    }
+
+    char from_path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT) + 4];
+    char to_path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT) + 4];
+    _fileserver_path(from_rel, from_path, sizeof(from_path));
+    _fileserver_path(to_rel, to_path, sizeof(to_path));
+    if (rename(from_path, to_path) != 0)
+    {
+        return NETFS_ERR_DISC_FAULT;
+    }
+    strcat(from_path, ".inf");
+    strcat(to_path, ".inf");
+    rename(from_path, to_path);
+    _fileserver_ok(session->client_id, reply_port);
+    return 0;
+}
+
+static uint8_t _fileserver_cli(fileserver_session_t *session, const uint8_t *req, size_t length)
+{
+    uint8_t reply_port = req[0];
+    char line[80];
+    _fileserver_text(req + 5, length - 5, line, sizeof(line));
+
+    // Split the command from its arguments. "I." and "." are the only
+    // abbreviations we know.
+    char *cmd = line;
+    while (*cmd == '*' || *cmd == ' ')
+    {
+        cmd++;
+    }
+    char *args = cmd + strcspn(cmd, " .");
+    bool is_dot = *args == '.';
+    if (*args != '\0')
+    {
+        *args++ = '\0';
+    }
+    while (*args == ' ')
+    {
+        args++;
+    }
+
+    if (!strcasecmp(cmd, "I") && (is_dot || !strncasecmp(args, "AM ", 3)))
+    {
+        return _fileserver_logon(session, reply_port, is_dot ? args : args + 3 + strspn(args + 3, " "));
+    }
+    if (!strcasecmp(cmd, "BYE"))
+    {
+        ESP_LOGI(TAG, "Station %d logged off", session->client_id);
+        _fileserver_ok(session->client_id, reply_port);
+        _fileserver_session_free(session);
+        return 0;
+    }
+    if ((cmd[0] == '\0' && is_dot) || !strcasecmp(cmd, "CAT") || !strcasecmp(cmd, "EX"))
+    {
+        _fileserver_cli_reply(session->client_id, reply_port, NETFS_CLI_CAT, args);
+        return 0;
+    }
+    if (!strcasecmp(cmd, "INFO"))
+    {
+        _fileserver_cli_reply(session->client_id, reply_port, NETFS_CLI_INFO, args);
+        return 0;
+    }
+    if (!strcasecmp(cmd, "LOAD"))
+    {
+        _fileserver_cli_reply(session->client_id, reply_port, NETFS_CLI_LOAD, args);
+        return 0;
+    }
+    if (!strcasecmp(cmd, "SAVE"))
+    {
+        _fileserver_cli_reply(session->client_id, reply_port, NETFS_CLI_SAVE, args);
+        return 0;
+    }
+    if (!strcasecmp(cmd, "DIR") || !strcasecmp(cmd, "LIB"))
+    {
+        bool is_lib = !strcasecmp(cmd, "LIB");
+        char rel[FILESERVER_PATH_MAX];
+        uint8_t rc = _fileserver_resolve_dir(session, req[3], args[0] != '\0' ? args : "&", rel, sizeof(rel));
+        if (rc != 0)
+        {
+            return rc;
+        }
+        uint8_t handle = is_lib ? FILESERVER_HANDLE_LIB : FILESERVER_HANDLE_CSD;
+        strcpy(session->dirs[handle - FILESERVER_HANDLE_URD], rel);
+        uint8_t reply[] = {is_lib ? NETFS_CLI_LIB : NETFS_CLI_DIR, 0, handle};
+        _fileserver_send(session->client_id, reply_port, reply, sizeof(reply));
+        return 0;
+    }
+    if (!strcasecmp(cmd, "SDISC"))
+    {
+        uint8_t reply[] = {NETFS_CLI_SDISC, 0,
+                           FILESERVER_HANDLE_URD, FILESERVER_HANDLE_CSD, FILESERVER_HANDLE_LIB};
+        _fileserver_send(session->client_id, reply_port, reply, sizeof(reply));
+        return 0;
+    }
+    if (!strcasecmp(cmd, "DELETE"))
+    {
+        return _fileserver_delete(session, reply_port, req[3], args);
+    }
+    if (!strcasecmp(cmd, "CDIR"))
+    {
+        return _fileserver_cdir(session, reply_port, req[3], args);
+    }
+    if (!strcasecmp(cmd, "RENAME"))
+    {
+        return _fileserver_rename(session, reply_port, req[3], args);
+    }
+    if (!strcasecmp(cmd, "ACCESS") || !strcasecmp(cmd, "PASS"))
+    {
+        _fileserver_ok(session->client_id, reply_port);
+        return 0;
+    }
+
+    // Anything else is a file to *RUN from the library
+    _fileserver_text(req + 5, length - 5, line, sizeof(line));
+    _fileserver_cli_reply(session->client_id, reply_port, NETFS_CLI_RUN, line);
+    return 0;
+}
+
+// LOAD and RUN: the file's details, the data in blocks to the client's
+// data port, then a final reply
+static uint8_t _fileserver_load(fileserver_session_t *session, const uint8_t *req, size_t length, bool is_run)
+{
+    if (length < 7)
+    {
+        return NETFS_ERR_BAD_COMMAND;
+    }
+    char name[FILESERVER_PATH_MAX];
+    char rel[FILESERVER_PATH_MAX];
+    _fileserver_text(req + 6, length - 6, name, sizeof(name));
+    uint8_t rc = _fileserver_resolve(session, req[3], name, true, rel, sizeof(rel));
+    if (rc == NETFS_ERR_NOT_FOUND && is_run)
+    {
+        rc = _fileserver_resolve(session, req[4], name, true, rel, sizeof(rel));
+    }
+    if (rc != 0)
+    {
+        return rc;
+    }
+
+    char path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT)];
+    fileserver_object_t obj;
+    _fileserver_path(rel, path, sizeof(path));
+    if (!_fileserver_stat(path, &obj))
+    {
+        return NETFS_ERR_NOT_FOUND;
+    }
+    if (obj.is_dir)
+    {
+        return NETFS_ERR_WRONG_TYPE;
+    }
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        return NETFS_ERR_DISC_FAULT;
+    }
+
+    uint8_t header[16] = {0, 0};
+    uint8_t *p = _fileserver_put32(header + 2, obj.load);
+    p = _fileserver_put32(p, obj.exec);
+    p = _fileserver_put24(p, obj.size);
+    *p++ = obj.access;
+    _fileserver_put_date(p, obj.mtime);
+    _fileserver_send(session->client_id, req[0], header, sizeof(header));
+
+    size_t n;
+    bool is_sent = true;
+    while (is_sent && (n = fread(fileserver_block, 1, sizeof(fileserver_block), fp)) > 0)
+    {
+        is_sent = _fileserver_send_block(session->client_id, req[5], fileserver_block, n);
+    }
+    fclose(fp);
+    if (!is_sent)
+    {
+        ESP_LOGW(TAG, "%s %s for station %d abandoned", is_run ? "RUN" : "LOAD", rel, session->client_id);
+        return NETFS_ERR_NOT_LISTENING;
+    }
+    _fileserver_ok(session->client_id, req[0]);
+
+    ESP_LOGI(TAG, "%s %s (%lu bytes) for station %d", is_run ? "RUN" : "LOAD", rel,
+             (unsigned long)obj.size, session->client_id);
+    return 0;
+}
+
+// Give up on a SAVE, leaving nothing half written behind
+static void _fileserver_save_abort(fileserver_session_t *session, uint8_t code)
+{
+    fclose(session->save_fp);
+    session->save_fp = NULL;
+    unlink(session->save_path);
+    _fileserver_error(session->client_id, session->save_reply_port, code);
+}
+
+static void _fileserver_save_finish(fileserver_session_t *session)
+{
+    fclose(session->save_fp);
+    session->save_fp = NULL;
+    _fileserver_write_addresses(session->save_path, session->save_load, session->save_exec);
+
+    uint8_t reply[5] = {0, 0, FILESERVER_ACCESS_FILE};
+    _fileserver_put_date(reply + 3, time(NULL));
+    _fileserver_send(session->client_id, session->save_reply_port, reply, sizeof(reply));
+    ESP_LOGI(TAG, "Saved %s for station %d", session->save_path, session->client_id);
+}
+
+// SAVE and CREATE. SAVE's data follows to FILESERVER_DATA_PORT.
+static uint8_t _fileserver_save(fileserver_session_t *session, const uint8_t *req, size_t length, bool is_create)
+{
+    if (length < 18)
+    {
+        return NETFS_ERR_BAD_COMMAND;
+    }
+    char name[FILESERVER_PATH_MAX];
+    char rel[FILESERVER_PATH_MAX];
+    _fileserver_text(req + 17, length - 17, name, sizeof(name));
+    uint8_t rc = _fileserver_resolve(session, req[3], name, false, rel, sizeof(rel));
+    if (rc != 0)
+    {
+        return rc;
+    }
+
+    // A SAVE that never finished is abandoned
+    if (session->save_fp != NULL)
+    {
+        fclose(session->save_fp);
+        session->save_fp = NULL;
+        unlink(session->save_path);
+    }
+
+    fileserver_object_t obj;
+    _fileserver_path(rel, session->save_path, sizeof(session->save_path));
+    if (_fileserver_stat(session->save_path, &obj) && obj.is_dir)
+    {
+        return NETFS_ERR_WRONG_TYPE;
+    }
+    session->save_fp = fopen(session->save_path, "wb");
+    if (session->save_fp == NULL)
+    {
+        return NETFS_ERR_DISC_FAULT;
+    }
+    session->save_reply_port = req[0];
+    session->save_ack_port = req[5];
+    session->save_load = _fileserver_get32(req + 6);
+    session->save_exec = _fileserver_get32(req + 10);
+    session->save_remaining = _fileserver_get24(req + 14);
+
+    if (is_create)
+    {
+        if (session->save_remaining > 0)
+        {
+            fseek(session->save_fp, session->save_remaining - 1, SEEK_SET);
+            fputc(0, session->save_fp);
+        }
+        session->save_remaining = 0;
+    }
+    else
+    {
+        uint8_t reply[] = {0, 0, FILESERVER_DATA_PORT, FILESERVER_BLOCK & 0xFF, FILESERVER_BLOCK >> 8};
+        if (!_fileserver_send_block(session->client_id, req[0], reply, sizeof(reply)))
+        {
+            _fileserver_save_abort(session, NETFS_ERR_NOT_LISTENING);
+            return 0;
+        }
+    }
+    if (session->save_remaining == 0)
+    {
+        _fileserver_save_finish(session);
+    }
+    return 0;
+}
+
+// A block of SAVE data. Every block but the last is acknowledged on the
+// client's ack port.
+static void _fileserver_save_data(fileserver_session_t *session, const uint8_t *data, size_t length)
+{
+    if (session == NULL || session->save_fp == NULL)
+    {
+        return;
+    }
+    size_t n = MIN(length, session->save_remaining);
+    if (fwrite(data, 1, n, session->save_fp) != n)
+    {
+        _fileserver_save_abort(session, NETFS_ERR_DISC_FULL);
+        return;
+    }
+    session->save_remaining -= n;
+    if (session->save_remaining > 0)
+    {
+        // Without this the client never sends the next block
+        uint8_t ack = 0;
+        if (!_fileserver_send_block(session->client_id, session->save_ack_port, &ack, 1))
+        {
+            _fileserver_save_abort(session, NETFS_ERR_NOT_LISTENING);
+        }
+    }
+    else
+    {
+        _fileserver_save_finish(session);
+    }
+}
+
+static uint8_t _fileserver_open(fileserver_session_t *session, const uint8_t *req, size_t length)
+{
+    if (length < 8)
+    {
+        return NETFS_ERR_BAD_COMMAND;
+    }
+    bool must_exist = req[5] != 0;
+    bool is_read_only = req[6] != 0;
+
+    char name[FILESERVER_PATH_MAX];
+    char rel[FILESERVER_PATH_MAX];
+    _fileserver_text(req + 7, length - 7, name, sizeof(name));
+    uint8_t rc = _fileserver_resolve(session, req[3], name, must_exist, rel, sizeof(rel));
+    if (rc != 0)
+    {
+        return rc;
+    }
+
+    int index = 0;
+    while (index < ARRAY_SIZE(session->files) && session->files[index].fp != NULL)
+    {
+        index++;
+    }
+    if (index == ARRAY_SIZE(session->files))
+    {
+        return NETFS_ERR_TOO_MANY_OPEN;
+    }
+
+    char path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT)];
+    fileserver_object_t obj;
+    _fileserver_path(rel, path, sizeof(path));
+    if (_fileserver_stat(path, &obj) && obj.is_dir)
+    {
+        return NETFS_ERR_WRONG_TYPE;
+    }
+
+    // OPENIN, OPENUP and OPENOUT
+    fileserver_file_t *file = &session->files[index];
+    file->fp = fopen(path, is_read_only ? "rb" : must_exist ? "r+b" : "w+b");
+    if (file->fp == NULL)
+    {
+        return must_exist ? NETFS_ERR_NOT_FOUND : NETFS_ERR_DISC_FAULT;
+    }
+    file->is_read_only = is_read_only;
+    file->last_seq = 0xFF;
+
+    uint8_t reply[] = {0, 0, FILESERVER_HANDLE_FILE + index};
+    _fileserver_send(session->client_id, req[0], reply, sizeof(reply));
+    return 0;
+}
+
+static uint8_t _fileserver_close(fileserver_session_t *session, const uint8_t *req, size_t length)
+{
+    if (length < 6)
+    {
+        return NETFS_ERR_BAD_COMMAND;
+    }
+    if (req[5] == 0)
+    {
+        for (int i = 0; i < ARRAY_SIZE(session->files); i++)
+        {
+            if (session->files[i].fp != NULL)
+            {
+                fclose(session->files[i].fp);
+                session->files[i].fp = NULL;
+            }
+        }
+    }
+    else
+    {
+        fileserver_file_t *file = _fileserver_file(session, req[5]);
+        if (file == NULL)
+        {
+            return NETFS_ERR_CHANNEL;
+        }
+        fclose(file->fp);
+        file->fp = NULL;
+    }
+    _fileserver_ok(session->client_id, req[0]);
+    return 0;
+}
+
+// BGET and BPUT carry the handle straight after the function code. Bit 0
+// of the control byte alternates, so a repeat can be answered again without
+// moving the file pointer.
+static uint8_t _fileserver_byte(fileserver_session_t *session, const uint8_t *req, size_t length,
+                                uint8_t control)
+{
+    bool is_put = req[1] == NETFS_FN_PUTBYTE;
+    fileserver_file_t *file = _fileserver_file(session, req[2]);
+    if (file == NULL)
+    {
+        return NETFS_ERR_CHANNEL;
+    }
+    if (is_put && (length < 4 || file->is_read_only))
+    {
+        return length < 4 ? NETFS_ERR_BAD_COMMAND : NETFS_ERR_ACCESS;
+    }
+
+    uint8_t seq = control & 1;
+    if (seq != file->last_seq)
+    {
+        file->last_seq = seq;
+        file->last_reply[0] = 0;
+        file->last_reply[1] = 0;
+        if (is_put)
+        {
+            if (fputc(req[3], file->fp) == EOF)
+            {
+                file->last_seq = 0xFF;
+                return NETFS_ERR_DISC_FULL;
+            }
+            file->last_reply_len = 2;
+        }
+        else
+        {
+            // Flag 0x80 is the last byte of the file, 0xC0 is past the end
+            int c = fgetc(file->fp);
+            int next = c != EOF ? fgetc(file->fp) : EOF;
+            if (next != EOF)
+            {
+                ungetc(next, file->fp);
+            }
+            file->last_reply[2] = c != EOF ? c : 0xFE;
+            file->last_reply[3] = c == EOF ? 0xC0 : next == EOF ? 0x80 : 0x00;
+            file->last_reply_len = 4;
+        }
+    }
+    _fileserver_send(session->client_id, req[0], file->last_reply, file->last_reply_len);
+    return 0;
+}
+
+// PTR#, EXT# and EOF#
+static uint8_t _fileserver_args(fileserver_session_t *session, const uint8_t *req, size_t length)
+{
+    if (length < 6)
+    {
+        return NETFS_ERR_BAD_COMMAND;
+    }
+    fileserver_file_t *file = _fileserver_file(session, req[5]);
+    if (file == NULL)
+    {
+        return NETFS_ERR_CHANNEL;
+    }
+
+    uint8_t reply[5] = {0, 0};
+    size_t reply_len = 2;
+    switch (req[1])
+    {
+    case NETFS_FN_READ_ARGS:
+        if (length < 7)
+        {
+            return NETFS_ERR_BAD_COMMAND;
+        }
+        _fileserver_put24(reply + 2, req[6] == 0 ? ftell(file->fp) : _fileserver_extent(file->fp));
+        reply_len = 5;
+        break;
+    case NETFS_FN_SET_ARGS:
+        if (length < 10)
+        {
+            return NETFS_ERR_BAD_COMMAND;
+        }
+        if (req[6] == 0)
+        {
+            fseek(file->fp, _fileserver_get24(req + 7), SEEK_SET);
+        }
+        else if (!file->is_read_only)
+        {
+            fflush(file->fp);
+            ftruncate(fileno(file->fp), _fileserver_get24(req + 7));
+        }
+        break;
+    default: // NETFS_FN_EOF
+        reply[2] = ftell(file->fp) >= _fileserver_extent(file->fp) ? 0xFF : 0x00;
+        reply_len = 3;
+        break;
+    }
+    _fileserver_send(session->client_id, req[0], reply, reply_len);
+    return 0;
+}
+
+static int _fileserver_compare(const void *a, const void *b)
+{
+    return strcasecmp(a, b);
+}
+
+// Directory entries the Beebs can see, sorted. Returns the count.
+static int _fileserver_list(const char *path, char (*names)[FILESERVER_NAME_MAX + 1], int max_names)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+    int count = 0;
+    struct dirent *de;
+    while (count < max_names && (de = readdir(dir)) != NULL)
+    {
+        if (_fileserver_visible(de->d_name))
+        {
+            strcpy(names[count++], de->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(names[0]), _fileserver_compare);
+    return count;
+}
+
+// One catalogue entry in the format asked for. Returns its length, or 0 if
+// it won't fit.
+static size_t _fileserver_examine_entry(uint8_t *p, size_t space, uint8_t arg, const char *name,
+                                        const fileserver_object_t *obj)
+{
+    const char *access = obj->is_dir ? "DL/" : "WR/r";
+    switch (arg)
+    {
+    case 0: // Machine readable
+        if (space < 27)
+        {
+            return 0;
+        }
+        p = _fileserver_put_padded(p, name, FILESERVER_NAME_MAX);
+        p = _fileserver_put32(p, obj->load);
+        p = _fileserver_put32(p, obj->exec);
+        *p++ = obj->access;
+        p = _fileserver_put_date(p, obj->mtime);
+        p = _fileserver_put24(p, 0);
+        _fileserver_put24(p, obj->size);
+        return 27;
+    case 1: // As *EX prints it
+    {
+        struct tm tm;
+        localtime_r(&obj->mtime, &tm);
+        char text[64];
+        int length = snprintf(text, sizeof(text), "%-10s %08lX %08lX   %06lX %-6s %02d:%02d:%02d",
+                              name, (unsigned long)obj->load, (unsigned long)obj->exec,
+                              (unsigned long)obj->size, access, tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+        if (space < length + 1)
+        {
+            return 0;
+        }
+        memcpy(p, text, length + 1);
+        return length + 1;
+    }
+    case 2: // Name only
+        if (space < FILESERVER_NAME_MAX + 1)
+        {
+            return 0;
+        }
+        *p++ = FILESERVER_NAME_MAX;
+        _fileserver_put_padded(p, name, FILESERVER_NAME_MAX);
+        return FILESERVER_NAME_MAX + 1;
+    default: // Name and access
+        if (space < FILESERVER_NAME_MAX + 7)
+        {
+            return 0;
+        }
+        p = _fileserver_put_padded(p, name, FILESERVER_NAME_MAX);
+        *p++ = ' ';
+        _fileserver_put_padded(p, access, 6);
+        return FILESERVER_NAME_MAX + 7;
+    }
+}
+
+static uint8_t _fileserver_examine(fileserver_session_t *session, const uint8_t *req, size_t length)
+{
+    if (length < 8)
+    {
+        return NETFS_ERR_BAD_COMMAND;
+    }
+    uint8_t arg = req[5];
+    uint8_t start = req[6];
+    uint8_t count = req[7];
+
+    char name[FILESERVER_PATH_MAX];
+    char rel[FILESERVER_PATH_MAX];
+    _fileserver_text(req + 8, length - 8, name, sizeof(name));
+    uint8_t rc = _fileserver_resolve_dir(session, req[3], name, rel, sizeof(rel));
+    if (rc != 0)
+    {
+        return rc;
+    }
+
+    char (*names)[FILESERVER_NAME_MAX + 1] = malloc(FILESERVER_DIR_MAX * sizeof(*names));
+    if (names == NULL)
+    {
+        return NETFS_ERR_DISC_FAULT;
+    }
+    char path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT) + FILESERVER_NAME_MAX + 1];
+    _fileserver_path(rel, path, sizeof(path));
+    int total = _fileserver_list(path, names, FILESERVER_DIR_MAX);
+
+    // Entry count, directory cycle number, the entries
+    uint8_t *reply = fileserver_block;
+    size_t reply_len = 4;
+    reply[0] = 0;
+    reply[1] = 0;
+    reply[3] = 0;
+    int n = 0;
+    size_t dir_len = strlen(path);
+    for (int i = start; i < total && n < count; i++)
+    {
+        fileserver_object_t obj;
+        snprintf(path + dir_len, sizeof(path) - dir_len, "/%s", names[i]);
+        if (!_fileserver_stat(path, &obj))
+        {
+            continue;
+        }
+        size_t entry_len = _fileserver_examine_entry(reply + reply_len, sizeof(fileserver_block) - reply_len - 1,
+                                                     arg, names[i], &obj);
+        if (entry_len == 0)
+        {
+            break;
+        }
+        reply_len += entry_len;
+        n++;
+    }
+    free(names);
+    reply[2] = n;
+    if (arg == 1)
+    {
+        reply[reply_len++] = 0x80;
+    }
+    _fileserver_send(session->client_id, req[0], reply, reply_len);
+    return 0;
+}
+
+static uint8_t _fileserver_cat_header(fileserver_session_t *session, const uint8_t *req, size_t length)
+{
+    char name[FILESERVER_PATH_MAX];
+    char rel[FILESERVER_PATH_MAX];
+    _fileserver_text(req + 5, length - 5, name, sizeof(name));
+    uint8_t rc = _fileserver_resolve_dir(session, req[3], name, rel, sizeof(rel));
+    if (rc != 0)
+    {
+        return rc;
+    }
+    uint8_t reply[48] = {0, 0};
+    size_t reply_len = 2 + snprintf((char *)reply + 2, sizeof(reply) - 2, "%-10s%c   %-15s\r",
+                                    _fileserver_leaf(rel), 'O', FILESERVER_DISC_NAME);
+    _fileserver_send(session->client_id, req[0], reply, reply_len);
+    return 0;
+}
+
+static uint8_t _fileserver_read_info(fileserver_session_t *session, const uint8_t *req, size_t length)
+{
+    if (length < 6)
+    {
+        return NETFS_ERR_BAD_COMMAND;
+    }
+    uint8_t arg = req[5];
+    char name[FILESERVER_PATH_MAX];
+    char rel[FILESERVER_PATH_MAX];
+    _fileserver_text(req + 6, length - 6, name, sizeof(name));
+
+    uint8_t reply[32] = {0, 0};
+    uint8_t *p = reply + 2;
+    if (arg == 6)
+    {
+        // The directory's name, ownership and cycle number
+        uint8_t rc = _fileserver_resolve_dir(session, req[3], name, rel, sizeof(rel));
+        if (rc != 0)
+        {
+            return rc;
+        }
+        *p++ = 0;
+        *p++ = FILESERVER_NAME_MAX;
+        p = _fileserver_put_padded(p, _fileserver_leaf(rel), FILESERVER_NAME_MAX);
+        *p++ = 0;
+        *p++ = 0;
+        _fileserver_send(session->client_id, req[0], reply, p - reply);
+        return 0;
+    }
+
+    uint8_t rc = _fileserver_resolve(session, req[3], name, true, rel, sizeof(rel));
+    if (rc != 0)
+    {
+        return rc;
+    }
+    char path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT)];
+    fileserver_object_t obj;
+    _fileserver_path(rel, path, sizeof(path));
+    if (!_fileserver_stat(path, &obj))
+    {
+        return NETFS_ERR_NOT_FOUND;
+    }
+
+    switch (arg)
+    {
+    case 1:
+        p = _fileserver_put_date(p, obj.mtime);
+        break;
+    case 2:
+        p = _fileserver_put32(p, obj.load);
+        p = _fileserver_put32(p, obj.exec);
+        break;
+    case 3:
+        p = _fileserver_put24(p, obj.size);
+        break;
+    case 4:
+        *p++ = obj.access;
+        break;
+    case 5:
+        *p++ = obj.is_dir ? 2 : 1;
+        p = _fileserver_put32(p, obj.load);
+        p = _fileserver_put32(p, obj.exec);
+        p = _fileserver_put24(p, obj.size);
+        *p++ = obj.access;
+        p = _fileserver_put_date(p, obj.mtime);
+        break;
+    default:
+        return NETFS_ERR_BAD_COMMAND;
+    }
+    _fileserver_send(session->client_id, req[0], reply, p - reply);
+    return 0;
+}
+
+// Only the addresses are kept. Access and date changes are accepted and
+// forgotten.
+static uint8_t _fileserver_set_info(fileserver_session_t *session, const uint8_t *req, size_t length)
+{
+    if (length < 7)
+    {
+        return NETFS_ERR_BAD_COMMAND;
+    }
+    uint8_t arg = req[5];
+    size_t name_offset = arg == 1 ? 15 : arg == 2 || arg == 3 ? 10 : arg == 4 ? 7 : 8;
+    if (length <= name_offset)
+    {
+        return NETFS_ERR_BAD_COMMAND;
+    }
+
+    char name[FILESERVER_PATH_MAX];
+    char rel[FILESERVER_PATH_MAX];
+    _fileserver_text(req + name_offset, length - name_offset, name, sizeof(name));
+    uint8_t rc = _fileserver_resolve(session, req[3], name, true, rel, sizeof(rel));
+    if (rc != 0)
+    {
+        return rc;
+    }
+    char path[FILESERVER_PATH_MAX + sizeof(FILESERVER_ROOT)];
+    fileserver_object_t obj;
+    _fileserver_path(rel, path, sizeof(path));
+    if (!_fileserver_stat(path, &obj))
+    {
+        return NETFS_ERR_NOT_FOUND;
+    }
+
+    if (!obj.is_dir && arg >= 1 && arg <= 3)
+    {
+        uint32_t load = arg == 1 || arg == 2 ? _fileserver_get32(req + 6) : obj.load;
+        uint32_t exec = arg == 1 ? _fileserver_get32(req + 10) : arg == 3 ? _fileserver_get32(req + 6) : obj.exec;
+        _fileserver_write_addresses(path, load, exec);
+    }
+    _fileserver_ok(session->client_id, req[0]);
+    return 0;
+}
+
+static uint8_t _fileserver_user_env(fileserver_session_t *session, const uint8_t *req)
+{
+    uint8_t reply[3 + 16 + 2 * FILESERVER_NAME_MAX] = {0, 0, 16};
+    uint8_t *p = _fileserver_put_padded(reply + 3, FILESERVER_DISC_NAME, 16);
+    p = _fileserver_put_padded(p, _fileserver_leaf(_fileserver_dir(session, req[3])), FILESERVER_NAME_MAX);
+    _fileserver_put_padded(p, _fileserver_leaf(_fileserver_dir(session, req[4])), FILESERVER_NAME_MAX);
+    _fileserver_send(session->client_id, req[0], reply, sizeof(reply));
+    return 0;
+}
+
+static uint8_t _fileserver_users(fileserver_session_t *session, const uint8_t *req)
+{
+    uint8_t *reply = fileserver_block;
+    size_t reply_len = 3;
+    reply[0] = 0;
+    reply[1] = 0;
+    reply[2] = 0;
+    for (int i = 0; i < ARRAY_SIZE(fileserver_sessions); i++)
+    {
+        fileserver_session_t *s = &fileserver_sessions[i];
+        if (s->client_id != 0 && s->user[0] != '\0')
+        {
+            reply[reply_len++] = s->client_id;
+            reply[reply_len++] = 0;
+            reply_len += sprintf((char *)reply + reply_len, "%s\r", s->user);
+            reply[2]++;
+        }
+    }
+    _fileserver_send(session->client_id, req[0], reply, reply_len);
+    return 0;
+}
+
+static uint8_t _fileserver_user_info(fileserver_session_t *session, const uint8_t *req, size_t length)
+{
+    char user[FILESERVER_NAME_MAX + 1];
+    _fileserver_text(req + 5, length - 5, user, sizeof(user));
+    for (int i = 0; i < ARRAY_SIZE(fileserver_sessions); i++)
+    {
+        fileserver_session_t *s = &fileserver_sessions[i];
+        if (s->client_id != 0 && !strcasecmp(s->user, user))
+        {
+            uint8_t reply[] = {0, 0, 0, s->client_id, 0};
+            _fileserver_send(session->client_id, req[0], reply, sizeof(reply));
+            return 0;
+        }
+    }
+    return NETFS_ERR_NOT_FOUND;
+}
+
+static uint8_t _fileserver_free(fileserver_session_t *session, const uint8_t *req)
+{
+    size_t total = 0;
+    size_t used = 0;
+    if (esp_littlefs_info(FILESERVER_PARTITION, &total, &used) != ESP_OK)
+    {
+        return NETFS_ERR_DISC_FAULT;
+    }
+    uint8_t reply[8] = {0, 0};
+    size_t reply_len;
+    if (req[1] == NETFS_FN_FREE)
+    {
+        // In 256 byte sectors
+        _fileserver_put24(reply + 2, (total - used) / 256);
+        _fileserver_put24(reply + 5, total / 256);
+        reply_len = 8;
+    }
+    else
+    {
+        _fileserver_put32(reply + 2, total - used);
+        reply_len = 6;
+    }
+    _fileserver_send(session->client_id, req[0], reply, reply_len);
+    return 0;
+}
+
+static uint8_t _fileserver_dispatch(fileserver_session_t *session, const uint8_t *req, size_t length,
+                                    uint8_t control)
+{
+    uint8_t fn = req[1];
+    if (fn == NETFS_FN_GETBYTE || fn == NETFS_FN_PUTBYTE)
+    {
+        return _fileserver_byte(session, req, length, control);
+    }
+    if (length < 5)
+    {
+        return NETFS_ERR_BAD_COMMAND;
+    }
+
+    char name[FILESERVER_PATH_MAX];
+    switch (fn)
+    {
+    case NETFS_FN_CLI:
+        return _fileserver_cli(session, req, length);
+    case NETFS_FN_SAVE:
+    case NETFS_FN_CREATE:
+        return _fileserver_save(session, req, length, fn == NETFS_FN_CREATE);
+    case NETFS_FN_LOAD:
+    case NETFS_FN_RUN:
+        return _fileserver_load(session, req, length, fn == NETFS_FN_RUN);
+    case NETFS_FN_EXAMINE:
+        return _fileserver_examine(session, req, length);
+    case NETFS_FN_CAT_HEADER:
+        return _fileserver_cat_header(session, req, length);
+    case NETFS_FN_OPEN:
+        return _fileserver_open(session, req, length);
+    case NETFS_FN_CLOSE:
+        return _fileserver_close(session, req, length);
+    case NETFS_FN_READ_ARGS:
+    case NETFS_FN_SET_ARGS:
+    case NETFS_FN_EOF:
+        return _fileserver_args(session, req, length);
+    case NETFS_FN_DISC_NAME:
+    {
+        uint8_t reply[4 + 16] = {0, 0, 1, 0};
+        _fileserver_put_padded(reply + 4, FILESERVER_DISC_NAME, 16);
+        _fileserver_send(session->client_id, req[0], reply, sizeof(reply));
+        return 0;
+    }
+    case NETFS_FN_USERS:
+        return _fileserver_users(session, req);
+    case NETFS_FN_DATE:
+    {
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        uint8_t reply[7] = {0, 0};
+        _fileserver_put_date(reply + 2, now);
+        reply[4] = tm.tm_hour;
+        reply[5] = tm.tm_min;
+        reply[6] = tm.tm_sec;
+        _fileserver_send(session->client_id, req[0], reply, sizeof(reply));
+        return 0;
+    }
+    case NETFS_FN_READ_INFO:
+        return _fileserver_read_info(session, req, length);
+    case NETFS_FN_SET_INFO:
+        return _fileserver_set_info(session, req, length);
+    case NETFS_FN_DELETE:
+        _fileserver_text(req + 5, length - 5, name, sizeof(name));
+        return _fileserver_delete(session, req[0], req[3], name);
+    case NETFS_FN_USER_ENV:
+        return _fileserver_user_env(session, req);
+    case NETFS_FN_LOGOFF:
+        _fileserver_ok(session->client_id, req[0]);
+        _fileserver_session_free(session);
+        return 0;
+    case NETFS_FN_USER_INFO:
+        return _fileserver_user_info(session, req, length);
+    case NETFS_FN_VERSION:
+        _fileserver_cli_reply(session->client_id, req[0], 0, FILESERVER_VERSION);
+        return 0;
+    case NETFS_FN_FREE:
+    case NETFS_FN_USER_FREE:
+        return _fileserver_free(session, req);
+    case NETFS_FN_CDIR:
+        if (length < 7)
+        {
+            return NETFS_ERR_BAD_COMMAND;
+        }
+        _fileserver_text(req + 6, length - 6, name, sizeof(name));
+        return _fileserver_cdir(session, req[0], req[3], name);
+    case NETFS_FN_SET_OPT:
+    case NETFS_FN_SET_DATE:
+        _fileserver_ok(session->client_id, req[0]);
+        return 0;
+    default:
+        // GETBYTES and PUTBYTES among others
+        return NETFS_ERR_BAD_COMMAND;
+    }
+}
+
+static void _fileserver_request(const fileserver_item_t *item)
+{
+    if (item->length < 3)
+    {
+        return; // Not even a reply port and function
+    }
+    int64_t start_us = esp_timer_get_time();
+    fileserver_session_t *session = _fileserver_session(item->client_id);
+    uint8_t rc = _fileserver_dispatch(session, item->data, item->length, item->control);
+    if (rc != 0)
+    {
+        _fileserver_error(item->client_id, item->data[0], rc);
+    }
+
+    uint32_t service_us = esp_timer_get_time() - start_us;
+    fileserver_stats.request_count++;
+    fileserver_service_total_us += service_us;
+    fileserver_stats.service_avg_us = fileserver_service_total_us / fileserver_stats.request_count;
+    fileserver_stats.service_max_us = MAX(fileserver_stats.service_max_us, service_us);
+}
+
+static void _fileserver_task(void *params)
+{
+    fileserver_item_t item;
+    for (;;)
+    {
+        xQueueReceive(fileserver_queue, &item, portMAX_DELAY);
+        if (item.type == 'R')
+        {
+            for (int i = 0; i < ARRAY_SIZE(fileserver_sessions); i++)
+            {
+                _fileserver_session_free(&fileserver_sessions[i]);
+            }
+            continue;
+        }
+
+        if (item.port == NETFS_PORT)
+        {
+            _fileserver_request(&item);
+        }
+        else if (item.port == FILESERVER_DATA_PORT)
+        {
+            _fileserver_save_data(_fileserver_session_find(item.client_id), item.data, item.length);
+        }
+        free(item.data);
+    }
+}
+
+void fileserver_init(fileserver_tx_fn tx)
+{
+    fileserver_tx = tx;
+    mkdir(FILESERVER_ROOT, 0775);
+    fileserver_queue = xQueueCreate(FILESERVER_QUEUE_DEPTH, sizeof(fileserver_item_t));
+    xTaskCreate(_fileserver_task, "fileserver", 6144, NULL, 1, NULL);
+}
+
+// Log everyone off, e.g. when the fileserver's station number changes
+void fileserver_reset(void)
+{
+    fileserver_item_t item = {.type = 'R'};
+    xQueueSend(fileserver_queue, &item, pdMS_TO_TICKS(100));
+}
+
+// A frame for the fileserver from a Beeb. Called from the bridge's Econet
+// RX task, so it only takes a copy.
+void fileserver_rx(uint8_t client_id, uint8_t port, uint8_t control, const uint8_t *data, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    fileserver_item_t item = {
+        .type = 'F',
+        .client_id = client_id,
+        .port = port,
+        .control = control,
+        .length = length,
+        .data = malloc(length),
+    };
+    if (item.data == NULL)
+    {
+        ESP_LOGE(TAG, "Out of memory. Frame from station %d dropped.", client_id);
+        return;
+    }
+    memcpy(item.data, data, length);
+    if (xQueueSend(fileserver_queue, &item, 0) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Busy. Frame from station %d dropped.", client_id);
+        free(item.data);
+    }
+}
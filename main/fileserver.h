@@ -0,0 +1,40 @@
+/*
+ * EconetWiFi
+ * Copyright (c) 2025 Paul G. Banks <https://paulbanks.org/projects/econet>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "netfs.h"
+
+// Puts a frame from the fileserver on the Econet. Supplied by the bridge,
+// which owns the transmitter. May block while the bridge catches up. With
+// is_wait it returns once the Beeb has taken the frame; false if it was
+// lost.
+typedef bool (*fileserver_tx_fn)(uint8_t client_id, uint8_t port, uint8_t control,
+                                 const uint8_t *data, size_t length, bool is_wait);
+
+typedef struct
+{
+    uint32_t request_count;
+    uint32_t error_count;      // Requests answered with an error
+    uint32_t service_avg_us;   // Time from request to reply queued
+    uint32_t service_max_us;
+} fileserver_stats_t;
+
+extern fileserver_stats_t fileserver_stats;
+
+void fileserver_init(fileserver_tx_fn tx);
+void fileserver_reset(void);
+void fileserver_rx(uint8_t client_id, uint8_t port, uint8_t control, const uint8_t *data, size_t length);
@@ -0,0 +1,922 @@
+/*
+ * EconetWiFi
+ * Copyright (c) 2025 Paul G. Banks <https://paulbanks.org/projects/econet>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the LICENSE file in the project root for full license information.
+ */
+
+// Read-through cache of NetFS LOADs. The bridge shows us each request a
+// Beeb makes of an AUN fileserver and each frame the server sends back.
+// A LOAD that completes is kept and answered from here next time. Names
+// from $ are shared by every Beeb logged on as the same user. Others are
+// relative to directory handles, which the server numbers per machine, so
+// they are only served back to the Beeb that loaded them.
+//
+// Invalidation is deliberately blunt. Any request to a server that might
+// change a file, or that we don't understand, throws away everything
+// cached from that server, and entries expire after a while anyway to
+// cover changes made other than through the bridge. The littlefs copy only
+// extends the RAM cache and is wiped at boot.
+//
+// The datapath never waits for flash. A worker task writes entries out
+// behind the RAM copy, deletes files that are no longer wanted and reads
+// back an entry that has left RAM once a Beeb asks for it. Until then that
+// LOAD goes to the server.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "fs_cache.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define FS_CACHE_DIR "/user/fscache"
+#define FS_CACHE_ENTRIES 48
+#define FS_CACHE_RECORDINGS 4
+#define FS_CACHE_MAX_FILE (32 * 1024)
+#define FS_CACHE_RAM_BYTES (96 * 1024)
+#define FS_CACHE_DISK_BYTES (384 * 1024)
+#define FS_CACHE_TTL_MS (15 * 60 * 1000)
+#define FS_CACHE_KEY_MAX 112
+#define FS_CACHE_REPLY_MAX 32
+#define FS_CACHE_LOAD_HEADER_LEN 16 // Codes, load and exec addresses, length, access, date
+#define FS_CACHE_WORKER_PRIORITY tskIDLE_PRIORITY // Below everything on the datapath
+
+static const char *TAG = "FSCACHE";
+
+// A complete LOAD as the server sent it: the reply giving the file's
+// addresses and length, the data blocks and the final reply. Entries don't
+// change once stored. refs pins one while it's being played back.
+struct fs_cache_entry
+{
+    char key[FS_CACHE_KEY_MAX]; // Empty when the slot is free
+    uint8_t server_id;
+    bool is_stale; // Invalidated whilst pinned. Freed when released.
+    bool is_on_disk;
+    bool is_reload_wanted; // Asked for while only on disk
+    bool is_write_failed;  // Kept in RAM only
+    uint8_t refs;
+    uint32_t stored_ms;
+    uint32_t used_ms;
+    uint8_t reply_control;
+    uint8_t data_control;
+    uint8_t header_len;
+    uint8_t final_len;
+    uint8_t header[FS_CACHE_REPLY_MAX];
+    uint8_t final[FS_CACHE_REPLY_MAX];
+    uint16_t block_size;
+    uint32_t size;
+    uint8_t *data; // NULL when only on disk
+};
+
+// A LOAD on its way from a server to a Beeb
+typedef struct
+{
+    bool is_active;
+    uint8_t client_id;
+    uint8_t reply_port;
+    uint8_t data_port;
+    bool has_header;
+    uint32_t received;
+    fs_cache_entry_t entry; // Filled in as the frames go past
+} fs_cache_recording_t;
+
+static SemaphoreHandle_t fs_cache_lock;
+static TaskHandle_t fs_cache_worker_handle;
+static fs_cache_entry_t fs_cache_entries[FS_CACHE_ENTRIES];
+static fs_cache_recording_t fs_cache_recordings[FS_CACHE_RECORDINGS];
+static uint8_t fs_cache_recording_next;
+static uint32_t fs_cache_ram_bytes;
+
+// What is on flash for each slot. A file can outlive its entry until the
+// worker deletes it. Only the worker touches these.
+static struct
+{
+    bool is_present;
+    uint32_t size;
+} fs_cache_files[FS_CACHE_ENTRIES];
+static uint32_t fs_cache_disk_bytes;
+
+// Who each Beeb is logged on as, and to which server. Part of the key, so
+// users with different home directories don't share entries. A Beeb whose
+// logon we haven't seen accepted is neither cached nor served. Kept when
+// the cache is cleared, as the Beebs stay logged on.
+static struct
+{
+    char name[11];
+    uint8_t server_id;
+    uint8_t reply_port; // Where the answer to the logon will come
+    bool is_known;
+} fs_cache_users[256];
+
+static uint32_t _fs_cache_now_ms(void)
+{
+    return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+static void _fs_cache_path(int slot, char *path, size_t path_size)
+{
+    snprintf(path, path_size, FS_CACHE_DIR "/%d", slot);
+}
+
+static void _fs_cache_wake_worker(void)
+{
+    if (fs_cache_worker_handle != NULL)
+    {
+        xTaskNotifyGive(fs_cache_worker_handle);
+    }
+}
+
+// The disk copy, if any, is left for the worker to delete
+static void _fs_cache_remove(fs_cache_entry_t *entry)
+{
+    if (entry->data != NULL)
+    {
+        free(entry->data);
+        entry->data = NULL;
+        fs_cache_ram_bytes -= entry->size;
+    }
+    if (entry->is_on_disk)
+    {
+        entry->is_on_disk = false;
+        _fs_cache_wake_worker();
+    }
+    entry->key[0] = '\0';
+    entry->is_stale = false;
+    entry->is_reload_wanted = false;
+}
+
+// Remove an entry, or mark it to go once nothing is playing it back
+static void _fs_cache_discard(fs_cache_entry_t *entry)
+{
+    if (entry->refs > 0)
+    {
+        entry->is_stale = true;
+        return;
+    }
+    _fs_cache_remove(entry);
+}
+
+// Least recently used entry that matches. Pinned entries are never chosen.
+static fs_cache_entry_t *_fs_cache_lru(bool want_data, bool want_disk, const fs_cache_entry_t *except)
+{
+    fs_cache_entry_t *victim = NULL;
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_entries); i++)
+    {
+        fs_cache_entry_t *entry = &fs_cache_entries[i];
+        if (entry->key[0] == '\0' || entry->refs > 0 || entry == except ||
+            (want_data && entry->data == NULL) || (want_disk && !entry->is_on_disk))
+        {
+            continue;
+        }
+        if (victim == NULL || (int32_t)(entry->used_ms - victim->used_ms) < 0)
+        {
+            victim = entry;
+        }
+    }
+    return victim;
+}
+
+// Drops RAM copies only. An entry already written out stays on disk.
+static bool _fs_cache_make_ram_room(uint32_t needed)
+{
+    if (needed > FS_CACHE_RAM_BYTES)
+    {
+        return false;
+    }
+    while (fs_cache_ram_bytes + needed > FS_CACHE_RAM_BYTES)
+    {
+        fs_cache_entry_t *victim = _fs_cache_lru(true, false, NULL);
+        if (victim == NULL)
+        {
+            return false;
+        }
+        if (victim->is_on_disk)
+        {
+            free(victim->data);
+            victim->data = NULL;
+            fs_cache_ram_bytes -= victim->size;
+        }
+        else
+        {
+            _fs_cache_remove(victim);
+        }
+    }
+    return true;
+}
+
+static fs_cache_entry_t *_fs_cache_find(const char *key)
+{
+    uint32_t now = _fs_cache_now_ms();
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_entries); i++)
+    {
+        fs_cache_entry_t *entry = &fs_cache_entries[i];
+        if (entry->key[0] == '\0' || entry->is_stale || strcmp(entry->key, key) != 0)
+        {
+            continue;
+        }
+        if (now - entry->stored_ms > FS_CACHE_TTL_MS)
+        {
+            _fs_cache_discard(entry);
+            return NULL;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+static void _fs_cache_recording_cancel(fs_cache_recording_t *rec)
+{
+    free(rec->entry.data);
+    rec->entry.data = NULL;
+    rec->is_active = false;
+}
+
+static fs_cache_recording_t *_fs_cache_recording_find(uint8_t server_id, uint8_t client_id)
+{
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_recordings); i++)
+    {
+        fs_cache_recording_t *rec = &fs_cache_recordings[i];
+        if (rec->is_active && rec->entry.server_id == server_id && rec->client_id == client_id)
+        {
+            return rec;
+        }
+    }
+    return NULL;
+}
+
+static void _fs_cache_invalidate_server(uint8_t server_id)
+{
+    int count = 0;
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_entries); i++)
+    {
+        fs_cache_entry_t *entry = &fs_cache_entries[i];
+        if (entry->key[0] != '\0' && !entry->is_stale && entry->server_id == server_id)
+        {
+            _fs_cache_discard(entry);
+            count++;
+        }
+    }
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_recordings); i++)
+    {
+        fs_cache_recording_t *rec = &fs_cache_recordings[i];
+        if (rec->is_active && rec->entry.server_id == server_id)
+        {
+            _fs_cache_recording_cancel(rec);
+        }
+    }
+    if (count > 0)
+    {
+        ESP_LOGI(TAG, "Dropped %d cached files from station %d", count, server_id);
+    }
+}
+
+// Requests that can't change what a LOAD returns
+static bool _fs_cache_is_read_only(uint8_t function)
+{
+    switch (function)
+    {
+    case NETFS_FN_LOAD:
+    case NETFS_FN_EXAMINE:
+    case NETFS_FN_CAT_HEADER:
+    case NETFS_FN_RUN:
+    case NETFS_FN_CLOSE:
+    case NETFS_FN_GETBYTE:
+    case NETFS_FN_GETBYTES:
+    case NETFS_FN_READ_ARGS:
+    case NETFS_FN_DISC_NAME:
+    case NETFS_FN_USERS:
+    case NETFS_FN_DATE:
+    case NETFS_FN_EOF:
+    case NETFS_FN_READ_INFO:
+    case NETFS_FN_USER_ENV:
+    case NETFS_FN_LOGOFF:
+    case NETFS_FN_USER_INFO:
+    case NETFS_FN_VERSION:
+    case NETFS_FN_FREE:
+    case NETFS_FN_USER_FREE:
+    case NETFS_FN_CLIENT_ID:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Copy a CR terminated string out of a request, upper cased
+static void _fs_cache_text(char *out, size_t out_size, const uint8_t *text, size_t length)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < length && text[i] != '\r' && text[i] != '\0' && n + 1 < out_size; i++)
+    {
+        out[n++] = toupper(text[i]);
+    }
+    out[n] = '\0';
+}
+
+// A command line for the server. Logons are noted; anything that isn't
+// known to leave files alone invalidates the server.
+static void _fs_cache_cli(uint8_t server_id, uint8_t client_id, uint8_t reply_port,
+                          const uint8_t *text, size_t length)
+{
+    char cmd[48];
+    _fs_cache_text(cmd, sizeof(cmd), text, length);
+    const char *p = cmd;
+    while (*p == ' ' || *p == '*')
+    {
+        p++;
+    }
+
+    if (!strncmp(p, "I AM ", 5) || !strncmp(p, "I.", 2))
+    {
+        p += (p[1] == '.') ? 2 : 5;
+        for (int word = 0; word < 2; word++)
+        {
+            while (*p == ' ')
+            {
+                p++;
+            }
+            if (!isdigit((unsigned char)*p))
+            {
+                break;
+            }
+            // Fileserver number before the user name
+            while (*p != ' ' && *p != '\0')
+            {
+                p++;
+            }
+        }
+        size_t n = strcspn(p, " :");
+        if (n >= sizeof(fs_cache_users[0].name))
+        {
+            n = sizeof(fs_cache_users[0].name) - 1;
+        }
+        memcpy(fs_cache_users[client_id].name, p, n);
+        fs_cache_users[client_id].name[n] = '\0';
+        fs_cache_users[client_id].server_id = server_id;
+        fs_cache_users[client_id].reply_port = reply_port;
+        fs_cache_users[client_id].is_known = false;
+        return;
+    }
+    if (!strncmp(p, "BYE", 3))
+    {
+        memset(&fs_cache_users[client_id], 0, sizeof(fs_cache_users[0]));
+        return;
+    }
+
+    static const char *read_only[] = {"CAT", "EX", "INFO", "RUN", "."};
+    for (int i = 0; i < ARRAY_SIZE(read_only); i++)
+    {
+        if (!strncmp(p, read_only[i], strlen(read_only[i])))
+        {
+            return;
+        }
+    }
+    _fs_cache_invalidate_server(server_id);
+}
+
+// Worker: delete one file whose entry has gone or given up its disk copy
+static bool _fs_cache_work_unlink(void)
+{
+    int slot = -1;
+    xSemaphoreTake(fs_cache_lock, portMAX_DELAY);
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_entries) && slot < 0; i++)
+    {
+        if (fs_cache_files[i].is_present && !fs_cache_entries[i].is_on_disk)
+        {
+            slot = i;
+        }
+    }
+    xSemaphoreGive(fs_cache_lock);
+    if (slot < 0)
+    {
+        return false;
+    }
+
+    // Only the worker sets is_on_disk, so the file is still unwanted
+    char path[32];
+    _fs_cache_path(slot, path, sizeof(path));
+    unlink(path);
+    fs_cache_files[slot].is_present = false;
+    fs_cache_disk_bytes -= fs_cache_files[slot].size;
+    return true;
+}
+
+// Worker: read back one entry that was asked for while only on disk
+static bool _fs_cache_work_reload(void)
+{
+    fs_cache_entry_t *entry = NULL;
+    xSemaphoreTake(fs_cache_lock, portMAX_DELAY);
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_entries) && entry == NULL; i++)
+    {
+        fs_cache_entry_t *candidate = &fs_cache_entries[i];
+        if (candidate->key[0] != '\0' && candidate->is_reload_wanted && !candidate->is_stale &&
+            candidate->data == NULL && candidate->is_on_disk)
+        {
+            entry = candidate;
+        }
+    }
+    if (entry != NULL)
+    {
+        entry->is_reload_wanted = false;
+        entry->refs++; // So it keeps its disk copy while we read it
+    }
+    xSemaphoreGive(fs_cache_lock);
+    if (entry == NULL)
+    {
+        return false;
+    }
+
+    uint32_t size = entry->size;
+    uint8_t *data = malloc(size > 0 ? size : 1);
+    bool is_read = false;
+    if (data != NULL)
+    {
+        char path[32];
+        _fs_cache_path(entry - fs_cache_entries, path, sizeof(path));
+        FILE *fp = fopen(path, "rb");
+        if (fp != NULL)
+        {
+            is_read = fread(data, 1, size, fp) == size;
+            fclose(fp);
+        }
+    }
+
+    xSemaphoreTake(fs_cache_lock, portMAX_DELAY);
+    entry->refs--;
+    if (data != NULL && !is_read)
+    {
+        ESP_LOGW(TAG, "Lost cached %s", entry->key);
+        _fs_cache_discard(entry);
+    }
+    else if (is_read && !entry->is_stale && entry->data == NULL && _fs_cache_make_ram_room(size))
+    {
+        entry->data = data;
+        fs_cache_ram_bytes += size;
+        data = NULL;
+    }
+    if (entry->is_stale && entry->refs == 0)
+    {
+        _fs_cache_remove(entry);
+    }
+    xSemaphoreGive(fs_cache_lock);
+    free(data);
+    return true;
+}
+
+// Worker: copy the least recently used entry that is only in RAM to disk,
+// or make room there for it. Only done once the next file to be cached
+// couldn't fit in RAM without losing an entry, to spare the flash.
+static bool _fs_cache_work_write(void)
+{
+    fs_cache_entry_t *entry = NULL;
+    xSemaphoreTake(fs_cache_lock, portMAX_DELAY);
+    uint32_t spare = FS_CACHE_RAM_BYTES - fs_cache_ram_bytes;
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_entries); i++)
+    {
+        fs_cache_entry_t *candidate = &fs_cache_entries[i];
+        if (candidate->key[0] == '\0' || candidate->data == NULL)
+        {
+            continue;
+        }
+        if (candidate->is_on_disk)
+        {
+            spare += candidate->size;
+        }
+        else if (!candidate->is_stale && !candidate->is_write_failed && !fs_cache_files[i].is_present &&
+                 (entry == NULL || (int32_t)(candidate->used_ms - entry->used_ms) < 0))
+        {
+            entry = candidate;
+        }
+    }
+    if (entry == NULL || spare >= FS_CACHE_MAX_FILE)
+    {
+        xSemaphoreGive(fs_cache_lock);
+        return false;
+    }
+
+    if (fs_cache_disk_bytes + entry->size > FS_CACHE_DISK_BYTES)
+    {
+        // The victim's file is deleted on the next pass
+        fs_cache_entry_t *victim = _fs_cache_lru(false, true, entry);
+        if (victim == NULL)
+        {
+            xSemaphoreGive(fs_cache_lock);
+            return false;
+        }
+        if (victim->data != NULL)
+        {
+            victim->is_on_disk = false;
+        }
+        else
+        {
+            _fs_cache_remove(victim);
+        }
+        xSemaphoreGive(fs_cache_lock);
+        return true;
+    }
+    entry->refs++; // So its data stays put while we write it
+    xSemaphoreGive(fs_cache_lock);
+
+    int slot = entry - fs_cache_entries;
+    uint32_t size = entry->size;
+    char path[32];
+    _fs_cache_path(slot, path, sizeof(path));
+    FILE *fp = fopen(path, "wb");
+    bool is_written = false;
+    if (fp != NULL)
+    {
+        is_written = fwrite(entry->data, 1, size, fp) == size;
+        fclose(fp);
+    }
+    if (is_written)
+    {
+        fs_cache_files[slot].is_present = true;
+        fs_cache_files[slot].size = size;
+        fs_cache_disk_bytes += size;
+    }
+    else
+    {
+        unlink(path);
+    }
+
+    xSemaphoreTake(fs_cache_lock, portMAX_DELAY);
+    entry->refs--;
+    entry->is_on_disk = is_written;
+    entry->is_write_failed = !is_written;
+    if (entry->is_stale && entry->refs == 0)
+    {
+        _fs_cache_remove(entry);
+    }
+    xSemaphoreGive(fs_cache_lock);
+    return true;
+}
+
+static void _fs_cache_worker_task(void *params)
+{
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (_fs_cache_work_unlink() || _fs_cache_work_reload() || _fs_cache_work_write())
+        {
+        }
+    }
+}
+
+void fs_cache_init(void)
+{
+    fs_cache_lock = xSemaphoreCreateMutex();
+
+    // Whatever was left from last time may be out of date
+    mkdir(FS_CACHE_DIR, 0777);
+    DIR *dir = opendir(FS_CACHE_DIR);
+    if (dir != NULL)
+    {
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL)
+        {
+            char path[300];
+            snprintf(path, sizeof(path), FS_CACHE_DIR "/%s", de->d_name);
+            unlink(path);
+        }
+        closedir(dir);
+    }
+
+    xTaskCreate(_fs_cache_worker_task, "fs_cache", 4096, NULL, FS_CACHE_WORKER_PRIORITY,
+                &fs_cache_worker_handle);
+}
+
+void fs_cache_clear(void)
+{
+    xSemaphoreTake(fs_cache_lock, portMAX_DELAY);
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_entries); i++)
+    {
+        if (fs_cache_entries[i].key[0] != '\0')
+        {
+            _fs_cache_discard(&fs_cache_entries[i]);
+        }
+    }
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_recordings); i++)
+    {
+        if (fs_cache_recordings[i].is_active)
+        {
+            _fs_cache_recording_cancel(&fs_cache_recordings[i]);
+        }
+    }
+    xSemaphoreGive(fs_cache_lock);
+}
+
+// A request from a Beeb to a fileserver. On a hit the entry is pinned in
+// playback until fs_cache_finish(). Pass a NULL playback when the Beeb
+// can't be answered locally just now.
+fs_cache_result_t fs_cache_request(uint8_t server_id, uint8_t client_id, const uint8_t *data, size_t length,
+                                   fs_cache_playback_t *playback)
+{
+    if (length < 5)
+    {
+        return FS_CACHE_PASS;
+    }
+    uint8_t function = data[1];
+
+    xSemaphoreTake(fs_cache_lock, portMAX_DELAY);
+
+    // Whatever the Beeb was loading from this server, it's given up on
+    fs_cache_recording_t *rec = _fs_cache_recording_find(server_id, client_id);
+    if (rec != NULL)
+    {
+        _fs_cache_recording_cancel(rec);
+    }
+
+    if (function == NETFS_FN_CLI)
+    {
+        _fs_cache_cli(server_id, client_id, data[0], data + 5, length - 5);
+    }
+    else if (function == NETFS_FN_LOGOFF)
+    {
+        memset(&fs_cache_users[client_id], 0, sizeof(fs_cache_users[0]));
+    }
+    else if (!_fs_cache_is_read_only(function))
+    {
+        _fs_cache_invalidate_server(server_id);
+    }
+
+    // Handles are only meaningful within a logon
+    bool is_user_known = fs_cache_users[client_id].is_known && fs_cache_users[client_id].server_id == server_id;
+
+    fs_cache_result_t result = FS_CACHE_PASS;
+    if ((function == NETFS_FN_LOAD || function == NETFS_FN_RUN) && length > 6 && is_user_known)
+    {
+        char name[64];
+        _fs_cache_text(name, sizeof(name), data + 6, length - 6);
+        name[strcspn(name, " ")] = '\0';
+
+        // Two Beebs can hold the same handle number for different
+        // directories, so only a name from the root means the same file
+        char key[FS_CACHE_KEY_MAX];
+        if (name[0] == '$')
+        {
+            snprintf(key, sizeof(key), "%d:%d:%s:%s", server_id, function, fs_cache_users[client_id].name, name);
+        }
+        else
+        {
+            snprintf(key, sizeof(key), "%d:%d:%d:%d:%d:%d:%s:%s", server_id, function, client_id, data[2], data[3],
+                     data[4], fs_cache_users[client_id].name, name);
+        }
+
+        fs_cache_entry_t *entry = _fs_cache_find(key);
+        if (entry != NULL && entry->data == NULL)
+        {
+            // Only on disk. The worker reads it back for the next Beeb that
+            // asks, and the server answers this one.
+            entry->is_reload_wanted = true;
+            _fs_cache_wake_worker();
+            result = FS_CACHE_MISS;
+        }
+        else if (entry != NULL && playback != NULL)
+        {
+            entry->refs++;
+            entry->used_ms = _fs_cache_now_ms();
+            playback->entry = entry;
+            playback->reply_port = data[0];
+            playback->data_port = data[5];
+            playback->stage = 0;
+            playback->offset = 0;
+            result = FS_CACHE_HIT;
+            ESP_LOGI(TAG, "Station %d: %s from cache (%lu bytes)", client_id, name, entry->size);
+        }
+        else
+        {
+            rec = &fs_cache_recordings[fs_cache_recording_next];
+            fs_cache_recording_next = (fs_cache_recording_next + 1) % ARRAY_SIZE(fs_cache_recordings);
+            if (rec->is_active)
+            {
+                _fs_cache_recording_cancel(rec);
+            }
+            memset(rec, 0, sizeof(*rec));
+            rec->is_active = true;
+            rec->client_id = client_id;
+            rec->reply_port = data[0];
+            rec->data_port = data[5];
+            rec->entry.server_id = server_id;
+            snprintf(rec->entry.key, sizeof(rec->entry.key), "%s", key);
+            result = FS_CACHE_MISS;
+        }
+    }
+
+    xSemaphoreGive(fs_cache_lock);
+    return result;
+}
+
+static void _fs_cache_commit(fs_cache_recording_t *rec)
+{
+    fs_cache_entry_t *old = _fs_cache_find(rec->entry.key);
+    if (old != NULL)
+    {
+        _fs_cache_discard(old);
+    }
+
+    fs_cache_entry_t *slot = NULL;
+    for (int i = 0; i < ARRAY_SIZE(fs_cache_entries) && slot == NULL; i++)
+    {
+        if (fs_cache_entries[i].key[0] == '\0' && fs_cache_entries[i].refs == 0)
+        {
+            slot = &fs_cache_entries[i];
+        }
+    }
+    if (slot == NULL && (slot = _fs_cache_lru(false, false, NULL)) != NULL)
+    {
+        _fs_cache_remove(slot);
+    }
+    if (slot == NULL || !_fs_cache_make_ram_room(rec->entry.size))
+    {
+        _fs_cache_recording_cancel(rec);
+        return;
+    }
+
+    *slot = rec->entry;
+    slot->refs = 0;
+    slot->stored_ms = _fs_cache_now_ms();
+    slot->used_ms = slot->stored_ms;
+    fs_cache_ram_bytes += slot->size;
+    rec->entry.data = NULL;
+    rec->is_active = false;
+    ESP_LOGI(TAG, "Cached %s (%lu bytes)", slot->key, slot->size);
+    _fs_cache_wake_worker();
+}
+
+// A frame from a server that the Beeb has accepted
+void fs_cache_observe(uint8_t server_id, uint8_t client_id, uint8_t port, uint8_t control,
+                      const econet_iovec_t *iov, int iov_count)
+{
+    xSemaphoreTake(fs_cache_lock, portMAX_DELAY);
+
+    // The answer to a logon. A return code of 0 means it was accepted.
+    if (fs_cache_users[client_id].name[0] != '\0' && !fs_cache_users[client_id].is_known &&
+        fs_cache_users[client_id].server_id == server_id && fs_cache_users[client_id].reply_port == port)
+    {
+        if (iov_count > 0 && iov[0].length >= 2 && iov[0].data[1] == 0)
+        {
+            fs_cache_users[client_id].is_known = true;
+        }
+        else
+        {
+            memset(&fs_cache_users[client_id], 0, sizeof(fs_cache_users[0]));
+        }
+    }
+
+    fs_cache_recording_t *rec = _fs_cache_recording_find(server_id, client_id);
+    if (rec == NULL)
+    {
+        xSemaphoreGive(fs_cache_lock);
+        return;
+    }
+    fs_cache_entry_t *entry = &rec->entry;
+
+    size_t length = 0;
+    for (int i = 0; i < iov_count; i++)
+    {
+        length += iov[i].length;
+    }
+
+    if (!rec->has_header && port == rec->reply_port)
+    {
+        for (int i = 0; i < iov_count && entry->header_len < sizeof(entry->header); i++)
+        {
+            size_t n = MIN(iov[i].length, sizeof(entry->header) - entry->header_len);
+            memcpy(&entry->header[entry->header_len], iov[i].data, n);
+            entry->header_len += n;
+        }
+        entry->size = entry->header[10] | (entry->header[11] << 8) | (entry->header[12] << 16);
+        entry->reply_control = control;
+        if (length != entry->header_len || length < FS_CACHE_LOAD_HEADER_LEN || entry->header[1] != 0 ||
+            entry->size > FS_CACHE_MAX_FILE || (entry->data = malloc(entry->size > 0 ? entry->size : 1)) == NULL)
+        {
+            _fs_cache_recording_cancel(rec); // Error, too big or not a LOAD reply
+        }
+        rec->has_header = true;
+    }
+    else if (rec->has_header && port == rec->data_port)
+    {
+        if (entry->block_size == 0)
+        {
+            entry->block_size = length;
+            entry->data_control = control;
+        }
+        for (int i = 0; i < iov_count; i++)
+        {
+            if (rec->received + iov[i].length > entry->size)
+            {
+                _fs_cache_recording_cancel(rec);
+                break;
+            }
+            memcpy(&entry->data[rec->received], iov[i].data, iov[i].length);
+            rec->received += iov[i].length;
+        }
+    }
+    else if (rec->has_header && port == rec->reply_port)
+    {
+        for (int i = 0; i < iov_count && entry->final_len < sizeof(entry->final); i++)
+        {
+            size_t n = MIN(iov[i].length, sizeof(entry->final) - entry->final_len);
+            memcpy(&entry->final[entry->final_len], iov[i].data, n);
+            entry->final_len += n;
+        }
+        if (length == entry->final_len && length >= 2 && entry->final[1] == 0 &&
+            rec->received == entry->size && (entry->size == 0 || entry->block_size > 0))
+        {
+            _fs_cache_commit(rec);
+        }
+        else
+        {
+            _fs_cache_recording_cancel(rec);
+        }
+    }
+    xSemaphoreGive(fs_cache_lock);
+}
+
+// The next frame of a playback. False when there are none left.
+bool fs_cache_next(const fs_cache_playback_t *playback, fs_cache_frame_t *frame)
+{
+    const fs_cache_entry_t *entry = playback->entry;
+    if (entry == NULL)
+    {
+        return false;
+    }
+
+    switch (playback->stage)
+    {
+    case 0:
+        frame->port = playback->reply_port;
+        frame->control = entry->reply_control;
+        frame->data = entry->header;
+        frame->length = entry->header_len;
+        return true;
+    case 1:
+        frame->port = playback->data_port;
+        frame->control = entry->data_control;
+        frame->data = &entry->data[playback->offset];
+        frame->length = MIN(entry->block_size, entry->size - playback->offset);
+        return true;
+    case 2:
+        frame->port = playback->reply_port;
+        frame->control = entry->reply_control;
+        frame->data = entry->final;
+        frame->length = entry->final_len;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The frame from fs_cache_next() was accepted
+void fs_cache_advance(fs_cache_playback_t *playback)
+{
+    const fs_cache_entry_t *entry = playback->entry;
+    switch (playback->stage)
+    {
+    case 0:
+        playback->stage = entry->size > 0 ? 1 : 2;
+        break;
+    case 1:
+        playback->offset += entry->block_size;
+        if (playback->offset >= entry->size)
+        {
+            playback->stage = 2;
+        }
+        break;
+    default:
+        playback->stage = 3;
+        break;
+    }
+}
+
+void fs_cache_finish(fs_cache_playback_t *playback)
+{
+    if (playback->entry == NULL)
+    {
+        return;
+    }
+    xSemaphoreTake(fs_cache_lock, portMAX_DELAY);
+    fs_cache_entry_t *entry = playback->entry;
+    entry->refs--;
+    if (entry->is_stale && entry->refs == 0)
+    {
+        _fs_cache_remove(entry);
+    }
+    xSemaphoreGive(fs_cache_lock);
+    playback->entry = NULL;
+}
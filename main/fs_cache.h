@@ -0,0 +1,57 @@
+/*
+ * EconetWiFi
+ * Copyright (c) 2025 Paul G. Banks <https://paulbanks.org/projects/econet>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "econet.h"
+#include "netfs.h"
+
+typedef enum
+{
+    FS_CACHE_PASS, ///< Not a LOAD; forward it
+    FS_CACHE_MISS, ///< LOAD we don't have in RAM; forward it
+    FS_CACHE_HIT,  ///< LOAD answered from the cache; don't forward it
+} fs_cache_result_t;
+
+typedef struct fs_cache_entry fs_cache_entry_t;
+
+// A cached LOAD being played back to a Beeb a frame at a time
+typedef struct
+{
+    fs_cache_entry_t *entry; // NULL when idle
+    uint8_t reply_port;
+    uint8_t data_port;
+    uint8_t stage;
+    uint32_t offset;
+} fs_cache_playback_t;
+
+typedef struct
+{
+    uint8_t port;
+    uint8_t control;
+    const uint8_t *data;
+    size_t length;
+} fs_cache_frame_t;
+
+void fs_cache_init(void);
+void fs_cache_clear(void);
+fs_cache_result_t fs_cache_request(uint8_t server_id, uint8_t client_id, const uint8_t *data, size_t length,
+                                   fs_cache_playback_t *playback);
+void fs_cache_observe(uint8_t server_id, uint8_t client_id, uint8_t port, uint8_t control,
+                      const econet_iovec_t *iov, int iov_count);
+bool fs_cache_next(const fs_cache_playback_t *playback, fs_cache_frame_t *frame);
+void fs_cache_advance(fs_cache_playback_t *playback);
+void fs_cache_finish(fs_cache_playback_t *playback);
@@ -10,67 +10,136 @@
  * See the LICENSE file in the project root for full license information.
  */
 
+#include <string.h>
+
 #include "esp_log.h"
+#include "esp_partition.h"
 #include "http.h"
 
 httpd_handle_t http_server = NULL;
 
 static const char *TAG = "httpd";
 
-static esp_err_t _file_handler(httpd_req_t *req)
-{
-    char filepath[256];
-    const char *base_path = "/app/web";
+// The web UI comes from a read-only bundle in its own partition, packed at
+// build time by tools/web_assets.py. The partition is mapped and responses
+// are sent straight from flash.
+#define WEBUI_PARTITION "webui"
+#define WEBUI_PARTITION_SUBTYPE 0x40
+#define WEBUI_MAGIC "NBWB"
+#define WEBUI_VERSION 1
 
-    snprintf(filepath, sizeof(filepath), "%s%s", base_path, req->uri);
+#define WEBUI_FLAG_GZIP 0x01
+#define WEBUI_FLAG_IMMUTABLE 0x02 // Named by content hash, so never changes
 
-    // Default file if request is "/"
-    if (strcmp(req->uri, "/") == 0)
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t count;
+    uint32_t size;
+} webui_header_t;
+
+// Offsets are from the start of the bundle; strings are NUL terminated
+typedef struct
+{
+    uint32_t uri;
+    uint32_t data;
+    uint32_t data_size;
+    uint32_t etag; // Quoted, ready for the header
+    uint32_t type;
+    uint32_t flags;
+} webui_entry_t;
+
+static const uint8_t *_webui;
+static const webui_entry_t *_webui_index;
+static int _webui_count;
+
+static void _webui_map(void)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, WEBUI_PARTITION_SUBTYPE,
+                                                            WEBUI_PARTITION);
+    webui_header_t header;
+    if (!part || esp_partition_read(part, 0, &header, sizeof(header)) != ESP_OK)
     {
-        snprintf(filepath, sizeof(filepath), "%s/index.html", base_path);
+        ESP_LOGE(TAG, "No web UI partition");
+        return;
     }
 
-    FILE *f = fopen(filepath, "r");
-    if (!f)
+    if (memcmp(header.magic, WEBUI_MAGIC, sizeof(header.magic)) || header.version != WEBUI_VERSION ||
+        header.size > part->size || sizeof(header) + header.count * sizeof(webui_entry_t) > header.size)
     {
-        httpd_resp_send_404(req);
-        return ESP_OK;
+        ESP_LOGE(TAG, "Web UI partition doesn't hold a bundle we understand");
+        return;
     }
 
-    // Determine MIME type (super basic)
-    if (strstr(filepath, ".html"))
-        httpd_resp_set_type(req, "text/html");
-    else if (strstr(filepath, ".css"))
-        httpd_resp_set_type(req, "text/css");
-    else if (strstr(filepath, ".js"))
-        httpd_resp_set_type(req, "application/javascript");
-    else if (strstr(filepath, ".png"))
-        httpd_resp_set_type(req, "image/png");
-    else if (strstr(filepath, ".jpg"))
-        httpd_resp_set_type(req, "image/jpeg");
-    else if (strstr(filepath, ".svg"))
-        httpd_resp_set_type(req, "image/svg+xml");
-    else
+    const void *ptr;
+    esp_partition_mmap_handle_t handle;
+    if (esp_partition_mmap(part, 0, header.size, ESP_PARTITION_MMAP_DATA, &ptr, &handle) != ESP_OK)
     {
-        httpd_resp_set_type(req, "application/octet-stream");
+        ESP_LOGE(TAG, "Couldn't map the web UI");
+        return;
     }
 
-    // Stream file
-    char chunk[1024];
-    size_t read_len;
+    _webui = ptr;
+    _webui_index = (const webui_entry_t *)(_webui + sizeof(header));
+    _webui_count = header.count;
+    ESP_LOGI(TAG, "%d web assets, %lu bytes", _webui_count, header.size);
+}
 
-    while ((read_len = fread(chunk, 1, sizeof(chunk), f)) > 0)
+static const webui_entry_t *_find_asset(const char *uri)
+{
+    size_t len = strcspn(uri, "?#");
+    if (len == 1 && uri[0] == '/')
     {
-        if (httpd_resp_send_chunk(req, chunk, read_len) != ESP_OK)
+        uri = "/index.html";
+        len = strlen(uri);
+    }
+
+    for (int i = 0; i < _webui_count; i++)
+    {
+        const char *asset_uri = (const char *)_webui + _webui_index[i].uri;
+        if (!strncmp(asset_uri, uri, len) && asset_uri[len] == '\0')
         {
-            fclose(f);
-            return ESP_FAIL;
+            return &_webui_index[i];
         }
     }
+    return NULL;
+}
 
-    fclose(f);
-    httpd_resp_send_chunk(req, NULL, 0); // terminate chunked response
-    return ESP_OK;
+// Assets go out as stored, gzipped or not, with their ETag. A browser that
+// already has the asset just gets a 304.
+static esp_err_t _file_handler(httpd_req_t *req)
+{
+    const webui_entry_t *asset = _find_asset(req->uri);
+    if (!asset)
+    {
+        httpd_resp_send_404(req);
+        return ESP_OK;
+    }
+
+    const char *etag = (const char *)_webui + asset->etag;
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control",
+                       (asset->flags & WEBUI_FLAG_IMMUTABLE) ? "public, max-age=31536000, immutable" : "no-cache");
+
+    char if_none_match[64];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+        strstr(if_none_match, etag))
+    {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    httpd_resp_set_type(req, (const char *)_webui + asset->type);
+    if (asset->flags & WEBUI_FLAG_GZIP)
+    {
+        // Every browser able to run the UI accepts gzip
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    }
+
+    // One response with a Content-Length, written to the socket straight
+    // from the mapping
+    return httpd_resp_send(req, (const char *)_webui + asset->data, asset->data_size);
 }
 
 httpd_handle_t http_server_start(void)
@@ -83,6 +152,8 @@ httpd_handle_t http_server_start(void)
 
     ESP_LOGI(TAG, "Starting server on port: %d", config.server_port);
 
+    _webui_map();
+
     httpd_uri_t ws = {
         .uri = "/ws",
         .method = HTTP_GET,
@@ -14,11 +14,42 @@
 
 #include "cJSON.h"
 #include "esp_http_server.h"
+#include "esp_log.h"
 
 typedef esp_err_t (*ws_handler_fn)(httpd_req_t* req, int request_id, const cJSON *payload);
 
+// What a WebSocket client can ask for with "subscribe" and "unsubscribe".
+// New clients get stats and logs.
+typedef enum
+{
+    HTTP_WS_TOPIC_STATS,
+    HTTP_WS_TOPIC_LOGS,
+    HTTP_WS_TOPIC_CAPTURE,
+    HTTP_WS_TOPIC_TRACES,
+    HTTP_WS_TOPIC_COUNT,
+} http_ws_topic_t;
+
 httpd_handle_t http_server_start(void);
-esp_err_t http_ws_broadcast_json(const char *json);
+esp_err_t http_ws_broadcast_json(const char *json); // Every client, subscribed or not
+
+// Producers should check for subscribers before formatting anything.
+// Longer messages than HTTP_WS_MAX_MESSAGE bytes are refused.
+#define HTTP_WS_MAX_MESSAGE 1536
+bool http_ws_has_subscribers(http_ws_topic_t topic);
+esp_err_t http_ws_publish_json(http_ws_topic_t topic, const char *json);
+bool http_ws_log_wanted(esp_log_level_t level, const char *tag);
+esp_err_t http_ws_publish_log(esp_log_level_t level, const char *tag, const char *json);
+
+// Stats stream. Clients pick JSON (the default) or binary frames when
+// subscribing; the version of the binary layout is given in the reply.
+// Binary subscribers each have their own interval, so each gets its own
+// deltas; client masks have a bit per slot.
+#define HTTP_WS_STATS_VERSION 1
+#define HTTP_WS_MAX_CLIENTS 4
+esp_err_t http_ws_broadcast_stats_json(const char *json);
+esp_err_t http_ws_send_stats_binary(uint8_t clients, const uint8_t *data, size_t length);
+bool http_ws_stats_json_wanted(void);
+uint8_t http_ws_stats_binary_due(uint32_t elapsed_ms, uint8_t *snapshot_clients);
 
 // Private api
 esp_err_t http_ws_handler(httpd_req_t *req);
@@ -22,48 +22,120 @@
 
 static const char *TAG = "ws";
 
-#define MAX_WS_BROADCAST_SIZE 512
-#define MAX_WS_CLIENTS 4
+#define MAX_WS_BROADCAST_SIZE HTTP_WS_MAX_MESSAGE
+#define MAX_WS_CLIENTS HTTP_WS_MAX_CLIENTS
+
+#define WS_STATS_INTERVAL_DEFAULT_MS 1000
+#define WS_STATS_INTERVAL_MIN_MS 250
+#define WS_STATS_INTERVAL_MAX_MS 60000
+
+#define WS_LOG_TAG_MAX 16
+
+// Each message in _broadcast_messages starts with a byte saying who it's
+// for: a bit per client slot, and whether it goes as a binary frame.
+#define WS_MSG_BINARY 0x80
+
+typedef struct
+{
+    int fd; // -1 when the slot is free
+    uint8_t topics; // Bit per http_ws_topic_t
+    bool is_stats_binary;
+    uint32_t stats_interval_ms;
+    uint32_t stats_wait_ms;               // Since its last binary frame
+    bool is_stats_snapshot_wanted;        // Set on subscribing
+    esp_log_level_t log_level; // Most verbose level sent
+    char log_tag[WS_LOG_TAG_MAX]; // Only this tag's lines when not empty
+} ws_client_t;
+
+static const char *const ws_topic_names[HTTP_WS_TOPIC_COUNT] = {
+    [HTTP_WS_TOPIC_STATS] = "stats",
+    [HTTP_WS_TOPIC_LOGS] = "logs",
+    [HTTP_WS_TOPIC_CAPTURE] = "capture",
+    [HTTP_WS_TOPIC_TRACES] = "traces",
+};
 
 static MessageBufferHandle_t _broadcast_messages;
 static portMUX_TYPE _broadcast_messages_lock = portMUX_INITIALIZER_UNLOCKED;
 
 static bool _ws_init_complete;
-static int s_ws_fds[MAX_WS_CLIENTS];
+
+// The httpd task changes the client table; the logging task and the stats
+// loop in main.c read it. All of it is under the lock, and readers filter
+// on a copy.
+static ws_client_t s_ws_clients[MAX_WS_CLIENTS];
+static portMUX_TYPE s_ws_clients_lock = portMUX_INITIALIZER_UNLOCKED;
 
 static void ws_clients_init(void)
 {
     for (int i = 0; i < MAX_WS_CLIENTS; i++)
     {
-        s_ws_fds[i] = -1;
+        s_ws_clients[i].fd = -1;
     }
 }
 
 static void ws_client_add(int fd)
 {
+    int slot = -1;
+    portENTER_CRITICAL(&s_ws_clients_lock);
     for (int i = 0; i < MAX_WS_CLIENTS; i++)
     {
-        if (s_ws_fds[i] == -1)
+        if (s_ws_clients[i].fd == -1)
         {
-            s_ws_fds[i] = fd;
-            ESP_LOGI("ws", "Client added on fd=%d (slot %d)", fd, i);
-            return;
+            // Until told otherwise, clients get what everyone always got
+            s_ws_clients[i] = (ws_client_t){
+                .fd = fd,
+                .topics = (1 << HTTP_WS_TOPIC_STATS) | (1 << HTTP_WS_TOPIC_LOGS),
+                .stats_interval_ms = WS_STATS_INTERVAL_DEFAULT_MS,
+                .log_level = ESP_LOG_VERBOSE,
+            };
+            slot = i;
+            break;
         }
     }
-    ESP_LOGW("ws", "No space for more WS clients");
+    portEXIT_CRITICAL(&s_ws_clients_lock);
+
+    if (slot < 0)
+    {
+        ESP_LOGW("ws", "No space for more WS clients");
+        return;
+    }
+    ESP_LOGI("ws", "Client added on fd=%d (slot %d)", fd, slot);
 }
 
 static void ws_client_remove(int fd)
 {
+    int slot = -1;
+    portENTER_CRITICAL(&s_ws_clients_lock);
     for (int i = 0; i < MAX_WS_CLIENTS; i++)
     {
-        if (s_ws_fds[i] == fd)
+        if (s_ws_clients[i].fd == fd)
         {
-            s_ws_fds[i] = -1;
-            ESP_LOGI("ws", "Client removed fd=%d (slot %d)", fd, i);
-            return;
+            s_ws_clients[i].fd = -1;
+            s_ws_clients[i].topics = 0;
+            slot = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_ws_clients_lock);
+
+    if (slot >= 0)
+    {
+        ESP_LOGI("ws", "Client removed fd=%d (slot %d)", fd, slot);
+    }
+}
+
+// Only the httpd task changes fd, so it can look without the lock
+
+static ws_client_t *ws_client_find(int fd)
+{
+    for (int i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        if (s_ws_clients[i].fd == fd)
+        {
+            return &s_ws_clients[i];
         }
     }
+    return NULL;
 }
 
 esp_err_t _ws_send(httpd_req_t *req, const char *json)
@@ -412,6 +484,119 @@ static esp_err_t _ws_get_econet_termination(httpd_req_t *req, int request_id, co
     return _ws_send(req, response);
 }
 
+static int _ws_topic_from_payload(const cJSON *payload)
+{
+    const cJSON *topic = cJSON_GetObjectItemCaseSensitive(payload, "topic");
+    for (int t = 0; cJSON_IsString(topic) && t < HTTP_WS_TOPIC_COUNT; t++)
+    {
+        if (!strcmp(topic->valuestring, ws_topic_names[t]))
+        {
+            return t;
+        }
+    }
+    return -1;
+}
+
+// Everything when no level is given, -1 for one we don't know
+static int _ws_log_level_from_payload(const cJSON *payload)
+{
+    static const char *const names[] = {"none", "error", "warn", "info", "debug", "verbose"};
+    const cJSON *level = cJSON_GetObjectItemCaseSensitive(payload, "level");
+    if (!level)
+    {
+        return ESP_LOG_VERBOSE;
+    }
+    for (int i = 0; cJSON_IsString(level) && i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (!strcmp(level->valuestring, names[i]))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Starts sending a topic to this client. Options by topic:
+//   stats: format "json" (the default) or "binary", interval_ms. Binary
+//          subscribers get a full snapshot first.
+//   logs:  level ("error" ... "verbose") and tag to narrow the lines sent.
+static esp_err_t _ws_subscribe(httpd_req_t *req, int request_id, const cJSON *payload)
+{
+    ws_client_t *client = ws_client_find(httpd_req_to_sockfd(req));
+    int topic = _ws_topic_from_payload(payload);
+    if (!client || topic < 0)
+    {
+        return send_err_response(req, request_id, "Unknown topic");
+    }
+
+    if (topic == HTTP_WS_TOPIC_LOGS)
+    {
+        int level = _ws_log_level_from_payload(payload);
+        if (level < 0)
+        {
+            return send_err_response(req, request_id, "Unknown log level");
+        }
+        const cJSON *tag = cJSON_GetObjectItemCaseSensitive(payload, "tag");
+        char log_tag[WS_LOG_TAG_MAX];
+        strlcpy(log_tag, cJSON_IsString(tag) ? tag->valuestring : "", sizeof(log_tag));
+
+        portENTER_CRITICAL(&s_ws_clients_lock);
+        client->log_level = (esp_log_level_t)level;
+        memcpy(client->log_tag, log_tag, sizeof(client->log_tag));
+        portEXIT_CRITICAL(&s_ws_clients_lock);
+    }
+
+    if (topic != HTTP_WS_TOPIC_STATS)
+    {
+        portENTER_CRITICAL(&s_ws_clients_lock);
+        client->topics |= 1 << topic;
+        portEXIT_CRITICAL(&s_ws_clients_lock);
+        return send_ok_response(req, request_id);
+    }
+
+    const cJSON *format = cJSON_GetObjectItemCaseSensitive(payload, "format");
+    const cJSON *interval = cJSON_GetObjectItemCaseSensitive(payload, "interval_ms");
+
+    uint32_t interval_ms = WS_STATS_INTERVAL_DEFAULT_MS;
+    if (cJSON_IsNumber(interval))
+    {
+        interval_ms = interval->valuedouble < WS_STATS_INTERVAL_MIN_MS   ? WS_STATS_INTERVAL_MIN_MS
+                      : interval->valuedouble > WS_STATS_INTERVAL_MAX_MS ? WS_STATS_INTERVAL_MAX_MS
+                                                                         : (uint32_t)interval->valuedouble;
+    }
+
+    bool is_binary = cJSON_IsString(format) && !strcmp(format->valuestring, "binary");
+
+    portENTER_CRITICAL(&s_ws_clients_lock);
+    client->stats_interval_ms = interval_ms;
+    client->is_stats_binary = is_binary;
+    client->is_stats_snapshot_wanted = is_binary;
+    client->stats_wait_ms = 0;
+    client->topics |= 1 << topic;
+    portEXIT_CRITICAL(&s_ws_clients_lock);
+
+    char response[128];
+    snprintf(response, sizeof(response),
+             "{\"type\":\"response\",\"id\": %d, \"ok\":true, \"version\":%d, \"interval_ms\":%lu}",
+             request_id, HTTP_WS_STATS_VERSION, interval_ms);
+    return _ws_send(req, response);
+}
+
+static esp_err_t _ws_unsubscribe(httpd_req_t *req, int request_id, const cJSON *payload)
+{
+    ws_client_t *client = ws_client_find(httpd_req_to_sockfd(req));
+    int topic = _ws_topic_from_payload(payload);
+    if (!client || topic < 0)
+    {
+        return send_err_response(req, request_id, "Unknown topic");
+    }
+
+    portENTER_CRITICAL(&s_ws_clients_lock);
+    client->topics &= ~(1 << topic);
+    portEXIT_CRITICAL(&s_ws_clients_lock);
+    return send_ok_response(req, request_id);
+}
+
 static const struct
 {
     const char *type;
@@ -428,7 +613,9 @@ static const struct
     {"get_econet_clock", _ws_get_econet_clock},
     {"save_econet_clock", _ws_save_econet_clock},
     {"get_econet_termination", _ws_get_econet_termination},
-    {"save_econet_termination", _ws_save_econet_termination}
+    {"save_econet_termination", _ws_save_econet_termination},
+    {"subscribe", _ws_subscribe},
+    {"unsubscribe", _ws_unsubscribe}
 };
 
 static esp_err_t _ws_dispatch(httpd_req_t *req, const char *type, int id, const cJSON *payload)
@@ -541,7 +728,7 @@ esp_err_t http_ws_handler(httpd_req_t *req)
 
 static void _async_send_worker(void *arg)
 {
-    uint8_t msg[MAX_WS_BROADCAST_SIZE];
+    static uint8_t msg[MAX_WS_BROADCAST_SIZE + 1]; // Only ever runs in the httpd task
 
     while (1)
     {
@@ -552,15 +739,15 @@ static void _async_send_worker(void *arg)
         }
 
         httpd_ws_frame_t frame = {
-            .type = HTTPD_WS_TYPE_TEXT,
-            .payload = msg,
-            .len = msg_len,
+            .type = (msg[0] & WS_MSG_BINARY) ? HTTPD_WS_TYPE_BINARY : HTTPD_WS_TYPE_TEXT,
+            .payload = msg + 1,
+            .len = msg_len - 1,
         };
 
         for (int i = 0; i < MAX_WS_CLIENTS; i++)
         {
-            int fd = s_ws_fds[i];
-            if (fd < 0)
+            int fd = s_ws_clients[i].fd;
+            if (fd < 0 || !(msg[0] & (1 << i)))
             {
                 continue;
             }
@@ -575,29 +762,37 @@ static void _async_send_worker(void *arg)
     }
 }
 
-esp_err_t http_ws_broadcast_json(const char *json)
+// Queues a message for the client slots in the mask. Nothing is copied when
+// there's nobody to send it to.
+static esp_err_t _ws_broadcast(uint8_t clients, bool is_binary, const void *data, size_t length)
 {
-
-    if (!_ws_init_complete || !json)
+    if (!_ws_init_complete || !data)
     {
         return ESP_FAIL;
     }
 
-    int msg_len = strlen(json);
-    if (msg_len > MAX_WS_BROADCAST_SIZE)
+    if (length > MAX_WS_BROADCAST_SIZE)
     {
         ESP_LOGW(TAG, "Couldn't send broadcast message. Too long.");
         return ESP_FAIL;
     }
-    if (msg_len==0) {
+    if (length == 0)
+    {
         return ESP_FAIL;
     }
+    if (!clients)
+    {
+        return ESP_OK;
+    }
 
+    static uint8_t msg[MAX_WS_BROADCAST_SIZE + 1]; // Only touched under the lock
     portENTER_CRITICAL(&_broadcast_messages_lock);
+    msg[0] = clients | (is_binary ? WS_MSG_BINARY : 0);
+    memcpy(msg + 1, data, length);
     bool is_empty = xStreamBufferNextMessageLengthBytes(_broadcast_messages) > 0;
-    size_t len_written = xMessageBufferSend(_broadcast_messages, json, msg_len, 0);
+    size_t len_written = xMessageBufferSend(_broadcast_messages, msg, length + 1, 0);
     portEXIT_CRITICAL(&_broadcast_messages_lock);
-    if (len_written==0)
+    if (len_written == 0)
     {
         return ESP_FAIL;
     }
@@ -609,6 +804,148 @@ esp_err_t http_ws_broadcast_json(const char *json)
     return ESP_OK;
 }
 
+static void _ws_clients_snapshot(ws_client_t *clients)
+{
+    portENTER_CRITICAL(&s_ws_clients_lock);
+    memcpy(clients, s_ws_clients, sizeof(s_ws_clients));
+    portEXIT_CRITICAL(&s_ws_clients_lock);
+}
+
+static uint8_t _ws_topic_mask(const ws_client_t *clients, http_ws_topic_t topic)
+{
+    uint8_t mask = 0;
+    for (int i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        if (clients[i].fd >= 0 && (clients[i].topics & (1 << topic)))
+        {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+}
+
+static uint8_t _ws_topic_clients(http_ws_topic_t topic)
+{
+    ws_client_t clients[MAX_WS_CLIENTS];
+    _ws_clients_snapshot(clients);
+    return _ws_topic_mask(clients, topic);
+}
+
+static uint8_t _ws_stats_clients(bool is_binary)
+{
+    ws_client_t clients[MAX_WS_CLIENTS];
+    _ws_clients_snapshot(clients);
+    uint8_t mask = _ws_topic_mask(clients, HTTP_WS_TOPIC_STATS);
+    for (int i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        if (clients[i].is_stats_binary != is_binary)
+        {
+            mask &= ~(1 << i);
+        }
+    }
+    return mask;
+}
+
+static uint8_t _ws_log_clients(esp_log_level_t level, const char *tag)
+{
+    ws_client_t clients[MAX_WS_CLIENTS];
+    _ws_clients_snapshot(clients);
+    uint8_t mask = _ws_topic_mask(clients, HTTP_WS_TOPIC_LOGS);
+    for (int i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        const ws_client_t *client = &clients[i];
+        if (level > client->log_level || (client->log_tag[0] && strcmp(tag, client->log_tag)))
+        {
+            mask &= ~(1 << i);
+        }
+    }
+    return mask;
+}
+
+esp_err_t http_ws_broadcast_json(const char *json)
+{
+    uint8_t clients = 0;
+    portENTER_CRITICAL(&s_ws_clients_lock);
+    for (int i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        if (s_ws_clients[i].fd >= 0)
+        {
+            clients |= 1 << i;
+        }
+    }
+    portEXIT_CRITICAL(&s_ws_clients_lock);
+    return _ws_broadcast(clients, false, json, json ? strlen(json) : 0);
+}
+
+bool http_ws_has_subscribers(http_ws_topic_t topic)
+{
+    return _ws_topic_clients(topic) != 0;
+}
+
+esp_err_t http_ws_publish_json(http_ws_topic_t topic, const char *json)
+{
+    return _ws_broadcast(_ws_topic_clients(topic), false, json, json ? strlen(json) : 0);
+}
+
+bool http_ws_log_wanted(esp_log_level_t level, const char *tag)
+{
+    return _ws_log_clients(level, tag) != 0;
+}
+
+esp_err_t http_ws_publish_log(esp_log_level_t level, const char *tag, const char *json)
+{
+    return _ws_broadcast(_ws_log_clients(level, tag), false, json, json ? strlen(json) : 0);
+}
+
+esp_err_t http_ws_broadcast_stats_json(const char *json)
+{
+    return _ws_broadcast(_ws_stats_clients(false), false, json, json ? strlen(json) : 0);
+}
+
+esp_err_t http_ws_send_stats_binary(uint8_t clients, const uint8_t *data, size_t length)
+{
+    return _ws_broadcast(clients & _ws_stats_clients(true), true, data, length);
+}
+
+bool http_ws_stats_json_wanted(void)
+{
+    return _ws_stats_clients(false) != 0;
+}
+
+// Binary subscribers due a frame, elapsed_ms after the last call. Those
+// that have just subscribed are due at once and are also set in
+// snapshot_clients.
+uint8_t http_ws_stats_binary_due(uint32_t elapsed_ms, uint8_t *snapshot_clients)
+{
+    uint8_t due = 0;
+    uint8_t snapshots = 0;
+    portENTER_CRITICAL(&s_ws_clients_lock);
+    for (int i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        ws_client_t *client = &s_ws_clients[i];
+        if (client->fd < 0 || !(client->topics & (1 << HTTP_WS_TOPIC_STATS)) || !client->is_stats_binary)
+        {
+            continue;
+        }
+        client->stats_wait_ms += elapsed_ms;
+        if (client->is_stats_snapshot_wanted)
+        {
+            client->is_stats_snapshot_wanted = false;
+            snapshots |= 1 << i;
+        }
+        else if (client->stats_wait_ms < client->stats_interval_ms)
+        {
+            continue;
+        }
+        client->stats_wait_ms = 0;
+        due |= 1 << i;
+    }
+    portEXIT_CRITICAL(&s_ws_clients_lock);
+
+    *snapshot_clients = snapshots;
+    return due;
+}
+
 void http_ws_close_handler(httpd_handle_t hd, int sockfd)
 {
     ws_client_remove(sockfd);
@@ -617,7 +954,7 @@ void http_ws_close_handler(httpd_handle_t hd, int sockfd)
 
 void http_ws_init(void)
 {
-    _broadcast_messages = xMessageBufferCreate(MAX_WS_BROADCAST_SIZE * 4);
+    _broadcast_messages = xMessageBufferCreate(MAX_WS_BROADCAST_SIZE * 8);
     ws_clients_init();
     _ws_init_complete = true;
 }
@@ -10,20 +10,295 @@
  * See the LICENSE file in the project root for full license information.
 */
 
+#include <stdatomic.h>
+#include <stddef.h>
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_memory_utils.h"
 #include "logging.h"
 #include "http.h"
 
 static vprintf_like_t original_logger;
 
-static QueueHandle_t s_log_queue;
+logging_stats_t logging_stats;
 
 #define LOG_LINE_MAX 256
 
+// Log calls only pack the format pointer and raw arguments into a ring of
+// variable length records; the logging task does the formatting, UART and
+// WebSocket output later. A record that doesn't fit is dropped and counted.
+#define LOG_RING_SIZE 4096   // Power of two. All the memory logging gets.
+#define LOG_RECORD_MAX 256   // Longer records have their last arguments cut off
+#define LOG_RECORD_ALIGN 4
+#define LOG_STR_REF 0xFFFFFFFF // String argument kept as a pointer into flash
+
+#define LOG_REC_PAD 0x01       // Filler up to the end of the ring
+#define LOG_REC_FMT_COPIED 0x02 // Format wasn't in flash, so its text comes first
+#define LOG_REC_TRUNCATED 0x04
+
 typedef struct {
-    char line[LOG_LINE_MAX];
-} log_msg_t;
+    volatile uint16_t size; // Whole record, aligned. 0 until it's written.
+    uint8_t flags;
+    uint8_t spec_count;     // Conversions whose arguments follow
+    const char *fmt;
+    uint8_t args[];
+} log_record_t;
+
+static uint8_t s_log_ring[LOG_RING_SIZE] __attribute__((aligned(LOG_RECORD_ALIGN)));
+static atomic_uint s_log_head; // Reserved up to here
+static atomic_uint s_log_tail; // Read up to here
+static TaskHandle_t s_log_task;
+
+typedef enum {
+    LOG_ARG_NONE, // %% or something we don't understand
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_INTMAX,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LDOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STR,
+} log_arg_t;
+
+typedef struct {
+    const char *start; // The '%'
+    const char *end;   // Just past the conversion character
+    bool is_star_width;
+    bool is_star_precision;
+    int precision;     // -1 if none, or given by '*'
+    log_arg_t arg;
+} log_spec_t;
+
+// Finds the next conversion in a printf format. Packing and formatting both
+// walk the format with this, so they agree on the arguments.
+static const char *_log_next_spec(const char *p, log_spec_t *spec)
+{
+    p = strchr(p, '%');
+    if (!p) {
+        return NULL;
+    }
+
+    *spec = (log_spec_t){ .start = p++, .precision = -1 };
+    while (*p && strchr("-+ #0", *p)) {
+        p++;
+    }
+    if (*p == '*') {
+        spec->is_star_width = true;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        spec->precision = 0;
+        if (*p == '*') {
+            spec->is_star_precision = true;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            spec->precision = spec->precision * 10 + (*p++ - '0');
+        }
+    }
+
+    log_arg_t int_arg = LOG_ARG_INT;
+    if (p[0] == 'h') {
+        p += (p[1] == 'h') ? 2 : 1;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        int_arg = LOG_ARG_LLONG;
+        p += 2;
+    } else if (*p == 'l') {
+        int_arg = LOG_ARG_LONG;
+        p++;
+    } else if (*p == 'z') {
+        int_arg = LOG_ARG_SIZE;
+        p++;
+    } else if (*p == 't') {
+        int_arg = LOG_ARG_PTRDIFF;
+        p++;
+    } else if (*p == 'j') {
+        int_arg = LOG_ARG_INTMAX;
+        p++;
+    } else if (*p == 'L') {
+        int_arg = LOG_ARG_LDOUBLE;
+        p++;
+    }
+
+    switch (*p) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            spec->arg = int_arg == LOG_ARG_LDOUBLE ? LOG_ARG_INT : int_arg;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec->arg = int_arg == LOG_ARG_LDOUBLE ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+            break;
+        case 'p': spec->arg = LOG_ARG_PTR; break;
+        case 's': spec->arg = LOG_ARG_STR; break;
+        default:  spec->arg = LOG_ARG_NONE; break;
+    }
+
+    spec->end = *p ? p + 1 : p;
+    return spec->end;
+}
+
+static size_t _log_arg_size(log_arg_t arg)
+{
+    switch (arg) {
+        case LOG_ARG_INT:     return sizeof(int);
+        case LOG_ARG_LONG:    return sizeof(long);
+        case LOG_ARG_LLONG:   return sizeof(long long);
+        case LOG_ARG_SIZE:    return sizeof(size_t);
+        case LOG_ARG_PTRDIFF: return sizeof(ptrdiff_t);
+        case LOG_ARG_INTMAX:  return sizeof(intmax_t);
+        case LOG_ARG_DOUBLE:  return sizeof(double);
+        case LOG_ARG_LDOUBLE: return sizeof(long double);
+        case LOG_ARG_PTR:     return sizeof(void *);
+        default:              return 0;
+    }
+}
+
+static size_t _log_align(size_t n)
+{
+    return (n + LOG_RECORD_ALIGN - 1) & ~(LOG_RECORD_ALIGN - 1);
+}
+
+// Packs one log call into rec. Strings outside flash are copied, as the
+// caller's buffer will be gone by the time it's formatted.
+static size_t _log_pack(log_record_t *rec, const char *fmt, va_list args)
+{
+    uint8_t *out = rec->args;
+    uint8_t *limit = (uint8_t *)rec + LOG_RECORD_MAX;
+
+    rec->flags = 0;
+    rec->spec_count = 0;
+    rec->fmt = fmt;
+    bool is_fmt_cut = false;
+    if (!esp_ptr_in_drom(fmt)) {
+        // Arguments are packed for the copy, which is what gets formatted
+        size_t len = strnlen(fmt, LOG_RECORD_MAX / 2);
+        is_fmt_cut = fmt[len] != '\0';
+        memcpy(out, fmt, len);
+        out[len] = '\0';
+        fmt = (const char *)out;
+        out += _log_align(len + 1);
+        rec->flags |= LOG_REC_FMT_COPIED;
+    }
+
+    log_spec_t spec;
+    for (const char *p = fmt; (p = _log_next_spec(p, &spec)) && rec->spec_count < UINT8_MAX;) {
+        int star[2];
+        int star_count = 0;
+        if (spec.is_star_width) {
+            star[star_count++] = va_arg(args, int);
+        }
+        if (spec.is_star_precision) {
+            star[star_count++] = va_arg(args, int);
+            spec.precision = star[star_count - 1];
+        }
+
+        union {
+            int i; long l; long long ll; size_t z; ptrdiff_t t; intmax_t j;
+            double d; long double ld; void *ptr;
+        } v;
+        const char *str = NULL;
+        switch (spec.arg) {
+            case LOG_ARG_INT:     v.i = va_arg(args, int); break;
+            case LOG_ARG_LONG:    v.l = va_arg(args, long); break;
+            case LOG_ARG_LLONG:   v.ll = va_arg(args, long long); break;
+            case LOG_ARG_SIZE:    v.z = va_arg(args, size_t); break;
+            case LOG_ARG_PTRDIFF: v.t = va_arg(args, ptrdiff_t); break;
+            case LOG_ARG_INTMAX:  v.j = va_arg(args, intmax_t); break;
+            case LOG_ARG_DOUBLE:  v.d = va_arg(args, double); break;
+            case LOG_ARG_LDOUBLE: v.ld = va_arg(args, long double); break;
+            case LOG_ARG_PTR:     v.ptr = va_arg(args, void *); break;
+            case LOG_ARG_STR:     str = va_arg(args, const char *); break;
+            default: break;
+        }
+
+        size_t size = star_count * sizeof(int) + _log_align(_log_arg_size(spec.arg));
+        if (spec.arg == LOG_ARG_STR) {
+            // A pointer, or at least room to cut the copy short
+            size += sizeof(uint32_t) + (!str || esp_ptr_in_drom(str) ? sizeof(str) : LOG_RECORD_ALIGN);
+        }
+        if (out + size > limit) {
+            rec->flags |= LOG_REC_TRUNCATED;
+            break;
+        }
+
+        memcpy(out, star, star_count * sizeof(int));
+        out += star_count * sizeof(int);
+
+        if (spec.arg != LOG_ARG_STR) {
+            memcpy(out, &v, _log_arg_size(spec.arg));
+            out += _log_align(_log_arg_size(spec.arg));
+        } else if (!str || esp_ptr_in_drom(str)) {
+            uint32_t ref = LOG_STR_REF;
+            str = str ? str : "(null)";
+            memcpy(out, &ref, sizeof(ref));
+            memcpy(out + sizeof(ref), &str, sizeof(str));
+            out += sizeof(ref) + sizeof(str);
+        } else {
+            uint32_t len = spec.precision >= 0 ? strnlen(str, spec.precision) : strlen(str);
+            uint32_t room = limit - out - sizeof(len) - 1;
+            if (len > room) {
+                len = room;
+                rec->flags |= LOG_REC_TRUNCATED;
+            }
+            memcpy(out, &len, sizeof(len));
+            memcpy(out + sizeof(len), str, len);
+            out[sizeof(len) + len] = '\0';
+            out += _log_align(sizeof(len) + len + 1);
+        }
+        rec->spec_count++;
+
+        if (rec->flags & LOG_REC_TRUNCATED) {
+            break;
+        }
+    }
+
+    if (is_fmt_cut) {
+        rec->flags |= LOG_REC_TRUNCATED;
+    }
+    return _log_align(out - (uint8_t *)rec);
+}
+
+// Reserves room for a record without locking; any task may log at any time.
+// Returns NULL when the ring is full.
+static log_record_t *_log_reserve(size_t size, bool *was_empty)
+{
+    unsigned head = atomic_load(&s_log_head);
+    unsigned start, next;
+    do {
+        // A record never wraps: the end of the ring is padded out instead
+        start = head;
+        unsigned to_end = LOG_RING_SIZE - (head & (LOG_RING_SIZE - 1));
+        if (to_end < size) {
+            start += to_end;
+        }
+        next = start + size;
+        if (next - atomic_load(&s_log_tail) > LOG_RING_SIZE) {
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak(&s_log_head, &head, next));
+
+    atomic_uint *used_max = (atomic_uint *)&logging_stats.ring_used_max;
+    unsigned used = next - atomic_load(&s_log_tail);
+    unsigned prev_max = atomic_load(used_max);
+    while (used > prev_max && !atomic_compare_exchange_weak(used_max, &prev_max, used)) {
+    }
+
+    if (start != head) {
+        log_record_t *pad = (log_record_t *)&s_log_ring[head & (LOG_RING_SIZE - 1)];
+        pad->flags = LOG_REC_PAD;
+        atomic_thread_fence(memory_order_release);
+        pad->size = start - head;
+    }
+
+    *was_empty = head == atomic_load(&s_log_tail);
+    return (log_record_t *)&s_log_ring[start & (LOG_RING_SIZE - 1)];
+}
 
 static void _json_escape_append(char *dst, size_t dst_len, const char *src)
 {
@@ -46,49 +321,214 @@ static void _json_escape_append(char *dst, size_t dst_len, const char *src)
 
 static int _logging_func(const char *fmt, va_list args)
 {
-    char buf[LOG_LINE_MAX];
-    int len = vsnprintf(buf, sizeof(buf), fmt, args);
-    if (len < 0) {
-        return len;
+    union {
+        log_record_t rec;
+        uint8_t bytes[LOG_RECORD_MAX];
+    } packed;
+    size_t size = _log_pack(&packed.rec, fmt, args);
+
+    bool was_empty;
+    log_record_t *rec = _log_reserve(size, &was_empty);
+    if (!rec) {
+        atomic_fetch_add((atomic_uint *)&logging_stats.drop_count, 1);
+        return 0;
     }
 
-    // Normal task context, so use xQueueSend
-    if (s_log_queue) {
-        log_msg_t msg;
-        size_t copy_len = (len >= LOG_LINE_MAX) ? LOG_LINE_MAX - 1 : len;
-        memcpy(msg.line, buf, copy_len);
-        msg.line[copy_len] = '\0';
+    // The size goes in last; until then the logging task won't touch it
+    memcpy((uint8_t *)rec + sizeof(rec->size), (uint8_t *)&packed.rec + sizeof(rec->size),
+           size - sizeof(rec->size));
+    atomic_thread_fence(memory_order_release);
+    rec->size = size;
+    atomic_fetch_add((atomic_uint *)&logging_stats.record_count, 1);
 
-        // Best-effort, non-blocking
-        xQueueSend(s_log_queue, &msg, 0);
+    if (was_empty && s_log_task) {
+        xTaskNotifyGive(s_log_task);
     }
+    return 0;
+}
 
-    // Send to serial console
-    fputs(buf, stdout);
+// Formats a record the way vsnprintf would have at the time of the call.
+// Each conversion is handed to snprintf on its own with its saved argument.
+static void _log_format(const log_record_t *rec, char *buf, size_t size)
+{
+    const uint8_t *in = rec->args;
+    const char *fmt = rec->fmt;
+    if (rec->flags & LOG_REC_FMT_COPIED) {
+        fmt = (const char *)in;
+        in += _log_align(strlen(fmt) + 1);
+    }
+
+    size_t len = 0;
+    const char *p = fmt;
+    log_spec_t spec;
+    for (int n = 0; len < size - 1; n++) {
+        const char *next = _log_next_spec(p, &spec);
+        size_t literal = (next ? spec.start : p + strlen(p)) - p;
+        literal = literal < size - 1 - len ? literal : size - 1 - len;
+        memcpy(buf + len, p, literal);
+        len += literal;
+        if (!next || n >= rec->spec_count) {
+            break;
+        }
+
+        // Stars are replaced by the values they stood for
+        char conv[32];
+        size_t conv_len = 0;
+        for (const char *c = spec.start; c < spec.end && conv_len < sizeof(conv) - 12; c++) {
+            if (*c == '*') {
+                int star;
+                memcpy(&star, in, sizeof(star));
+                in += sizeof(star);
+                conv_len += snprintf(conv + conv_len, sizeof(conv) - conv_len, "%d", star);
+            } else {
+                conv[conv_len++] = *c;
+            }
+        }
+        conv[conv_len] = '\0';
+
+        union {
+            int i; long l; long long ll; size_t z; ptrdiff_t t; intmax_t j;
+            double d; long double ld; void *ptr;
+        } v;
+        if (spec.arg != LOG_ARG_STR) {
+            memcpy(&v, in, _log_arg_size(spec.arg));
+            in += _log_align(_log_arg_size(spec.arg));
+        }
 
-    return len;
+        char *out = buf + len;
+        size_t room = size - len;
+        int written = 0;
+        switch (spec.arg) {
+            case LOG_ARG_INT:     written = snprintf(out, room, conv, v.i); break;
+            case LOG_ARG_LONG:    written = snprintf(out, room, conv, v.l); break;
+            case LOG_ARG_LLONG:   written = snprintf(out, room, conv, v.ll); break;
+            case LOG_ARG_SIZE:    written = snprintf(out, room, conv, v.z); break;
+            case LOG_ARG_PTRDIFF: written = snprintf(out, room, conv, v.t); break;
+            case LOG_ARG_INTMAX:  written = snprintf(out, room, conv, v.j); break;
+            case LOG_ARG_DOUBLE:  written = snprintf(out, room, conv, v.d); break;
+            case LOG_ARG_LDOUBLE: written = snprintf(out, room, conv, v.ld); break;
+            case LOG_ARG_PTR:     written = snprintf(out, room, conv, v.ptr); break;
+            case LOG_ARG_STR: {
+                uint32_t str_len;
+                const char *str;
+                memcpy(&str_len, in, sizeof(str_len));
+                if (str_len == LOG_STR_REF) {
+                    memcpy(&str, in + sizeof(str_len), sizeof(str));
+                    in += sizeof(str_len) + sizeof(str);
+                } else {
+                    str = (const char *)in + sizeof(str_len);
+                    in += _log_align(sizeof(str_len) + str_len + 1);
+                }
+                written = snprintf(out, room, conv, str);
+                break;
+            }
+            default:
+                written = snprintf(out, room, "%s", spec.end[-1] == '%' ? "%" : "");
+                break;
+        }
+        if (written > 0) {
+            len += (size_t)written < room ? (size_t)written : room - 1;
+        }
+        p = spec.end;
+    }
+
+    if (rec->flags & LOG_REC_TRUNCATED) {
+        len = len < size - 5 ? len : size - 5;
+        memcpy(buf + len, "...\n", 4);
+        len += 4;
+    }
+    buf[len] = '\0';
+}
+
+// Lines look like "I (1234) tag: text", possibly wrapped in colour codes.
+// Anything else counts as info with no tag.
+static esp_log_level_t _log_parse(const char *line, char *tag, size_t tag_len)
+{
+    if (line[0] == '\033') {
+        const char *m = strchr(line, 'm');
+        line = m ? m + 1 : line;
+    }
+
+    tag[0] = '\0';
+    const char *open = strstr(line, ") ");
+    const char *colon = open ? strchr(open + 2, ':') : NULL;
+    if (colon) {
+        size_t len = colon - (open + 2);
+        len = len < tag_len - 1 ? len : tag_len - 1;
+        memcpy(tag, open + 2, len);
+        tag[len] = '\0';
+    }
+
+    switch (line[0]) {
+        case 'E': return ESP_LOG_ERROR;
+        case 'W': return ESP_LOG_WARN;
+        case 'D': return ESP_LOG_DEBUG;
+        case 'V': return ESP_LOG_VERBOSE;
+        default:  return ESP_LOG_INFO;
+    }
 }
 
-static void _log_to_ws(void *arg)
+static void _log_output(const char *line)
 {
-    log_msg_t msg;
     char json[LOG_LINE_MAX + 64];
+    char tag[32];
+
+    // Send to serial console
+    fputs(line, stdout);
+
+    esp_log_level_t level = _log_parse(line, tag, sizeof(tag));
+    if (!http_ws_log_wanted(level, tag)) {
+        return;
+    }
+
+    // Send log to web listeners
+    strncpy(json, "{\"type\":\"log\",\"line\":\"", sizeof(json));
+    _json_escape_append(json, sizeof(json)-3, line);
+    strlcat(json, "\"}", sizeof(json));
+    http_ws_publish_log(level, tag, json);
+}
+
+static void _log_task(void *arg)
+{
+    char line[LOG_LINE_MAX];
+    uint32_t drops_reported = 0;
 
     while (1) {
-        if (xQueueReceive(s_log_queue, &msg, portMAX_DELAY) == pdTRUE) {
+        unsigned tail = atomic_load(&s_log_tail);
+        log_record_t *rec = (log_record_t *)&s_log_ring[tail & (LOG_RING_SIZE - 1)];
+        uint16_t size = rec->size;
+        if (tail == atomic_load(&s_log_head) || !size) {
+            // Empty, or the next record is still being written
+            uint32_t drops = logging_stats.drop_count;
+            if (drops != drops_reported) {
+                snprintf(line, sizeof(line), "W (%lu) logging: %lu log lines dropped\n",
+                         esp_log_timestamp(), drops - drops_reported);
+                _log_output(line);
+                drops_reported = drops;
+            }
+            // A record part written is done within a tick or two, and
+            // its writer won't notify unless the ring was empty
+            ulTaskNotifyTake(pdTRUE, tail == atomic_load(&s_log_head) ? pdMS_TO_TICKS(100) : 1);
+            continue;
+        }
+        atomic_thread_fence(memory_order_acquire);
 
-            // Send log to web listeners
-            strncpy(json, "{\"type\":\"log\",\"line\":\"", sizeof(json));
-            _json_escape_append(json, sizeof(json)-3,  msg.line);
-            strlcat(json, "\"}", sizeof(json));
-            http_ws_broadcast_json(json);
+        if (!(rec->flags & LOG_REC_PAD)) {
+            _log_format(rec, line, sizeof(line));
+            _log_output(line);
         }
+
+        // Cleared so a later record written here isn't taken as done early
+        memset(rec, 0, size);
+        atomic_thread_fence(memory_order_release);
+        atomic_store(&s_log_tail, tail + size);
     }
 }
 
 void logging_init(void)
 {
-    s_log_queue = xQueueCreate(32, sizeof(log_msg_t));
+    // Formatting is the least urgent thing we do, so run alongside the
+    // bridge tasks rather than above them
+    xTaskCreate(_log_task, "logging", 8192, NULL, 1, &s_log_task);
     original_logger = esp_log_set_vprintf(_logging_func);
-    xTaskCreate(_log_to_ws, "logging", 8192, NULL, 5, NULL);
 }
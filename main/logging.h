@@ -12,6 +12,15 @@
 
 #pragma once
 
+#include <stdint.h>
 #include "esp_log.h"
 
+typedef struct {
+    uint32_t record_count;  // Log calls taken
+    uint32_t drop_count;    // ... and lost because the ring was full
+    uint32_t ring_used_max; // Most of the ring in use at once, in bytes
+} logging_stats_t;
+
+extern logging_stats_t logging_stats;
+
 void logging_init(void);
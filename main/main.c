@@ -10,6 +10,7 @@
  * See the LICENSE file in the project root for full license information.
  */
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -25,6 +26,8 @@
 #include "http.h"
 #include "econet.h"
 #include "aun_bridge.h"
+#include "fileserver.h"
+#include "print_spool.h"
 #include "logging.h"
 
 #define CLK_PIN 6
@@ -35,27 +38,20 @@
 #define CLK_OE_PIN 4
 #define CLK_FREQ_HZ 100000
 
+#define STATS_TICK_MS 250
+#define STATS_JSON_TICKS 4        // The JSON streams go out once a second
+#define STATS_SNAPSHOT_FRAMES 60  // Resend everything now and then in case a frame was lost
+
+// The web UI isn't a filesystem; http.c maps its partition directly
 void init_fs(void)
 {
-    {
-        esp_vfs_littlefs_conf_t conf = {
-            .base_path = "/app",
-            .partition_label = "rootfs",
-            .format_if_mount_failed = true,
-            .dont_mount = false,
-        };
-        ESP_ERROR_CHECK(esp_vfs_littlefs_register(&conf));
-    }
-
-    {
-        esp_vfs_littlefs_conf_t conf = {
-            .base_path = "/user",
-            .partition_label = "user",
-            .format_if_mount_failed = true,
-            .dont_mount = false,
-        };
-        ESP_ERROR_CHECK(esp_vfs_littlefs_register(&conf));
-    }
+    esp_vfs_littlefs_conf_t conf = {
+        .base_path = "/user",
+        .partition_label = "user",
+        .format_if_mount_failed = true,
+        .dont_mount = false,
+    };
+    ESP_ERROR_CHECK(esp_vfs_littlefs_register(&conf));
 }
 
 void print_task_list(void)
@@ -73,6 +69,375 @@ void print_task_list(void)
     // free(buf);
 }
 
+// Appends to a JSON message being built in buf. len is left negative once
+// the message no longer fits, and further appends are ignored.
+static void __attribute__((format(printf, 4, 5))) json_append(char *buf, size_t size, int *len, const char *fmt, ...)
+{
+    if (*len < 0)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, args);
+    va_end(args);
+    *len = (n < 0 || n >= (int)size - *len) ? -1 : *len + n;
+}
+
+static void publish_stats_json(const char *buf, int len)
+{
+    if (len > 0)
+    {
+        http_ws_publish_json(HTTP_WS_TOPIC_STATS, buf);
+    }
+    else
+    {
+        ESP_LOGW("ws", "JSON too long or error building JSON");
+    }
+}
+
+static const aunbridge_station_stats_t *find_station_stats(const aunbridge_station_stats_t *stats, int count,
+                                                           uint8_t station_id)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (stats[i].station_id == station_id)
+        {
+            return &stats[i];
+        }
+    }
+    return NULL;
+}
+
+// Stream per-station counters for one table. Only stations whose counters
+// changed since the last call are sent, split over as many messages as
+// needed. prev is matched by station, as slots are reused. Rows are
+// [station, frames_in, bytes_in, frames_out, bytes_out, retries, aborts,
+// nacks, last_seen_s, latency_avg_us, latency_max_us].
+static void broadcast_station_stats(char *buf, size_t size, const char *table,
+                                    const aunbridge_station_stats_t *stats, int count,
+                                    aunbridge_station_stats_t *prev, int *prev_count)
+{
+    uint32_t now_s = xTaskGetTickCount() / configTICK_RATE_HZ;
+    int header_len = snprintf(buf, size, "{\"type\":\"station_stats\",\"table\":\"%s\",\"now\":%lu,\"rows\":[",
+                              table, now_s);
+    int len = header_len;
+
+    for (int i = 0; i < count; i++)
+    {
+        const aunbridge_station_stats_t *was = find_station_stats(prev, *prev_count, stats[i].station_id);
+        if (was != NULL && !memcmp(&stats[i].counters, &was->counters, sizeof(was->counters)))
+        {
+            continue;
+        }
+
+        char row[160];
+        const aunbridge_station_counters_t *c = &stats[i].counters;
+        int row_len = snprintf(row, sizeof(row), "[%u,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu]",
+                               stats[i].station_id,
+                               c->frames_in, c->bytes_in,
+                               c->frames_out, c->bytes_out,
+                               c->retries, c->aborts, c->nacks,
+                               c->last_seen_ms / 1000,
+                               c->latency_avg_us, c->latency_max_us);
+
+        if (len > header_len && len + row_len + 3 > (int)size)
+        {
+            snprintf(buf + len, size - len, "]}");
+            http_ws_publish_json(HTTP_WS_TOPIC_STATS, buf);
+            len = header_len; // Header is still in place
+        }
+        if (len > header_len)
+        {
+            buf[len++] = ',';
+        }
+        memcpy(buf + len, row, row_len);
+        len += row_len;
+    }
+
+    // Always finish with a message, even an empty one, so the UI gets the
+    // current time
+    snprintf(buf + len, size - len, "]}");
+    http_ws_publish_json(HTTP_WS_TOPIC_STATS, buf);
+
+    memcpy(prev, stats, count * sizeof(*stats));
+    *prev_count = count;
+}
+
+// Per-peer timing as [station, srtt_us, rttvar_us, rto_ms], split over as
+// many messages as needed. The first has "first":true and replaces the
+// UI's list; the rest add to it.
+static void broadcast_peer_stats(char *buf, size_t size)
+{
+    static aunbridge_peer_stats_t peers[AUN_MAX_MAPPED_STATIONS];
+    int count = aunbridge_get_peer_stats(peers, AUN_MAX_MAPPED_STATIONS);
+
+    int header_len = snprintf(buf, size, "{\"type\":\"aun_peers\",\"first\":true,\"peers\":[");
+    int len = header_len;
+    for (int i = 0; i < count; i++)
+    {
+        char row[48];
+        int row_len = snprintf(row, sizeof(row), "[%u,%lu,%lu,%lu]",
+                               peers[i].station_id,
+                               peers[i].srtt_us,
+                               peers[i].rttvar_us,
+                               peers[i].rto_ms);
+
+        if (len > header_len && len + row_len + 3 > (int)size)
+        {
+            snprintf(buf + len, size - len, "]}");
+            http_ws_publish_json(HTTP_WS_TOPIC_STATS, buf);
+            header_len = snprintf(buf, size, "{\"type\":\"aun_peers\",\"first\":false,\"peers\":[");
+            len = header_len;
+        }
+        if (len > header_len)
+        {
+            buf[len++] = ',';
+        }
+        memcpy(buf + len, row, row_len);
+        len += row_len;
+    }
+
+    snprintf(buf + len, size - len, "]}");
+    http_ws_publish_json(HTTP_WS_TOPIC_STATS, buf);
+}
+
+// The counters as JSON, for clients that haven't asked for binary frames
+static void broadcast_stats_json(char *buf, size_t size)
+{
+    aunbridge_stats_t aun = aunbridge_stats;
+    econet_stats_t eco = econet_stats;
+
+    int len = snprintf(buf, size,
+                       "{"
+                       "\"type\":\"stats_stream\","
+                       "\"aunbridge_stats\":{"
+                       "\"tx_count\":%lu,"
+                       "\"tx_retry_count\":%lu,"
+                       "\"tx_abort_count\":%lu,"
+                       "\"tx_error_count\":%lu,"
+                       "\"tx_ack_count\":%lu,"
+                       "\"tx_nack_count\":%lu,"
+                       "\"rx_data_count\":%lu,"
+                       "\"rx_ack_count\":%lu,"
+                       "\"rx_stale_ack_count\":%lu,"
+                       "\"rx_nack_count\":%lu,"
+                       "\"rx_unknown_count\":%lu,"
+                       "\"rx_duplicate_count\":%lu,"
+                       "\"rx_reorder_count\":%lu,"
+                       "\"rx_reorder_timeout_count\":%lu,"
+                       "\"trunk_tx_frame_count\":%lu,"
+                       "\"trunk_tx_datagram_count\":%lu,"
+                       "\"tx_broadcast_count\":%lu,"
+                       "\"rx_broadcast_count\":%lu,"
+                       "\"rx_broadcast_drop_count\":%lu,"
+                       "\"fs_cache_hit_count\":%lu,"
+                       "\"fs_cache_miss_count\":%lu,"
+                       "\"rx_readahead_count\":%lu,"
+                       "\"rx_readahead_fail_count\":%lu,"
+                       "\"bridge_query_count\":%lu,"
+                       "\"fileserver_request_count\":%lu,"
+                       "\"fileserver_error_count\":%lu,"
+                       "\"fileserver_service_avg_us\":%lu,"
+                       "\"fileserver_service_max_us\":%lu,"
+                       "\"print_job_count\":%lu,"
+                       "\"print_forward_count\":%lu,"
+                       "\"print_waiting_count\":%lu,"
+                       "\"print_retry_count\":%lu,"
+                       "\"print_drop_count\":%lu"
+                       "},"
+                       "\"econet_stats\":{"
+                       "\"rx_frame_count\":%lu,"
+                       "\"rx_crc_fail_count\":%lu,"
+                       "\"rx_short_frame_count\":%lu,"
+                       "\"rx_abort_count\":%lu,"
+                       "\"rx_oversize_count\":%lu,"
+                       "\"rx_ack_count\":%lu,"
+                       "\"rx_nack_count\":%lu,"
+                       "\"rx_error_count\":%lu,"
+                       "\"tx_frame_count\":%lu,"
+                       "\"tx_ack_count\":%lu"
+                       "},"
+                       "\"logging_stats\":{"
+                       "\"drop_count\":%lu"
+                       "}"
+                       "}",
+                       aun.tx_count,
+                       aun.tx_retry_count,
+                       aun.tx_abort_count,
+                       aun.tx_error_count,
+                       aun.tx_ack_count,
+                       aun.tx_nack_count,
+                       aun.rx_data_count,
+                       aun.rx_ack_count,
+                       aun.rx_stale_ack_count,
+                       aun.rx_nack_count,
+                       aun.rx_unknown_count,
+                       aun.rx_duplicate_count,
+                       aun.rx_reorder_count,
+                       aun.rx_reorder_timeout_count,
+                       aun.trunk_tx_frame_count,
+                       aun.trunk_tx_datagram_count,
+                       aun.tx_broadcast_count,
+                       aun.rx_broadcast_count,
+                       aun.rx_broadcast_drop_count,
+                       aun.fs_cache_hit_count,
+                       aun.fs_cache_miss_count,
+                       aun.rx_readahead_count,
+                       aun.rx_readahead_fail_count,
+                       aun.bridge_query_count,
+                       fileserver_stats.request_count,
+                       fileserver_stats.error_count,
+                       fileserver_stats.service_avg_us,
+                       fileserver_stats.service_max_us,
+                       print_spool_stats.job_count,
+                       print_spool_stats.job_forward_count,
+                       print_spool_stats.job_waiting_count,
+                       print_spool_stats.forward_retry_count,
+                       print_spool_stats.drop_count,
+                       eco.rx_frame_count,
+                       eco.rx_crc_fail_count,
+                       eco.rx_short_frame_count,
+                       eco.rx_abort_count,
+                       eco.rx_oversize_count,
+                       eco.rx_ack_count,
+                       eco.rx_nack_count,
+                       eco.rx_error_count,
+                       eco.tx_frame_count,
+                       eco.tx_ack_count,
+                       logging_stats.drop_count);
+
+    if (len > 0 && len < (int)size)
+    {
+        http_ws_broadcast_stats_json(buf);
+    }
+    else
+    {
+        ESP_LOGW("ws", "JSON too long or error building JSON");
+    }
+}
+
+// Counters in the binary stats stream, in wire order. The first ones follow
+// the JSON stream's aunbridge_stats and then econet_stats; later additions
+// are appended wherever they live in the JSON. The web UI's
+// STATS_BINARY_FIELDS says where each goes. Appending is fine; anything
+// else needs HTTP_WS_STATS_VERSION bumped along with the web UI.
+#define STATS_FIELDS(X)                      \
+    X(aun->tx_count)                         \
+    X(aun->tx_retry_count)                   \
+    X(aun->tx_abort_count)                   \
+    X(aun->tx_error_count)                   \
+    X(aun->tx_ack_count)                     \
+    X(aun->tx_nack_count)                    \
+    X(aun->rx_data_count)                    \
+    X(aun->rx_ack_count)                     \
+    X(aun->rx_nack_count)                    \
+    X(aun->rx_unknown_count)                 \
+    X(aun->rx_duplicate_count)               \
+    X(aun->rx_reorder_count)                 \
+    X(aun->rx_reorder_timeout_count)         \
+    X(aun->trunk_tx_frame_count)             \
+    X(aun->trunk_tx_datagram_count)          \
+    X(aun->tx_broadcast_count)               \
+    X(aun->rx_broadcast_count)               \
+    X(aun->rx_broadcast_drop_count)          \
+    X(aun->fs_cache_hit_count)               \
+    X(aun->fs_cache_miss_count)              \
+    X(aun->rx_readahead_count)               \
+    X(aun->rx_readahead_fail_count)          \
+    X(aun->bridge_query_count)               \
+    X(fileserver_stats.request_count)        \
+    X(fileserver_stats.error_count)          \
+    X(fileserver_stats.service_avg_us)       \
+    X(fileserver_stats.service_max_us)       \
+    X(print_spool_stats.job_count)           \
+    X(print_spool_stats.job_forward_count)   \
+    X(print_spool_stats.job_waiting_count)   \
+    X(print_spool_stats.forward_retry_count) \
+    X(print_spool_stats.drop_count)          \
+    X(eco->rx_frame_count)                   \
+    X(eco->rx_crc_fail_count)                \
+    X(eco->rx_short_frame_count)             \
+    X(eco->rx_abort_count)                   \
+    X(eco->rx_oversize_count)                \
+    X(eco->rx_ack_count)                     \
+    X(eco->rx_nack_count)                    \
+    X(eco->rx_error_count)                   \
+    X(eco->tx_frame_count)                   \
+    X(eco->tx_ack_count)                     \
+    X(logging_stats.drop_count)              \
+    X(aun->rx_stale_ack_count)
+
+#define STATS_FIELD_ONE(value) +1
+#define STATS_FIELD_COUNT (0 STATS_FIELDS(STATS_FIELD_ONE))
+
+static void stats_fields(uint32_t *v, const aunbridge_stats_t *aun, const econet_stats_t *eco)
+{
+    int n = 0;
+#define STATS_FIELD_VALUE(value) v[n++] = (value);
+    STATS_FIELDS(STATS_FIELD_VALUE)
+#undef STATS_FIELD_VALUE
+}
+
+static size_t put_varint(uint8_t *p, uint32_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        p[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+// Binary stats frame: [version, flags, seq] then (field, delta) pairs as
+// LEB128 varints, the delta zigzag encoded. A snapshot (flags bit 0) has
+// every field as a delta from zero; otherwise only the fields that changed
+// since that client's last frame are sent, and nothing at all if none did.
+static void send_stats_binary(int client, const uint32_t *values, bool is_snapshot_wanted)
+{
+    static uint32_t prev[HTTP_WS_MAX_CLIENTS][STATS_FIELD_COUNT];
+    static uint8_t seq[HTTP_WS_MAX_CLIENTS];
+    static int frames_since_snapshot[HTTP_WS_MAX_CLIENTS];
+
+    bool is_snapshot = is_snapshot_wanted || frames_since_snapshot[client] >= STATS_SNAPSHOT_FRAMES;
+
+    uint8_t frame[3 + STATS_FIELD_COUNT * 6];
+    size_t len = 3;
+    for (int f = 0; f < STATS_FIELD_COUNT; f++)
+    {
+        int32_t delta = values[f] - (is_snapshot ? 0 : prev[client][f]);
+        if (!delta && !is_snapshot)
+        {
+            continue;
+        }
+        len += put_varint(frame + len, f);
+        len += put_varint(frame + len, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+    }
+
+    if (len == 3 && !is_snapshot)
+    {
+        return;
+    }
+
+    frame[0] = HTTP_WS_STATS_VERSION;
+    frame[1] = is_snapshot ? 0x01 : 0x00;
+    frame[2] = seq[client];
+
+    if (http_ws_send_stats_binary(1 << client, frame, len) != ESP_OK)
+    {
+        // Deltas only make sense against what the client has
+        frames_since_snapshot[client] = STATS_SNAPSHOT_FRAMES;
+        return;
+    }
+
+    seq[client]++;
+    frames_since_snapshot[client] = is_snapshot ? 0 : frames_since_snapshot[client] + 1;
+    memcpy(prev[client], values, sizeof(prev[client]));
+}
+
 void app_main(void)
 {
 
@@ -102,75 +467,93 @@ void app_main(void)
 
     esp_intr_dump(stderr);
 
-    static char buf[512];
+    static char buf[HTTP_WS_MAX_MESSAGE + 1]; // Messages are split to fit
     for (int i = 0;; i++)
     {
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        vTaskDelay(STATS_TICK_MS / portTICK_PERIOD_MS);
+
+        uint8_t snapshot_clients;
+        uint8_t binary_clients = http_ws_stats_binary_due(STATS_TICK_MS, &snapshot_clients);
+        if (binary_clients)
+        {
+            uint32_t values[STATS_FIELD_COUNT];
+            aunbridge_stats_t aun = aunbridge_stats;
+            econet_stats_t eco = econet_stats;
+            stats_fields(values, &aun, &eco);
+            for (int c = 0; c < HTTP_WS_MAX_CLIENTS; c++)
+            {
+                if (binary_clients & (1 << c))
+                {
+                    send_stats_binary(c, values, snapshot_clients & (1 << c));
+                }
+            }
+        }
+
+        if ((i % STATS_JSON_TICKS) != 0)
+        {
+            continue;
+        }
 
-        if ((i % 10) == 0)
+        if ((i % (10 * STATS_JSON_TICKS)) == 0)
         {
             print_task_list();
         }
 
-        aunbridge_stats_t aun = aunbridge_stats;
-        econet_stats_t eco = econet_stats;
-
-        int len = snprintf(buf, sizeof(buf),
-                           "{"
-                           "\"type\":\"stats_stream\","
-                           "\"aunbridge_stats\":{"
-                           "\"tx_count\":%lu,"
-                           "\"tx_retry_count\":%lu,"
-                           "\"tx_abort_count\":%lu,"
-                           "\"tx_error_count\":%lu,"
-                           "\"tx_ack_count\":%lu,"
-                           "\"tx_nack_count\":%lu,"
-                           "\"rx_data_count\":%lu,"
-                           "\"rx_ack_count\":%lu,"
-                           "\"rx_nack_count\":%lu,"
-                           "\"rx_unknown_count\":%lu"
-                           "},"
-                           "\"econet_stats\":{"
-                           "\"rx_frame_count\":%lu,"
-                           "\"rx_crc_fail_count\":%lu,"
-                           "\"rx_short_frame_count\":%lu,"
-                           "\"rx_abort_count\":%lu,"
-                           "\"rx_oversize_count\":%lu,"
-                           "\"rx_ack_count\":%lu,"
-                           "\"rx_nack_count\":%lu,"
-                           "\"rx_error_count\":%lu,"
-                           "\"tx_frame_count\":%lu,"
-                           "\"tx_ack_count\":%lu"
-                           "}"
-                           "}",
-                           aun.tx_count,
-                           aun.tx_retry_count,
-                           aun.tx_abort_count,
-                           aun.tx_error_count,
-                           aun.tx_ack_count,
-                           aun.tx_nack_count,
-                           aun.rx_data_count,
-                           aun.rx_ack_count,
-                           aun.rx_nack_count,
-                           aun.rx_unknown_count,
-                           eco.rx_frame_count,
-                           eco.rx_crc_fail_count,
-                           eco.rx_short_frame_count,
-                           eco.rx_abort_count,
-                           eco.rx_oversize_count,
-                           eco.rx_ack_count,
-                           eco.rx_nack_count,
-                           eco.rx_error_count,
-                           eco.tx_frame_count,
-                           eco.tx_ack_count);
-
-        if (len > 0 && len < (int)sizeof(buf))
+        if (!http_ws_has_subscribers(HTTP_WS_TOPIC_STATS))
+        {
+            continue;
+        }
+
+        if (http_ws_stats_json_wanted())
         {
-            http_ws_broadcast_json(buf);
+            broadcast_stats_json(buf, sizeof(buf));
         }
-        else
+
+        broadcast_peer_stats(buf, sizeof(buf));
+
+        static aunbridge_station_stats_t econet_now[AUN_MAX_ECONET_STATIONS];
+        static aunbridge_station_stats_t econet_prev[AUN_MAX_ECONET_STATIONS];
+        static aunbridge_station_stats_t aun_now[AUN_MAX_MAPPED_STATIONS];
+        static aunbridge_station_stats_t aun_prev[AUN_MAX_MAPPED_STATIONS];
+        static int econet_prev_count;
+        static int aun_prev_count;
+        int station_count = aunbridge_get_econet_station_stats(econet_now, AUN_MAX_ECONET_STATIONS);
+        broadcast_station_stats(buf, sizeof(buf), "econet", econet_now, station_count, econet_prev, &econet_prev_count);
+        station_count = aunbridge_get_aun_station_stats(aun_now, AUN_MAX_MAPPED_STATIONS);
+        broadcast_station_stats(buf, sizeof(buf), "aun", aun_now, station_count, aun_prev, &aun_prev_count);
+
+        // Econet TX priority classes as [frames, avg_wait_ms, max_wait_ms]
+        aunbridge_class_stats_t classes[AUN_SCHED_CLASSES];
+        int class_count = aunbridge_get_class_stats(classes, sizeof(classes) / sizeof(classes[0]));
+        int len = 0;
+        json_append(buf, sizeof(buf), &len, "{\"type\":\"econet_classes\",\"classes\":[");
+        for (int c = 0; c < class_count; c++)
+        {
+            json_append(buf, sizeof(buf), &len, "%s[%lu,%lu,%lu]",
+                        c ? "," : "",
+                        classes[c].tx_count,
+                        classes[c].tx_count ? classes[c].wait_total_ms / classes[c].tx_count : 0,
+                        classes[c].wait_max_ms);
+        }
+        json_append(buf, sizeof(buf), &len, "]}");
+        publish_stats_json(buf, len);
+
+        // Econet TX queues as [station, depth, max_depth, avg_wait_ms, max_wait_ms]
+        aunbridge_queue_stats_t queues[AUN_MAX_ECONET_STATIONS];
+        int queue_count = aunbridge_get_queue_stats(queues, sizeof(queues) / sizeof(queues[0]));
+        len = 0;
+        json_append(buf, sizeof(buf), &len, "{\"type\":\"econet_queues\",\"queues\":[");
+        for (int q = 0; q < queue_count; q++)
         {
-            ESP_LOGW("ws", "JSON too long or error building JSON");
+            json_append(buf, sizeof(buf), &len, "%s[%u,%u,%u,%lu,%lu]",
+                        q ? "," : "",
+                        queues[q].station_id,
+                        queues[q].depth,
+                        queues[q].depth_max,
+                        queues[q].wait_avg_ms,
+                        queues[q].wait_max_ms);
         }
+        json_append(buf, sizeof(buf), &len, "]}");
+        publish_stats_json(buf, len);
     }
 }
@@ -0,0 +1,77 @@
+/*
+ * EconetWiFi
+ * Copyright (c) 2025 Paul G. Banks <https://paulbanks.org/projects/econet>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+
+// NetFS requests go to this port. The first five bytes are the reply port,
+// function code and the user's URD, CSD and library handles.
+#define NETFS_PORT 0x99
+
+#define NETFS_FN_CLI 0
+#define NETFS_FN_SAVE 1
+#define NETFS_FN_LOAD 2
+#define NETFS_FN_EXAMINE 3
+#define NETFS_FN_CAT_HEADER 4
+#define NETFS_FN_RUN 5
+#define NETFS_FN_OPEN 6
+#define NETFS_FN_CLOSE 7
+#define NETFS_FN_GETBYTE 8
+#define NETFS_FN_PUTBYTE 9
+#define NETFS_FN_GETBYTES 10
+#define NETFS_FN_PUTBYTES 11
+#define NETFS_FN_READ_ARGS 12
+#define NETFS_FN_SET_ARGS 13
+#define NETFS_FN_DISC_NAME 14
+#define NETFS_FN_USERS 15
+#define NETFS_FN_DATE 16
+#define NETFS_FN_EOF 17
+#define NETFS_FN_READ_INFO 18
+#define NETFS_FN_SET_INFO 19
+#define NETFS_FN_DELETE 20
+#define NETFS_FN_USER_ENV 21
+#define NETFS_FN_SET_OPT 22
+#define NETFS_FN_LOGOFF 23
+#define NETFS_FN_USER_INFO 24
+#define NETFS_FN_VERSION 25
+#define NETFS_FN_FREE 26
+#define NETFS_FN_CDIR 27
+#define NETFS_FN_SET_DATE 28
+#define NETFS_FN_CREATE 29
+#define NETFS_FN_USER_FREE 30
+#define NETFS_FN_SET_USER_FREE 31
+#define NETFS_FN_CLIENT_ID 32
+
+// First byte of a reply to NETFS_FN_CLI, telling the client what to do next
+#define NETFS_CLI_DONE 0
+#define NETFS_CLI_SAVE 1
+#define NETFS_CLI_LOAD 2
+#define NETFS_CLI_CAT 3
+#define NETFS_CLI_INFO 4
+#define NETFS_CLI_LOGON 5
+#define NETFS_CLI_SDISC 6
+#define NETFS_CLI_DIR 7
+#define NETFS_CLI_RUN 8
+#define NETFS_CLI_LIB 9
+
+// Return codes, sent in the second byte of a reply with the message after
+#define NETFS_ERR_NOT_LISTENING 0xA2
+#define NETFS_ERR_DIR_NOT_EMPTY 0xB4
+#define NETFS_ERR_ACCESS 0xBD
+#define NETFS_ERR_WRONG_TYPE 0xBE
+#define NETFS_ERR_WHO_ARE_YOU 0xBF
+#define NETFS_ERR_TOO_MANY_OPEN 0xC0
+#define NETFS_ERR_DISC_FULL 0xC6
+#define NETFS_ERR_DISC_FAULT 0xC7
+#define NETFS_ERR_BAD_NAME 0xCC
+#define NETFS_ERR_NOT_FOUND 0xD6
+#define NETFS_ERR_CHANNEL 0xDE
+#define NETFS_ERR_BAD_COMMAND 0xFE
@@ -0,0 +1,495 @@
+/*
+ * EconetWiFi
+ * Copyright (c) 2025 Paul G. Banks <https://paulbanks.org/projects/econet>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the LICENSE file in the project root for full license information.
+ */
+
+// Spooling print server. Beebs print to our station at Econet speed and
+// each job is written to the user partition, gathered into large writes.
+// A second task passes finished jobs on to the AUN print server one block
+// at a time, waiting for each to be acknowledged and backing off while the
+// server is busy or away, so a slow printer never holds up a Beeb.
+//
+// Every data block carries a sequence bit in its control byte and the last
+// block of a job has PRINT_CTRL_END set. Beebs that never send one have
+// their job closed after PRINT_SPOOL_IDLE_MS. Jobs survive a restart; ones
+// that were still arriving are thrown away.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_littlefs.h"
+
+#include "print_spool.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define PRINT_SPOOL_ROOT "/user/spool"
+#define PRINT_SPOOL_PARTITION "user"
+#define PRINT_SPOOL_QUEUE_DEPTH 16
+#define PRINT_SPOOL_RX_WAIT_MS 50     // The Beeb has its ACK already, so wait a little rather than lose data
+#define PRINT_SPOOL_JOBS 4            // Jobs arriving at once
+#define PRINT_SPOOL_BATCH 2048        // Bytes gathered before writing to flash
+#define PRINT_SPOOL_BLOCK 256         // Frame size when passing a job on
+#define PRINT_SPOOL_IDLE_MS 30000     // A job with no data for this long is finished
+#define PRINT_SPOOL_REPEAT_MS 500     // How long a finished job's last block is recognised if sent again
+#define PRINT_SPOOL_FREE_MIN 32768    // Tell the Beebs we're busy with less space than this
+#define PRINT_SPOOL_RETRY_MIN_MS 1000
+#define PRINT_SPOOL_RETRY_MAX_MS 60000
+
+static const char *TAG = "PRINT";
+
+// A job being received from a Beeb
+typedef struct
+{
+    uint8_t client_id; // 0 when the slot is free
+    bool is_open;      // Otherwise just remembering the last block for a while
+    uint32_t job_id;
+    FILE *fp;
+    bool is_failed;   // Couldn't be written, so the rest is swallowed
+    uint8_t last_seq; // PRINT_CTRL_SEQ of the last block, 0xFF before the first
+    uint32_t last_ms;
+    uint32_t length;
+    uint16_t batch_len;
+    uint8_t batch[PRINT_SPOOL_BATCH];
+} print_spool_job_t;
+
+// Work for the spool task: 'F' frame from a Beeb, 'R' reset
+typedef struct
+{
+    char type;
+    uint8_t client_id;
+    uint8_t port;
+    uint8_t control;
+    uint16_t length;
+    uint8_t *data;
+} print_spool_item_t;
+
+print_spool_stats_t print_spool_stats;
+
+// The spool task adds to this and the forward task takes from it
+static atomic_uint *const print_spool_waiting = (atomic_uint *)&print_spool_stats.job_waiting_count;
+
+static print_spool_reply_fn print_spool_reply;
+static print_spool_forward_fn print_spool_forward;
+static QueueHandle_t print_spool_queue;
+static SemaphoreHandle_t print_spool_ready; // Given when a job is finished
+static print_spool_job_t print_spool_jobs[PRINT_SPOOL_JOBS];
+static uint32_t print_spool_next_id;
+
+static uint32_t _print_spool_now_ms(void)
+{
+    return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+static void _print_spool_path(char *path, size_t size, uint32_t job_id, const char *ext)
+{
+    snprintf(path, size, PRINT_SPOOL_ROOT "/%08lu.%s", job_id, ext);
+}
+
+// Job number from a spool file name, if it has the extension given
+static bool _print_spool_parse(const char *name, const char *ext, uint32_t *job_id)
+{
+    char *end;
+    unsigned long id = strtoul(name, &end, 10);
+    if (end == name || *end != '.' || strcmp(end + 1, ext) != 0)
+    {
+        return false;
+    }
+    *job_id = id;
+    return true;
+}
+
+static bool _print_spool_is_full(void)
+{
+    size_t total = 0;
+    size_t used = 0;
+    if (esp_littlefs_info(PRINT_SPOOL_PARTITION, &total, &used) != ESP_OK)
+    {
+        return true;
+    }
+    return total - used < PRINT_SPOOL_FREE_MIN;
+}
+
+static void _print_spool_flush(print_spool_job_t *job)
+{
+    if (job->batch_len == 0)
+    {
+        return;
+    }
+    if (!job->is_failed && fwrite(job->batch, 1, job->batch_len, job->fp) != job->batch_len)
+    {
+        ESP_LOGE(TAG, "Can't write job %lu from station %d. Spool full?", job->job_id, job->client_id);
+        job->is_failed = true;
+    }
+    if (job->is_failed)
+    {
+        print_spool_stats.drop_count++;
+    }
+    job->batch_len = 0;
+}
+
+static void _print_spool_finish(print_spool_job_t *job)
+{
+    _print_spool_flush(job);
+    if (job->fp != NULL)
+    {
+        fclose(job->fp);
+        job->fp = NULL;
+    }
+
+    char part[48];
+    _print_spool_path(part, sizeof(part), job->job_id, "part");
+    if (job->is_failed || job->length == 0)
+    {
+        remove(part);
+    }
+    else
+    {
+        char done[48];
+        _print_spool_path(done, sizeof(done), job->job_id, "job");
+        rename(part, done);
+        ESP_LOGI(TAG, "Spooled job %lu from station %d, %lu bytes", job->job_id, job->client_id, job->length);
+        print_spool_stats.job_count++;
+        atomic_fetch_add(print_spool_waiting, 1);
+        xSemaphoreGive(print_spool_ready);
+    }
+    job->is_open = false;
+}
+
+static print_spool_job_t *_print_spool_job(uint8_t client_id)
+{
+    uint32_t now = _print_spool_now_ms();
+    print_spool_job_t *free_job = NULL;
+    for (int i = 0; i < ARRAY_SIZE(print_spool_jobs); i++)
+    {
+        print_spool_job_t *job = &print_spool_jobs[i];
+        bool is_done = !job->is_open && now - job->last_ms >= PRINT_SPOOL_REPEAT_MS;
+        if (job->client_id == client_id)
+        {
+            if (is_done)
+            {
+                job->last_seq = 0xFF;
+            }
+            return job;
+        }
+        if (free_job == NULL && (job->client_id == 0 || is_done))
+        {
+            free_job = job;
+        }
+    }
+    if (free_job != NULL)
+    {
+        free_job->client_id = client_id;
+        free_job->is_open = false;
+        free_job->last_seq = 0xFF;
+    }
+    return free_job;
+}
+
+static void _print_spool_open(print_spool_job_t *job)
+{
+    job->is_open = true;
+    job->job_id = print_spool_next_id++;
+    job->length = 0;
+    job->batch_len = 0;
+    job->is_failed = _print_spool_is_full();
+
+    char part[48];
+    _print_spool_path(part, sizeof(part), job->job_id, "part");
+    job->fp = job->is_failed ? NULL : fopen(part, "wb");
+    if (job->fp == NULL)
+    {
+        ESP_LOGE(TAG, "Can't start a job for station %d", job->client_id);
+        job->is_failed = true;
+    }
+}
+
+static void _print_spool_data(const print_spool_item_t *item)
+{
+    print_spool_job_t *job = _print_spool_job(item->client_id);
+    if (job == NULL)
+    {
+        ESP_LOGW(TAG, "Too many jobs at once. Data from station %d dropped.", item->client_id);
+        print_spool_stats.drop_count++;
+        return;
+    }
+    job->last_ms = _print_spool_now_ms();
+
+    // A Beeb that missed our ACK sends the same block again
+    uint8_t seq = item->control & PRINT_CTRL_SEQ;
+    if (seq == job->last_seq)
+    {
+        return;
+    }
+    if (!job->is_open)
+    {
+        _print_spool_open(job);
+    }
+    job->last_seq = seq;
+    job->length += item->length;
+    for (size_t done = 0; done < item->length;)
+    {
+        size_t n = MIN(item->length - done, sizeof(job->batch) - job->batch_len);
+        memcpy(&job->batch[job->batch_len], &item->data[done], n);
+        job->batch_len += n;
+        done += n;
+        if (job->batch_len == sizeof(job->batch))
+        {
+            _print_spool_flush(job);
+        }
+    }
+
+    if ((item->control & PRINT_CTRL_END) == PRINT_CTRL_END)
+    {
+        _print_spool_finish(job);
+    }
+}
+
+static void _print_spool_status(const print_spool_item_t *item)
+{
+    uint8_t reply[3] = {_print_spool_is_full() ? PRINT_STATUS_BUSY : PRINT_STATUS_READY, 0, 0};
+    print_spool_reply(item->client_id, PRINT_PORT_STATUS_REPLY, 0x80, reply, sizeof(reply));
+}
+
+static void _print_spool_expire(void)
+{
+    uint32_t now = _print_spool_now_ms();
+    for (int i = 0; i < ARRAY_SIZE(print_spool_jobs); i++)
+    {
+        print_spool_job_t *job = &print_spool_jobs[i];
+        if (job->is_open && now - job->last_ms >= PRINT_SPOOL_IDLE_MS)
+        {
+            _print_spool_finish(job);
+        }
+    }
+}
+
+static void _print_spool_task(void *params)
+{
+    print_spool_item_t item;
+    for (;;)
+    {
+        if (xQueueReceive(print_spool_queue, &item, pdMS_TO_TICKS(1000)) != pdTRUE)
+        {
+            _print_spool_expire();
+            continue;
+        }
+
+        if (item.type == 'R')
+        {
+            for (int i = 0; i < ARRAY_SIZE(print_spool_jobs); i++)
+            {
+                if (print_spool_jobs[i].is_open)
+                {
+                    _print_spool_finish(&print_spool_jobs[i]);
+                }
+                print_spool_jobs[i].client_id = 0;
+            }
+            continue;
+        }
+
+        if (item.port == PRINT_PORT_DATA)
+        {
+            _print_spool_data(&item);
+        }
+        else if (item.port == PRINT_PORT_STATUS)
+        {
+            _print_spool_status(&item);
+        }
+        free(item.data);
+        _print_spool_expire();
+    }
+}
+
+static bool _print_spool_oldest(uint32_t *job_id)
+{
+    DIR *dir = opendir(PRINT_SPOOL_ROOT);
+    if (dir == NULL)
+    {
+        return false;
+    }
+    bool is_found = false;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        uint32_t id;
+        if (_print_spool_parse(de->d_name, "job", &id) && (!is_found || id < *job_id))
+        {
+            *job_id = id;
+            is_found = true;
+        }
+    }
+    closedir(dir);
+    return is_found;
+}
+
+// Pass one job on, a block at a time. Blocks the server doesn't take are
+// sent again, further apart each time, until it does.
+static void _print_spool_forward_job(uint32_t job_id)
+{
+    static uint8_t block[PRINT_SPOOL_BLOCK];
+    static uint8_t seq; // Carried across jobs, so a new job never looks like a repeat
+
+    char path[48];
+    _print_spool_path(path, sizeof(path), job_id, "job");
+    struct stat st;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL || stat(path, &st) != 0)
+    {
+        ESP_LOGE(TAG, "Can't read spooled job %lu. Discarded.", job_id);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Sending job %lu to the print server, %ld bytes", job_id, (long)st.st_size);
+        for (off_t offset = 0; offset < st.st_size;)
+        {
+            size_t n = fread(block, 1, sizeof(block), fp);
+            if (n == 0)
+            {
+                ESP_LOGE(TAG, "Short read on spooled job %lu", job_id);
+                break;
+            }
+            uint8_t control = 0x80 | seq;
+            if (offset + n >= st.st_size)
+            {
+                control |= PRINT_CTRL_END;
+            }
+
+            uint32_t backoff_ms = PRINT_SPOOL_RETRY_MIN_MS;
+            while (!print_spool_forward(control, block, n))
+            {
+                ESP_LOGW(TAG, "Print server didn't take job %lu. Trying again in %lu ms.", job_id, backoff_ms);
+                print_spool_stats.forward_retry_count++;
+                vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+                backoff_ms = MIN(backoff_ms * 2, PRINT_SPOOL_RETRY_MAX_MS);
+            }
+            seq ^= PRINT_CTRL_SEQ;
+            offset += n;
+        }
+        print_spool_stats.job_forward_count++;
+    }
+
+    if (fp != NULL)
+    {
+        fclose(fp);
+    }
+    remove(path);
+    unsigned waiting = atomic_load(print_spool_waiting);
+    while (waiting > 0 && !atomic_compare_exchange_weak(print_spool_waiting, &waiting, waiting - 1))
+    {
+    }
+}
+
+static void _print_spool_forward_task(void *params)
+{
+    for (;;)
+    {
+        uint32_t job_id;
+        if (_print_spool_oldest(&job_id))
+        {
+            _print_spool_forward_job(job_id);
+        }
+        else
+        {
+            xSemaphoreTake(print_spool_ready, portMAX_DELAY);
+        }
+    }
+}
+
+// Tidy the spool after a restart. Finished jobs are kept and sent; ones
+// that were cut off part way are not.
+static void _print_spool_scan(void)
+{
+    DIR *dir = opendir(PRINT_SPOOL_ROOT);
+    if (dir == NULL)
+    {
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        uint32_t id;
+        if (_print_spool_parse(de->d_name, "job", &id))
+        {
+            atomic_fetch_add(print_spool_waiting, 1);
+        }
+        else if (_print_spool_parse(de->d_name, "part", &id))
+        {
+            char path[48];
+            _print_spool_path(path, sizeof(path), id, "part");
+            remove(path);
+        }
+        else
+        {
+            continue;
+        }
+        print_spool_next_id = MAX(print_spool_next_id, id + 1);
+    }
+    closedir(dir);
+}
+
+void print_spool_init(print_spool_reply_fn reply, print_spool_forward_fn forward)
+{
+    print_spool_reply = reply;
+    print_spool_forward = forward;
+    mkdir(PRINT_SPOOL_ROOT, 0775);
+    _print_spool_scan();
+    print_spool_queue = xQueueCreate(PRINT_SPOOL_QUEUE_DEPTH, sizeof(print_spool_item_t));
+    print_spool_ready = xSemaphoreCreateBinary();
+    xTaskCreate(_print_spool_task, "print_spool", 4096, NULL, 1, NULL);
+    xTaskCreate(_print_spool_forward_task, "print_forward", 4096, NULL, 1, NULL);
+}
+
+// Close any jobs arriving, e.g. when the print station number changes
+void print_spool_reset(void)
+{
+    print_spool_item_t item = {.type = 'R'};
+    xQueueSend(print_spool_queue, &item, pdMS_TO_TICKS(100));
+}
+
+// A frame for the print station from a Beeb. Called from the bridge's
+// Econet RX task, so it only takes a copy.
+void print_spool_rx(uint8_t client_id, uint8_t port, uint8_t control, const uint8_t *data, size_t length)
+{
+    if (port != PRINT_PORT_DATA && port != PRINT_PORT_STATUS)
+    {
+        return;
+    }
+    print_spool_item_t item = {
+        .type = 'F',
+        .client_id = client_id,
+        .port = port,
+        .control = control,
+        .length = length,
+        .data = malloc(MAX(length, 1)),
+    };
+    if (item.data == NULL)
+    {
+        ESP_LOGE(TAG, "Out of memory. Frame from station %d dropped.", client_id);
+        print_spool_stats.drop_count++;
+        return;
+    }
+    memcpy(item.data, data, length);
+    if (xQueueSend(print_spool_queue, &item, pdMS_TO_TICKS(PRINT_SPOOL_RX_WAIT_MS)) != pdTRUE)
+    {
+        ESP_LOGW(TAG, "Busy. Frame from station %d dropped.", client_id);
+        print_spool_stats.drop_count++;
+        free(item.data);
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * EconetWiFi
+ * Copyright (c) 2025 Paul G. Banks <https://paulbanks.org/projects/econet>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the LICENSE file in the project root for full license information.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PRINT_PORT_DATA 0xD1
+#define PRINT_PORT_STATUS 0x9F       // Printer server enquiry
+#define PRINT_PORT_STATUS_REPLY 0x9E
+
+// Control byte of a print data frame, top bit aside
+#define PRINT_CTRL_SEQ 0x01 // Alternates each block so a repeat can be spotted
+#define PRINT_CTRL_END 0x06 // Both set on the last block of a job
+
+#define PRINT_STATUS_READY 0x00
+#define PRINT_STATUS_BUSY 0x01
+
+// Puts a frame from the print station on the Econet. Supplied by the
+// bridge, which owns the transmitter.
+typedef bool (*print_spool_reply_fn)(uint8_t client_id, uint8_t port, uint8_t control,
+                                     const uint8_t *data, size_t length);
+
+// Sends a block of a job to the AUN print server and waits for its
+// answer. True once the server has acknowledged it.
+typedef bool (*print_spool_forward_fn)(uint8_t control, const uint8_t *data, size_t length);
+
+typedef struct
+{
+    uint32_t job_count;          // Jobs taken from the Beebs
+    uint32_t job_forward_count;  // ... and passed on to the print server
+    uint32_t job_waiting_count;  // ... still in the spool
+    uint32_t forward_retry_count;
+    uint32_t drop_count;         // Data lost because the spool couldn't keep up or was full
+} print_spool_stats_t;
+
+extern print_spool_stats_t print_spool_stats;
+
+void print_spool_init(print_spool_reply_fn reply, print_spool_forward_fn forward);
+void print_spool_reset(void);
+void print_spool_rx(uint8_t client_id, uint8_t port, uint8_t control, const uint8_t *data, size_t length);
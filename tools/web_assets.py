@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+#
+# EconetWiFi
+# Copyright (c) 2025 Paul G. Banks <https://paulbanks.org/projects/econet>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# See the LICENSE file in the project root for full license information.
+
+"""Packs the web UI into the image flashed to the webui partition.
+
+The HTTP server maps the partition and answers straight from it, so the
+layout is simple and fixed (all little endian, offsets from the start):
+
+    header:  magic "NBWB", u16 version, u16 asset count, u32 image size
+    index:   per asset u32 uri, u32 data, u32 data size, u32 etag,
+             u32 content type, u32 flags
+    strings: NUL terminated, referred to by the index
+    data:    the assets, each 4 byte aligned
+
+Assets are stored gzipped where that makes them smaller (flag 1). The ETag
+is taken from the asset's content, so it only changes when the asset does.
+Flag 2 marks the assets Vite names by content hash (everything under
+assets/), which browsers may keep for good. Keep in step with main/http.c.
+
+Usage: web_assets.py <web dir> <image file> [max size]
+"""
+
+import gzip
+import hashlib
+import os
+import struct
+import sys
+
+MAGIC = b"NBWB"
+VERSION = 1
+HEADER = struct.Struct("<4sHHI")
+ENTRY = struct.Struct("<IIIIII")
+
+FLAG_GZIP = 0x01
+FLAG_IMMUTABLE = 0x02
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".txt": "text/plain",
+    ".png": "image/png",
+    ".jpg": "image/jpeg",
+    ".jpeg": "image/jpeg",
+    ".ico": "image/x-icon",
+    ".woff2": "font/woff2",
+}
+
+# Already compressed; gzip would only cost the browser time
+NO_GZIP = {".png", ".jpg", ".jpeg", ".woff2"}
+
+
+def load_asset(path, rel_path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    ext = os.path.splitext(rel_path)[1].lower()
+    etag = '"%s"' % hashlib.sha256(data).hexdigest()[:16]
+
+    flags = 0
+    if ext not in NO_GZIP:
+        # mtime=0 keeps the image the same from build to build
+        packed = gzip.compress(data, compresslevel=9, mtime=0)
+        if len(packed) < len(data):
+            data = packed
+            flags |= FLAG_GZIP
+    if rel_path.startswith("assets/"):
+        flags |= FLAG_IMMUTABLE
+
+    return {
+        "uri": "/" + rel_path,
+        "data": data,
+        "etag": etag,
+        "type": CONTENT_TYPES.get(ext, "application/octet-stream"),
+        "flags": flags,
+    }
+
+
+def align4(n):
+    return (n + 3) & ~3
+
+
+def pack(assets):
+    strings = bytearray()
+    string_offsets = {}
+    strings_start = HEADER.size + ENTRY.size * len(assets)
+
+    def string(s):
+        if s not in string_offsets:
+            string_offsets[s] = strings_start + len(strings)
+            strings.extend(s.encode() + b"\0")
+        return string_offsets[s]
+
+    refs = [(string(a["uri"]), string(a["etag"]), string(a["type"])) for a in assets]
+
+    data = bytearray()
+    data_start = align4(strings_start + len(strings))
+    entries = bytearray()
+    for asset, (uri, etag, content_type) in zip(assets, refs):
+        entries += ENTRY.pack(uri, data_start + len(data), len(asset["data"]), etag, content_type, asset["flags"])
+        data += asset["data"]
+        data += b"\0" * (align4(len(data)) - len(data))
+
+    body = entries + strings
+    body += b"\0" * (data_start - HEADER.size - len(body))
+    size = data_start + len(data)
+    return HEADER.pack(MAGIC, VERSION, len(assets), size) + body + data
+
+
+def main():
+    if len(sys.argv) not in (3, 4):
+        print(__doc__)
+        return 1
+
+    web_dir, out_file = sys.argv[1], sys.argv[2]
+    max_size = int(sys.argv[3], 0) if len(sys.argv) == 4 else None
+
+    assets = []
+    for dirpath, dirnames, filenames in os.walk(web_dir):
+        dirnames.sort()
+        for name in sorted(filenames):
+            path = os.path.join(dirpath, name)
+            rel_path = os.path.relpath(path, web_dir).replace(os.sep, "/")
+            assets.append(load_asset(path, rel_path))
+
+    image = pack(assets)
+    if max_size is not None and len(image) > max_size:
+        print("Web UI bundle is %d bytes; the partition holds %d" % (len(image), max_size))
+        return 1
+
+    with open(out_file, "wb") as f:
+        f.write(image)
+
+    print("Packed %d web assets, %d bytes" % (len(assets), len(image)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
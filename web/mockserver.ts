@@ -19,9 +19,12 @@ import type {
   AunbridgeStats,
   ClientMessage,
   EconetStats,
+  LoggingStats,
   ServerMessage,
   EconetClockSettings,
+  WsTopic,
 } from "./src/lib/types";
+import { STATS_BINARY_FIELDS, STATS_BINARY_VERSION, encodeStatsBinary } from "./src/lib/statsBinary";
 
 export function mockWsPlugin(): PluginOption {
 
@@ -64,8 +67,35 @@ export function mockWsPlugin(): PluginOption {
             tx_ack_count: 0,
             tx_nack_count: 0,
             rx_ack_count: 0,
+            rx_stale_ack_count: 0,
             rx_nack_count: 0,
             rx_unknown_count: 0,
+            rx_duplicate_count: 0,
+            rx_reorder_count: 0,
+            rx_reorder_timeout_count: 0,
+            trunk_tx_frame_count: 0,
+            trunk_tx_datagram_count: 0,
+            tx_broadcast_count: 0,
+            rx_broadcast_count: 0,
+            rx_broadcast_drop_count: 0,
+            fs_cache_hit_count: 0,
+            fs_cache_miss_count: 0,
+            rx_readahead_count: 0,
+            rx_readahead_fail_count: 0,
+            bridge_query_count: 0,
+            fileserver_request_count: 0,
+            fileserver_error_count: 0,
+            fileserver_service_avg_us: 450,
+            fileserver_service_max_us: 2100,
+            print_job_count: 0,
+            print_forward_count: 0,
+            print_waiting_count: 0,
+            print_retry_count: 0,
+            print_drop_count: 0,
+          };
+
+          const log: LoggingStats = {
+            drop_count: 0,
           };
   
           let eco: EconetStats = {
@@ -76,9 +106,32 @@ export function mockWsPlugin(): PluginOption {
             rx_oversize_count: 0,
             rx_ack_count: 0,
             rx_nack_count: 0,
+            rx_error_count: 0,
             tx_frame_count: 0,
             tx_ack_count: 0,
           };
+
+          let topics = new Set<WsTopic>(["stats", "logs"]);
+          let logTag = "";
+
+          // Binary stats, once the UI subscribes to them
+          let statsTimer: ReturnType<typeof setInterval> | undefined;
+          let statsPrev: number[] | null = null;
+          let statsSeq = 0;
+
+          function statsValues() {
+            const groups = { aunbridge_stats: aun, econet_stats: eco, logging_stats: log } as Record<string, Record<string, number>>;
+            return STATS_BINARY_FIELDS.map(([group, key]) => groups[group][key] ?? 0);
+          }
+
+          function sendStatsBinary() {
+            const values = statsValues();
+            if (statsPrev && values.every((v, f) => v === statsPrev![f])) {
+              return;
+            }
+            ws.send(encodeStatsBinary(values, statsPrev, statsSeq++));
+            statsPrev = values;
+          }
   
           function inc(v: number, spread = 5) {
             return v + Math.floor(Math.random() * spread);
@@ -97,8 +150,25 @@ export function mockWsPlugin(): PluginOption {
               tx_nack_count: inc(aun.tx_error_count, 1),
               rx_data_count: inc(aun.rx_data_count, 15),
               rx_ack_count: inc(aun.rx_ack_count, 15),
+              rx_stale_ack_count: inc(aun.rx_stale_ack_count, 1),
               rx_nack_count: inc(aun.rx_nack_count, 2),
               rx_unknown_count: inc(aun.rx_unknown_count, 1),
+              rx_duplicate_count: inc(aun.rx_duplicate_count, 2),
+              rx_reorder_count: inc(aun.rx_reorder_count, 1),
+              rx_reorder_timeout_count: inc(aun.rx_reorder_timeout_count, 1),
+              trunk_tx_frame_count: inc(aun.trunk_tx_frame_count, 12),
+              trunk_tx_datagram_count: inc(aun.trunk_tx_datagram_count, 4),
+              tx_broadcast_count: inc(aun.tx_broadcast_count, 1),
+              rx_broadcast_count: inc(aun.rx_broadcast_count, 1),
+              rx_broadcast_drop_count: inc(aun.rx_broadcast_drop_count, 1),
+              fs_cache_hit_count: inc(aun.fs_cache_hit_count, 3),
+              fs_cache_miss_count: inc(aun.fs_cache_miss_count, 1),
+              rx_readahead_count: inc(aun.rx_readahead_count, 8),
+              rx_readahead_fail_count: inc(aun.rx_readahead_fail_count, 0),
+              bridge_query_count: inc(aun.bridge_query_count, 0),
+              fileserver_request_count: inc(aun.fileserver_request_count, 5),
+              print_job_count: inc(aun.print_job_count, 1),
+              print_forward_count: inc(aun.print_forward_count, 1),
             };
   
             eco = {
@@ -109,23 +179,84 @@ export function mockWsPlugin(): PluginOption {
               rx_oversize_count: inc(eco.rx_oversize_count, 1),
               rx_ack_count: inc(eco.rx_nack_count, 2),
               rx_nack_count: inc(eco.rx_nack_count, 2),
+              rx_error_count: inc(eco.rx_error_count, 1),
               tx_frame_count: inc(eco.tx_frame_count, 20),
               tx_ack_count: inc(eco.tx_ack_count, 20),
             };
   
-            let ssp: ServerMessage = {
-              type: "stats_stream",
-              aunbridge_stats: aun,
-              econet_stats: eco,
+            if (!topics.has("stats")) {
+              return;
+            }
+
+            if (!statsTimer) {
+              let ssp: ServerMessage = {
+                type: "stats_stream",
+                aunbridge_stats: aun,
+                econet_stats: eco,
+                logging_stats: log,
+              };
+              ws.send(JSON.stringify(ssp));
+            }
+
+            let peers: ServerMessage = {
+              type: "aun_peers",
+              first: true,
+              peers: [
+                [254, inc(2000, 800), inc(400, 200), 10],
+                [235, inc(45000, 5000), inc(6000, 2000), 70],
+              ],
+            };
+            ws.send(JSON.stringify(peers));
+
+            let queues: ServerMessage = {
+              type: "econet_queues",
+              queues: [
+                [100, inc(0, 2), 4, inc(3, 5), 120],
+                [101, 0, 1, inc(1, 2), 15],
+              ],
+            };
+            ws.send(JSON.stringify(queues));
+
+            let classes: ServerMessage = {
+              type: "econet_classes",
+              classes: [
+                [inc(100, 20), inc(2, 3), 40],
+                [inc(50, 10), inc(5, 5), 90],
+                [0, 0, 0],
+                [inc(300, 50), inc(80, 40), 900],
+              ],
+            };
+            ws.send(JSON.stringify(classes));
+
+            let econetStations: ServerMessage = {
+              type: "station_stats",
+              table: "econet",
+              now: uptime,
+              rows: [
+                [100, inc(uptime * 4), inc(uptime * 300), inc(uptime * 4), inc(uptime * 900), 0, 0, inc(0, 2), uptime, inc(3500, 500), 9000],
+              ],
             };
-            ws.send(JSON.stringify(ssp));
+            ws.send(JSON.stringify(econetStations));
+
+            let aunStations: ServerMessage = {
+              type: "station_stats",
+              table: "aun",
+              now: uptime,
+              rows: [
+                [254, inc(uptime * 4), inc(uptime * 900), inc(uptime * 4), inc(uptime * 300), inc(0, 2), 0, 0, uptime, inc(2000, 800), 12000],
+              ],
+            };
+            ws.send(JSON.stringify(aunStations));
           }, 1000);
   
           const logInterval = setInterval(() => {
+            if (!topics.has("logs") || (logTag && logTag != "mock")) {
+              return;
+            }
             ws.send(
               JSON.stringify({
                 type: "log",
-                line: `[mock] ${new Date().toLocaleTimeString()} - simulated log entry`,
+                line: `I (${uptime * 1000}) mock: ${new Date().toLocaleTimeString()} - simulated log entry`,
               })
             );
           }, 3000);
@@ -135,6 +266,45 @@ export function mockWsPlugin(): PluginOption {
   
             console.log("UI sent →", msg);
   
+            if (msg.type == "unsubscribe") {
+              topics.delete(msg.topic);
+              if (msg.topic == "stats") {
+                clearInterval(statsTimer);
+                statsTimer = undefined;
+              }
+              ws.send(JSON.stringify({ type: "response", id: msg.id, ok: true }));
+            }
+
+            if (msg.type == "subscribe" && msg.topic != "stats") {
+              topics.add(msg.topic);
+              if (msg.topic == "logs") {
+                logTag = msg.tag ?? "";
+              }
+              ws.send(JSON.stringify({ type: "response", id: msg.id, ok: true }));
+            }
+
+            if (msg.type == "subscribe" && msg.topic == "stats") {
+              topics.add("stats");
+              clearInterval(statsTimer);
+              statsTimer = undefined;
+              const interval_ms = Math.min(Math.max(msg.interval_ms ?? 1000, 250), 60000);
+              if (msg.format == "binary") {
+                statsPrev = null;
+                statsTimer = setInterval(sendStatsBinary, interval_ms);
+              }
+              let response: ServerMessage = {
+                type: "response",
+                id: msg.id,
+                ok: true,
+                version: STATS_BINARY_VERSION,
+                interval_ms,
+              };
+              ws.send(JSON.stringify(response));
+              if (statsTimer) {
+                sendStatsBinary();
+              }
+            }
+
             if (msg.type == "save_wifi") {
               let response: ServerMessage = {
                 type: "response",
@@ -220,6 +390,8 @@ export function mockWsPlugin(): PluginOption {
                 settings: {
                   econetStations: [{station_id: 127, udp_port: 32768}, {station_id: 88, udp_port: 32769}],
                   aunStations: [{station_id: 254, remote_ip: "10.222.8.8", udp_port: 32768}],
+                  aunMode: "ports",
+                  aunSubnet: "10.222.8.0",
 
                 },
               };
@@ -269,6 +441,7 @@ export function mockWsPlugin(): PluginOption {
           });
   
           ws.on("close", () => {
+            clearInterval(statsTimer);
             clearInterval(stateInterval);
             clearInterval(logInterval);
           });
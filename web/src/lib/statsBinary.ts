@@ -0,0 +1,148 @@
+/*
+ * EconetWiFi
+ * Copyright (c) 2025 Paul G. Banks <https://paulbanks.org/projects/econet>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * See the LICENSE file in the project root for full license information.
+ */
+
+// Binary stats stream. Each frame is [version, flags, seq] followed by
+// (field, delta) pairs as LEB128 varints with the delta zigzag encoded. A
+// snapshot (flags bit 0) carries every field as a delta from zero.
+
+import type { StatsStreamPayload } from "./types";
+
+export const STATS_BINARY_VERSION = 1;
+
+const FLAG_SNAPSHOT = 0x01;
+
+// Wire order; must match stats_fields() in main/main.c
+export const STATS_BINARY_FIELDS: ["aunbridge_stats" | "econet_stats" | "logging_stats", string][] = [
+  ["aunbridge_stats", "tx_count"],
+  ["aunbridge_stats", "tx_retry_count"],
+  ["aunbridge_stats", "tx_abort_count"],
+  ["aunbridge_stats", "tx_error_count"],
+  ["aunbridge_stats", "tx_ack_count"],
+  ["aunbridge_stats", "tx_nack_count"],
+  ["aunbridge_stats", "rx_data_count"],
+  ["aunbridge_stats", "rx_ack_count"],
+  ["aunbridge_stats", "rx_nack_count"],
+  ["aunbridge_stats", "rx_unknown_count"],
+  ["aunbridge_stats", "rx_duplicate_count"],
+  ["aunbridge_stats", "rx_reorder_count"],
+  ["aunbridge_stats", "rx_reorder_timeout_count"],
+  ["aunbridge_stats", "trunk_tx_frame_count"],
+  ["aunbridge_stats", "trunk_tx_datagram_count"],
+  ["aunbridge_stats", "tx_broadcast_count"],
+  ["aunbridge_stats", "rx_broadcast_count"],
+  ["aunbridge_stats", "rx_broadcast_drop_count"],
+  ["aunbridge_stats", "fs_cache_hit_count"],
+  ["aunbridge_stats", "fs_cache_miss_count"],
+  ["aunbridge_stats", "rx_readahead_count"],
+  ["aunbridge_stats", "rx_readahead_fail_count"],
+  ["aunbridge_stats", "bridge_query_count"],
+  ["aunbridge_stats", "fileserver_request_count"],
+  ["aunbridge_stats", "fileserver_error_count"],
+  ["aunbridge_stats", "fileserver_service_avg_us"],
+  ["aunbridge_stats", "fileserver_service_max_us"],
+  ["aunbridge_stats", "print_job_count"],
+  ["aunbridge_stats", "print_forward_count"],
+  ["aunbridge_stats", "print_waiting_count"],
+  ["aunbridge_stats", "print_retry_count"],
+  ["aunbridge_stats", "print_drop_count"],
+  ["econet_stats", "rx_frame_count"],
+  ["econet_stats", "rx_crc_fail_count"],
+  ["econet_stats", "rx_short_frame_count"],
+  ["econet_stats", "rx_abort_count"],
+  ["econet_stats", "rx_oversize_count"],
+  ["econet_stats", "rx_ack_count"],
+  ["econet_stats", "rx_nack_count"],
+  ["econet_stats", "rx_error_count"],
+  ["econet_stats", "tx_frame_count"],
+  ["econet_stats", "tx_ack_count"],
+  ["logging_stats", "drop_count"],
+  ["aunbridge_stats", "rx_stale_ack_count"],
+];
+
+function putVarint(out: number[], v: number) {
+  while (v >= 0x80) {
+    out.push((v & 0x7f) | 0x80);
+    v = Math.floor(v / 128);
+  }
+  out.push(v);
+}
+
+// Used by the mock server. Pass prev as null for a snapshot.
+export function encodeStatsBinary(values: number[], prev: number[] | null, seq: number): Uint8Array {
+  const out = [STATS_BINARY_VERSION, prev ? 0 : FLAG_SNAPSHOT, seq & 0xff];
+  values.forEach((v, f) => {
+    const delta = (v - (prev ? prev[f] : 0)) | 0;
+    if (prev && !delta) {
+      return;
+    }
+    putVarint(out, f);
+    putVarint(out, ((delta << 1) ^ (delta >> 31)) >>> 0);
+  });
+  return Uint8Array.from(out);
+}
+
+// Keeps the counters a client has seen so deltas can be applied. Returns
+// null for frames that can't be used: an unknown version, or deltas before
+// a snapshot or after a lost frame. needsSnapshot says when to resubscribe.
+export class StatsBinaryDecoder {
+  values: number[] = [];
+  seq = -1;
+  needsSnapshot = false;
+
+  decode(data: ArrayBuffer): StatsStreamPayload | null {
+    const bytes = new Uint8Array(data);
+    if (bytes.length < 3 || bytes[0] !== STATS_BINARY_VERSION) {
+      return null;
+    }
+
+    const isSnapshot = (bytes[1] & FLAG_SNAPSHOT) !== 0;
+    const seq = bytes[2];
+    if (!isSnapshot && (this.seq < 0 || seq !== ((this.seq + 1) & 0xff))) {
+      this.seq = -1;
+      this.needsSnapshot = true;
+      return null;
+    }
+    this.seq = seq;
+    this.needsSnapshot = false;
+
+    let pos = 3;
+    const readVarint = () => {
+      let v = 0;
+      let scale = 1;
+      while (pos < bytes.length) {
+        const b = bytes[pos++];
+        v += (b & 0x7f) * scale;
+        if (!(b & 0x80)) {
+          break;
+        }
+        scale *= 128;
+      }
+      return v;
+    };
+
+    const payload: StatsStreamPayload = { aunbridge_stats: {}, econet_stats: {}, logging_stats: {} };
+    while (pos < bytes.length) {
+      const f = readVarint();
+      const z = readVarint();
+      const delta = (z >>> 1) ^ -(z & 1);
+      const value = ((isSnapshot ? 0 : this.values[f] ?? 0) + delta) >>> 0;
+      this.values[f] = value;
+
+      // Fields from a newer firmware are kept but not shown
+      if (f < STATS_BINARY_FIELDS.length) {
+        const [group, key] = STATS_BINARY_FIELDS[f];
+        (payload[group] as Record<string, number>)[key] = value;
+      }
+    }
+    return payload;
+  }
+}
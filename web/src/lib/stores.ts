@@ -12,7 +12,7 @@
 
 import type { Component } from "svelte";
 import { writable } from "svelte/store";
-import type { EconetStats, AunbridgeStats } from "./types";
+import type { EconetStats, AunbridgeStats, LoggingStats, AunPeerTiming, EconetQueueStats, EconetClassStats, StationStats } from "./types";
 
 export const activePage = writable<Component>();
 
@@ -29,6 +29,9 @@ export const device = writable({
   firmware: "",
 });
 
+// How often binary stats are pushed; the JSON stream is always once a second
+export const statsIntervalMs = writable<number>(1000);
+
 export const econetStats = writable<EconetStats>({
   rx_frame_count: 0,
   rx_crc_fail_count: 0,
@@ -51,10 +54,47 @@ export const aunbridgeStats = writable<AunbridgeStats>({
   tx_nack_count: 0,
   rx_data_count: 0,
   rx_ack_count: 0,
+  rx_stale_ack_count: 0,
   rx_nack_count: 0,
   rx_unknown_count: 0,
+  rx_duplicate_count: 0,
+  rx_reorder_count: 0,
+  rx_reorder_timeout_count: 0,
+  trunk_tx_frame_count: 0,
+  trunk_tx_datagram_count: 0,
+  tx_broadcast_count: 0,
+  rx_broadcast_count: 0,
+  rx_broadcast_drop_count: 0,
+  fs_cache_hit_count: 0,
+  fs_cache_miss_count: 0,
+  rx_readahead_count: 0,
+  rx_readahead_fail_count: 0,
+  bridge_query_count: 0,
+  fileserver_request_count: 0,
+  fileserver_error_count: 0,
+  fileserver_service_avg_us: 0,
+  fileserver_service_max_us: 0,
+  print_job_count: 0,
+  print_forward_count: 0,
+  print_waiting_count: 0,
+  print_retry_count: 0,
+  print_drop_count: 0,
+});
+
+export const loggingStats = writable<LoggingStats>({
+  drop_count: 0,
 });
 
+export const aunPeers = writable<AunPeerTiming[]>([]);
+
+export const econetQueues = writable<EconetQueueStats[]>([]);
+
+export const econetClasses = writable<EconetClassStats[]>([]);
+
+// Only changed rows are sent so these accumulate
+export const econetStationStats = writable<StationStats>({ now: 0, rows: {} });
+export const aunStationStats = writable<StationStats>({ now: 0, rows: {} });
+
 export type LogLevel = "info" | "warn" | "error" | "other";
 export interface LogEntry {
   level: LogLevel;
@@ -62,6 +102,7 @@ export interface LogEntry {
 }
 const MAX_LOGS = 200;
 export const logs = writable<LogEntry[]>([]);
+export const logTag = writable<string>("");
 function detectLevel(line: string): LogLevel {
   if (line.startsWith("E ")) return "error";
   if (line.startsWith("W ")) return "warn";
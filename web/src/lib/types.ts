@@ -18,6 +18,7 @@ export type EconetStats = {
   rx_oversize_count: number;
   rx_ack_count: number;
   rx_nack_count: number;
+  rx_error_count: number;
   tx_frame_count: number;
   tx_ack_count: number;
 };
@@ -31,8 +32,53 @@ export type AunbridgeStats = {
   tx_nack_count: number;
   rx_data_count: number;
   rx_ack_count: number;
+  rx_stale_ack_count: number;
   rx_nack_count: number;
   rx_unknown_count: number;
+  rx_duplicate_count: number;
+  rx_reorder_count: number;
+  rx_reorder_timeout_count: number;
+  trunk_tx_frame_count: number;
+  trunk_tx_datagram_count: number;
+  tx_broadcast_count: number;
+  rx_broadcast_count: number;
+  rx_broadcast_drop_count: number;
+  fs_cache_hit_count: number;
+  fs_cache_miss_count: number;
+  rx_readahead_count: number;
+  rx_readahead_fail_count: number;
+  bridge_query_count: number;
+  fileserver_request_count: number;
+  fileserver_error_count: number;
+  fileserver_service_avg_us: number;
+  fileserver_service_max_us: number;
+  print_job_count: number;
+  print_forward_count: number;
+  print_waiting_count: number;
+  print_retry_count: number;
+  print_drop_count: number;
+};
+
+export type LoggingStats = {
+  drop_count: number;
+};
+
+// Sent as [station_id, srtt_us, rttvar_us, rto_ms]
+export type AunPeerTiming = [number, number, number, number];
+
+// Sent as [station_id, depth, max_depth, avg_wait_ms, max_wait_ms]
+export type EconetQueueStats = [number, number, number, number, number];
+
+// Sent as [frames, avg_wait_ms, max_wait_ms], one entry per class
+export type EconetClassStats = [number, number, number];
+
+// Sent as [station_id, frames_in, bytes_in, frames_out, bytes_out, retries,
+//          aborts, nacks, last_seen_s, latency_avg_us, latency_max_us]
+export type StationStatsRow = [number, number, number, number, number, number, number, number, number, number, number];
+
+export type StationStats = {
+  now: number;
+  rows: Record<number, StationStatsRow>;
 };
 
 export type WifiSettings = {
@@ -55,11 +101,44 @@ export interface AUNRow {
   remote_ip: string;
   udp_port: number;
   station_id: number;
+  network_id?: number;
+};
+
+export interface RouteRow {
+  network: number;
+  subnet: string;
+};
+
+export interface PriorityRow {
+  port: number;
+  control: number;
+  class: number;
 };
 
 export type EconetSettings = {
   econetStations?: ECSRow[];
   aunStations?: AUNRow[];
+  priorityRules?: PriorityRow[];
+  priorityMode?: "strict" | "weighted";
+  priorityWeights?: number[];
+  dynamicPortBase?: number;
+  aunMode?: "ports" | "single";
+  aunSubnet?: string;
+  aunFirstStation?: number;
+  aunLastStation?: number;
+  trunkHost?: string;
+  trunkPort?: number;
+  trunkLocalPort?: number;
+  trunkLocalNet?: number;
+  trunkNetworks?: number[];
+  fsCache?: boolean;
+  fsStation?: number;
+  readAhead?: boolean;
+  printStation?: number;
+  printServer?: number;
+  printLocalPort?: number;
+  routes?: RouteRow[];
+  bridgeStation?: number;
 };
 
 export type ClockMode = "internal" | "external";
@@ -73,10 +152,17 @@ export type EconetClockSettings = {
 export type StatsStreamPayload = {
   aunbridge_stats?: Partial<AunbridgeStats>;
   econet_stats?: Partial<EconetStats>;
+  logging_stats?: Partial<LoggingStats>;
 };
 
+export type WsTopic = "stats" | "logs" | "capture" | "traces";
+
 export type ServerMessage =
   | ({ type: "stats_stream" } & StatsStreamPayload)
+  | { type: "aun_peers"; first?: boolean; peers: AunPeerTiming[] }
+  | { type: "econet_queues"; queues: EconetQueueStats[] }
+  | { type: "econet_classes"; classes: EconetClassStats[] }
+  | { type: "station_stats"; table: "econet" | "aun"; now: number; rows: StationStatsRow[] }
   | { type: "log"; line: string }
   |({ type: "response"; id: number } & Record<string, any>);
 
@@ -92,4 +178,6 @@ export type ClientMessage =
   | { type: "save_econet_clock"; id: number, settings: EconetClockSettings }
   | { type: "get_econet_clock"; id: number }
   | { type: "get_econet_termination"; id: number }
-  | { type: "save_econet_termination"; id: number, value: number };
+  | { type: "save_econet_termination"; id: number, value: number }
+  | { type: "subscribe"; id: number, topic: WsTopic, format?: "json" | "binary", interval_ms?: number, level?: string, tag?: string }
+  | { type: "unsubscribe"; id: number, topic: WsTopic };
@@ -10,11 +10,14 @@
  * See the LICENSE file in the project root for full license information.
  */
 
-import { connectionState, device, econetStats, aunbridgeStats, addLog } from "./stores";
-import type { ClientMessage, ServerMessage } from "./types";
+import { get } from "svelte/store";
+import { connectionState, device, econetStats, aunbridgeStats, loggingStats, aunPeers, econetQueues, econetClasses, econetStationStats, aunStationStats, statsIntervalMs, logTag, addLog } from "./stores";
+import type { ClientMessage, ServerMessage, StatsStreamPayload } from "./types";
+import { STATS_BINARY_VERSION, StatsBinaryDecoder } from "./statsBinary";
 
 let socket: WebSocket | null = null;
 let nextRequestId = 1;
+let statsDecoder = new StatsBinaryDecoder();
 const pending = new Map<
   number,
   { resolve: (v: any) => void; reject: (e: any) => void }
@@ -37,9 +40,14 @@ export function getWebSocket() {
   connectionState.set("connecting");
 
   socket = new WebSocket(`ws://${location.host}/ws`);
+  socket.binaryType = "arraybuffer";
 
   socket.addEventListener("open", () => {
     connectionState.set("connected");
+    subscribeStats();
+    if (get(logTag)) {
+      subscribeLogs(get(logTag));
+    }
   });
 
   socket.addEventListener("close", () => {
@@ -52,6 +60,16 @@ export function getWebSocket() {
   });
 
   socket.addEventListener("message", (event) => {
+    if (event.data instanceof ArrayBuffer) {
+      const stats = statsDecoder.decode(event.data);
+      if (stats) {
+        applyStats(stats);
+      } else if (statsDecoder.needsSnapshot) {
+        subscribeStats();
+      }
+      return;
+    }
+
     let msg: ServerMessage;
 
     try {
@@ -67,17 +85,78 @@ export function getWebSocket() {
   return socket;
 }
 
+// Ask for binary stats, falling back to the JSON stream if the device
+// doesn't know the command or speaks a different version of the format
+function subscribeStats() {
+  statsDecoder = new StatsBinaryDecoder();
+  const interval_ms = get(statsIntervalMs);
+  sendWsRequest({ type: "subscribe", topic: "stats", format: "binary", interval_ms })
+    .then((res) => {
+      if (res.version !== STATS_BINARY_VERSION) {
+        return sendWsRequest({ type: "subscribe", topic: "stats", format: "json", interval_ms });
+      }
+    })
+    .catch(() => {});
+}
+
+// Only lines with this tag are sent when it isn't empty
+export function subscribeLogs(tag: string) {
+  logTag.set(tag);
+  if (socket && socket.readyState === WebSocket.OPEN) {
+    sendWsRequest({ type: "subscribe", topic: "logs", tag }).catch(() => {});
+  }
+}
+
+export function setStatsInterval(ms: number) {
+  statsIntervalMs.set(ms);
+  if (socket && socket.readyState === WebSocket.OPEN) {
+    subscribeStats();
+  }
+}
+
+function applyStats(stats: StatsStreamPayload) {
+
+  if (stats.aunbridge_stats) {
+    aunbridgeStats.update((s) => ({ ...s, ...stats.aunbridge_stats }));
+  }
+
+  if (stats.econet_stats) {
+    econetStats.update((s) => ({ ...s, ...stats.econet_stats }));
+  }
+
+  if (stats.logging_stats) {
+    loggingStats.update((s) => ({ ...s, ...stats.logging_stats }));
+  }
+}
+
 function handleMessage(msg: ServerMessage) {
 
   if (msg.type === "stats_stream") {
+    applyStats(msg);
+  }
 
-    if (msg.aunbridge_stats) {
-      aunbridgeStats.update((s) => ({ ...s, ...msg.aunbridge_stats }));
-    }
+  if (msg.type === "aun_peers") {
+    // A long list comes in several messages; the first replaces what we had
+    aunPeers.update((peers) => (msg.first === false ? [...peers, ...msg.peers] : msg.peers));
+  }
 
-    if (msg.econet_stats) {
-      econetStats.update((s) => ({ ...s, ...msg.econet_stats }));
-    }
+  if (msg.type === "econet_queues") {
+    econetQueues.set(msg.queues);
+  }
+
+  if (msg.type === "econet_classes") {
+    econetClasses.set(msg.classes);
+  }
+
+  if (msg.type === "station_stats") {
+    const store = msg.table === "econet" ? econetStationStats : aunStationStats;
+    store.update((s) => {
+      const rows = { ...s.rows };
+      for (const row of msg.rows) {
+        rows[row[0]] = row;
+      }
+      return { now: msg.now, rows };
+    });
   }
 
   if (msg.type === "log") {